@@ -1,7 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <float.h>
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <iostream>
 
 #include "glew/glew.h"
@@ -18,6 +21,32 @@
 #include "glm/gtc/matrix_transform.hpp" // glm::translate, glm::rotate, glm::scale, glm::perspective
 #include "glm/gtc/type_ptr.hpp" // glm::value_ptr
 
+#include "residency.h"
+#include "normalmap.h"
+#include "mesh.h"
+#include "archive.h"
+#include "assets.h"
+#include "obj.h"
+#include "gltf.h"
+#include "culling.h"
+#include "picking.h"
+#include "lod.h"
+#include "meshlet.h"
+#include "gpu_culling.h"
+#include "pvs.h"
+#include "hash.h"
+#include "ground.h"
+#include "terrain.h"
+#include "light_grid.h"
+#include "deferred.h"
+#include "gpu_timer.h"
+#include "shadow.h"
+#include "pipeline.h"
+#include "ssao.h"
+#include "ibl.h"
+#include "render_target.h"
+#include "post.h"
+
 #ifndef DEBUG_PRINT
 #define DEBUG_PRINT 1
 #endif
@@ -45,10 +74,33 @@ int check_link_error(GLuint program);
 int check_compile_error(GLuint shader, const char ** sourceBuffer);
 GLuint compile_shader(GLenum shaderType, const char * sourceBuffer, int bufferSize);
 GLuint compile_shader_from_file(GLenum shaderType, const char * fileName);
+// Shader assets may pull other assets in with #include "name" lines
+GLuint compile_shader_from_asset(GLenum shaderType, const Archive & archive, const char * name);
+
+// Asset utils
+int load_texture_asset(TextureResidency & residency, const Archive & archive, const char * name);
+bool pack_assets(const char * path, const MeshData & cube, const MeshData & plane);
+
+// Instances on a square grid of the xz plane around the origin
+void instance_grid(int count, float spacing, std::vector<glm::mat4> & transforms);
+// Nearest instances inside the frustum, used as occluders. Instances are
+// translations of the local bounds, as built by instance_grid.
+void select_occluders(const std::vector<glm::mat4> & transforms, const glm::vec3 & boundsMin, const glm::vec3 & boundsMax,
+                      const Frustum & frustum, const glm::vec3 & eye, int maxCount, std::vector<glm::mat4> & occluders);
+// Compares GPU and CPU culling of instance grids seen from several views,
+// returns EXIT_SUCCESS when they agree everywhere. culling is 0 when the
+// driver does not support it.
+int check_gpu_culling(GpuCulling * culling, const LodChain & chain, const glm::vec3 & boundsMin, const glm::vec3 & boundsMax,
+                      float aspect, int viewportHeight);
+// Coloured point lights spread over a square of the xz plane around the
+// origin, each circling its own spot
+void animate_lights(int count, float extent, float time, std::vector<PointLight> & lights);
 
 // OpenGL utils
 bool checkError(const char* title);
 
+void usage();
+
 struct Camera
 {
     float radius;
@@ -59,6 +111,7 @@ struct Camera
     glm::vec3 up;
 };
 void camera_defaults(Camera & c);
+void camera_compute(Camera & c);
 void camera_zoom(Camera & c, float factor);
 void camera_turn(Camera & c, float phi, float theta);
 void camera_pan(Camera & c, float x, float y);
@@ -73,6 +126,7 @@ struct GUIStates
     int camera;
     double time;
     bool playing;
+    double scroll;      // wheel offset not yet given to the UI
     static const float MOUSE_PAN_SPEED;
     static const float MOUSE_ZOOM_SPEED;
     static const float MOUSE_TURN_SPEED;
@@ -81,15 +135,81 @@ const float GUIStates::MOUSE_PAN_SPEED = 0.001f;
 const float GUIStates::MOUSE_ZOOM_SPEED = 0.05f;
 const float GUIStates::MOUSE_TURN_SPEED = 0.005f;
 void init_gui_states(GUIStates & guiStates);
+// Accumulates the wheel into the GUIStates of the window user pointer
+void scroll_callback(GLFWwindow * window, double x, double y);
 
 
 int main( int argc, char **argv )
 {
+    const char * packPath = 0;
+    const char * terrainCachePath = 0;
+    const char * environmentPath = "textures/environment.hdr";
+    const char * objPath = 0;
+    bool checkGpuCulling = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--pack") == 0 && i + 1 < argc)
+            packPath = argv[++i];
+        else if (strcmp(argv[i], "--terrain-cache") == 0 && i + 1 < argc)
+            terrainCachePath = argv[++i];
+        else if (strcmp(argv[i], "--environment") == 0 && i + 1 < argc)
+            environmentPath = argv[++i];
+        else if (strcmp(argv[i], "--check-gpu-culling") == 0)
+            checkGpuCulling = true;
+        else if (argv[i][0] == '-' || objPath)
+        {
+            usage();
+            exit(EXIT_FAILURE);
+        }
+        else
+            objPath = argv[i];
+    }
+
     int width = 1024, height= 768;
     float widthf = (float) width, heightf = (float) height;
     double t;
     float fps = 0.f;
 
+    // Built-in geometry
+    int cube_triangleCount = 12;
+    int cube_triangleList[] = {0, 1, 2, 2, 1, 3, 4, 5, 6, 6, 5, 7, 8, 9, 10, 10, 9, 11, 12, 13, 14, 14, 13, 15, 16, 17, 18, 19, 17, 20, 21, 22, 23, 24, 25, 26, };
+    float cube_uvs[] = {0.f, 0.f, 0.f, 1.f, 1.f, 0.f, 1.f, 1.f, 0.f, 0.f, 0.f, 1.f, 1.f, 0.f, 1.f, 1.f, 0.f, 0.f, 0.f, 1.f, 1.f, 0.f, 1.f, 1.f, 0.f, 0.f, 0.f, 1.f, 1.f, 0.f, 1.f, 1.f, 0.f, 0.f, 0.f, 1.f, 1.f, 0.f,  1.f, 0.f,  1.f, 1.f,  0.f, 1.f,  1.f, 1.f,  0.f, 0.f, 0.f, 0.f, 1.f, 1.f,  1.f, 0.f,  };
+    float cube_vertices[] = {-0.5, -0.5, 0.5, 0.5, -0.5, 0.5, -0.5, 0.5, 0.5, 0.5, 0.5, 0.5, -0.5, 0.5, 0.5, 0.5, 0.5, 0.5, -0.5, 0.5, -0.5, 0.5, 0.5, -0.5, -0.5, 0.5, -0.5, 0.5, 0.5, -0.5, -0.5, -0.5, -0.5, 0.5, -0.5, -0.5, -0.5, -0.5, -0.5, 0.5, -0.5, -0.5, -0.5, -0.5, 0.5, 0.5, -0.5, 0.5, 0.5, -0.5, 0.5, 0.5, -0.5, -0.5, 0.5, 0.5, 0.5, 0.5, 0.5, 0.5, 0.5, 0.5, -0.5, -0.5, -0.5, -0.5, -0.5, -0.5, 0.5, -0.5, 0.5, -0.5, -0.5, 0.5, -0.5, -0.5, -0.5, 0.5, -0.5, 0.5, 0.5 };
+    float cube_normals[] = {0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, };
+
+    int plane_triangleCount = 2;
+    int plane_triangleList[] = {0, 1, 2, 2, 1, 3};
+    float plane_uvs[] = {0.f, 0.f, 0.f, 1.f, 1.f, 0.f, 1.f, 1.f};
+    float plane_vertices[] = {-5.0, -1.0, 5.0, 5.0, -1.0, 5.0, -5.0, -1.0, -5.0, 5.0, -1.0, -5.0};
+    float plane_normals[] = {0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0};
+
+    // Tangent frames for normal mapping
+    const int cube_vertexCount = sizeof(cube_vertices) / (3 * sizeof(float));
+    float cube_tangents[cube_vertexCount * 4];
+    compute_tangents(cube_triangleList, cube_triangleCount, cube_vertices, cube_normals, cube_uvs, cube_vertexCount, cube_tangents);
+    const int plane_vertexCount = sizeof(plane_vertices) / (3 * sizeof(float));
+    float plane_tangents[plane_vertexCount * 4];
+    compute_tangents(plane_triangleList, plane_triangleCount, plane_vertices, plane_normals, plane_uvs, plane_vertexCount, plane_tangents);
+
+    MeshData cubeMesh = { cube_vertexCount, cube_triangleCount, cube_vertices, cube_normals, cube_uvs, cube_tangents, cube_triangleList };
+    MeshData planeMesh = { plane_vertexCount, plane_triangleCount, plane_vertices, plane_normals, plane_uvs, plane_tangents, plane_triangleList };
+
+    // aogl --pack <archive> writes the assets below into a single packed archive
+    if (packPath)
+    {
+        if (!pack_assets(packPath, cubeMesh, planeMesh))
+        {
+            fprintf(stderr, "Failed to write %s\n", packPath);
+            exit(EXIT_FAILURE);
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    // Packed assets are mapped once and used in place, loose files otherwise
+    Archive archive;
+    if (archive_open(archive, "aogl.pak"))
+        fprintf(stderr, "Using packed assets from aogl.pak\n");
+
     // Initialise GLFW
     if( !glfwInit() )
     {
@@ -98,7 +218,7 @@ int main( int argc, char **argv )
     }
     glfwInit();
     glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
-    glfwWindowHint(GLFW_VISIBLE, GL_TRUE);
+    glfwWindowHint(GLFW_VISIBLE, checkGpuCulling ? GL_FALSE : GL_TRUE);
     glfwWindowHint(GLFW_DECORATED, GL_TRUE);
     glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_API);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
@@ -154,22 +274,72 @@ int main( int argc, char **argv )
     camera_defaults(camera);
     GUIStates guiStates;
     init_gui_states(guiStates);
+    glfwSetWindowUserPointer(window, &guiStates);
+    glfwSetScrollCallback(window, scroll_callback);
     float dummySlider = 0.f;
 
     // Try to load and compile shaders
-    GLuint vertShaderId = compile_shader_from_file(GL_VERTEX_SHADER, "aogl.vert");
-    GLuint fragShaderId = compile_shader_from_file(GL_FRAGMENT_SHADER, "aogl.frag");
-    GLuint geomShaderId = compile_shader_from_file(GL_GEOMETRY_SHADER, "aogl.geom");
-    GLuint programObject = glCreateProgram();
-    glAttachShader(programObject, vertShaderId);
-    glAttachShader(programObject, fragShaderId);
-    glAttachShader(programObject, geomShaderId);
-    glLinkProgram(programObject);
-    if (check_link_error(programObject) < 0)
+    GLuint vertShaderId = compile_shader_from_asset(GL_VERTEX_SHADER, archive, "aogl.vert");
+    GLuint fragShaderId = compile_shader_from_asset(GL_FRAGMENT_SHADER, archive, "aogl.frag");
+    GLuint geomShaderId = compile_shader_from_asset(GL_GEOMETRY_SHADER, archive, "aogl.geom");
+
+    // Scene stages are separable programs, combined into cached pipelines:
+    // the geometry stage is only in the pipeline when it broadcasts to
+    // several views, and the ground shares the scene fragment program
+    PipelineCache pipelines;
+    pipeline_cache_init(pipelines);
+    GLuint sceneVertexProgram = pipeline_program(pipelines, "aogl.vert", &vertShaderId, 1);
+    GLuint multiViewGeometryProgram = pipeline_program(pipelines, "aogl.geom", &geomShaderId, 1);
+    GLuint sceneFragmentProgram = pipeline_program(pipelines, "aogl.frag", &fragShaderId, 1);
+    GLuint groundShaderIds[3] = {
+        compile_shader_from_asset(GL_VERTEX_SHADER, archive, "ground.vert"),
+        compile_shader_from_asset(GL_TESS_CONTROL_SHADER, archive, "ground.tesc"),
+        compile_shader_from_asset(GL_TESS_EVALUATION_SHADER, archive, "ground.tese")
+    };
+    GLuint groundProgram = pipeline_program(pipelines, "ground.vert+ground.tesc+ground.tese", groundShaderIds, 3);
+    if (!sceneVertexProgram || !multiViewGeometryProgram || !sceneFragmentProgram || !groundProgram)
+        exit(1);
+    PipelineStages sceneStages = { sceneVertexProgram, 0, 0, 0, sceneFragmentProgram };
+    PipelineStages multiViewStages = { sceneVertexProgram, 0, 0, multiViewGeometryProgram, sceneFragmentProgram };
+    PipelineStages groundStages = { groundProgram, groundProgram, groundProgram, 0, sceneFragmentProgram };
+    GLuint scenePipeline = pipeline_get(pipelines, sceneStages);
+    GLuint multiViewPipeline = pipeline_get(pipelines, multiViewStages);
+    GLuint groundPipeline = pipeline_get(pipelines, groundStages);
+
+    // Deferred lighting pass over the G-buffer written by aogl.frag
+    GLuint deferredProgram = glCreateProgram();
+    glAttachShader(deferredProgram, compile_shader_from_asset(GL_VERTEX_SHADER, archive, "deferred.vert"));
+    glAttachShader(deferredProgram, compile_shader_from_asset(GL_FRAGMENT_SHADER, archive, "deferred.frag"));
+    glLinkProgram(deferredProgram);
+    if (check_link_error(deferredProgram) < 0)
+        exit(1);
+
+    // Ambient occlusion passes over the G-buffer, full screen like deferred.frag
+    GLuint ssaoProgram = glCreateProgram();
+    glAttachShader(ssaoProgram, compile_shader_from_asset(GL_VERTEX_SHADER, archive, "deferred.vert"));
+    glAttachShader(ssaoProgram, compile_shader_from_asset(GL_FRAGMENT_SHADER, archive, "ssao.frag"));
+    glLinkProgram(ssaoProgram);
+    if (check_link_error(ssaoProgram) < 0)
+        exit(1);
+
+    // Bloom and tonemapping of the HDR scene, full screen like deferred.frag
+    GLuint postProgram = glCreateProgram();
+    glAttachShader(postProgram, compile_shader_from_asset(GL_VERTEX_SHADER, archive, "deferred.vert"));
+    glAttachShader(postProgram, compile_shader_from_asset(GL_FRAGMENT_SHADER, archive, "post.frag"));
+    glLinkProgram(postProgram);
+    if (check_link_error(postProgram) < 0)
         exit(1);
-    
+
+    // Casters of all the shadow cascades, layered by shadow.geom
+    GLuint shadowProgram = glCreateProgram();
+    glAttachShader(shadowProgram, compile_shader_from_asset(GL_VERTEX_SHADER, archive, "shadow.vert"));
+    glAttachShader(shadowProgram, compile_shader_from_asset(GL_GEOMETRY_SHADER, archive, "shadow.geom"));
+    glLinkProgram(shadowProgram);
+    if (check_link_error(shadowProgram) < 0)
+        exit(1);
+
     // Upload uniforms
-    GLuint mvpLocation = glGetUniformLocation(programObject, "MVP");
+    GLuint mvpLocation = glGetUniformLocation(sceneVertexProgram, "MVP");
 
     if (!checkError("Uniforms"))
         exit(1);
@@ -179,146 +349,308 @@ int main( int argc, char **argv )
 
     // Init OpenGL
 
-    int cube_triangleCount = 12;
-    int cube_triangleList[] = {0, 1, 2, 2, 1, 3, 4, 5, 6, 6, 5, 7, 8, 9, 10, 10, 9, 11, 12, 13, 14, 14, 13, 15, 16, 17, 18, 19, 17, 20, 21, 22, 23, 24, 25, 26, };
-    float cube_uvs[] = {0.f, 0.f, 0.f, 1.f, 1.f, 0.f, 1.f, 1.f, 0.f, 0.f, 0.f, 1.f, 1.f, 0.f, 1.f, 1.f, 0.f, 0.f, 0.f, 1.f, 1.f, 0.f, 1.f, 1.f, 0.f, 0.f, 0.f, 1.f, 1.f, 0.f, 1.f, 1.f, 0.f, 0.f, 0.f, 1.f, 1.f, 0.f,  1.f, 0.f,  1.f, 1.f,  0.f, 1.f,  1.f, 1.f,  0.f, 0.f, 0.f, 0.f, 1.f, 1.f,  1.f, 0.f,  };
-    float cube_vertices[] = {-0.5, -0.5, 0.5, 0.5, -0.5, 0.5, -0.5, 0.5, 0.5, 0.5, 0.5, 0.5, -0.5, 0.5, 0.5, 0.5, 0.5, 0.5, -0.5, 0.5, -0.5, 0.5, 0.5, -0.5, -0.5, 0.5, -0.5, 0.5, 0.5, -0.5, -0.5, -0.5, -0.5, 0.5, -0.5, -0.5, -0.5, -0.5, -0.5, 0.5, -0.5, -0.5, -0.5, -0.5, 0.5, 0.5, -0.5, 0.5, 0.5, -0.5, 0.5, 0.5, -0.5, -0.5, 0.5, 0.5, 0.5, 0.5, 0.5, 0.5, 0.5, 0.5, -0.5, -0.5, -0.5, -0.5, -0.5, -0.5, 0.5, -0.5, 0.5, -0.5, -0.5, 0.5, -0.5, -0.5, -0.5, 0.5, -0.5, 0.5, 0.5 };
-    float cube_normals[] = {0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, };
-
-    int plane_triangleCount = 2;
-    int plane_triangleList[] = {0, 1, 2, 2, 1, 3};
-    float plane_uvs[] = {0.f, 0.f, 0.f, 1.f, 1.f, 0.f, 1.f, 1.f};
-    float plane_vertices[] = {-5.0, -1.0, 5.0, 5.0, -1.0, 5.0, -5.0, -1.0, -5.0, 5.0, -1.0, -5.0};
-    float plane_normals[] = {0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0};
-
+    GpuMesh cube;
+    GpuMesh plane;
+    size_t blobSize;
+    const void * blob = archive_find(archive, "meshes/cube.mesh", &blobSize);
+    if (blob && !mesh_from_blob(blob, blobSize, cubeMesh))
+        fprintf(stderr, "Invalid meshes/cube.mesh, keeping the built-in cube\n");
+
+    // aogl <mesh.obj> draws the mesh in place of the cube, cooked version first,
+    // aogl <scene.glb> draws the glTF scene next to it
+    MeshBuffers objMesh;
+    const char * glbPath = 0;
+    if (objPath && strlen(objPath) > 4 && strcmp(objPath + strlen(objPath) - 4, ".glb") == 0)
+    {
+        glbPath = objPath;
+        objPath = 0;
+    }
+    if (objPath)
+    {
+        std::string cookedName = std::string(objPath) + ".mesh";
+        blob = archive_find(archive, cookedName.c_str(), &blobSize);
+        ObjStats objStats;
+        if (blob && mesh_from_blob(blob, blobSize, cubeMesh))
+            fprintf(stderr, "Using cooked %s\n", cookedName.c_str());
+        else if (load_obj(objPath, objMesh, &objStats))
+        {
+            cubeMesh = mesh_view(objMesh);
+            fprintf(stderr, "Loaded %s: %d triangles, %.1f MB in %.1f ms (%.0f MB/s)\n", objPath, objStats.triangleCount,
+                    objStats.bytes / (1024.0 * 1024.0), objStats.totalMs, objStats.bytes / (1024.0 * 1024.0) / (objStats.totalMs / 1000.0));
+        }
+        else
+            fprintf(stderr, "Failed to load %s\n", objPath);
+    }
+    mesh_upload(cubeMesh, cube);
+
+    // Cube instances, frustum culled every frame into the instance buffer
+    float instanceCountf = 4096.f;
+    int instanceCount = 0;
+    std::vector<glm::mat4> instanceTransforms;
+    InstanceBounds instanceBounds;
+    CullStats cullStats = { 0, 0, 0, 0.0 };
+    glm::vec3 cubeMin(FLT_MAX), cubeMax(-FLT_MAX);
+    for (int i = 0; i < cubeMesh.vertexCount; ++i)
+    {
+        glm::vec3 p(cubeMesh.vertices[i * 3], cubeMesh.vertices[i * 3 + 1], cubeMesh.vertices[i * 3 + 2]);
+        cubeMin = glm::min(cubeMin, p);
+        cubeMax = glm::max(cubeMax, p);
+    }
+    GLuint instanceBuffer;
+    glGenBuffers(1, &instanceBuffer);
+    mesh_bind_instances(cube, instanceBuffer, 0);
+    std::vector<glm::mat4> culledTransforms;
+
+    // Simplified index buffers of the cube mesh, instances are drawn at the
+    // coarsest level whose error stays under lodPixelError on screen
+    LodChain cubeLod;
+    lod_build_chain(cubeMesh, cubeLod);
+    lod_upload(cubeLod, cube);
+    LodInstances lodInstances;
+    float lodPixelError = 1.f;
+    fprintf(stderr, "Mesh LOD: %d levels, %d to %d triangles in %.1f ms\n", (int) cubeLod.levels.size(),
+            cubeLod.levels.front().triangleCount, cubeLod.levels.back().triangleCount, cubeLod.buildMs);
+
+    // Full detail instances of dense meshes are culled per meshlet into a
+    // compacted index stream, one range per instance
+    const int maxClusterInstances = 64;
+    bool clusterCulling = true;
+    MeshletMesh cubeMeshlets;
+    meshlet_build(cubeMesh, &cubeLod.indices[0], cubeLod.levels[0].triangleCount, cubeMeshlets);
+    std::vector<int> clusterIndices;
+    std::vector<int> clusterOffsets;
+    MeshletStats meshletStats = { 0, 0, 0, 0, 0, 0.0 };
+    GLuint clusterIndexBuffer;
+    glGenBuffers(1, &clusterIndexBuffer);
+
+    // Frustum culling and LOD selection can also run in a compute shader
+    // writing the draw commands, the CPU path stays the reference
+    GpuCulling gpuCulling;
+    bool gpuCullingSupported = gpu_culling_supported();
+    bool gpuCullingEnabled = false;
+    int gpuCullingMismatches = -1;
+    if (gpuCullingSupported)
+    {
+        GLuint cullShaderId = compile_shader_from_asset(GL_COMPUTE_SHADER, archive, "cull.comp");
+        GLuint cullProgram = glCreateProgram();
+        glAttachShader(cullProgram, cullShaderId);
+        glLinkProgram(cullProgram);
+        gpuCullingSupported = check_link_error(cullProgram) == 0;
+        if (gpuCullingSupported)
+            gpu_culling_init(gpuCulling, cullProgram);
+        else
+            glDeleteProgram(cullProgram);
+    }
 
-    //CUBE
-
-    // Create a Vertex Array Object
-    GLuint vao;
-    glGenVertexArrays(1, &vao);
-
-    // Create a VBO for each array
-    GLuint vbo[4];
-    glGenBuffers(4, vbo);
-
-    // Bind the VAO
-    glBindVertexArray(vao);
-
-    // Bind indices and upload data
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo[0]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(cube_triangleList), cube_triangleList, GL_STATIC_DRAW);
-
-    // Bind vertices and upload data
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(GL_FLOAT)*3, (void*)0);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(cube_vertices), cube_vertices, GL_STATIC_DRAW);
-
-    // Bind normals and upload data
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[2]);
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(GL_FLOAT)*3, (void*)0);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(cube_normals), cube_normals, GL_STATIC_DRAW);
-
-    // Bind uv coords and upload data
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[3]);
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(GL_FLOAT)*2, (void*)0);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(cube_uvs), cube_uvs, GL_STATIC_DRAW);
-
-    // Unbind everything
-    glBindVertexArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-
-    // TRIANGLE
-    // Create a Vertex Array Object
-    GLuint vao2;
-    glGenVertexArrays(1, &vao2);
-
-    // Create a VBO for each array
-    GLuint vbo2[4];
-    glGenBuffers(4, vbo2);
-
-    // Bind the VAO
-    glBindVertexArray(vao2);
-
-    // Bind indices and upload data
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo2[0]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(plane_triangleList), plane_triangleList, GL_STATIC_DRAW);
-
-    // Bind vertices and upload data
-    glBindBuffer(GL_ARRAY_BUFFER, vbo2[1]);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(GL_FLOAT)*3, (void*)0);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(plane_vertices), plane_vertices, GL_STATIC_DRAW);
-
-    // Bind normals and upload data
-    glBindBuffer(GL_ARRAY_BUFFER, vbo2[2]);
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(GL_FLOAT)*3, (void*)0);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(plane_normals), plane_normals, GL_STATIC_DRAW);
-
-    // Bind uv coords and upload data
-    glBindBuffer(GL_ARRAY_BUFFER, vbo2[3]);
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(GL_FLOAT)*2, (void*)0);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(plane_uvs), plane_uvs, GL_STATIC_DRAW);
-
-    // Unbind everything
-    glBindVertexArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    // aogl --check-gpu-culling runs the comparison in a hidden window and exits
+    if (checkGpuCulling)
+        exit(check_gpu_culling(gpuCullingSupported ? &gpuCulling : 0, cubeLod, cubeMin, cubeMax, widthf / heightf, height));
+
+    // Cells over the instance grid store the instances seen from them. The
+    // set of the cell holding the eye replaces culling. It is read from the
+    // cache the first time it is needed for a grid, or baked on a thread of
+    // its own while culling goes on.
+    bool pvsEnabled = false;
+    const float pvsCellSize = 6.f;
+    const int pvsSamples = 4;
+    Pvs pvs;
+    pvs.objectCount = -1;
+    PvsBakeJob pvsBake;
+    std::vector<int> pvsObjects;
+    int pvsCell = -1;
+
+    // Instances behind the nearest ones are dropped after frustum culling
+    bool occlusionCulling = true;
+    OcclusionBuffer occlusion;
+    occlusion_init(occlusion);
+    std::vector<glm::mat4> occluders;
+
+    // Left click picks an instance by casting a ray through the
+    // instance and triangle BVHs, without reading anything back from the GPU
+    PickMesh cubePick;
+    pick_mesh_build(cubePick, cubeMesh);
+    PickScene pickScene;
+    PickHit pickHit = { -1, -1, 0.f, glm::vec3(0.f), 0.0 };
+    int previousLeftButton = GLFW_RELEASE;
+    bool uiHovered = false;
+    blob = archive_find(archive, "meshes/plane.mesh", &blobSize);
+    if (blob && !mesh_from_blob(blob, blobSize, planeMesh))
+        fprintf(stderr, "Invalid meshes/plane.mesh, keeping the built-in plane\n");
+    mesh_upload(planeMesh, plane);
+    Ground ground;
+    ground_init(ground, groundProgram, 400.f, 32, -1.f);
+    GroundSettings groundSettings = { 1.f, 8.f, 0.25f };
+    bool groundEnabled = true;
+
+    // Noise terrain streamed in chunks around the eye, optionally flown over
+    // to exercise the background generation
+    TerrainSettings terrainSettings;
+    terrain_default_settings(terrainSettings);
+    if (terrainCachePath)
+        terrainSettings.cacheDirectory = terrainCachePath;
+    Terrain terrain;
+    terrain_init(terrain, terrainSettings);
+    bool terrainEnabled = false;
+    float terrainSpeed = 0.f;
+    float terrainBudgetKB = terrainSettings.uploadBudget / 1024.f;
+
+    // Point lights culled per cluster of the view every frame, walked by aogl.frag
+    LightGrid lightGrid;
+    light_grid_init(lightGrid);
+    LightGridUniforms sceneLightGridUniforms, deferredLightGridUniforms;
+    light_grid_uniforms_init(sceneLightGridUniforms, sceneFragmentProgram);
+    light_grid_uniforms_init(deferredLightGridUniforms, deferredProgram);
+    std::vector<PointLight> lights;
+    float lightCountf = 256.f;
+    bool clusteredLights = true;
+    bool lightHeatMap = false;
+
+    // Deferred shading with per pass GPU timings, to compare with forward
+    DeferredRenderer deferred;
+    deferred_init(deferred, deferredProgram, width, height);
+    bool deferredEnabled = false;
+    GpuTimer forwardTimer, geometryTimer, lightingTimer;
+    gpu_timer_init(forwardTimer);
+    gpu_timer_init(geometryTimer);
+    gpu_timer_init(lightingTimer);
+    GLint gbufferPassLocation = glGetUniformLocation(sceneFragmentProgram, "GBufferPass");
+
+    // Half resolution ambient occlusion of the G-buffer, applied to the
+    // ambient term of both paths (forward has no occlusion)
+    SsaoSettings ssaoSettings;
+    ssao_default_settings(ssaoSettings);
+    Ssao ssao;
+    ssao_init(ssao, ssaoSettings, ssaoProgram, width, height);
+    SsaoUniforms ssaoUniforms;
+    ssao_uniforms_init(ssaoUniforms, deferredProgram);
+    bool ssaoEnabled = false;
+    bool ssaoShow = false;
+    float ssaoSamplesf = (float) ssaoSettings.samples;
+    float ambient = 0.1f;
+    GpuTimer ssaoTimer;
+    gpu_timer_init(ssaoTimer);
+    SsaoDiff ssaoDiff;
+    bool ssaoChecked = false;
+    GLint ambientLocation = glGetUniformLocation(sceneFragmentProgram, "Ambient");
+    GLint deferredAmbientLocation = glGetUniformLocation(deferredProgram, "Ambient");
+
+    // Split screen views around the camera target, drawn in one pass
+    float viewCountf = 1.f;
+    GLint viewCountLocation = glGetUniformLocation(multiViewGeometryProgram, "ViewCount");
+    GLint viewFromMainLocation = glGetUniformLocation(multiViewGeometryProgram, "ViewFromMain");
+    GLint viewCameraLocation = glGetUniformLocation(sceneFragmentProgram, "ViewCamera");
+
+    // Cascaded shadow maps of the sun over the instance grid
+    ShadowSettings shadowSettings;
+    shadow_default_settings(shadowSettings);
+    ShadowMap shadow;
+    shadow_init(shadow, shadowSettings, shadowProgram, cube);
+    ShadowUniforms sceneShadowUniforms, deferredShadowUniforms;
+    shadow_uniforms_init(sceneShadowUniforms, sceneFragmentProgram);
+    shadow_uniforms_init(deferredShadowUniforms, deferredProgram);
+    bool shadowsEnabled = false;
+    GpuTimer shadowTimer;
+    gpu_timer_init(shadowTimer);
+
+    // Image based ambient light, from aogl --environment <file.hdr> or
+    // textures/environment.hdr, else from a sky generated around the sun.
+    // The file is reloaded when it changes.
+    IblSettings iblSettings;
+    ibl_default_settings(iblSettings);
+    Ibl ibl;
+    ibl_init(ibl, iblSettings);
+    IblUniforms sceneIblUniforms, deferredIblUniforms;
+    ibl_uniforms_init(sceneIblUniforms, sceneFragmentProgram);
+    ibl_uniforms_init(deferredIblUniforms, deferredProgram);
+    float skyTurn = 0.f;
+    float bakedSkyTurn = skyTurn;
+    if (!ibl_load(ibl, environmentPath))
+        ibl_load_sky(ibl, shadowSettings.direction);
+    bool environmentEnabled = true;
+    float environmentIntensity = 1.f;
+    double environmentPollTime = 0.0;
+
+    // Offscreen HDR scene with bloom and tonemapping, its targets pooled
+    // by size and format and freed after 10 s unused
+    RenderTargetPool renderTargets;
+    render_target_pool_init(renderTargets, 64 << 20, 600);
+    PostSettings postSettings;
+    post_default_settings(postSettings);
+    PostProcess post;
+    post_init(post, postSettings, postProgram);
+    bool hdrEnabled = true;
+    float bloomLevelsf = (float) postSettings.bloomLevels;
+    GpuTimer postTimer;
+    gpu_timer_init(postTimer);
 
     // Initialize uniform location
-    GLuint timeLocation = glGetUniformLocation(programObject, "Time");
+    GLuint timeLocation = glGetUniformLocation(sceneVertexProgram, "Time");
 
     // Charger les textures
-    int x;
-    int y;
-    int comp;
-    unsigned char * diffuse = stbi_load("textures/spnza_bricks_a_diff.tga", &x, &y, &comp, 3);
-
-    GLuint texture[2];
-    glGenTextures(2, &texture[0]);
-
-    glBindTexture(GL_TEXTURE_2D, texture[0]);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, x, y, 0, GL_RGB, GL_UNSIGNED_BYTE, diffuse);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    GLuint diffuseLocation = glGetUniformLocation(programObject, "Diffuse");
-    glProgramUniform1i(programObject, diffuseLocation, 0);
-
-    glBindTexture(GL_TEXTURE_2D, texture[1]);
-    diffuse = stbi_load("textures/spnza_bricks_a_spec.tga", &x, &y, &comp, 3);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, x, y, 0, GL_RGB, GL_UNSIGNED_BYTE, diffuse);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    GLuint diffuseLocation2 = glGetUniformLocation(programObject, "Diffuse2");
-    glProgramUniform1i(programObject, diffuseLocation2, 1);
+    // Mips are kept on the CPU and streamed to the GPU under this budget
+    float textureBudgetMB = 16.f;
+    TextureResidency residency;
+    residency_init(residency, (size_t) (textureBudgetMB * 1024.f * 1024.f));
+
+    int diffuseTexture = load_texture_asset(residency, archive, "textures/spnza_bricks_a_diff.tga");
+    int diffuseSize = residency_texture_size(residency, diffuseTexture);
+
+    GLuint diffuseLocation = glGetUniformLocation(sceneFragmentProgram, "Diffuse");
+    glProgramUniform1i(sceneFragmentProgram, diffuseLocation, 0);
+
+    int specTexture = load_texture_asset(residency, archive, "textures/spnza_bricks_a_spec.tga");
+    int specSize = residency_texture_size(residency, specTexture);
+
+    GLuint diffuseLocation2 = glGetUniformLocation(sceneFragmentProgram, "Diffuse2");
+    glProgramUniform1i(sceneFragmentProgram, diffuseLocation2, 1);
+
+    // Height map converted to a tangent-space normal map, cached on disk
+    int normalTexture = load_texture_asset(residency, archive, "textures/spnza_bricks_a_bump.png.nrm");
+    if (normalTexture < 0)
+    {
+        int x, y;
+        unsigned char * normals = load_normal_map_from_height("textures/spnza_bricks_a_bump.png", NORMAL_MAP_STRENGTH, &x, &y);
+        normalTexture = residency_add_texture(residency, normals, x, y, 3);
+        delete[] normals;
+    }
+    int normalSize = residency_texture_size(residency, normalTexture);
+
+    GLuint normalMapLocation = glGetUniformLocation(sceneFragmentProgram, "NormalMap");
+    glProgramUniform1i(sceneFragmentProgram, normalMapLocation, 2);
 
     float lightPosition[3] = {0.3,0.5,2};
-    GLuint lightLocation = glGetUniformLocation(programObject, "Light");
-    glProgramUniform3f(programObject, lightLocation, lightPosition[0], lightPosition[1], lightPosition[2]);
+    GLuint lightLocation = glGetUniformLocation(sceneFragmentProgram, "Light");
+    glProgramUniform3f(sceneFragmentProgram, lightLocation, lightPosition[0], lightPosition[1], lightPosition[2]);
+    glProgramUniform3f(deferredProgram, glGetUniformLocation(deferredProgram, "Light"), lightPosition[0], lightPosition[1], lightPosition[2]);
 
     int specularPower = 80;
-    GLuint specularLocation = glGetUniformLocation(programObject, "specularPower");
-    glProgramUniform1i(programObject, specularLocation, specularPower);
+    GLuint specularLocation = glGetUniformLocation(sceneFragmentProgram, "specularPower");
+    glProgramUniform1i(sceneFragmentProgram, specularLocation, specularPower);
 
-    GLuint cameraLocation = glGetUniformLocation(programObject, "Camera");
+    GLuint deferredCameraLocation = glGetUniformLocation(deferredProgram, "Camera");
 
+    GltfScene gltf;
+    int gltfDrawCalls = 0;
+    if (glbPath)
+    {
+        GltfStats gltfStats;
+        if (gltf_load_glb(glbPath, residency, gltf, &gltfStats))
+            fprintf(stderr, "Loaded %s: %d draws, %.1f MB (%.1f MB uploaded from %d views, %d images) in %.1f ms "
+                    "(json %.1f ms, buffers %.1f ms, images %.1f ms, batching %.1f ms: %d draws in %d chunks)\n",
+                    glbPath, (int) gltf.draws.size(), gltfStats.bytes / (1024.0 * 1024.0), gltfStats.uploadedBytes / (1024.0 * 1024.0),
+                    gltfStats.bufferViews, gltfStats.images, gltfStats.totalMs, gltfStats.parseMs, gltfStats.uploadMs,
+                    gltfStats.imageMs, gltfStats.batchMs, gltfStats.batchedDraws, gltfStats.batchChunks);
+        else
+            fprintf(stderr, "Failed to load %s\n", glbPath);
+    }
+
+    int uiScroll = 0;
     do
     {
         t = glfwGetTime();
         // Upload value
-        glProgramUniform1f(programObject, timeLocation, t);
+        glProgramUniform1f(sceneVertexProgram, timeLocation, t);
+        pipeline_frame(pipelines);
 
         // Mouse states
         int leftButton = glfwGetMouseButton( window, GLFW_MOUSE_BUTTON_LEFT );
@@ -379,37 +711,359 @@ int main( int argc, char **argv )
             guiStates.lockPositionY = mousey;
         }
 
-        glProgramUniform3f(programObject, cameraLocation, camera.eye.x, camera.eye.y, camera.eye.z);
+        // Flight over the terrain, keeping above the ground
+        if (terrainEnabled && terrainSpeed > 0.f && fps > 0.f)
+        {
+            camera.o.x += terrainSpeed / fps;
+            camera.o.y = terrain_height(terrain.settings, camera.o.x, camera.o.z) + 4.f;
+            camera_compute(camera);
+        }
+        glProgramUniform3f(deferredProgram, deferredCameraLocation, camera.eye.x, camera.eye.y, camera.eye.z);
+        glProgramUniform3f(sceneFragmentProgram, ambientLocation, ambient, ambient, ambient);
+        glProgramUniform3f(deferredProgram, deferredAmbientLocation, ambient, ambient, ambient);
+
+        // Rebake when the HDR file or the generated sky change, the sun of
+        // the shadows turns with the sky
+        if (ibl.path.empty() && skyTurn != bakedSkyTurn)
+        {
+            glm::vec3 sunDirection(glm::rotate(glm::mat4(1.f), skyTurn, glm::vec3(0.f, 1.f, 0.f)) * glm::vec4(shadowSettings.direction, 0.f));
+            shadow_set_direction(shadow, sunDirection);
+            ibl_load_sky(ibl, sunDirection);
+            bakedSkyTurn = skyTurn;
+        }
+        if (t - environmentPollTime > 1.0)
+        {
+            if (ibl_source_changed(ibl))
+                ibl_load(ibl, ibl.path.c_str());
+            environmentPollTime = t;
+        }
+        ibl_bind(ibl, sceneIblUniforms, 13, environmentEnabled ? environmentIntensity : 0.f);
 
 
         // Default states
         glEnable(GL_DEPTH_TEST);
 
-        // Clear the front buffer
+        // Clear the front buffer, the HDR target or the G-buffer the scene
+        // goes to first
+        if (deferredEnabled)
+            deferred_begin_geometry(deferred);
+        else if (hdrEnabled)
+            post_begin(post, renderTargets, width, height, true);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
         // Get camera matrices
-        glm::mat4 projection = glm::perspective(45.0f, widthf / heightf, 0.1f, 100.f); 
+        const float nearPlane = 0.1f, farPlane = 100.f;
+        glm::mat4 projection = glm::perspective(45.0f, widthf / heightf, nearPlane, farPlane);
         glm::mat4 worldToView = glm::lookAt(camera.eye, camera.o, camera.up);
         glm::mat4 objectToWorld;
         glm::mat4 mvp = projection * worldToView * objectToWorld;
 
+        // Views orbit the target at even angles, side by side or in quarters
+        // of the window. Deferred shading only has one view.
+        int viewCount = deferredEnabled ? 1 : (int) viewCountf;
+        bool multiView = viewCount > 1;
+        glm::mat4 viewProjections[CULL_MAX_VIEWS];
+        glm::mat4 viewFromMain[CULL_MAX_VIEWS];
+        glm::vec3 viewEyes[CULL_MAX_VIEWS];
+        Frustum viewFrusta[CULL_MAX_VIEWS];
+        glm::vec4 viewports[CULL_MAX_VIEWS];
+        glm::mat4 mainToWorld = glm::inverse(projection * worldToView);
+        for (int i = 0; i < viewCount; ++i)
+        {
+            float viewWidth = multiView ? width / 2.f : (float) width;
+            float viewHeight = viewCount > 2 ? height / 2.f : (float) height;
+            float viewX = (i & 1) * viewWidth;
+            float viewY = viewCount > 2 && i < 2 ? viewHeight : 0.f;
+            viewports[i] = glm::vec4(viewX, viewY, viewWidth, viewHeight);
+            glm::mat4 orbit = glm::rotate(glm::mat4(1.f), i * 6.2831853f / viewCount, camera.up);
+            viewEyes[i] = camera.o + glm::vec3(orbit * glm::vec4(camera.eye - camera.o, 0.f));
+            glm::mat4 viewProjection = glm::perspective(45.0f, viewWidth / viewHeight, nearPlane, farPlane)
+                                     * glm::lookAt(viewEyes[i], camera.o, camera.up);
+            viewProjections[i] = multiView ? viewProjection : projection * worldToView;
+            viewFromMain[i] = viewProjection * mainToWorld;
+            frustum_from_matrix(viewProjections[i], viewFrusta[i]);
+        }
+        glProgramUniform1i(multiViewGeometryProgram, viewCountLocation, viewCount);
+        glProgramUniformMatrix4fv(multiViewGeometryProgram, viewFromMainLocation, viewCount, 0, glm::value_ptr(viewFromMain[0]));
+        if (multiView)
+            glProgramUniform3fv(sceneFragmentProgram, viewCameraLocation, viewCount, glm::value_ptr(viewEyes[0]));
+        else
+            glProgramUniform3fv(sceneFragmentProgram, viewCameraLocation, 1, glm::value_ptr(camera.eye));
+
+        // Rebuild the grid when the instance count changes, then write the
+        // visible instances to the instance buffer
+        if ((int) instanceCountf != instanceCount)
+        {
+            instanceCount = (int) instanceCountf;
+            instance_grid(instanceCount, 3.f, instanceTransforms);
+            instance_bounds_update(instanceBounds, &instanceTransforms[0], instanceCount, cubeMin, cubeMax);
+            glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+            glBufferData(GL_ARRAY_BUFFER, instanceCount * sizeof(glm::mat4), 0, GL_STREAM_DRAW);
+            culledTransforms.resize(instanceCount);
+            pick_scene_build(pickScene, cubePick, &instanceTransforms[0], instanceCount);
+            shadow_invalidate(shadow);
+            pickHit.instance = -1;
+            if (gpuCullingSupported)
+                gpu_culling_set_instances(gpuCulling, instanceBounds, &instanceTransforms[0], instanceCount);
+        }
+
+        // Pick on the frame the left button goes down, camera moves need shift
+        if (!altPressed && !uiHovered && leftButton == GLFW_PRESS && previousLeftButton != GLFW_PRESS)
+        {
+            double cursorX; double cursorY;
+            glfwGetCursorPos(window, &cursorX, &cursorY);
+            glm::vec3 rayOrigin, rayDirection;
+            pick_ray(projection * worldToView, camera.eye, cursorX, cursorY, width / DPI, height / DPI, rayOrigin, rayDirection);
+            pick_raycast(pickScene, rayOrigin, rayDirection, pickHit);
+        }
+        previousLeftButton = leftButton;
+        Frustum frustum;
+        frustum_from_matrix(projection * worldToView, frustum);
+        if (pvsEnabled && pvs.objectCount != instanceCount && !pvsBake.thread.joinable())
+        {
+            // Walkable space spans the grid up to twice its height
+            glm::vec3 sceneMin(FLT_MAX), sceneMax(-FLT_MAX);
+            for (int i = 0; i < instanceCount; ++i)
+            {
+                glm::vec3 center(instanceBounds.centerX[i], instanceBounds.centerY[i], instanceBounds.centerZ[i]);
+                glm::vec3 extent(instanceBounds.extentX[i], instanceBounds.extentY[i], instanceBounds.extentZ[i]);
+                sceneMin = glm::min(sceneMin, center - extent);
+                sceneMax = glm::max(sceneMax, center + extent);
+            }
+            sceneMax.y += sceneMax.y - sceneMin.y;
+            uint64_t key = hash_bytes(cubeMesh.vertices, cubeMesh.vertexCount * 3 * sizeof(float), pvsSamples);
+            key = hash_bytes(&instanceTransforms[0], instanceCount * sizeof(glm::mat4), key ^ (uint64_t) (pvsCellSize * 1000.f));
+            if (pvs_load(pvs, "aogl.pvs", key))
+            {
+                fprintf(stderr, "PVS read from aogl.pvs\n");
+                pvsObjects.resize(instanceCount);
+            }
+            else
+                pvs_bake_start(pvsBake, pickScene, instanceBounds, sceneMin, sceneMax, pvsCellSize, pvsSamples, "aogl.pvs", key);
+        }
+        if (pvs_bake_finish(pvsBake, pvs, false))
+        {
+            fprintf(stderr, "PVS baked: %d cells, %lld rays in %.0f ms, %.1f KB\n", pvs.cellsX * pvs.cellsY * pvs.cellsZ,
+                    pvs.rays, pvs.bakeMs, pvs.data.size() / 1024.f);
+            pvsObjects.resize(pvs.objectCount);
+        }
+        pvsCell = pvsEnabled && pvs.objectCount == instanceCount && !gpuCullingEnabled && !multiView ? pvs_find_cell(pvs, camera.eye) : -1;
+
+        int visibleInstances = 0;
+        if (gpuCullingEnabled && !multiView)
+            gpu_culling_dispatch(gpuCulling, cubeLod, frustum, camera.eye, projection[1][1], height, lodPixelError);
+        else
+        {
+            if (pvsCell >= 0)
+            {
+                visibleInstances = pvs_visible_objects(pvs, pvsCell, &pvsObjects[0]);
+                for (int i = 0; i < visibleInstances; ++i)
+                    culledTransforms[i] = instanceTransforms[pvsObjects[i]];
+            }
+            else
+            {
+                // Occluders are rendered from the camera, other views skip them
+                bool occlusionFrame = occlusionCulling && !multiView;
+                if (occlusionFrame)
+                {
+                    select_occluders(instanceTransforms, cubeMin, cubeMax, frustum, camera.eye, 32, occluders);
+                    occlusion_render(occlusion, projection * worldToView, cubeMesh, occluders.empty() ? 0 : &occluders[0], (int) occluders.size());
+                }
+                visibleInstances = frustum_cull_instances_views(viewFrusta, viewCount, instanceBounds, occlusionFrame ? &occlusion : 0,
+                                                                &instanceTransforms[0], &culledTransforms[0], &cullStats);
+            }
+            glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+            glm::mat4 * visibleTransforms = (glm::mat4 *) glMapBufferRange(GL_ARRAY_BUFFER, 0, instanceCount * sizeof(glm::mat4),
+                                                                           GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+            lod_sort_instances(cubeLod, &culledTransforms[0], visibleInstances, camera.eye, projection[1][1], height,
+                               lodPixelError, visibleTransforms, lodInstances);
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+
+        // Level 0 instances keep their culling order in the instance buffer
+        clusterIndices.clear();
+        clusterOffsets.clear();
+        memset(&meshletStats, 0, sizeof(meshletStats));
+        if (clusterCulling && !gpuCullingEnabled && !multiView && cubeMeshlets.meshlets.size() > 1)
+        {
+            for (int i = 0; i < visibleInstances && (int) clusterOffsets.size() < maxClusterInstances; ++i)
+            {
+                if (lodInstances.level[i] != 0)
+                    continue;
+                clusterOffsets.push_back((int) clusterIndices.size());
+                meshlet_cull(cubeMeshlets, culledTransforms[i], frustum, camera.eye, clusterIndices, &meshletStats);
+            }
+            clusterOffsets.push_back((int) clusterIndices.size());
+            glBindBuffer(GL_ARRAY_BUFFER, clusterIndexBuffer);
+            glBufferData(GL_ARRAY_BUFFER, clusterIndices.size() * sizeof(int), clusterIndices.empty() ? 0 : &clusterIndices[0], GL_STREAM_DRAW);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+        int clusterInstances = clusterOffsets.empty() ? 0 : (int) clusterOffsets.size() - 1;
+
+        // Stream texture mips from the estimated on-screen texel density
+        float cubeDistance = glm::length(camera.eye - glm::vec3(objectToWorld[3]));
+        residency_request(residency, diffuseTexture, residency_estimate_mip(diffuseSize, 1.f, cubeDistance, projection[1][1], height));
+        residency_request(residency, specTexture, residency_estimate_mip(specSize, 1.f, cubeDistance, projection[1][1], height));
+        residency_request(residency, normalTexture, residency_estimate_mip(normalSize, 1.f, cubeDistance, projection[1][1], height));
+        gltf_request_textures(gltf, residency, camera.eye, projection[1][1], height);
+        residency.budget = (size_t) (textureBudgetMB * 1024.f * 1024.f);
+        residency_update(residency);
+
+        // Clustered point lights over the instance grid. Both programs read
+        // the grid so their buffer samplers never alias the 2D ones.
+        int clusterMode = 0;
+        if (clusteredLights)
+        {
+            int lightCount = (int) lightCountf;
+            animate_lights(lightCount, ceilf(sqrtf((float) instanceCount)) * 3.f, (float) t, lights);
+            light_grid_build(lightGrid, &lights[0], lightCount, worldToView, projection, nearPlane, farPlane, width, height);
+            light_grid_upload(lightGrid);
+            clusterMode = lightHeatMap ? 2 : 1;
+        }
+        light_grid_bind(lightGrid, sceneLightGridUniforms, 3, worldToView, multiView ? 0 : clusterMode);
+
+        // Sun shadows, cascades are only redrawn when the view leaves them
+        // or the casters change
+        if (shadowsEnabled)
+        {
+            shadow_update(shadow, worldToView, projection, nearPlane, instanceBounds, &instanceTransforms[0], cubeLod);
+            gpu_timer_begin(shadowTimer);
+            shadow_render(shadow, cubeLod);
+            gpu_timer_end(shadowTimer);
+            if (deferredEnabled)
+                deferred_begin_geometry(deferred);
+            else
+            {
+                glBindFramebuffer(GL_FRAMEBUFFER, hdrEnabled ? post.sceneFbo : 0);
+                glViewport(0, 0, width, height);
+            }
+        }
+        shadow_bind(shadow, sceneShadowUniforms, 10, shadowsEnabled);
+        shadow_bind(shadow, deferredShadowUniforms, 10, shadowsEnabled);
+        glProgramUniform1i(sceneFragmentProgram, gbufferPassLocation, deferredEnabled);
+        gpu_timer_begin(deferredEnabled ? geometryTimer : forwardTimer);
+
         // Select shader
-        glUseProgram(programObject);
+        pipeline_bind(pipelines, multiView ? multiViewPipeline : scenePipeline);
+        if (multiView)
+            glViewportArrayv(0, viewCount, glm::value_ptr(viewports[0]));
 
         // Upload uniforms
-        glProgramUniformMatrix4fv(programObject, mvpLocation, 1, 0, glm::value_ptr(mvp));
+        glProgramUniformMatrix4fv(sceneVertexProgram, mvpLocation, 1, 0, glm::value_ptr(mvp));
 
         // Render vaos
         glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture[0]);
+        glBindTexture(GL_TEXTURE_2D, residency_texture_id(residency, diffuseTexture));
         glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, texture[1]);
-        glBindVertexArray(vao);
-        glDrawElementsInstanced(GL_TRIANGLES, cube_triangleCount * 3, GL_UNSIGNED_INT, (void*)0, 4);
+        glBindTexture(GL_TEXTURE_2D, residency_texture_id(residency, specTexture));
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D, residency_texture_id(residency, normalTexture));
+        if (gpuCullingEnabled && !multiView)
+            gpu_culling_draw(gpuCulling, cube);
+        else
+        {
+            for (int i = 0; i < (int) cubeLod.levels.size(); ++i)
+            {
+                int first = lodInstances.first[i] + (i == 0 ? clusterInstances : 0);
+                int count = lodInstances.count[i] - (i == 0 ? clusterInstances : 0);
+                if (!count)
+                    continue;
+                const LodLevel & level = cubeLod.levels[i];
+                mesh_bind_instances(cube, instanceBuffer, first);
+                glBindVertexArray(cube.vao);
+                glDrawElementsInstanced(GL_TRIANGLES, level.triangleCount * 3, GL_UNSIGNED_INT,
+                                        (void*)(level.indexOffset * sizeof(int)), count);
+            }
+        }
+        if (clusterInstances)
+        {
+            glBindVertexArray(cube.vao);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, clusterIndexBuffer);
+            for (int i = 0; i < clusterInstances; ++i)
+            {
+                int count = clusterOffsets[i + 1] - clusterOffsets[i];
+                if (!count)
+                    continue;
+                mesh_bind_instances(cube, instanceBuffer, lodInstances.first[0] + i);
+                glBindVertexArray(cube.vao);
+                glDrawElementsInstanced(GL_TRIANGLES, count, GL_UNSIGNED_INT, (void*)(clusterOffsets[i] * sizeof(int)), 1);
+            }
+            glBindVertexArray(cube.vao);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cube.vbo[0]);
+        }
+
+        // glTF, ground and terrain cull against one view, they stay in the first
+        if (!gltf.draws.empty())
+        {
+            pipeline_bind(pipelines, scenePipeline);
+            gltfDrawCalls = gltf_draw(gltf, residency, sceneVertexProgram, mvpLocation, sceneFragmentProgram, specularLocation, viewProjections[0]);
+            glProgramUniform1i(sceneFragmentProgram, specularLocation, specularPower);
+        }
+
+//        glBindVertexArray(plane.vao);
+//        glDrawElements(GL_TRIANGLES, plane.triangleCount * 3, GL_UNSIGNED_INT, (void*)0);
+        if (groundEnabled)
+        {
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, residency_texture_id(residency, diffuseTexture));
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, residency_texture_id(residency, specTexture));
+            glActiveTexture(GL_TEXTURE2);
+            glBindTexture(GL_TEXTURE_2D, residency_texture_id(residency, normalTexture));
+            pipeline_bind(pipelines, groundPipeline);
+            ground_draw(ground, groundSettings, viewProjections[0], camera.eye, projection[1][1], height);
+        }
+        if (terrainEnabled)
+        {
+            pipeline_bind(pipelines, scenePipeline);
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, residency_texture_id(residency, diffuseTexture));
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, residency_texture_id(residency, specTexture));
+            glActiveTexture(GL_TEXTURE2);
+            glBindTexture(GL_TEXTURE_2D, residency_texture_id(residency, normalTexture));
+            terrain.settings.uploadBudget = (size_t) (terrainBudgetKB * 1024.f);
+            terrain_update(terrain, camera.eye);
+            terrain_draw(terrain, sceneVertexProgram, mvpLocation, viewProjections[0]);
+        }
 
-//        glBindVertexArray(vao2);
-//        glDrawElements(GL_TRIANGLES, plane_triangleCount * 3, GL_UNSIGNED_INT, (void*)0);
+        // Light the G-buffer into the window
+        if (deferredEnabled)
+        {
+            gpu_timer_end(geometryTimer);
+            if (ssaoEnabled)
+            {
+                ssao.settings.samples = (int) ssaoSamplesf;
+                gpu_timer_begin(ssaoTimer);
+                ssao_render(ssao, renderTargets, deferred, projection, worldToView, 11);
+                gpu_timer_end(ssaoTimer);
+                glViewport(0, 0, width, height);
+            }
+            ssao_bind(ssao, ssaoUniforms, 11, ssaoEnabled ? (ssaoShow ? 2 : 1) : 0);
+            ibl_bind(ibl, deferredIblUniforms, 13, environmentEnabled ? environmentIntensity : 0.f);
+            if (hdrEnabled)
+                post_begin(post, renderTargets, width, height, false);
+            else
+                glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            gpu_timer_begin(lightingTimer);
+            light_grid_bind(lightGrid, deferredLightGridUniforms, 3, worldToView, clusterMode);
+            deferred_light(deferred, projection * worldToView, 6);
+            gpu_timer_end(lightingTimer);
+        }
+        else
+            gpu_timer_end(forwardTimer);
+
+        // Bloom and tonemapping into the window
+        if (hdrEnabled)
+        {
+            post.settings.bloomLevels = (int) bloomLevelsf;
+            gpu_timer_begin(postTimer);
+            post_end(post, renderTargets, 14);
+            gpu_timer_end(postTimer);
+        }
+        render_target_pool_frame(renderTargets);
 
 #if 1
         // Draw UI
@@ -419,7 +1073,9 @@ int main( int argc, char **argv )
         glViewport(0, 0, width, height);
 
         unsigned char mbut = 0;
-        int mscroll = 0;
+        // Wheel up scrolls the panel up, fractions of trackpads add up
+        int mscroll = (int) -guiStates.scroll;
+        guiStates.scroll += mscroll;
         double mousex; double mousey;
         glfwGetCursorPos(window, &mousex, &mousey);
         mousex*=DPI;
@@ -430,12 +1086,210 @@ int main( int argc, char **argv )
             mbut |= IMGUI_MBUT_LEFT;
 
         imguiBeginFrame(mousex, mousey, mbut, mscroll);
-        int logScroll = 0;
         char lineBuffer[512];
-        imguiBeginScrollArea("aogl", width - 210, height - 310, 200, 300, &logScroll);
+        uiHovered = imguiBeginScrollArea("aogl", width - 210, 10, 200, height - 20, &uiScroll);
         sprintf(lineBuffer, "FPS %f", fps);
         imguiLabel(lineBuffer);
         imguiSlider("Dummy", &dummySlider, 0.0, 3.0, 0.1);
+        sprintf(lineBuffer, "Textures %.1f / %.1f MB", residency.usage / (1024.f * 1024.f), residency.budget / (1024.f * 1024.f));
+        imguiLabel(lineBuffer);
+        sprintf(lineBuffer, "Mips evicted %d streamed %d", residency.evictedMips, residency.streamedMips);
+        imguiLabel(lineBuffer);
+        imguiSlider("Texture budget MB", &textureBudgetMB, 1.0, 64.0, 1.0);
+        // The GPU path keeps its counts on the GPU, the CPU ones would be stale
+        bool cpuCullStats = !(gpuCullingEnabled && !multiView);
+        if (cpuCullStats)
+            sprintf(lineBuffer, "Visible %d / %d (%.2f ms)", cullStats.visible, cullStats.tested, cullStats.ms);
+        else
+            sprintf(lineBuffer, "Culled on the GPU, %d instances", instanceCount);
+        imguiLabel(lineBuffer);
+        imguiSlider("Instances", &instanceCountf, 1.0, 65536.0, 1.0);
+        if (imguiCheck("Occlusion culling", occlusionCulling))
+            occlusionCulling = !occlusionCulling;
+        if (occlusionCulling && cpuCullStats)
+        {
+            sprintf(lineBuffer, "Occluded %d (%.0f%%)", cullStats.occluded,
+                    cullStats.tested ? 100.f * cullStats.occluded / cullStats.tested : 0.f);
+            imguiLabel(lineBuffer);
+            sprintf(lineBuffer, "Occluders %d tris %.2f ms", occlusion.occluderTriangles, occlusion.rasterMs);
+            imguiLabel(lineBuffer);
+        }
+        if (cpuCullStats)
+        {
+            sprintf(lineBuffer, "LOD triangles %d (%d levels)", lodInstances.triangles, (int) cubeLod.levels.size());
+            imguiLabel(lineBuffer);
+        }
+        imguiSlider("LOD pixel error", &lodPixelError, 0.25, 8.0, 0.25);
+        if (imguiCheck("Cluster culling", clusterCulling))
+            clusterCulling = !clusterCulling;
+        if (clusterCulling && meshletStats.meshlets && cpuCullStats)
+        {
+            sprintf(lineBuffer, "Clusters %d frustum %d back %d", meshletStats.meshlets, meshletStats.frustumCulled, meshletStats.backfaceCulled);
+            imguiLabel(lineBuffer);
+            sprintf(lineBuffer, "Cluster tris %.0f%% culled (%.2f ms)", 100.f * (meshletStats.triangles - meshletStats.visibleTriangles) / meshletStats.triangles, meshletStats.ms);
+            imguiLabel(lineBuffer);
+        }
+        if (imguiCheck("PVS", pvsEnabled))
+            pvsEnabled = !pvsEnabled;
+        if (pvsEnabled)
+        {
+            if (pvsBake.thread.joinable())
+                sprintf(lineBuffer, "PVS baking, culling meanwhile");
+            else if (pvsCell >= 0)
+                sprintf(lineBuffer, "PVS cell %d: %d / %d", pvsCell, visibleInstances, instanceCount);
+            else
+                sprintf(lineBuffer, "PVS eye outside the cells");
+            imguiLabel(lineBuffer);
+        }
+        if (gpuCullingSupported)
+        {
+            if (imguiCheck("GPU culling", gpuCullingEnabled))
+                gpuCullingEnabled = !gpuCullingEnabled;
+            if (gpuCullingEnabled && imguiButton("Check against CPU"))
+                gpuCullingMismatches = gpu_culling_compare(gpuCulling, cubeLod, instanceBounds, &instanceTransforms[0], frustum,
+                                                           camera.eye, projection[1][1], height, lodPixelError);
+            if (gpuCullingMismatches >= 0)
+            {
+                sprintf(lineBuffer, "GPU vs CPU mismatches %d", gpuCullingMismatches);
+                imguiLabel(lineBuffer);
+            }
+        }
+        if (imguiCheck("Clustered lights", clusteredLights))
+            clusteredLights = !clusteredLights;
+        if (clusteredLights)
+        {
+            imguiSlider("Lights", &lightCountf, 1.0, 4096.0, 1.0);
+            if (imguiCheck("Lights per cluster", lightHeatMap))
+                lightHeatMap = !lightHeatMap;
+            sprintf(lineBuffer, "Light grid %dx%dx%d: %d refs, max %d (%.2f ms)", lightGrid.tilesX, lightGrid.tilesY, lightGrid.slices,
+                    (int) lightGrid.indices.size(), lightGrid.maxClusterLights, lightGrid.ms);
+            imguiLabel(lineBuffer);
+        }
+        if (imguiCheck("Cascaded shadows", shadowsEnabled))
+            shadowsEnabled = !shadowsEnabled;
+        if (shadowsEnabled)
+        {
+            imguiSlider("Shadow distance", &shadow.settings.distance, 10.0, 100.0, 1.0);
+            const ShadowStats & ss = shadow.stats;
+            sprintf(lineBuffer, "Shadows: %d / %d cascades redrawn, %d draws", ss.renderedCascades, shadow.settings.cascadeCount, ss.draws);
+            imguiLabel(lineBuffer);
+            sprintf(lineBuffer, "Casters %d %d %d %d (%.2f ms, GPU %.2f ms)", ss.casters[0], ss.casters[1], ss.casters[2], ss.casters[3],
+                    ss.ms, shadowTimer.ms);
+            imguiLabel(lineBuffer);
+        }
+        imguiSlider("Views", &viewCountf, 1.0, 4.0, 1.0);
+        if (viewCount > 1)
+        {
+            sprintf(lineBuffer, "%d views in one pass through aogl.geom", viewCount);
+            imguiLabel(lineBuffer);
+        }
+        sprintf(lineBuffer, "Pipelines %d, %d programs linked (%.1f ms)", pipelines.stats.pipelines, pipelines.stats.links, pipelines.stats.linkMs);
+        imguiLabel(lineBuffer);
+        sprintf(lineBuffer, "Pipeline binds %d, %d switches (%.3f ms)", pipelines.stats.binds, pipelines.stats.switches, pipelines.stats.bindMs);
+        imguiLabel(lineBuffer);
+        if (imguiCheck("Deferred shading", deferredEnabled))
+            deferredEnabled = !deferredEnabled;
+        if (deferredEnabled)
+            sprintf(lineBuffer, "GPU geometry %.2f ms, lighting %.2f ms", geometryTimer.ms, lightingTimer.ms);
+        else
+            sprintf(lineBuffer, "GPU forward %.2f ms", forwardTimer.ms);
+        imguiLabel(lineBuffer);
+        if (imguiCheck("HDR and tonemapping", hdrEnabled))
+            hdrEnabled = !hdrEnabled;
+        if (hdrEnabled)
+        {
+            imguiSlider("Exposure", &post.settings.exposure, 0.1, 4.0, 0.05);
+            if (imguiCheck("Bloom", post.settings.bloom))
+                post.settings.bloom = !post.settings.bloom;
+            if (post.settings.bloom)
+            {
+                imguiSlider("Bloom threshold", &post.settings.bloomThreshold, 0.1, 4.0, 0.05);
+                imguiSlider("Bloom intensity", &post.settings.bloomIntensity, 0.0, 1.0, 0.01);
+                imguiSlider("Bloom levels", &bloomLevelsf, 1.0, (float) POST_MAX_BLOOM_LEVELS, 1.0);
+            }
+            sprintf(lineBuffer, "Post GPU %.2f ms", postTimer.ms);
+            imguiLabel(lineBuffer);
+        }
+        const RenderTargetStats & rs = renderTargets.stats;
+        sprintf(lineBuffer, "Targets %d, %.1f MB, %d allocations (%d this frame)", rs.targets, rs.bytes / (1024.f * 1024.f),
+                rs.allocations, rs.frameAllocations);
+        imguiLabel(lineBuffer);
+        if (imguiCheck("Environment lighting", environmentEnabled))
+            environmentEnabled = !environmentEnabled;
+        if (environmentEnabled)
+        {
+            imguiSlider("Environment intensity", &environmentIntensity, 0.0, 2.0, 0.05);
+            if (ibl.path.empty())
+                imguiSlider("Sky turn", &skyTurn, -3.14, 3.14, 0.05);
+            if (ibl.stats.cached)
+                sprintf(lineBuffer, "Environment from cache (%.1f ms)", ibl.stats.loadMs);
+            else
+                sprintf(lineBuffer, "Environment SH %.1f ms, specular %.1f ms", ibl.stats.shMs, ibl.stats.prefilterMs);
+            imguiLabel(lineBuffer);
+        }
+        else
+            imguiSlider("Ambient", &ambient, 0.0, 0.5, 0.01);
+        if (deferredEnabled)
+        {
+            if (imguiCheck("Ambient occlusion", ssaoEnabled))
+                ssaoEnabled = !ssaoEnabled;
+        }
+        if (deferredEnabled && ssaoEnabled)
+        {
+            imguiSlider("AO radius", &ssao.settings.radius, 0.1, 4.0, 0.1);
+            imguiSlider("AO samples", &ssaoSamplesf, 4.0, (float) SSAO_MAX_SAMPLES, 1.0);
+            if (imguiCheck("Temporal AO", ssao.settings.temporal))
+                ssao.settings.temporal = !ssao.settings.temporal;
+            if (imguiCheck("Show occlusion", ssaoShow))
+                ssaoShow = !ssaoShow;
+            double frameMs = geometryTimer.ms + ssaoTimer.ms + lightingTimer.ms;
+            sprintf(lineBuffer, "SSAO %dx%d GPU %.2f ms (%.0f%% of the frame)", ssao.width, ssao.height, ssaoTimer.ms,
+                    frameMs > 0.0 ? 100.0 * ssaoTimer.ms / frameMs : 0.0);
+            imguiLabel(lineBuffer);
+            if (!ssao.settings.temporal && imguiButton("Check AO against CPU"))
+            {
+                ssaoDiff = ssao_compare(ssao, deferred, projection, worldToView, 2.f / 255.f);
+                ssaoChecked = true;
+            }
+            if (ssaoChecked)
+            {
+                sprintf(lineBuffer, "AO vs CPU: %d / %d off, max %.3f", ssaoDiff.different, ssaoDiff.pixels, ssaoDiff.maxError);
+                imguiLabel(lineBuffer);
+            }
+        }
+        if (imguiCheck("Tessellated ground", groundEnabled))
+            groundEnabled = !groundEnabled;
+        if (groundEnabled)
+        {
+            sprintf(lineBuffer, "Ground triangles %u", ground.triangles);
+            imguiLabel(lineBuffer);
+            imguiSlider("Ground pixels per edge", &groundSettings.pixelsPerEdge, 2.0, 32.0, 1.0);
+            imguiSlider("Ground amplitude", &groundSettings.amplitude, 0.0, 8.0, 0.25);
+        }
+        if (imguiCheck("Streaming terrain", terrainEnabled))
+            terrainEnabled = !terrainEnabled;
+        if (terrainEnabled)
+        {
+            const TerrainStats & ts = terrain.stats;
+            sprintf(lineBuffer, "Terrain %d / %d chunks, %d pending, %d cached", ts.wanted - ts.missing, ts.wanted, ts.pending, ts.cached);
+            imguiLabel(lineBuffer);
+            sprintf(lineBuffer, "Terrain %d uploads %.0f KB, update %.2f ms", ts.uploads, ts.uploadedBytes / 1024.f, ts.updateMs);
+            imguiLabel(lineBuffer);
+            sprintf(lineBuffer, "Terrain %lld built (%.2f ms), %lld from disk", ts.generated, ts.generateMs, ts.diskHits);
+            imguiLabel(lineBuffer);
+            imguiSlider("Terrain upload KB per frame", &terrainBudgetKB, 64.0, 4096.0, 64.0);
+            imguiSlider("Terrain flight speed", &terrainSpeed, 0.0, 400.0, 10.0);
+        }
+        if (!gltf.draws.empty())
+        {
+            sprintf(lineBuffer, "glTF draw calls %d", gltfDrawCalls);
+            imguiLabel(lineBuffer);
+        }
+        if (pickHit.instance >= 0)
+            sprintf(lineBuffer, "Picked %d tri %d (%.3f ms)", pickHit.instance, pickHit.triangle, pickHit.ms);
+        else
+            sprintf(lineBuffer, "Picked none (%.3f ms)", pickHit.ms);
+        imguiLabel(lineBuffer);
 
         imguiEndScrollArea();
         imguiEndFrame();
@@ -454,6 +1308,33 @@ int main( int argc, char **argv )
     } // Check if the ESC key was pressed
     while( glfwGetKey( window, GLFW_KEY_ESCAPE ) != GLFW_PRESS );
 
+    gltf_release(gltf);
+    residency_release(residency);
+    glDeleteBuffers(1, &instanceBuffer);
+    glDeleteBuffers(1, &clusterIndexBuffer);
+    if (gpuCullingSupported)
+        gpu_culling_release(gpuCulling);
+    mesh_release(cube);
+    mesh_release(plane);
+    ground_release(ground);
+    pvs_bake_finish(pvsBake, pvs, true);
+    terrain_release(terrain);
+    light_grid_release(lightGrid);
+    deferred_release(deferred);
+    shadow_release(shadow);
+    ssao_release(ssao);
+    ibl_release(ibl);
+    post_release(post);
+    render_target_pool_release(renderTargets);
+    gpu_timer_release(postTimer);
+    gpu_timer_release(ssaoTimer);
+    gpu_timer_release(shadowTimer);
+    gpu_timer_release(forwardTimer);
+    gpu_timer_release(geometryTimer);
+    gpu_timer_release(lightingTimer);
+    pipeline_cache_release(pipelines);
+    archive_close(archive);
+
     // Close OpenGL window and terminate GLFW
     glfwTerminate();
 
@@ -540,9 +1421,12 @@ GLuint compile_shader(GLenum shaderType, const char * sourceBuffer, int bufferSi
     glShaderSource(shaderObject, 
                    1, 
                    sc,
-                   NULL);
+                   &bufferSize);
     glCompileShader(shaderObject);
-    check_compile_error(shaderObject, sc);
+    // Sources mapped from an archive are not nul terminated, list a copy
+    std::string source(sourceBuffer, bufferSize);
+    const char * listing[1] = { source.c_str() };
+    check_compile_error(shaderObject, listing);
     return shaderObject;
 }
 
@@ -562,6 +1446,248 @@ GLuint compile_shader_from_file(GLenum shaderType, const char * path)
     return shaderObject;
 }
 
+static bool read_asset_text(const Archive & archive, const char * name, std::string & text)
+{
+    size_t size;
+    const char * source = (const char *) archive_find(archive, name, &size);
+    if (source)
+    {
+        text.assign(source, size);
+        return true;
+    }
+    FILE * f = fopen(name, "rb");
+    if (!f)
+        return false;
+    fseek(f, 0, SEEK_END);
+    text.resize(ftell(f));
+    rewind(f);
+    bool ok = text.empty() || fread(&text[0], text.size(), 1, f) == 1;
+    fclose(f);
+    return ok;
+}
+
+// Replaces #include "name" lines by the asset, with #line directives so
+// compile errors point at the right file (source string = include depth)
+static bool expand_shader_includes(const Archive & archive, const char * name, int depth, std::string & out)
+{
+    std::string text;
+    if (depth > 8 || !read_asset_text(archive, name, text))
+    {
+        fprintf(stderr, "Shader: cannot read %s\n", name);
+        return false;
+    }
+    int lineNumber = 1;
+    for (size_t begin = 0; begin < text.size(); ++lineNumber)
+    {
+        size_t end = text.find('\n', begin);
+        end = end == std::string::npos ? text.size() : end + 1;
+        std::string line = text.substr(begin, end - begin);
+        begin = end;
+        size_t open = line.find_first_not_of(" \t");
+        if (open == std::string::npos || line.compare(open, 8, "#include") != 0)
+        {
+            out += line;
+            continue;
+        }
+        size_t first = line.find('"', open);
+        size_t last = first == std::string::npos ? first : line.find('"', first + 1);
+        if (last == std::string::npos)
+        {
+            fprintf(stderr, "Shader: malformed include in %s line %d\n", name, lineNumber);
+            return false;
+        }
+        char directive[32];
+        sprintf(directive, "#line 1 %d\n", depth + 1);
+        out += directive;
+        if (!expand_shader_includes(archive, line.substr(first + 1, last - first - 1).c_str(), depth + 1, out))
+            return false;
+        sprintf(directive, "\n#line %d %d\n", lineNumber + 1, depth);
+        out += directive;
+    }
+    return true;
+}
+
+GLuint compile_shader_from_asset(GLenum shaderType, const Archive & archive, const char * name)
+{
+    std::string source;
+    if (!expand_shader_includes(archive, name, 0, source))
+        return 0;
+    return compile_shader(shaderType, source.c_str(), (int) source.size());
+}
+
+int load_texture_asset(TextureResidency & residency, const Archive & archive, const char * name)
+{
+    // Packed textures are prebuilt mip chains used straight from the mapping
+    size_t size;
+    const void * chain = archive_find(archive, name, &size);
+    if (chain)
+        return residency_add_chain(residency, chain, size);
+    int x, y, comp;
+    unsigned char * pixels = stbi_load(name, &x, &y, &comp, 3);
+    if (!pixels)
+        return -1;
+    int handle = residency_add_texture(residency, pixels, x, y, 3);
+    stbi_image_free(pixels);
+    return handle;
+}
+
+void instance_grid(int count, float spacing, std::vector<glm::mat4> & transforms)
+{
+    int side = (int) ceilf(sqrtf((float) count));
+    transforms.resize(count);
+    for (int i = 0; i < count; ++i)
+    {
+        glm::vec3 position((i % side - side / 2) * spacing, 0.f, (i / side - side / 2) * spacing);
+        transforms[i] = glm::translate(glm::mat4(1.f), position);
+    }
+}
+
+void select_occluders(const std::vector<glm::mat4> & transforms, const glm::vec3 & boundsMin, const glm::vec3 & boundsMax,
+                      const Frustum & frustum, const glm::vec3 & eye, int maxCount, std::vector<glm::mat4> & occluders)
+{
+    std::vector< std::pair<float, int> > candidates;
+    for (size_t i = 0; i < transforms.size(); ++i)
+    {
+        glm::vec3 position(transforms[i][3]);
+        if (frustum_test_aabb(frustum, position + boundsMin, position + boundsMax))
+            candidates.push_back(std::make_pair(glm::length(position - eye), (int) i));
+    }
+    int count = std::min(maxCount, (int) candidates.size());
+    std::nth_element(candidates.begin(), candidates.begin() + count, candidates.end());
+    occluders.resize(count);
+    for (int i = 0; i < count; ++i)
+        occluders[i] = transforms[candidates[i].second];
+}
+
+int check_gpu_culling(GpuCulling * culling, const LodChain & chain, const glm::vec3 & boundsMin, const glm::vec3 & boundsMax,
+                      float aspect, int viewportHeight)
+{
+    if (!culling)
+    {
+        fprintf(stderr, "GPU culling is not supported\n");
+        return EXIT_FAILURE;
+    }
+    static const int counts[] = { 1, 100, 4096, 65536 };
+    const int viewCount = 8;
+    const float pixelError = 1.f;
+    glm::mat4 projection = glm::perspective(45.0f, aspect, 0.1f, 100.f);
+    std::vector<glm::mat4> transforms;
+    InstanceBounds bounds;
+    int failures = 0;
+    for (int c = 0; c < (int) (sizeof(counts) / sizeof(counts[0])); ++c)
+    {
+        instance_grid(counts[c], 3.f, transforms);
+        instance_bounds_update(bounds, &transforms[0], counts[c], boundsMin, boundsMax);
+        gpu_culling_set_instances(*culling, bounds, &transforms[0], counts[c]);
+        int mismatches = 0;
+        for (int v = 0; v < viewCount; ++v)
+        {
+            // Eyes turning around the grid, further and higher each time
+            float angle = v * 0.8f;
+            float radius = 5.f + v * 20.f;
+            glm::vec3 eye(cosf(angle) * radius, 2.f + v * 4.f, sinf(angle) * radius);
+            Frustum frustum;
+            frustum_from_matrix(projection * glm::lookAt(eye, glm::vec3(0.f), glm::vec3(0.f, 1.f, 0.f)), frustum);
+            gpu_culling_dispatch(*culling, chain, frustum, eye, projection[1][1], viewportHeight, pixelError);
+            mismatches += gpu_culling_compare(*culling, chain, bounds, &transforms[0], frustum, eye, projection[1][1],
+                                              viewportHeight, pixelError);
+        }
+        fprintf(stderr, "GPU culling of %d instances: %d mismatches over %d views\n", counts[c], mismatches, viewCount);
+        failures += mismatches != 0;
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void animate_lights(int count, float extent, float time, std::vector<PointLight> & lights)
+{
+    lights.resize(count);
+    for (int i = 0; i < count; ++i)
+    {
+        // Golden angle spiral, evenly covering the square
+        float angle = i * 2.39996f;
+        float distance = extent * 0.7f * sqrtf((i + 0.5f) / count);
+        float phase = time * (0.5f + (i % 7) * 0.15f) + i;
+        PointLight & light = lights[i];
+        light.position = glm::vec3(cosf(angle) * distance + cosf(phase) * 1.5f,
+                                   0.8f + sinf(phase * 1.3f) * 0.4f,
+                                   sinf(angle) * distance + sinf(phase) * 1.5f);
+        light.radius = 3.f;
+        light.color = glm::vec3(0.5f + 0.5f * cosf(angle), 0.5f + 0.5f * cosf(angle + 2.094f), 0.5f + 0.5f * cosf(angle + 4.189f)) * 2.f;
+    }
+}
+
+static bool pack_file(std::vector< std::vector<unsigned char> > & storage, const char * path)
+{
+    FILE * f = fopen(path, "rb");
+    if (!f)
+        return false;
+    fseek(f, 0, SEEK_END);
+    storage.push_back(std::vector<unsigned char>(ftell(f)));
+    rewind(f);
+    bool ok = storage.back().empty() || fread(&storage.back()[0], storage.back().size(), 1, f) == 1;
+    fclose(f);
+    return ok;
+}
+
+bool pack_assets(const char * path, const MeshData & cube, const MeshData & plane)
+{
+    static const char * textures[] = { "textures/spnza_bricks_a_diff.tga", "textures/spnza_bricks_a_spec.tga" };
+    std::vector<ArchiveBlob> blobs;
+    std::vector< std::vector<unsigned char> > storage;
+    std::vector<const char *> names;
+
+    for (int i = 0; i < SHADER_ASSET_COUNT; ++i)
+    {
+        if (!pack_file(storage, SHADER_ASSETS[i]))
+            return false;
+        names.push_back(SHADER_ASSETS[i]);
+    }
+    for (int i = 0; i < (int) (sizeof(textures) / sizeof(textures[0])); ++i)
+    {
+        int x, y, comp;
+        unsigned char * pixels = stbi_load(textures[i], &x, &y, &comp, 3);
+        if (!pixels)
+            return false;
+        storage.push_back(std::vector<unsigned char>());
+        texture_build_chain(pixels, x, y, 3, storage.back());
+        stbi_image_free(pixels);
+        names.push_back(textures[i]);
+    }
+    int x, y;
+    unsigned char * normals = load_normal_map_from_height("textures/spnza_bricks_a_bump.png", NORMAL_MAP_STRENGTH, &x, &y);
+    if (!normals)
+        return false;
+    storage.push_back(std::vector<unsigned char>());
+    texture_build_chain(normals, x, y, 3, storage.back());
+    delete[] normals;
+    names.push_back("textures/spnza_bricks_a_bump.png.nrm");
+
+    storage.push_back(std::vector<unsigned char>());
+    mesh_write_blob(cube, storage.back());
+    names.push_back("meshes/cube.mesh");
+    storage.push_back(std::vector<unsigned char>());
+    mesh_write_blob(plane, storage.back());
+    names.push_back("meshes/plane.mesh");
+
+    for (size_t i = 0; i < storage.size(); ++i)
+    {
+        ArchiveBlob b = { names[i], storage[i].empty() ? 0 : &storage[i][0], storage[i].size() };
+        blobs.push_back(b);
+    }
+    return archive_write(path, blobs);
+}
+
+
+void usage()
+{
+    fprintf(stderr, "usage: aogl [--terrain-cache dir] [--environment file.hdr] [mesh.obj | scene.glb]\n"
+                    "  Draws the mesh in place of the cube, or the glTF scene next to it,\n"
+                    "  lit by the environment (default textures/environment.hdr).\n"
+                    "usage: aogl --pack <archive>\n"
+                    "  Writes the shaders, textures and built-in meshes into a packed archive.\n"
+                    "usage: aogl --check-gpu-culling\n"
+                    "  Compares GPU and CPU culling over several grids and views, without showing the window.\n");
+}
 
 bool checkError(const char* title)
 {
@@ -658,4 +1784,11 @@ void init_gui_states(GUIStates & guiStates)
     guiStates.camera = 0;
     guiStates.time = 0.0;
     guiStates.playing = false;
+    guiStates.scroll = 0.0;
+}
+
+void scroll_callback(GLFWwindow * window, double /*x*/, double y)
+{
+    GUIStates * guiStates = (GUIStates *) glfwGetWindowUserPointer(window);
+    guiStates->scroll += y;
 }
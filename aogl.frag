@@ -4,23 +4,33 @@
 #define NORMAL		1
 #define TEXCOORD	2
 #define FRAG_COLOR	0
+#define GBUFFER_SPECULAR	1
+#define GBUFFER_NORMAL	2
+#define MAX_VIEWS	4
 
 precision highp int;
 
+#include "lighting.glsl"
+
 uniform sampler2D Diffuse;
 uniform sampler2D Diffuse2;
-uniform vec3 Light;
-uniform vec3 Camera;
+uniform sampler2D NormalMap;
 uniform int specularPower;
+uniform int GBufferPass;    // write the surface for deferred.frag instead of shading it
+uniform vec3 ViewCamera[MAX_VIEWS];     // eye of each view aogl.geom draws to
 
 layout(location = FRAG_COLOR, index = 0) out vec4 FragColor;
+layout(location = GBUFFER_SPECULAR) out vec4 GBufferSpecular;
+layout(location = GBUFFER_NORMAL) out vec2 GBufferNormal;
 
 in block
 {
 	vec2 TexCoord;
         vec3 Position;
         vec3 Normal;
+        vec4 Tangent;
         float Time;
+        flat int View;
 } In;
 
 void main()
@@ -31,23 +41,26 @@ void main()
     vec3 diffuseColor = texture(Diffuse, In.TexCoord).rgb;
     vec3 spec = texture(Diffuse2, In.TexCoord).rgb;
 
-    // illumination
-
-    vec3 l = normalize(Light - In.Position);
+    // Tangent-space normal from the normal map
+    vec3 n = normalize(In.Normal);
+    vec3 t = normalize(In.Tangent.xyz - n * dot(n, In.Tangent.xyz));
+    vec3 b = cross(n, t) * In.Tangent.w;
+    vec3 normal = normalize(mat3(t, b, n) * (texture(NormalMap, In.TexCoord).rgb * 2.0 - 1.0));
+
+    // Albedo and specular power, specular color, octahedral normal. The
+    // position comes back from the depth buffer.
+    if (GBufferPass != 0)
+    {
+        FragColor = vec4(diffuseColor, clamp(float(specularPower), 0.0, 255.0) / 255.0);
+        GBufferSpecular = vec4(spec, 0.0);
+        GBufferNormal = oct_encode(normal) * 0.5 + 0.5;
+        return;
+    }
+
+    // illumination, BlinnPhong
 //    float ndotl =  dot(In.Normal, l);
 //    vec3 color = mix(diffuse, diffuse2, 0.5) * ndotl;
-    float ndotl =  clamp(dot(In.Normal, l), 0.0, 1.0);
-    vec3 color = diffuseColor * ndotl;
-
-    // BlinnPhong
-    vec3 e = normalize(Camera - In.Position);
-//    vec3 h = normalize(l-e);
-//    float ndoth = dot(In.Normal, h);
-//    vec3 specularColor =  diffuse2 * pow(ndoth, specularPower);
-
-    vec3 h = normalize(l-e);
-    float ndoth = clamp(dot(In.Normal, h), 0.0, 1.0);
-    vec3 specularColor =  spec * pow(ndoth, specularPower);
+    vec3 color = shade_surface(gl_FragCoord.xy, ViewCamera[In.View], In.Position, normal, diffuseColor, spec, float(specularPower), 1.0);
 
 //    vec2 tex = vec2(abs(cos(In.TexCoord.x * 10)), abs(sin(In.TexCoord.y * 10)));
 //    float ring = 1.0 - pow(abs(cos(In.Time)), tex.x) + pow(0.7, tex.y);
@@ -56,7 +69,7 @@ void main()
 
 //    FragColor = vec4(diffuseColor, 1);
 
-//    FragColor = vec4(color , 1); // diffuse light
-  FragColor = vec4(specularColor, 1);
+    // Diffuse plus specular since the normal map, it used to be specular only
+    FragColor = vec4(color, 1);
 
 }
@@ -3,6 +3,8 @@
 #define POSITION	0
 #define NORMAL		1
 #define TEXCOORD	2
+#define TANGENT		3
+#define INSTANCE	4
 #define FRAG_COLOR	0
 
 precision highp float;
@@ -14,6 +16,8 @@ uniform float Time;
 layout(location = POSITION) in vec3 Position;
 layout(location = NORMAL) in vec3 Normal;
 layout(location = TEXCOORD) in vec2 TexCoord;
+layout(location = TANGENT) in vec4 Tangent;
+layout(location = INSTANCE) in mat4 ObjectToWorld;
 
 out gl_PerVertex
 {
@@ -25,7 +29,9 @@ out block
         vec2 TexCoord;
         vec3 Position;
         vec3 Normal;
+        vec4 Tangent;
         float Time;
+        flat int View;
 } Out;
 
 void main()
@@ -36,14 +42,16 @@ void main()
 //    pos.y += gl_InstanceID;
 //    pos.x += cos(Time*4+gl_InstanceID);
 
-    gl_Position = MVP * vec4(pos, 1.0);
+    gl_Position = MVP * (ObjectToWorld * vec4(pos, 1.0));
 
     //    normal.y += gl_InstanceID;
     //    normal.x += cos(Time*4+gl_InstanceID);
 
 
     Out.TexCoord = TexCoord;
-    Out.Position = Position;
-    Out.Normal = normal;
+    Out.Position = vec3(ObjectToWorld * vec4(pos, 1.0));
+    Out.Normal = mat3(ObjectToWorld) * normal;
+    Out.Tangent = vec4(mat3(ObjectToWorld) * Tangent.xyz, Tangent.w);
     Out.Time = Time;
+    Out.View = 0;
 }
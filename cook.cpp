@@ -0,0 +1,815 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <math.h>
+#include <float.h>
+#include <atomic>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+#include "stb/stb_image.h"
+#include "glm/gtc/matrix_transform.hpp"
+
+#include "archive.h"
+#include "assets.h"
+#include "bvh.h"
+#include "hash.h"
+#include "lod.h"
+#include "mapped_file.h"
+#include "normalmap.h"
+#include "obj.h"
+#include "parallel.h"
+#include "residency.h"
+#include "ssao.h"
+#include "timer.h"
+
+// Bump when a change of this tool invalidates every cooked output
+static const int COOK_TOOL_VERSION = 1;
+
+struct CookItem;
+
+// Turns the inputs of an item into its runtime form
+struct Cooker
+{
+    const char * name;
+    int version;
+    bool (*cook)(const CookItem & item, std::vector<unsigned char> & out);
+};
+
+// One cooked output, keyed by the content of all its inputs
+struct CookItem
+{
+    std::string name;                   // name in the archive
+    std::vector<std::string> inputs;    // inputs[0] is the main source
+    const Cooker * cooker;
+    uint64_t key;
+    bool ok;
+};
+
+// Content hash of a source, reused while its size and date are unchanged
+struct SourceStamp
+{
+    uint64_t hash;
+    long long size;
+    long long time;
+};
+
+// Cookers
+bool cook_shader(const CookItem & item, std::vector<unsigned char> & out);
+bool cook_texture(const CookItem & item, std::vector<unsigned char> & out);
+bool cook_normal_map(const CookItem & item, std::vector<unsigned char> & out);
+bool cook_mesh(const CookItem & item, std::vector<unsigned char> & out);
+
+static const Cooker SHADER_COOKER = { "shader", 1, cook_shader };
+static const Cooker TEXTURE_COOKER = { "texture", 1, cook_texture };
+static const Cooker NORMAL_MAP_COOKER = { "normalmap", 1, cook_normal_map };
+static const Cooker MESH_COOKER = { "mesh", 1, cook_mesh };
+
+// File utils
+void list_files(const std::string & path, std::vector<std::string> & files);
+bool read_file(const std::string & path, std::vector<unsigned char> & data);
+bool write_file(const std::string & path, const std::vector<unsigned char> & data);
+void make_directory(const std::string & path);
+std::string file_extension(const std::string & path);
+
+// Dependency graph utils
+void add_items(const std::string & source, std::vector<CookItem> & items);
+void collect_includes(const std::string & path, std::vector<std::string> & inputs);
+void load_stamps(const std::string & path, std::map<std::string, SourceStamp> & stamps);
+void save_stamps(const std::string & path, const std::map<std::string, SourceStamp> & stamps);
+std::string cooked_path(const std::string & cookDir, uint64_t key);
+
+// Benchmarks
+int bench_obj(const char * source);
+int bench_bvh(int count);
+int bench_lod(const char * source);
+
+// Checks
+int check_ssao(const char * referencePath);
+
+void usage()
+{
+    fprintf(stderr, "usage: aogl_cook [-o archive] [-d cookdir] [sources...]\n"
+                    "  Cooks shaders, textures, height maps and OBJ meshes found in sources\n"
+                    "  (files or directories) and packs them into archive.\n"
+                    "  Defaults: -o aogl.pak -d cooked, the shaders of assets.h and textures\n"
+                    "usage: aogl_cook --bench-obj <file.obj | grid size>\n"
+                    "  Measures OBJ import throughput on a file or a generated grid.\n"
+                    "usage: aogl_cook --bench-bvh <primitive count>\n"
+                    "  Measures BVH build, refit, ray and frustum queries on random boxes.\n"
+                    "usage: aogl_cook --bench-lod <file.obj | grid size>\n"
+                    "  Measures LOD chain simplification on a file or a generated grid.\n"
+                    "usage: aogl_cook --check-ssao [reference.pgm]\n"
+                    "  Diffs ssao_reference on a synthetic G-buffer with a stored image,\n"
+                    "  default reference/ssao.pgm, written when missing.\n");
+}
+
+int main( int argc, char **argv )
+{
+    std::string archivePath = "aogl.pak";
+    std::string cookDir = "cooked";
+    std::vector<std::string> sources;
+    if (argc == 3 && strcmp(argv[1], "--bench-obj") == 0)
+        exit(bench_obj(argv[2]));
+    if (argc == 3 && strcmp(argv[1], "--bench-bvh") == 0)
+        exit(bench_bvh(atoi(argv[2])));
+    if (argc == 3 && strcmp(argv[1], "--bench-lod") == 0)
+        exit(bench_lod(argv[2]));
+    if ((argc == 2 || argc == 3) && strcmp(argv[1], "--check-ssao") == 0)
+        exit(check_ssao(argc == 3 ? argv[2] : "reference/ssao.pgm"));
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            archivePath = argv[++i];
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+            cookDir = argv[++i];
+        else if (argv[i][0] == '-')
+        {
+            usage();
+            exit(EXIT_FAILURE);
+        }
+        else
+            sources.push_back(argv[i]);
+    }
+    if (sources.empty())
+    {
+        sources.assign(SHADER_ASSETS, SHADER_ASSETS + SHADER_ASSET_COUNT);
+        sources.push_back("textures");
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    make_directory(cookDir);
+
+    // Build the graph from sources to cooked outputs
+    std::vector<std::string> files;
+    for (size_t i = 0; i < sources.size(); ++i)
+        list_files(sources[i], files);
+    std::vector<CookItem> items;
+    for (size_t i = 0; i < files.size(); ++i)
+        add_items(files[i], items);
+
+    // Hash every input once, sources with an unchanged size and date keep their hash
+    std::map<std::string, SourceStamp> stamps;
+    std::string stampsPath = cookDir + "/sources.db";
+    load_stamps(stampsPath, stamps);
+    std::set<std::string> inputSet;
+    for (size_t i = 0; i < items.size(); ++i)
+        inputSet.insert(items[i].inputs.begin(), items[i].inputs.end());
+    std::vector<std::string> inputs(inputSet.begin(), inputSet.end());
+    std::vector<SourceStamp> inputStamps(inputs.size());
+    std::vector<bool> rehashed(inputs.size(), false);
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        struct stat st;
+        SourceStamp & s = inputStamps[i];
+        s.hash = 0;
+        s.size = stat(inputs[i].c_str(), &st) == 0 ? (long long) st.st_size : -1;
+        s.time = s.size >= 0 ? (long long) st.st_mtime : 0;
+        std::map<std::string, SourceStamp>::const_iterator it = stamps.find(inputs[i]);
+        if (it != stamps.end() && it->second.size == s.size && it->second.time == s.time)
+            s.hash = it->second.hash;
+        else
+            rehashed[i] = true;
+    }
+    parallel_for((int) inputs.size(), 1, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; ++i)
+        {
+            if (!rehashed[i])
+                continue;
+            MappedFile f;
+            if (map_file(f, inputs[i].c_str()))
+            {
+                inputStamps[i].hash = hash_bytes(f.data, f.size, 0);
+                unmap_file(f);
+            }
+        }
+    });
+    std::map<std::string, uint64_t> inputHashes;
+    stamps.clear();
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        inputHashes[inputs[i]] = inputStamps[i].hash;
+        if (inputStamps[i].size >= 0)
+            stamps[inputs[i]] = inputStamps[i];
+    }
+
+    // Key every output by its cooker, the tool versions and its input contents
+    std::vector<int> dirty;
+    for (size_t i = 0; i < items.size(); ++i)
+    {
+        CookItem & item = items[i];
+        std::string keyData = item.name + '\n' + item.cooker->name + '\n';
+        uint64_t versions[2] = { (uint64_t) COOK_TOOL_VERSION, (uint64_t) item.cooker->version };
+        keyData.append((const char *) versions, sizeof(versions));
+        for (size_t j = 0; j < item.inputs.size(); ++j)
+        {
+            uint64_t h = inputHashes[item.inputs[j]];
+            keyData += item.inputs[j];
+            keyData.append((const char *) &h, sizeof(h));
+        }
+        item.key = hash_bytes(keyData.data(), keyData.size(), 0);
+        struct stat st;
+        item.ok = stat(cooked_path(cookDir, item.key).c_str(), &st) == 0;
+        if (!item.ok)
+            dirty.push_back((int) i);
+    }
+
+    // Cook what changed, one item per task
+    parallel_for((int) dirty.size(), 1, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; ++i)
+        {
+            CookItem & item = items[dirty[i]];
+            std::vector<unsigned char> out;
+            item.ok = item.cooker->cook(item, out) && write_file(cooked_path(cookDir, item.key), out);
+            fprintf(stderr, "%s %s %s\n", item.ok ? "Cooked" : "Failed", item.cooker->name, item.name.c_str());
+        }
+    });
+    save_stamps(stampsPath, stamps);
+
+    // Pack every cooked output, mapped so that no copy is made
+    std::vector<MappedFile> mapped(items.size());
+    std::vector<ArchiveBlob> blobs;
+    std::set<std::string> live;
+    int failed = 0;
+    for (size_t i = 0; i < items.size(); ++i)
+    {
+        std::string path = cooked_path(cookDir, items[i].key);
+        live.insert(path);
+        if (!items[i].ok || !map_file(mapped[i], path.c_str()))
+        {
+            ++failed;
+            continue;
+        }
+        ArchiveBlob b = { items[i].name, mapped[i].data, mapped[i].size };
+        blobs.push_back(b);
+    }
+    bool written = archive_write(archivePath.c_str(), blobs);
+    for (size_t i = 0; i < items.size(); ++i)
+        if (items[i].ok)
+            unmap_file(mapped[i]);
+
+    // Outputs no source maps to anymore
+    std::vector<std::string> cooked;
+    list_files(cookDir, cooked);
+    for (size_t i = 0; i < cooked.size(); ++i)
+        if (file_extension(cooked[i]) == "bin" && live.find(cooked[i]) == live.end())
+            remove(cooked[i].c_str());
+
+    double ms = elapsed_ms(start);
+    fprintf(stderr, "%d items, %d cooked, %d up to date, %d failed, %d inputs hashed, %.1f ms\n",
+            (int) items.size(), (int) dirty.size(), (int) (items.size() - dirty.size()), failed,
+            (int) std::count(rehashed.begin(), rehashed.end(), true), ms);
+    if (!written)
+        fprintf(stderr, "Failed to write %s\n", archivePath.c_str());
+    exit(written && failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+bool cook_shader(const CookItem & item, std::vector<unsigned char> & out)
+{
+    return read_file(item.inputs[0], out);
+}
+
+bool cook_texture(const CookItem & item, std::vector<unsigned char> & out)
+{
+    std::vector<unsigned char> source;
+    if (!read_file(item.inputs[0], source) || source.empty())
+        return false;
+    int x, y, comp;
+    unsigned char * pixels = stbi_load_from_memory(&source[0], (int) source.size(), &x, &y, &comp, 3);
+    if (!pixels)
+        return false;
+    texture_build_chain(pixels, x, y, 3, out);
+    stbi_image_free(pixels);
+    return true;
+}
+
+bool cook_normal_map(const CookItem & item, std::vector<unsigned char> & out)
+{
+    std::vector<unsigned char> source;
+    if (!read_file(item.inputs[0], source) || source.empty())
+        return false;
+    int x, y, comp;
+    unsigned char * heights = stbi_load_from_memory(&source[0], (int) source.size(), &x, &y, &comp, 1);
+    if (!heights)
+        return false;
+    std::vector<unsigned char> normals(x * y * 3);
+    height_to_normal_map(heights, x, y, NORMAL_MAP_STRENGTH, &normals[0]);
+    stbi_image_free(heights);
+    texture_build_chain(&normals[0], x, y, 3, out);
+    return true;
+}
+
+bool cook_mesh(const CookItem & item, std::vector<unsigned char> & out)
+{
+    MeshBuffers mesh;
+    if (!load_obj(item.inputs[0].c_str(), mesh, 0))
+        return false;
+    mesh_write_blob(mesh_view(mesh), out);
+    return true;
+}
+
+void add_items(const std::string & source, std::vector<CookItem> & items)
+{
+    std::string ext = file_extension(source);
+    CookItem item;
+    item.name = source;
+    item.inputs.push_back(source);
+    item.cooker = 0;
+    item.key = 0;
+    item.ok = false;
+    if (ext == "vert" || ext == "geom" || ext == "frag" || ext == "tesc" || ext == "tese" || ext == "comp" || ext == "glsl")
+    {
+        item.cooker = &SHADER_COOKER;
+        collect_includes(source, item.inputs);
+    }
+    else if (ext == "tga" || ext == "png" || ext == "jpg" || ext == "bmp")
+    {
+        // Height maps become the normal maps the runtime looks up as <source>.nrm
+        if (source.find("_bump.") != std::string::npos)
+        {
+            item.name = source + ".nrm";
+            item.cooker = &NORMAL_MAP_COOKER;
+        }
+        else
+            item.cooker = &TEXTURE_COOKER;
+    }
+    else if (ext == "obj")
+    {
+        // Looked up by the runtime as <source>.mesh
+        item.name = source + ".mesh";
+        item.cooker = &MESH_COOKER;
+    }
+    if (item.cooker)
+        items.push_back(item);
+}
+
+// Adds the files pulled by #include "file" lines, recursively. As in
+// expand_shader_includes of aogl, only lines starting with #include count
+// and names are asset names, relative to the shader directory rather than
+// to the including file.
+void collect_includes(const std::string & path, std::vector<std::string> & inputs)
+{
+    std::vector<unsigned char> data;
+    if (!read_file(path, data))
+        return;
+    std::string text(data.begin(), data.end());
+    for (size_t begin = 0; begin < text.size(); )
+    {
+        size_t end = text.find('\n', begin);
+        end = end == std::string::npos ? text.size() : end + 1;
+        std::string line = text.substr(begin, end - begin);
+        begin = end;
+        size_t open = line.find_first_not_of(" \t");
+        if (open == std::string::npos || line.compare(open, 8, "#include") != 0)
+            continue;
+        size_t first = line.find('"', open);
+        size_t last = first == std::string::npos ? first : line.find('"', first + 1);
+        if (last == std::string::npos)
+            continue;
+        std::string include = line.substr(first + 1, last - first - 1);
+        if (std::find(inputs.begin(), inputs.end(), include) == inputs.end())
+        {
+            inputs.push_back(include);
+            collect_includes(include, inputs);
+        }
+    }
+}
+
+std::string cooked_path(const std::string & cookDir, uint64_t key)
+{
+    char name[32];
+    sprintf(name, "/%016llx.bin", (unsigned long long) key);
+    return cookDir + name;
+}
+
+void load_stamps(const std::string & path, std::map<std::string, SourceStamp> & stamps)
+{
+    FILE * f = fopen(path.c_str(), "r");
+    if (!f)
+        return;
+    char line[1024];
+    while (fgets(line, sizeof(line), f))
+    {
+        unsigned long long hash;
+        long long size, time;
+        int consumed;
+        if (sscanf(line, "%llx %lld %lld %n", &hash, &size, &time, &consumed) != 3)
+            continue;
+        std::string name(line + consumed);
+        while (!name.empty() && (name[name.size() - 1] == '\n' || name[name.size() - 1] == '\r'))
+            name.erase(name.size() - 1);
+        SourceStamp s = { (uint64_t) hash, size, time };
+        stamps[name] = s;
+    }
+    fclose(f);
+}
+
+void save_stamps(const std::string & path, const std::map<std::string, SourceStamp> & stamps)
+{
+    FILE * f = fopen(path.c_str(), "w");
+    if (!f)
+        return;
+    for (std::map<std::string, SourceStamp>::const_iterator it = stamps.begin(); it != stamps.end(); ++it)
+        fprintf(f, "%016llx %lld %lld %s\n", (unsigned long long) it->second.hash, it->second.size, it->second.time, it->first.c_str());
+    fclose(f);
+}
+
+std::string file_extension(const std::string & path)
+{
+    size_t dot = path.rfind('.');
+    size_t slash = path.rfind('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return std::string();
+    return path.substr(dot + 1);
+}
+
+bool read_file(const std::string & path, std::vector<unsigned char> & data)
+{
+    FILE * f = fopen(path.c_str(), "rb");
+    if (!f)
+        return false;
+    fseek(f, 0, SEEK_END);
+    data.resize(ftell(f));
+    rewind(f);
+    bool ok = data.empty() || fread(&data[0], data.size(), 1, f) == 1;
+    fclose(f);
+    return ok;
+}
+
+bool write_file(const std::string & path, const std::vector<unsigned char> & data)
+{
+    // Written aside then renamed, an interrupted cook never leaves a truncated output
+    std::string tmp = path + ".tmp";
+    FILE * f = fopen(tmp.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = data.empty() || fwrite(&data[0], data.size(), 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+    remove(path.c_str());
+    return ok && rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+void make_directory(const std::string & path)
+{
+#ifdef _WIN32
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0755);
+#endif
+}
+
+void list_files(const std::string & path, std::vector<std::string> & files)
+{
+    std::string base = path;
+    while (base.size() > 2 && base.compare(0, 2, "./") == 0)
+        base = base.substr(2);
+    struct stat st;
+    if (stat(base.c_str(), &st) != 0)
+        return;
+    if (!(st.st_mode & S_IFDIR))
+    {
+        files.push_back(base);
+        return;
+    }
+    std::vector<std::string> names;
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE h = FindFirstFileA((base + "/*").c_str(), &data);
+    if (h == INVALID_HANDLE_VALUE)
+        return;
+    do
+        names.push_back(data.cFileName);
+    while (FindNextFileA(h, &data));
+    FindClose(h);
+#else
+    DIR * dir = opendir(base.c_str());
+    if (!dir)
+        return;
+    while (struct dirent * e = readdir(dir))
+        names.push_back(e->d_name);
+    closedir(dir);
+#endif
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); ++i)
+        if (names[i] != "." && names[i] != "..")
+            list_files(base + "/" + names[i], files);
+}
+
+// OBJ text of a regular grid of quads with positions, uvs and normals, or
+// the content of the file when source is not a number
+bool bench_obj_text(const char * source, std::vector<unsigned char> & text)
+{
+    int grid = atoi(source);
+    if (grid > 0)
+    {
+        std::string s;
+        char line[256];
+        for (int y = 0; y <= grid; ++y)
+            for (int x = 0; x <= grid; ++x)
+            {
+                sprintf(line, "v %f %f %f\nvt %f %f\nvn 0 1 0\n", x * 0.01f, sinf(x * 0.1f) * cosf(y * 0.1f), y * 0.01f, x / (float) grid, y / (float) grid);
+                s += line;
+            }
+        for (int y = 0; y < grid; ++y)
+            for (int x = 0; x < grid; ++x)
+            {
+                int a = y * (grid + 1) + x + 1, b = a + 1, c = a + grid + 1, d = c + 1;
+                sprintf(line, "f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d\n", a, a, a, b, b, b, d, d, d, c, c, c);
+                s += line;
+            }
+        text.assign(s.begin(), s.end());
+        return true;
+    }
+    if (!read_file(source, text) || text.empty())
+    {
+        fprintf(stderr, "Cannot read %s\n", source);
+        return false;
+    }
+    return true;
+}
+
+int bench_obj(const char * source)
+{
+    std::vector<unsigned char> text;
+    if (!bench_obj_text(source, text))
+        return EXIT_FAILURE;
+
+    const int iterations = 5;
+    ObjStats best;
+    best.totalMs = 0.0;
+    for (int i = 0; i < iterations; ++i)
+    {
+        MeshBuffers mesh;
+        ObjStats stats;
+        if (!parse_obj((const char *) &text[0], text.size(), mesh, &stats))
+        {
+            fprintf(stderr, "Parse failed\n");
+            return EXIT_FAILURE;
+        }
+        if (i == 0 || stats.totalMs < best.totalMs)
+            best = stats;
+    }
+    printf("OBJ import, %d threads, best of %d\n", parallel_thread_count(), iterations);
+    printf("  %.1f MB, %d chunks, %d vertices, %d triangles\n", best.bytes / (1024.0 * 1024.0), best.chunks, best.vertexCount, best.triangleCount);
+    printf("  parse %.1f ms (%.0f MB/s)\n", best.parseMs, best.bytes / (1024.0 * 1024.0) / (best.parseMs / 1000.0));
+    printf("  merge %.1f ms, tangents %.1f ms\n", best.mergeMs, best.tangentMs);
+    printf("  total %.1f ms (%.0f MB/s)\n", best.totalMs, best.bytes / (1024.0 * 1024.0) / (best.totalMs / 1000.0));
+    return EXIT_SUCCESS;
+}
+
+// Slab test against the box of a primitive, the benchmark scene has no triangles
+struct BenchBoxes
+{
+    const glm::vec3 * boundsMin;
+    const glm::vec3 * boundsMax;
+};
+
+static float bench_intersect_box(void * user, int primitive, const glm::vec3 & origin, const glm::vec3 & direction, float tMax)
+{
+    const BenchBoxes * boxes = (const BenchBoxes *) user;
+    glm::vec3 t0 = (boxes->boundsMin[primitive] - origin) / direction;
+    glm::vec3 t1 = (boxes->boundsMax[primitive] - origin) / direction;
+    glm::vec3 near = glm::min(t0, t1), far = glm::max(t0, t1);
+    float tNear = std::max(std::max(near.x, near.y), std::max(near.z, 0.f));
+    float tFar = std::min(std::min(far.x, far.y), std::min(far.z, tMax));
+    return tNear <= tFar ? tNear : tMax;
+}
+
+int bench_bvh(int count)
+{
+    if (count <= 0)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    // Boxes of 0.1 to 2 units scattered uniformly, one per 8 cubic units
+    srand(1);
+    std::vector<glm::vec3> boundsMin(count), boundsMax(count);
+    float side = 2.f * cbrtf((float) count);
+    for (int i = 0; i < count; ++i)
+    {
+        glm::vec3 center(rand() / (float) RAND_MAX, rand() / (float) RAND_MAX, rand() / (float) RAND_MAX);
+        glm::vec3 size(0.1f + 1.9f * rand() / (float) RAND_MAX);
+        boundsMin[i] = center * side - size * 0.5f;
+        boundsMax[i] = center * side + size * 0.5f;
+    }
+
+    Bvh bvh;
+    bvh_build(bvh, &boundsMin[0], &boundsMax[0], count);
+    printf("BVH, %d threads, %d primitives\n", parallel_thread_count(), count);
+    printf("  build %.1f ms (%.1f Mprims/s), %d nodes, depth %d, %.1f MB\n", bvh.buildMs, count / (bvh.buildMs * 1000.0),
+           (int) bvh.nodes.size(), bvh.depth, (bvh.nodes.size() * sizeof(BvhNode) + bvh.indices.size() * sizeof(int)) / (1024.0 * 1024.0));
+
+    // Jitter every box a little, as animated instances would
+    for (int i = 0; i < count; ++i)
+    {
+        glm::vec3 offset(rand() / (float) RAND_MAX - 0.5f, rand() / (float) RAND_MAX - 0.5f, rand() / (float) RAND_MAX - 0.5f);
+        boundsMin[i] += offset;
+        boundsMax[i] += offset;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bvh_refit(bvh, &boundsMin[0], &boundsMax[0]);
+    double refitMs = elapsed_ms(start);
+    printf("  refit %.1f ms\n", refitMs);
+
+    // Rays from random points inside the scene in random directions
+    const int rayCount = 1 << 20;
+    std::vector<glm::vec3> origins(rayCount), directions(rayCount);
+    for (int i = 0; i < rayCount; ++i)
+    {
+        origins[i] = glm::vec3(rand() / (float) RAND_MAX, rand() / (float) RAND_MAX, rand() / (float) RAND_MAX) * side;
+        directions[i] = glm::normalize(glm::vec3(rand() / (float) RAND_MAX - 0.5f, rand() / (float) RAND_MAX - 0.5f, rand() / (float) RAND_MAX - 0.5f) + glm::vec3(1e-4f));
+    }
+    BenchBoxes boxes = { &boundsMin[0], &boundsMax[0] };
+    std::atomic<int> hitCount(0);
+    start = std::chrono::steady_clock::now();
+    parallel_for(rayCount, 4096, [&](int begin, int end)
+    {
+        int hits = 0;
+        for (int i = begin; i < end; ++i)
+        {
+            float tMax = FLT_MAX;
+            if (bvh_raycast(bvh, origins[i], directions[i], tMax, bench_intersect_box, &boxes) >= 0)
+                ++hits;
+        }
+        hitCount += hits;
+    });
+    double rayMs = elapsed_ms(start);
+    printf("  %d rays in %.1f ms (%.2f Mrays/s), %.0f%% hit\n", rayCount, rayMs, rayCount / (rayMs * 1000.0), 100.0 * hitCount.load() / rayCount);
+
+    // Frustums looking at the scene center from random points around it
+    const int frustumCount = 64;
+    std::vector<int> visible;
+    size_t visibleTotal = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frustumCount; ++i)
+    {
+        glm::vec3 eye = origins[i];
+        glm::mat4 viewProjection = glm::perspective(0.8f, 16.f / 9.f, 0.1f, side * 0.25f)
+                                 * glm::lookAt(eye, glm::vec3(side * 0.5f), glm::vec3(0.f, 1.f, 0.f));
+        Frustum frustum;
+        frustum_from_matrix(viewProjection, frustum);
+        visible.clear();
+        bvh_cull_frustum(bvh, frustum, visible);
+        visibleTotal += visible.size();
+    }
+    double frustumMs = elapsed_ms(start);
+    printf("  frustum query %.3f ms, %.0f visible on average\n", frustumMs / frustumCount, visibleTotal / (double) frustumCount);
+    return EXIT_SUCCESS;
+}
+
+int bench_lod(const char * source)
+{
+    std::vector<unsigned char> text;
+    MeshBuffers buffers;
+    if (!bench_obj_text(source, text) || !parse_obj((const char *) &text[0], text.size(), buffers, 0))
+        return EXIT_FAILURE;
+    MeshData mesh = mesh_view(buffers);
+
+    const int iterations = 3;
+    LodChain chain;
+    double bestMs = 0.0;
+    for (int i = 0; i < iterations; ++i)
+    {
+        lod_build_chain(mesh, chain);
+        if (i == 0 || chain.buildMs < bestMs)
+            bestMs = chain.buildMs;
+    }
+    printf("LOD chain, best of %d\n", iterations);
+    printf("  %d vertices, %d triangles, radius %f\n", mesh.vertexCount, mesh.triangleCount, chain.radius);
+    printf("  build %.1f ms (%.2f Mtris/s)\n", bestMs, mesh.triangleCount / (bestMs * 1000.0));
+
+    // Distance from which each level is used, 1 pixel of error at 1080p
+    // with the projection of aogl
+    float projectionScale = glm::perspective(45.0f, 16.f / 9.f, 0.1f, 100.f)[1][1];
+    for (size_t i = 0; i < chain.levels.size(); ++i)
+    {
+        const LodLevel & level = chain.levels[i];
+        printf("  level %d: %d triangles (%.1f%%), error %f, from %.2f units\n", (int) i, level.triangleCount,
+               100.0 * level.triangleCount / mesh.triangleCount, level.error, level.error * projectionScale * 1080.f * 0.5f);
+    }
+    return EXIT_SUCCESS;
+}
+
+// Octahedral encoding of lighting.glsl, to RG16 texels
+void oct_encode(const glm::vec3 & n, unsigned short * texel)
+{
+    glm::vec3 v = n / (fabsf(n.x) + fabsf(n.y) + fabsf(n.z));
+    glm::vec2 e(v.x, v.y);
+    if (v.z < 0.f)
+        e = glm::vec2((1.f - fabsf(v.y)) * (v.x >= 0.f ? 1.f : -1.f), (1.f - fabsf(v.x)) * (v.y >= 0.f ? 1.f : -1.f));
+    texel[0] = (unsigned short) floorf((e.x * 0.5f + 0.5f) * 65535.f + 0.5f);
+    texel[1] = (unsigned short) floorf((e.y * 0.5f + 0.5f) * 65535.f + 0.5f);
+}
+
+// G-buffer of a ground, a back wall and a sphere resting in the corner,
+// raycast with the projection of aogl. Sky where the rays miss.
+void synthetic_gbuffer(const glm::mat4 & projection, const glm::mat4 & worldToView, int width, int height,
+                       std::vector<float> & depth, std::vector<unsigned short> & normals)
+{
+    const glm::vec3 sphereCenter(0.5f, 0.f, -3.f);
+    const float sphereRadius = 1.f;
+    glm::mat4 viewProjection = projection * worldToView;
+    glm::mat4 clipToWorld = glm::inverse(viewProjection);
+    glm::vec3 eye = glm::vec3(glm::inverse(worldToView)[3]);
+    depth.assign(width * height, 1.f);
+    normals.assign(width * height * 2, 0);
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+        {
+            glm::vec4 far = clipToWorld * glm::vec4((x + 0.5f) / width * 2.f - 1.f, (y + 0.5f) / height * 2.f - 1.f, 1.f, 1.f);
+            glm::vec3 direction = glm::normalize(glm::vec3(far) / far.w - eye);
+            float t = FLT_MAX;
+            glm::vec3 normal;
+            if (direction.y < 0.f && (-1.f - eye.y) / direction.y < t)
+            {
+                t = (-1.f - eye.y) / direction.y;
+                normal = glm::vec3(0.f, 1.f, 0.f);
+            }
+            if (direction.z < 0.f && (-4.f - eye.z) / direction.z < t)
+            {
+                t = (-4.f - eye.z) / direction.z;
+                normal = glm::vec3(0.f, 0.f, 1.f);
+            }
+            glm::vec3 toCenter = sphereCenter - eye;
+            float b = glm::dot(toCenter, direction);
+            float c = glm::dot(toCenter, toCenter) - sphereRadius * sphereRadius;
+            if (b * b - c >= 0.f && b - sqrtf(b * b - c) > 0.f && b - sqrtf(b * b - c) < t)
+            {
+                t = b - sqrtf(b * b - c);
+                normal = glm::normalize(eye + direction * t - sphereCenter);
+            }
+            if (t == FLT_MAX)
+                continue;
+            glm::vec4 clip = viewProjection * glm::vec4(eye + direction * t, 1.f);
+            depth[y * width + x] = clip.z / clip.w * 0.5f + 0.5f;
+            oct_encode(normal, &normals[(y * width + x) * 2]);
+        }
+}
+
+int check_ssao(const char * referencePath)
+{
+    const int width = 160, height = 90;
+    glm::mat4 projection = glm::perspective(45.0f, (float) width / height, 0.1f, 100.f);
+    glm::mat4 worldToView = glm::lookAt(glm::vec3(-1.f, 1.f, 3.f), glm::vec3(0.f, -0.5f, -3.f), glm::vec3(0.f, 1.f, 0.f));
+    std::vector<float> depth;
+    std::vector<unsigned short> normals;
+    synthetic_gbuffer(projection, worldToView, width, height, depth, normals);
+
+    SsaoSettings settings;
+    ssao_default_settings(settings);
+    glm::vec3 kernel[SSAO_MAX_SAMPLES];
+    ssao_kernel(settings.samples, kernel);
+    std::vector<float> occlusion;
+    ssao_reference(settings, kernel, projection, worldToView, width, height, &depth[0], &normals[0], occlusion, 0);
+
+    // Binary PGM of the half resolution result, exact as it is 8 bit
+    int w = (width + 1) / 2, h = (height + 1) / 2;
+    char header[32];
+    int headerSize = sprintf(header, "P5\n%d %d\n255\n", w, h);
+    std::vector<unsigned char> image(header, header + headerSize);
+    for (int i = 0; i < w * h; ++i)
+        image.push_back((unsigned char) (occlusion[i] * 255.f + 0.5f));
+
+    std::vector<unsigned char> reference;
+    if (!read_file(referencePath, reference))
+    {
+        if (!write_file(referencePath, image))
+        {
+            fprintf(stderr, "Can't write %s\n", referencePath);
+            return EXIT_FAILURE;
+        }
+        printf("Wrote the SSAO reference %s\n", referencePath);
+        return EXIT_SUCCESS;
+    }
+    if (reference.size() != image.size() || memcmp(&reference[0], &image[0], headerSize) != 0)
+    {
+        fprintf(stderr, "%s is not a %dx%d SSAO reference\n", referencePath, w, h);
+        return EXIT_FAILURE;
+    }
+    std::vector<float> stored(w * h);
+    for (int i = 0; i < w * h; ++i)
+        stored[i] = reference[headerSize + i] / 255.f;
+
+    // One step of tolerance for the rounding of expf and cosf across platforms
+    SsaoDiff diff;
+    ssao_diff(&occlusion[0], &stored[0], w * h, 1.5f / 255.f, diff);
+    printf("SSAO reference %dx%d: %d of %d pixels differ, max error %f, mean %f\n", w, h,
+           diff.different, diff.pixels, diff.maxError, diff.meanError);
+    return diff.different ? EXIT_FAILURE : EXIT_SUCCESS;
+}
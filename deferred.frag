@@ -0,0 +1,73 @@
+#version 410 core
+
+#define FRAG_COLOR	0
+#define OCCLUSION_OFF	0
+#define OCCLUSION_AMBIENT	1
+#define OCCLUSION_SHOW	2
+
+precision highp float;
+precision highp int;
+
+#include "lighting.glsl"
+
+uniform sampler2D GBufferAlbedo;    // albedo, specular power / 255
+uniform sampler2D GBufferSpecular;
+uniform sampler2D GBufferNormal;    // octahedral, [0, 1]
+uniform sampler2D GBufferDepth;
+uniform mat4 InverseViewProjection;
+uniform vec2 ViewportSize;
+
+// Half resolution ambient occlusion, see ssao.h
+uniform int OcclusionMode;
+uniform sampler2D Occlusion;
+uniform sampler2D OcclusionDepth;   // linear view depth
+uniform vec2 DepthParameters;       // view depth = x / (ndc depth + y)
+
+layout(location = FRAG_COLOR, index = 0) out vec4 FragColor;
+
+// Bilinear taps of the half resolution occlusion, each weighted down by its
+// depth difference so occlusion does not leak across edges
+float upsample_occlusion(float viewDepth)
+{
+    ivec2 last = textureSize(Occlusion, 0) - 1;
+    vec2 h = gl_FragCoord.xy * 0.5 - 0.5;
+    ivec2 base = ivec2(floor(h));
+    vec2 f = h - vec2(base);
+    float sum = 0.0;
+    float weights = 0.0;
+    for (int i = 0; i < 4; ++i)
+    {
+        ivec2 offset = ivec2(i & 1, i >> 1);
+        ivec2 tap = clamp(base + offset, ivec2(0), last);
+        float bilinear = (offset.x == 1 ? f.x : 1.0 - f.x) * (offset.y == 1 ? f.y : 1.0 - f.y);
+        float w = bilinear / (1e-3 + abs(texelFetch(OcclusionDepth, tap, 0).r - viewDepth) / viewDepth);
+        sum += texelFetch(Occlusion, tap, 0).r * w;
+        weights += w;
+    }
+    return sum / weights;
+}
+
+void main()
+{
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(GBufferDepth, texel, 0).r;
+    if (depth == 1.0)
+        discard;
+
+    // World position from the depth buffer
+    vec4 ndc = vec4(gl_FragCoord.xy / ViewportSize, depth, 1.0) * 2.0 - 1.0;
+    vec4 world = InverseViewProjection * ndc;
+    vec3 position = world.xyz / world.w;
+
+    vec4 albedo = texelFetch(GBufferAlbedo, texel, 0);
+    vec3 spec = texelFetch(GBufferSpecular, texel, 0).rgb;
+    vec3 normal = oct_decode(texelFetch(GBufferNormal, texel, 0).rg * 2.0 - 1.0);
+    float specularPower = floor(albedo.a * 255.0 + 0.5);
+    float occlusion = 1.0;
+    if (OcclusionMode != OCCLUSION_OFF)
+        occlusion = upsample_occlusion(DepthParameters.x / (depth * 2.0 - 1.0 + DepthParameters.y));
+    if (OcclusionMode == OCCLUSION_SHOW)
+        FragColor = vec4(vec3(occlusion), 1.0);
+    else
+        FragColor = vec4(shade_surface(gl_FragCoord.xy, Camera, position, normal, albedo.rgb, spec, specularPower, occlusion), 1.0);
+}
@@ -0,0 +1,16 @@
+#version 410 core
+
+precision highp float;
+precision highp int;
+
+out gl_PerVertex
+{
+	vec4 gl_Position;
+};
+
+// One triangle covering the screen, no vertex buffer
+void main()
+{
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+}
@@ -0,0 +1,18 @@
+#version 410 core
+
+#define POSITION	0
+
+precision highp float;
+precision highp int;
+
+layout(location = POSITION) in vec3 Position;
+
+out block
+{
+    vec3 Position;
+} Out;
+
+void main()
+{
+    Out.Position = Position;
+}
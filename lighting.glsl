@@ -0,0 +1,152 @@
+// Lighting shared by the forward (aogl.frag) and deferred (deferred.frag)
+// paths, pulled in with #include "lighting.glsl" after the #version line
+
+#define CLUSTER_OFF	0
+#define CLUSTER_LIGHTS	1
+#define CLUSTER_HEAT	2
+#define MAX_CASCADES	4
+
+uniform vec3 Light;
+uniform vec3 Camera;
+uniform vec3 Ambient;
+
+// Clustered point lights, see light_grid.h
+uniform int ClusterMode;
+uniform usamplerBuffer ClusterCells;    // first index, light count
+uniform usamplerBuffer ClusterLights;   // light indices
+uniform samplerBuffer LightData;        // position radius, color
+uniform int ClusterTileSize;
+uniform ivec3 ClusterCount;
+uniform vec2 ClusterDepth;              // slice = log(depth) * x + y
+uniform vec4 DepthPlane;                // view depth of a world position
+
+// Sun with cascaded shadow maps, see shadow.h. Without cascades the key
+// light is the point Light.
+uniform int ShadowCascades;
+uniform sampler2DArrayShadow ShadowMap;
+uniform mat4 ShadowMatrices[MAX_CASCADES];      // world to map texture space
+uniform float ShadowTexelSize[MAX_CASCADES];    // world units
+uniform vec3 SunDirection;
+
+// Image based ambient light, see ibl.h. Without it, a flat Ambient.
+uniform float EnvironmentIntensity;
+uniform vec3 EnvironmentSH[9];          // irradiance / pi
+uniform sampler2D Environment;          // equirectangular, Phong lobe of power 2^(11 - 2 level) per level
+uniform int EnvironmentLevels;
+
+// Diffuse and Blinn-Phong specular terms of one light, l and e point to
+// the light and the eye
+vec3 shade(vec3 l, vec3 e, vec3 normal, vec3 diffuseColor, vec3 spec, float specularPower)
+{
+    float ndotl =  clamp(dot(normal, l), 0.0, 1.0);
+    vec3 h = normalize(l + e);
+    float ndoth = clamp(dot(normal, h), 0.0, 1.0);
+    return diffuseColor * ndotl + spec * pow(ndoth, specularPower);
+}
+
+vec2 environment_uv(vec3 d)
+{
+    return vec2(atan(d.z, d.x) / 6.2831853 + 0.5, acos(clamp(d.y, -1.0, 1.0)) / 3.1415927);
+}
+
+vec3 sh_irradiance(vec3 n)
+{
+    return EnvironmentSH[0] * 0.282095
+         + EnvironmentSH[1] * (0.488603 * n.y) + EnvironmentSH[2] * (0.488603 * n.z) + EnvironmentSH[3] * (0.488603 * n.x)
+         + EnvironmentSH[4] * (1.092548 * n.x * n.y) + EnvironmentSH[5] * (1.092548 * n.y * n.z)
+         + EnvironmentSH[6] * (0.315392 * (3.0 * n.z * n.z - 1.0))
+         + EnvironmentSH[7] * (1.092548 * n.x * n.z) + EnvironmentSH[8] * (0.546274 * (n.x * n.x - n.y * n.y));
+}
+
+// Diffuse from the harmonics, specular from the level whose lobe is closest
+// to the Phong lobe matching specularPower, about a quarter of it
+vec3 ambient_light(vec3 normal, vec3 e, vec3 diffuseColor, vec3 spec, float specularPower)
+{
+    if (EnvironmentIntensity <= 0.0)
+        return Ambient * diffuseColor;
+    float level = clamp((11.0 - log2(max(specularPower * 0.25, 1.0))) * 0.5, 0.0, float(EnvironmentLevels - 1));
+    vec3 specular = textureLod(Environment, environment_uv(reflect(-e, normal)), level).rgb;
+    return EnvironmentIntensity * (diffuseColor * max(sh_irradiance(normal), 0.0) + spec * specular);
+}
+
+// Fraction of the sun reaching position, from the first cascade holding it
+float sun_visibility(vec3 position, vec3 normal)
+{
+    vec2 texel = 1.0 / vec2(textureSize(ShadowMap, 0).xy);
+    for (int i = 0; i < ShadowCascades; ++i)
+    {
+        vec3 p = (ShadowMatrices[i] * vec4(position, 1.0)).xyz;
+        if (any(lessThan(p.xy, texel * 2.0)) || any(greaterThan(p.xy, 1.0 - texel * 2.0)))
+            continue;
+
+        // Normal offset against acne where the sun grazes the surface, then
+        // 3x3 taps of bilinear compares
+        p = (ShadowMatrices[i] * vec4(position + normal * ShadowTexelSize[i] * 1.5, 1.0)).xyz;
+        float lit = 0.0;
+        for (int y = -1; y <= 1; ++y)
+            for (int x = -1; x <= 1; ++x)
+                lit += textureGrad(ShadowMap, vec4(p.xy + vec2(x, y) * texel, float(i), p.z), vec2(0.0), vec2(0.0));
+        return lit / 9.0;
+    }
+    return 1.0;
+}
+
+int cluster_index(vec2 fragCoord, vec3 position)
+{
+    ivec2 tile = min(ivec2(fragCoord) / ClusterTileSize, ClusterCount.xy - 1);
+    float depth = max(dot(vec4(position, 1.0), DepthPlane), 1e-4);
+    int slice = clamp(int(log(depth) * ClusterDepth.x + ClusterDepth.y), 0, ClusterCount.z - 1);
+    return (slice * ClusterCount.y + tile.y) * ClusterCount.x + tile.x;
+}
+
+// Ambient or environment light scaled by occlusion, key light or shadowed
+// sun, then only the point lights touching the cluster of the pixel, with a
+// smooth falloff reaching 0 at their radius
+vec3 shade_surface(vec2 fragCoord, vec3 camera, vec3 position, vec3 normal, vec3 diffuseColor, vec3 spec, float specularPower,
+                   float occlusion)
+{
+    vec3 e = normalize(camera - position);
+    vec3 color = ambient_light(normal, e, diffuseColor, spec, specularPower) * occlusion;
+    if (ShadowCascades > 0)
+        color += sun_visibility(position, normal) * shade(-SunDirection, e, normal, diffuseColor, spec, specularPower);
+    else
+        color += shade(normalize(Light - position), e, normal, diffuseColor, spec, specularPower);
+    if (ClusterMode != CLUSTER_OFF)
+    {
+        uvec2 cell = texelFetch(ClusterCells, cluster_index(fragCoord, position)).xy;
+        for (uint i = 0u; i < cell.y; ++i)
+        {
+            int light = int(texelFetch(ClusterLights, int(cell.x + i)).x);
+            vec4 positionRadius = texelFetch(LightData, light * 2);
+            vec3 lightColor = texelFetch(LightData, light * 2 + 1).rgb;
+            vec3 toLight = positionRadius.xyz - position;
+            float d2 = dot(toLight, toLight);
+            float falloff = clamp(1.0 - d2 * d2 / pow(positionRadius.w, 4.0), 0.0, 1.0);
+            falloff = falloff * falloff / (d2 + 1.0);
+            color += lightColor * falloff * shade(toLight * inversesqrt(d2), e, normal, diffuseColor, spec, specularPower);
+        }
+        if (ClusterMode == CLUSTER_HEAT)
+            color = mix(color, vec3(float(cell.y) / 16.0, 1.0 - float(cell.y) / 16.0, 0.0), 0.5);
+    }
+    return color;
+}
+
+// Octahedral normal encoding, unit vector to [-1, 1]^2
+vec2 oct_wrap(vec2 v)
+{
+    return (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+vec2 oct_encode(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    return n.z >= 0.0 ? n.xy : oct_wrap(n.xy);
+}
+
+vec3 oct_decode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0)
+        n.xy = oct_wrap(n.xy);
+    return normalize(n);
+}
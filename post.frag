@@ -0,0 +1,83 @@
+#version 410 core
+
+// Bloom and tonemapping of the HDR scene, see post.h. Each draw runs one
+// pass of the chain, selected by Pass.
+
+#define PASS_PREFILTER	0
+#define PASS_DOWNSAMPLE	1
+#define PASS_UPSAMPLE	2
+#define PASS_TONEMAP	3
+
+precision highp float;
+precision highp int;
+
+uniform int Pass;
+uniform sampler2D Source;           // scene, or the previous level of the pyramid
+uniform sampler2D Bloom;
+uniform vec2 SourceTexelSize;
+uniform vec2 TargetTexelSize;
+uniform float BloomThreshold;       // luminance where bloom starts
+uniform float BloomIntensity;       // 0 without bloom
+uniform float Exposure;
+
+layout(location = 0) out vec4 FragColor;
+
+float luminance(vec3 c)
+{
+    return dot(c, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// 4x4 box from 4 bilinear taps
+vec3 downsample(vec2 uv)
+{
+    vec3 a = texture(Source, uv + SourceTexelSize * vec2(-1.0, -1.0)).rgb;
+    vec3 b = texture(Source, uv + SourceTexelSize * vec2(1.0, -1.0)).rgb;
+    vec3 c = texture(Source, uv + SourceTexelSize * vec2(-1.0, 1.0)).rgb;
+    vec3 d = texture(Source, uv + SourceTexelSize * vec2(1.0, 1.0)).rgb;
+    if (Pass != PASS_PREFILTER)
+        return (a + b + c + d) * 0.25;
+
+    // Taps weighted down by their brightness so single hot pixels do not
+    // flicker, then a soft threshold
+    vec4 w = 1.0 / (1.0 + vec4(luminance(a), luminance(b), luminance(c), luminance(d)));
+    vec3 color = (a * w.x + b * w.y + c * w.z + d * w.w) / dot(w, vec4(1.0));
+    float l = luminance(color);
+    float knee = BloomThreshold * 0.5;
+    float soft = clamp(l - BloomThreshold + knee, 0.0, 2.0 * knee);
+    soft = soft * soft / (4.0 * knee + 1e-4);
+    return color * max(soft, l - BloomThreshold) / max(l, 1e-4);
+}
+
+// 3x3 tent over the smaller level, added to the target by blending
+vec3 upsample(vec2 uv)
+{
+    vec3 sum = texture(Source, uv).rgb * 4.0;
+    sum += (texture(Source, uv + SourceTexelSize * vec2(-1.0, 0.0)).rgb + texture(Source, uv + SourceTexelSize * vec2(1.0, 0.0)).rgb
+          + texture(Source, uv + SourceTexelSize * vec2(0.0, -1.0)).rgb + texture(Source, uv + SourceTexelSize * vec2(0.0, 1.0)).rgb) * 2.0;
+    sum += texture(Source, uv + SourceTexelSize * vec2(-1.0, -1.0)).rgb + texture(Source, uv + SourceTexelSize * vec2(1.0, -1.0)).rgb
+         + texture(Source, uv + SourceTexelSize * vec2(-1.0, 1.0)).rgb + texture(Source, uv + SourceTexelSize * vec2(1.0, 1.0)).rgb;
+    return sum / 16.0;
+}
+
+// Fitted ACES filmic curve. The result is written as is, like the shaded
+// colors without HDR, the default framebuffer not being sRGB.
+vec3 tonemap(vec3 x)
+{
+    return clamp((x * (2.51 * x + 0.03)) / (x * (2.43 * x + 0.59) + 0.14), 0.0, 1.0);
+}
+
+void main()
+{
+    vec2 uv = gl_FragCoord.xy * TargetTexelSize;
+    if (Pass == PASS_PREFILTER || Pass == PASS_DOWNSAMPLE)
+        FragColor = vec4(downsample(uv), 1.0);
+    else if (Pass == PASS_UPSAMPLE)
+        FragColor = vec4(upsample(uv), 1.0);
+    else
+    {
+        vec3 color = texelFetch(Source, ivec2(gl_FragCoord.xy), 0).rgb;
+        if (BloomIntensity > 0.0)
+            color += texture(Bloom, uv).rgb * BloomIntensity;
+        FragColor = vec4(tonemap(color * Exposure), 1.0);
+    }
+}
@@ -5,19 +5,21 @@ solution "aogl"
    project "aogl"
       kind "ConsoleApp"
       language "C++"
-      files { "aogl.cpp"}
+      files { "aogl.cpp", "src/*.cpp", "src/*.h" }
       includedirs { "lib/glfw/include", "src", "common", "lib/" }
       links {"glfw", "glew", "stb", "imgui"}
       defines { "GLEW_STATIC" }
      
       configuration { "linux" }
          links {"X11","Xrandr", "Xi", "Xxf86vm", "rt", "GL", "GLU", "pthread"}
+         buildoptions { "-std=c++11", "-msse2", "-pthread" }
        
       configuration { "windows" }
          links {"glu32","opengl32", "gdi32", "winmm", "user32"}
 
       configuration { "macosx" }
          linkoptions { "-framework OpenGL", "-framework CoreVideo" , "-framework Cocoa", "-framework IOKit"}
+         buildoptions { "-std=c++11", "-msse2" }
          
        
       configuration "Debug"
@@ -29,6 +31,35 @@ solution "aogl"
          defines { "NDEBUG" }
          flags { "Optimize"}    
 
+   -- Asset cooking tool
+   project "aogl_cook"
+      kind "ConsoleApp"
+      language "C++"
+      files { "cook.cpp", "src/*.cpp", "src/*.h" }
+      includedirs { "src", "lib/" }
+      links {"glew", "stb"}
+      defines { "GLEW_STATIC" }
+
+      configuration { "linux" }
+         links {"GL", "pthread"}
+         buildoptions { "-std=c++11", "-msse2", "-pthread" }
+
+      configuration { "windows" }
+         links {"opengl32"}
+
+      configuration { "macosx" }
+         linkoptions { "-framework OpenGL" }
+         buildoptions { "-std=c++11", "-msse2" }
+
+      configuration "Debug"
+         defines { "DEBUG" }
+         flags {"ExtraWarnings", "Symbols" }
+         targetsuffix "_d"
+
+      configuration "Release"
+         defines { "NDEBUG" }
+         flags { "Optimize"}
+
    -- GLFW Library
    project "glfw"
       kind "StaticLib"
@@ -0,0 +1,25 @@
+#version 410 core
+
+#define POSITION	0
+#define INSTANCE	4
+#define CASCADE		8
+
+precision highp float;
+precision highp int;
+
+layout(location = POSITION) in vec3 Position;
+layout(location = INSTANCE) in mat4 ObjectToWorld;
+layout(location = CASCADE) in int Cascade;
+
+out block
+{
+        vec3 Position;
+        flat int Cascade;
+} Out;
+
+// World space only, shadow.geom picks the cascade matrix and layer
+void main()
+{
+    Out.Position = (ObjectToWorld * vec4(Position, 1.0)).xyz;
+    Out.Cascade = Cascade;
+}
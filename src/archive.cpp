@@ -0,0 +1,154 @@
+#include "archive.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+static const char ARCHIVE_MAGIC[8] = { 'A', 'O', 'G', 'L', 'P', 'A', 'K', 0 };
+static const uint32_t ARCHIVE_VERSION = 1;
+
+uint64_t archive_hash(const char * name, size_t length)
+{
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; ++i)
+    {
+        h ^= (unsigned char) name[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+bool archive_open(Archive & a, const char * path)
+{
+    a.entries = 0;
+    a.names = 0;
+    a.entryCount = 0;
+    if (!map_file(a.file, path))
+        return false;
+
+    // Sizes are compared without products or sums that could wrap, then
+    // every entry is checked once so lookups can trust the index
+    const ArchiveHeader * header = (const ArchiveHeader *) a.file.data;
+    uint64_t fileSize = a.file.size;
+    bool valid = fileSize >= sizeof(ArchiveHeader) && memcmp(header->magic, ARCHIVE_MAGIC, 8) == 0
+        && header->version == ARCHIVE_VERSION
+        && header->indexOffset <= fileSize && header->indexOffset % sizeof(uint64_t) == 0
+        && header->entryCount <= (fileSize - header->indexOffset) / sizeof(ArchiveEntry)
+        && header->namesOffset <= fileSize;
+    const ArchiveEntry * entries = valid ? (const ArchiveEntry *) (a.file.data + header->indexOffset) : 0;
+    uint64_t namesSize = valid ? fileSize - header->namesOffset : 0;
+    for (uint32_t i = 0; valid && i < header->entryCount; ++i)
+    {
+        const ArchiveEntry & e = entries[i];
+        valid = e.offset <= fileSize && e.size <= fileSize - e.offset
+            && e.nameOffset <= namesSize && e.nameLength <= namesSize - e.nameOffset
+            && (i == 0 || entries[i - 1].nameHash <= e.nameHash);
+    }
+    if (!valid)
+    {
+        fprintf(stderr, "%s is not a valid archive\n", path);
+        unmap_file(a.file);
+        return false;
+    }
+    a.entries = entries;
+    a.names = (const char *) (a.file.data + header->namesOffset);
+    a.entryCount = header->entryCount;
+    return true;
+}
+
+void archive_close(Archive & a)
+{
+    unmap_file(a.file);
+    a.entries = 0;
+    a.names = 0;
+    a.entryCount = 0;
+}
+
+const void * archive_find(const Archive & a, const char * name, size_t * size)
+{
+    if (!a.entries)
+        return 0;
+    size_t length = strlen(name);
+    uint64_t h = archive_hash(name, length);
+    uint32_t lo = 0, hi = a.entryCount;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (a.entries[mid].nameHash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < a.entryCount && a.entries[lo].nameHash == h; ++lo)
+    {
+        const ArchiveEntry & e = a.entries[lo];
+        if (e.nameLength == length && memcmp(a.names + e.nameOffset, name, length) == 0)
+        {
+            if (size)
+                *size = (size_t) e.size;
+            return a.file.data + e.offset;
+        }
+    }
+    return 0;
+}
+
+static bool archive_pad(FILE * f, uint64_t & offset)
+{
+    static const char zeros[ARCHIVE_ALIGNMENT] = { 0 };
+    uint64_t padding = (ARCHIVE_ALIGNMENT - offset % ARCHIVE_ALIGNMENT) % ARCHIVE_ALIGNMENT;
+    offset += padding;
+    return padding == 0 || fwrite(zeros, (size_t) padding, 1, f) == 1;
+}
+
+bool archive_write(const char * path, const std::vector<ArchiveBlob> & blobs)
+{
+    FILE * f = fopen(path, "wb");
+    if (!f)
+        return false;
+
+    ArchiveHeader header;
+    memcpy(header.magic, ARCHIVE_MAGIC, 8);
+    header.version = ARCHIVE_VERSION;
+    header.entryCount = (uint32_t) blobs.size();
+    header.indexOffset = 0;
+    header.namesOffset = 0;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    uint64_t offset = sizeof(header);
+
+    std::vector<ArchiveEntry> entries(blobs.size());
+    std::string names;
+    for (size_t i = 0; ok && i < blobs.size(); ++i)
+    {
+        ok = archive_pad(f, offset);
+        ArchiveEntry & e = entries[i];
+        e.nameHash = archive_hash(blobs[i].name.c_str(), blobs[i].name.size());
+        e.offset = offset;
+        e.size = blobs[i].size;
+        e.nameOffset = (uint32_t) names.size();
+        e.nameLength = (uint32_t) blobs[i].name.size();
+        names += blobs[i].name;
+        if (ok && blobs[i].size)
+            ok = fwrite(blobs[i].data, blobs[i].size, 1, f) == 1;
+        offset += blobs[i].size;
+    }
+
+    struct ByHash
+    {
+        bool operator()(const ArchiveEntry & a, const ArchiveEntry & b) const { return a.nameHash < b.nameHash; }
+    };
+    std::sort(entries.begin(), entries.end(), ByHash());
+    ok = ok && archive_pad(f, offset);
+    header.indexOffset = offset;
+    if (ok && !entries.empty())
+        ok = fwrite(&entries[0], sizeof(ArchiveEntry) * entries.size(), 1, f) == 1;
+    offset += sizeof(ArchiveEntry) * entries.size();
+    header.namesOffset = offset;
+    if (ok && !names.empty())
+        ok = fwrite(names.data(), names.size(), 1, f) == 1;
+
+    // Patch the header now that the index location is known
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+    return ok;
+}
@@ -0,0 +1,60 @@
+#ifndef AOGL_ARCHIVE_H
+#define AOGL_ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+
+// Packed asset archive: a header, blobs aligned on ARCHIVE_ALIGNMENT bytes,
+// then an index sorted by name hash followed by the names. The file is
+// memory-mapped and lookups return pointers straight into the mapping.
+static const int ARCHIVE_ALIGNMENT = 64;
+
+struct ArchiveHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t entryCount;
+    uint64_t indexOffset;
+    uint64_t namesOffset;
+};
+
+struct ArchiveEntry
+{
+    uint64_t nameHash;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t nameOffset;
+    uint32_t nameLength;
+};
+
+struct Archive
+{
+    MappedFile file;
+    const ArchiveEntry * entries;
+    const char * names;
+    uint32_t entryCount;
+};
+
+// Blob to pack, data is only read while archive_write runs
+struct ArchiveBlob
+{
+    std::string name;
+    const void * data;
+    size_t size;
+};
+
+uint64_t archive_hash(const char * name, size_t length);
+
+bool archive_open(Archive & a, const char * path);
+void archive_close(Archive & a);
+
+// Returns the mapped blob or 0 when the archive is not open or has no such name
+const void * archive_find(const Archive & a, const char * name, size_t * size);
+
+bool archive_write(const char * path, const std::vector<ArchiveBlob> & blobs);
+
+#endif // AOGL_ARCHIVE_H
@@ -0,0 +1,12 @@
+#ifndef AOGL_ASSETS_H
+#define AOGL_ASSETS_H
+
+// Shaders at the root of the repository, packed by aogl --pack and cooked
+// by default by aogl_cook
+static const char * const SHADER_ASSETS[] = {
+    "aogl.vert", "aogl.geom", "aogl.frag", "cull.comp", "ground.vert", "ground.tesc", "ground.tese", "lighting.glsl",
+    "deferred.vert", "deferred.frag", "shadow.vert", "shadow.geom", "ssao.frag", "post.frag"
+};
+static const int SHADER_ASSET_COUNT = sizeof(SHADER_ASSETS) / sizeof(SHADER_ASSETS[0]);
+
+#endif // AOGL_ASSETS_H
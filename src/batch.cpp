@@ -0,0 +1,196 @@
+#include "batch.h"
+
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include <algorithm>
+#include <xmmintrin.h>
+
+#include "parallel.h"
+#include "timer.h"
+
+namespace
+{
+
+// 10 bits per axis interleaved
+unsigned int morton_code(const glm::vec3 & p)
+{
+    unsigned int code = 0;
+    unsigned int x = (unsigned int) glm::clamp(p.x * 1023.f, 0.f, 1023.f);
+    unsigned int y = (unsigned int) glm::clamp(p.y * 1023.f, 0.f, 1023.f);
+    unsigned int z = (unsigned int) glm::clamp(p.z * 1023.f, 0.f, 1023.f);
+    for (int i = 0; i < 10; ++i)
+        code |= ((x >> i) & 1) << (i * 3) | ((y >> i) & 1) << (i * 3 + 1) | ((z >> i) & 1) << (i * 3 + 2);
+    return code;
+}
+
+glm::vec3 world_center(const BatchSource & source)
+{
+    return glm::vec3(source.objectToWorld * glm::vec4((source.boundsMin + source.boundsMax) * 0.5f, 1.f));
+}
+
+// Columns of m times (x, y, z, w), 3 floats written
+inline __m128 transform(const __m128 * columns, const float * v, float w)
+{
+    __m128 r = _mm_mul_ps(columns[0], _mm_set1_ps(v[0]));
+    r = _mm_add_ps(r, _mm_mul_ps(columns[1], _mm_set1_ps(v[1])));
+    r = _mm_add_ps(r, _mm_mul_ps(columns[2], _mm_set1_ps(v[2])));
+    if (w != 0.f)
+        r = _mm_add_ps(r, columns[3]);
+    return r;
+}
+
+inline __m128 normalize3(__m128 v)
+{
+    __m128 d = _mm_mul_ps(v, v);
+    float length2 = _mm_cvtss_f32(_mm_add_ss(d, _mm_add_ss(_mm_shuffle_ps(d, d, 1), _mm_shuffle_ps(d, d, 2))));
+    return length2 > 0.f ? _mm_mul_ps(v, _mm_set1_ps(1.f / sqrtf(length2))) : v;
+}
+
+inline void store3(float * out, __m128 v)
+{
+    float r[4];
+    _mm_storeu_ps(r, v);
+    out[0] = r[0];
+    out[1] = r[1];
+    out[2] = r[2];
+}
+
+struct Placement
+{
+    int batch;
+    int firstVertex;
+    int firstIndex;
+};
+
+// Writes one source at its place in its batch, returns its world bounds
+void place_source(const BatchSource & source, const Placement & placement, StaticBatch & batch,
+                  glm::vec3 & boundsMin, glm::vec3 & boundsMax)
+{
+    const MeshData & mesh = source.mesh;
+    glm::mat4 normalMatrix = glm::transpose(glm::inverse(source.objectToWorld));
+    __m128 columns[4], normalColumns[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        columns[i] = _mm_loadu_ps(&source.objectToWorld[i][0]);
+        normalColumns[i] = _mm_loadu_ps(&normalMatrix[i][0]);
+    }
+    bool mirrored = glm::determinant(glm::mat3(source.objectToWorld)) < 0.f;
+
+    __m128 lower = _mm_set1_ps(FLT_MAX);
+    __m128 upper = _mm_set1_ps(-FLT_MAX);
+    float * positions = &batch.mesh.vertices[placement.firstVertex * 3];
+    float * normals = &batch.mesh.normals[placement.firstVertex * 3];
+    float * tangents = &batch.mesh.tangents[placement.firstVertex * 4];
+    for (int i = 0; i < mesh.vertexCount; ++i)
+    {
+        __m128 p = transform(columns, mesh.vertices + i * 3, 1.f);
+        lower = _mm_min_ps(lower, p);
+        upper = _mm_max_ps(upper, p);
+        store3(positions + i * 3, p);
+        store3(normals + i * 3, normalize3(transform(normalColumns, mesh.normals + i * 3, 0.f)));
+        store3(tangents + i * 4, normalize3(transform(columns, mesh.tangents + i * 4, 0.f)));
+        tangents[i * 4 + 3] = mirrored ? -mesh.tangents[i * 4 + 3] : mesh.tangents[i * 4 + 3];
+    }
+    memcpy(&batch.mesh.uvs[placement.firstVertex * 2], mesh.uvs, mesh.vertexCount * 2 * sizeof(float));
+
+    int * indices = &batch.mesh.triangleList[placement.firstIndex];
+    for (int i = 0; i < mesh.triangleCount * 3; i += 3)
+    {
+        indices[i] = mesh.triangleList[i] + placement.firstVertex;
+        indices[i + 1] = mesh.triangleList[i + (mirrored ? 2 : 1)] + placement.firstVertex;
+        indices[i + 2] = mesh.triangleList[i + (mirrored ? 1 : 2)] + placement.firstVertex;
+    }
+
+    float l[4], u[4];
+    _mm_storeu_ps(l, lower);
+    _mm_storeu_ps(u, upper);
+    boundsMin = glm::vec3(l[0], l[1], l[2]);
+    boundsMax = glm::vec3(u[0], u[1], u[2]);
+}
+
+}
+
+void static_batch_build(const BatchSource * sources, int count, std::vector<StaticBatch> & batches, BatchStats * stats)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    batches.clear();
+
+    // Material first, then position along the curve
+    glm::vec3 sceneMin(FLT_MAX), sceneMax(-FLT_MAX);
+    for (int i = 0; i < count; ++i)
+    {
+        sceneMin = glm::min(sceneMin, world_center(sources[i]));
+        sceneMax = glm::max(sceneMax, world_center(sources[i]));
+    }
+    glm::vec3 scale = 1.f / glm::max(sceneMax - sceneMin, glm::vec3(1e-6f));
+    std::vector< std::pair<unsigned long long, int> > order(count);
+    for (int i = 0; i < count; ++i)
+    {
+        unsigned long long code = morton_code((world_center(sources[i]) - sceneMin) * scale);
+        order[i] = std::make_pair((unsigned long long) sources[i].material << 32 | code, i);
+    }
+    std::sort(order.begin(), order.end());
+
+    // Places and chunk ranges, chunks are cut on source boundaries
+    std::vector<Placement> placements(count);
+    std::vector<int> chunkOf(count);
+    std::vector<int> vertexCounts;
+    for (int o = 0; o < count; ++o)
+    {
+        const BatchSource & source = sources[order[o].second];
+        if (batches.empty() || batches.back().material != source.material)
+        {
+            batches.push_back(StaticBatch());
+            batches.back().material = source.material;
+            vertexCounts.push_back(0);
+        }
+        StaticBatch & batch = batches.back();
+        int indexCount = source.mesh.triangleCount * 3;
+        int firstIndex = (int) batch.mesh.triangleList.size();
+        if (batch.chunks.empty() || batch.chunks.back().indexCount + indexCount > BATCH_CHUNK_TRIANGLES * 3)
+        {
+            BatchChunk chunk = { firstIndex, 0, glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) };
+            batch.chunks.push_back(chunk);
+        }
+        batch.chunks.back().indexCount += indexCount;
+        Placement placement = { (int) batches.size() - 1, vertexCounts.back(), firstIndex };
+        placements[order[o].second] = placement;
+        chunkOf[order[o].second] = (int) batch.chunks.size() - 1;
+        vertexCounts.back() += source.mesh.vertexCount;
+        batch.mesh.triangleList.resize(firstIndex + indexCount);
+    }
+    for (size_t b = 0; b < batches.size(); ++b)
+    {
+        batches[b].mesh.vertices.resize(vertexCounts[b] * 3);
+        batches[b].mesh.normals.resize(vertexCounts[b] * 3);
+        batches[b].mesh.uvs.resize(vertexCounts[b] * 2);
+        batches[b].mesh.tangents.resize(vertexCounts[b] * 4);
+    }
+
+    std::vector<glm::vec3> sourceBounds(count * 2);
+    parallel_for(count, 8, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; ++i)
+            place_source(sources[i], placements[i], batches[placements[i].batch], sourceBounds[i * 2], sourceBounds[i * 2 + 1]);
+    });
+
+    int triangles = 0;
+    int chunks = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        BatchChunk & chunk = batches[placements[i].batch].chunks[chunkOf[i]];
+        chunk.boundsMin = glm::min(chunk.boundsMin, sourceBounds[i * 2]);
+        chunk.boundsMax = glm::max(chunk.boundsMax, sourceBounds[i * 2 + 1]);
+        triangles += sources[i].mesh.triangleCount;
+    }
+    for (size_t b = 0; b < batches.size(); ++b)
+        chunks += (int) batches[b].chunks.size();
+    if (stats)
+    {
+        stats->sources = count;
+        stats->triangles = triangles;
+        stats->chunks = chunks;
+        stats->ms = elapsed_ms(start);
+    }
+}
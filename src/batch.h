@@ -0,0 +1,54 @@
+#ifndef AOGL_BATCH_H
+#define AOGL_BATCH_H
+
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "mesh.h"
+
+// Triangle budget of a chunk, large enough to keep draw calls few and small
+// enough for chunks to be culled
+const int BATCH_CHUNK_TRIANGLES = 32768;
+
+// One static mesh placed in the world. Every attribute array must be set.
+struct BatchSource
+{
+    MeshData mesh;
+    glm::mat4 objectToWorld;
+    glm::vec3 boundsMin, boundsMax;     // object space
+    int material;
+};
+
+// Range of triangles in the index buffer of a batch, with world bounds
+struct BatchChunk
+{
+    int firstIndex;
+    int indexCount;
+    glm::vec3 boundsMin, boundsMax;
+};
+
+// All the sources sharing a material, pre-transformed to world space
+struct StaticBatch
+{
+    int material;
+    MeshBuffers mesh;
+    std::vector<BatchChunk> chunks;
+};
+
+struct BatchStats
+{
+    int sources;
+    int triangles;
+    int chunks;
+    double ms;
+};
+
+// Groups the sources by material, orders each group along a Morton curve of
+// the source centers and cuts it into chunks of at most
+// BATCH_CHUNK_TRIANGLES (a larger source gets a chunk of its own). Vertices
+// are transformed with SSE, sources spread over the worker pool.
+// Mirroring transforms keep their front faces and tangent frames.
+void static_batch_build(const BatchSource * sources, int count, std::vector<StaticBatch> & batches, BatchStats * stats);
+
+#endif // AOGL_BATCH_H
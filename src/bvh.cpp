@@ -0,0 +1,583 @@
+#include "bvh.h"
+
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+#include <emmintrin.h>
+
+#include "parallel.h"
+#include "timer.h"
+
+namespace
+{
+
+const int BIN_COUNT = 16;
+const int PARALLEL_BINNING = 1 << 16;   // primitives above which a node is binned on the pool
+const int SUBTREE_SIZE = 1 << 15;       // primitives below which a subtree is built by one thread
+const float TRAVERSAL_COST = 1.f;       // relative to one primitive test
+
+// Boxes live in SSE registers during the build, w is unused
+struct Box
+{
+    __m128 min, max;
+};
+
+inline __m128 load3(const glm::vec3 & v)
+{
+    return _mm_setr_ps(v.x, v.y, v.z, 0.f);
+}
+
+inline void box_empty(Box & b)
+{
+    b.min = _mm_set1_ps(FLT_MAX);
+    b.max = _mm_set1_ps(-FLT_MAX);
+}
+
+inline void box_grow(Box & b, const Box & other)
+{
+    b.min = _mm_min_ps(b.min, other.min);
+    b.max = _mm_max_ps(b.max, other.max);
+}
+
+inline float box_area(const Box & b)
+{
+    float d[4];
+    _mm_storeu_ps(d, _mm_sub_ps(b.max, b.min));
+    return d[0] < 0.f ? 0.f : 2.f * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+struct BinaryNode
+{
+    Box box;
+    int child[2];
+    int first, count;   // count > 0 for leaves
+};
+
+struct Bins
+{
+    Box box[3][BIN_COUNT];
+    int count[3][BIN_COUNT];
+};
+
+// Primitive boxes are partitioned in place together with their indices so
+// every level of the build streams through memory instead of gathering
+struct Builder
+{
+    std::vector<Box> bounds;
+    std::vector<int> & indices;
+
+    Builder(std::vector<int> & i) : indices(i) {}
+};
+
+inline __m128 box_centroid(const Box & b)
+{
+    return _mm_mul_ps(_mm_add_ps(b.min, b.max), _mm_set1_ps(0.5f));
+}
+
+// Bins of a centroid on the 3 axes, the same arithmetic for binning and partitioning
+inline void bin_indices(__m128 centroid, __m128 origin, __m128 scale, int bins[4])
+{
+    _mm_storeu_si128((__m128i *) bins, _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(centroid, origin), scale)));
+    for (int a = 0; a < 3; ++a)
+        bins[a] = std::min(BIN_COUNT - 1, bins[a]);
+}
+
+struct SubtreeTask
+{
+    int node;       // placeholder in the top level tree
+    int first, count;
+    std::vector<BinaryNode> nodes;
+};
+
+void bins_clear(Bins & bins)
+{
+    for (int a = 0; a < 3; ++a)
+        for (int b = 0; b < BIN_COUNT; ++b)
+        {
+            box_empty(bins.box[a][b]);
+            bins.count[a][b] = 0;
+        }
+}
+
+void bins_fill(const Builder & builder, Bins & bins, int begin, int end, __m128 origin, __m128 scale)
+{
+    for (int i = begin; i < end; ++i)
+    {
+        int b[4];
+        bin_indices(box_centroid(builder.bounds[i]), origin, scale, b);
+        for (int a = 0; a < 3; ++a)
+        {
+            box_grow(bins.box[a][b[a]], builder.bounds[i]);
+            bins.count[a][b[a]]++;
+        }
+    }
+}
+
+// Builds the subtree of [first, first + count[ into nodes, returns its root.
+// With tasks, large nodes are binned on the pool and nodes under
+// SUBTREE_SIZE are left as placeholders to build later in parallel.
+int build_node(Builder & builder, std::vector<BinaryNode> & nodes, int first, int count, std::vector<SubtreeTask> * tasks)
+{
+    int index = (int) nodes.size();
+    nodes.push_back(BinaryNode());
+    Box box, centroidBox;
+    box_empty(box);
+    box_empty(centroidBox);
+    for (int i = first; i < first + count; ++i)
+    {
+        box_grow(box, builder.bounds[i]);
+        __m128 centroid = box_centroid(builder.bounds[i]);
+        centroidBox.min = _mm_min_ps(centroidBox.min, centroid);
+        centroidBox.max = _mm_max_ps(centroidBox.max, centroid);
+    }
+    nodes[index].box = box;
+    nodes[index].first = first;
+    nodes[index].count = count;
+
+    if (tasks && count <= SUBTREE_SIZE)
+    {
+        SubtreeTask task;
+        task.node = index;
+        task.first = first;
+        task.count = count;
+        tasks->push_back(task);
+        return index;
+    }
+    if (count <= 1)
+        return index;
+
+    // Bin centroids on every axis
+    float extent[4], scale[4];
+    _mm_storeu_ps(extent, _mm_sub_ps(centroidBox.max, centroidBox.min));
+    for (int a = 0; a < 4; ++a)
+        scale[a] = a < 3 && extent[a] > 0.f ? BIN_COUNT * 0.9999f / extent[a] : 0.f;
+    __m128 binScale = _mm_loadu_ps(scale);
+    Bins bins;
+    bins_clear(bins);
+    if (tasks && count >= PARALLEL_BINNING)
+    {
+        int chunks = std::min(count / (PARALLEL_BINNING / 4), parallel_thread_count() * 4);
+        std::vector<Bins> partial(chunks);
+        parallel_for(chunks, 1, [&](int begin, int end)
+        {
+            for (int c = begin; c < end; ++c)
+            {
+                bins_clear(partial[c]);
+                bins_fill(builder, partial[c], first + (int) ((long long) count * c / chunks),
+                          first + (int) ((long long) count * (c + 1) / chunks), centroidBox.min, binScale);
+            }
+        });
+        for (int c = 0; c < chunks; ++c)
+            for (int a = 0; a < 3; ++a)
+                for (int b = 0; b < BIN_COUNT; ++b)
+                {
+                    box_grow(bins.box[a][b], partial[c].box[a][b]);
+                    bins.count[a][b] += partial[c].count[a][b];
+                }
+    }
+    else
+        bins_fill(builder, bins, first, first + count, centroidBox.min, binScale);
+
+    // Sweep the bins for the cheapest split plane
+    float bestCost = FLT_MAX;
+    int bestAxis = -1, bestBin = 0;
+    for (int a = 0; a < 3; ++a)
+    {
+        if (scale[a] == 0.f)
+            continue;
+        float rightArea[BIN_COUNT];
+        int rightCount[BIN_COUNT];
+        Box right;
+        box_empty(right);
+        int n = 0;
+        for (int b = BIN_COUNT - 1; b > 0; --b)
+        {
+            box_grow(right, bins.box[a][b]);
+            n += bins.count[a][b];
+            rightArea[b] = box_area(right);
+            rightCount[b] = n;
+        }
+        Box left;
+        box_empty(left);
+        n = 0;
+        for (int b = 0; b < BIN_COUNT - 1; ++b)
+        {
+            box_grow(left, bins.box[a][b]);
+            n += bins.count[a][b];
+            if (n == 0 || rightCount[b + 1] == 0)
+                continue;
+            float cost = box_area(left) * n + rightArea[b + 1] * rightCount[b + 1];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = a;
+                bestBin = b;
+            }
+        }
+    }
+
+    int middle;
+    float leafCost = box_area(box) * count;
+    if (bestAxis >= 0 && TRAVERSAL_COST * box_area(box) + bestCost >= leafCost && count <= BVH_MAX_LEAF_SIZE)
+        return index;
+    if (bestAxis < 0)
+    {
+        // All centroids are equal, split the range in two halves
+        if (count <= BVH_MAX_LEAF_SIZE)
+            return index;
+        middle = first + count / 2;
+    }
+    else
+    {
+        int i = first, j = first + count - 1;
+        while (i <= j)
+        {
+            int b[4];
+            bin_indices(box_centroid(builder.bounds[i]), centroidBox.min, binScale, b);
+            if (b[bestAxis] <= bestBin)
+                ++i;
+            else
+            {
+                std::swap(builder.bounds[i], builder.bounds[j]);
+                std::swap(builder.indices[i], builder.indices[j]);
+                --j;
+            }
+        }
+        middle = i;
+    }
+
+    nodes[index].count = 0;
+    int left = build_node(builder, nodes, first, middle - first, tasks);
+    int right = build_node(builder, nodes, middle, first + count - middle, tasks);
+    nodes[index].child[0] = left;
+    nodes[index].child[1] = right;
+    return index;
+}
+
+void set_slot(BvhNode & node, int slot, const Box & box)
+{
+    float min[4], max[4];
+    _mm_storeu_ps(min, box.min);
+    _mm_storeu_ps(max, box.max);
+    node.minX[slot] = min[0]; node.minY[slot] = min[1]; node.minZ[slot] = min[2];
+    node.maxX[slot] = max[0]; node.maxY[slot] = max[1]; node.maxZ[slot] = max[2];
+}
+
+// Turns a binary inner node into a 4-wide node by opening its largest inner children
+int collapse(const std::vector<BinaryNode> & binary, int root, std::vector<BvhNode> & nodes, int depth, int & maxDepth)
+{
+    maxDepth = std::max(maxDepth, depth);
+    int children[4] = { binary[root].child[0], binary[root].child[1], -1, -1 };
+    int childCount = 2;
+    while (childCount < 4)
+    {
+        int best = -1;
+        float bestArea = -1.f;
+        for (int i = 0; i < childCount; ++i)
+            if (binary[children[i]].count == 0 && box_area(binary[children[i]].box) > bestArea)
+            {
+                best = i;
+                bestArea = box_area(binary[children[i]].box);
+            }
+        if (best < 0)
+            break;
+        int opened = children[best];
+        children[best] = binary[opened].child[0];
+        children[childCount++] = binary[opened].child[1];
+    }
+
+    int index = (int) nodes.size();
+    nodes.push_back(BvhNode());
+    for (int i = 0; i < 4; ++i)
+    {
+        BvhNode & node = nodes[index];
+        if (i >= childCount)
+        {
+            Box empty;
+            box_empty(empty);
+            set_slot(node, i, empty);
+            node.child[i] = -1;
+            node.count[i] = -1;
+            continue;
+        }
+        const BinaryNode & child = binary[children[i]];
+        set_slot(node, i, child.box);
+        if (child.count > 0)
+        {
+            node.child[i] = child.first;
+            node.count[i] = child.count;
+        }
+        else
+        {
+            int c = collapse(binary, children[i], nodes, depth + 1, maxDepth);
+            nodes[index].child[i] = c;
+            nodes[index].count[i] = 0;
+        }
+    }
+    return index;
+}
+
+struct StackEntry
+{
+    int node;
+    float t;
+};
+
+void append_subtree(const Bvh & bvh, int node, std::vector<int> & visible)
+{
+    const BvhNode & n = bvh.nodes[node];
+    for (int i = 0; i < 4; ++i)
+    {
+        if (n.count[i] > 0)
+            visible.insert(visible.end(), bvh.indices.begin() + n.child[i], bvh.indices.begin() + n.child[i] + n.count[i]);
+        else if (n.count[i] == 0)
+            append_subtree(bvh, n.child[i], visible);
+    }
+}
+
+}
+
+void bvh_build(Bvh & bvh, const glm::vec3 * boundsMin, const glm::vec3 * boundsMax, int count)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bvh.primitiveCount = count;
+    bvh.depth = 0;
+    bvh.nodes.clear();
+    bvh.indices.resize(count);
+    for (int i = 0; i < count; ++i)
+        bvh.indices[i] = i;
+
+    Builder builder(bvh.indices);
+    builder.bounds.resize(count);
+    parallel_for(count, 4096, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; ++i)
+        {
+            builder.bounds[i].min = load3(boundsMin[i]);
+            builder.bounds[i].max = load3(boundsMax[i]);
+        }
+    });
+
+    // Top levels with parallel binning, then independent subtrees on the pool
+    std::vector<BinaryNode> binary;
+    std::vector<SubtreeTask> tasks;
+    if (count > 0)
+        build_node(builder, binary, 0, count, &tasks);
+    parallel_for((int) tasks.size(), 1, [&](int begin, int end)
+    {
+        for (int t = begin; t < end; ++t)
+            build_node(builder, tasks[t].nodes, tasks[t].first, tasks[t].count, 0);
+    });
+
+    // Subtree roots replace their placeholder, the other nodes are appended
+    for (size_t t = 0; t < tasks.size(); ++t)
+    {
+        int offset = (int) binary.size() - 1;
+        std::vector<BinaryNode> & nodes = tasks[t].nodes;
+        for (size_t i = 0; i < nodes.size(); ++i)
+            if (nodes[i].count == 0)
+            {
+                nodes[i].child[0] += offset;
+                nodes[i].child[1] += offset;
+            }
+        binary[tasks[t].node] = nodes[0];
+        binary.insert(binary.end(), nodes.begin() + 1, nodes.end());
+        std::vector<BinaryNode>().swap(nodes);
+    }
+
+    // Collapse to 4-wide nodes, a root leaf gets a node of its own
+    bvh.nodes.reserve(binary.size() / 2 + 1);
+    if (!binary.empty() && binary[0].count == 0)
+        collapse(binary, 0, bvh.nodes, 1, bvh.depth);
+    else if (!binary.empty())
+    {
+        BvhNode node;
+        Box empty;
+        box_empty(empty);
+        for (int i = 0; i < 4; ++i)
+        {
+            set_slot(node, i, i == 0 ? binary[0].box : empty);
+            node.child[i] = i == 0 ? binary[0].first : -1;
+            node.count[i] = i == 0 ? binary[0].count : -1;
+        }
+        bvh.nodes.push_back(node);
+        bvh.depth = 1;
+    }
+    bvh.buildMs = elapsed_ms(start);
+}
+
+void bvh_refit(Bvh & bvh, const glm::vec3 * boundsMin, const glm::vec3 * boundsMax)
+{
+    // Children are stored after their parent, so a reverse walk sees them first
+    for (int n = (int) bvh.nodes.size() - 1; n >= 0; --n)
+    {
+        BvhNode & node = bvh.nodes[n];
+        for (int i = 0; i < 4; ++i)
+        {
+            if (node.count[i] < 0)
+                continue;
+            Box box;
+            box_empty(box);
+            if (node.count[i] > 0)
+                for (int j = node.child[i]; j < node.child[i] + node.count[i]; ++j)
+                {
+                    Box primitive = { load3(boundsMin[bvh.indices[j]]), load3(boundsMax[bvh.indices[j]]) };
+                    box_grow(box, primitive);
+                }
+            else
+            {
+                const BvhNode & child = bvh.nodes[node.child[i]];
+                for (int k = 0; k < 4; ++k)
+                    if (child.count[k] >= 0)
+                    {
+                        Box slot = { _mm_setr_ps(child.minX[k], child.minY[k], child.minZ[k], 0.f),
+                                     _mm_setr_ps(child.maxX[k], child.maxY[k], child.maxZ[k], 0.f) };
+                        box_grow(box, slot);
+                    }
+            }
+            set_slot(node, i, box);
+        }
+    }
+}
+
+int bvh_raycast(const Bvh & bvh, const glm::vec3 & origin, const glm::vec3 & direction, float & tMax,
+                BvhIntersectFn intersect, void * user)
+{
+    if (bvh.nodes.empty())
+        return -1;
+    // Tiny direction components are replaced so the slab distances stay finite
+    glm::vec3 inv;
+    for (int a = 0; a < 3; ++a)
+        inv[a] = 1.f / (fabsf(direction[a]) > 1e-12f ? direction[a] : (direction[a] < 0.f ? -1e-12f : 1e-12f));
+    __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+    __m128 ix = _mm_set1_ps(inv.x), iy = _mm_set1_ps(inv.y), iz = _mm_set1_ps(inv.z);
+
+    // Every visited node pushes at most 3 more entries than it pops
+    StackEntry stackBuffer[256];
+    std::vector<StackEntry> heapStack;
+    StackEntry * stack = stackBuffer;
+    if (bvh.depth * 3 + 1 > 256)
+    {
+        heapStack.resize(bvh.depth * 3 + 1);
+        stack = &heapStack[0];
+    }
+    int stackSize = 0;
+    stack[stackSize].node = 0;
+    stack[stackSize++].t = 0.f;
+    int hit = -1;
+    while (stackSize)
+    {
+        StackEntry entry = stack[--stackSize];
+        if (entry.t >= tMax)
+            continue;
+        const BvhNode & node = bvh.nodes[entry.node];
+
+        // Slab test of the 4 children
+        __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minX), ox), ix);
+        __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxX), ox), ix);
+        __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minY), oy), iy);
+        __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxY), oy), iy);
+        __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minZ), oz), iz);
+        __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxZ), oz), iz);
+        __m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_setzero_ps()));
+        __m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_set1_ps(tMax)));
+        int mask = _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+        if (!mask)
+            continue;
+        float near[4];
+        _mm_storeu_ps(near, tNear);
+
+        // Leaves are tested right away, inner nodes pushed far to near
+        StackEntry children[4];
+        int childCount = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            if (!(mask & (1 << i)) || node.count[i] < 0)
+                continue;
+            if (node.count[i] > 0)
+            {
+                for (int j = node.child[i]; j < node.child[i] + node.count[i]; ++j)
+                {
+                    float t = intersect(user, bvh.indices[j], origin, direction, tMax);
+                    if (t < tMax)
+                    {
+                        tMax = t;
+                        hit = bvh.indices[j];
+                    }
+                }
+                continue;
+            }
+            int k = childCount++;
+            while (k > 0 && children[k - 1].t < near[i])
+            {
+                children[k] = children[k - 1];
+                --k;
+            }
+            children[k].node = node.child[i];
+            children[k].t = near[i];
+        }
+        for (int i = 0; i < childCount; ++i)
+            stack[stackSize++] = children[i];
+    }
+    return hit;
+}
+
+void bvh_cull_frustum(const Bvh & bvh, const Frustum & frustum, std::vector<int> & visible)
+{
+    if (bvh.nodes.empty())
+        return;
+    __m128 nx[6], ny[6], nz[6], ax[6], ay[6], az[6], w[6];
+    for (int p = 0; p < 6; ++p)
+    {
+        const glm::vec4 & plane = frustum.planes[p];
+        nx[p] = _mm_set1_ps(plane.x); ax[p] = _mm_set1_ps(fabsf(plane.x));
+        ny[p] = _mm_set1_ps(plane.y); ay[p] = _mm_set1_ps(fabsf(plane.y));
+        nz[p] = _mm_set1_ps(plane.z); az[p] = _mm_set1_ps(fabsf(plane.z));
+        w[p] = _mm_set1_ps(plane.w);
+    }
+    const __m128 half = _mm_set1_ps(0.5f);
+
+    int stackBuffer[256];
+    std::vector<int> heapStack;
+    int * stack = stackBuffer;
+    if (bvh.depth * 3 + 1 > 256)
+    {
+        heapStack.resize(bvh.depth * 3 + 1);
+        stack = &heapStack[0];
+    }
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize)
+    {
+        const BvhNode & node = bvh.nodes[stack[--stackSize]];
+        __m128 minX = _mm_loadu_ps(node.minX), minY = _mm_loadu_ps(node.minY), minZ = _mm_loadu_ps(node.minZ);
+        __m128 maxX = _mm_loadu_ps(node.maxX), maxY = _mm_loadu_ps(node.maxY), maxZ = _mm_loadu_ps(node.maxZ);
+        __m128 cx = _mm_mul_ps(_mm_add_ps(minX, maxX), half), ex = _mm_mul_ps(_mm_sub_ps(maxX, minX), half);
+        __m128 cy = _mm_mul_ps(_mm_add_ps(minY, maxY), half), ey = _mm_mul_ps(_mm_sub_ps(maxY, minY), half);
+        __m128 cz = _mm_mul_ps(_mm_add_ps(minZ, maxZ), half), ez = _mm_mul_ps(_mm_sub_ps(maxZ, minZ), half);
+
+        // Touching: no plane has the whole box behind it. Inside: every plane
+        // has the whole box in front of it.
+        __m128 touching = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        __m128 inside = touching;
+        for (int p = 0; p < 6; ++p)
+        {
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx[p], cx), _mm_mul_ps(ny[p], cy)), _mm_add_ps(_mm_mul_ps(nz[p], cz), w[p]));
+            __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax[p], ex), _mm_mul_ps(ay[p], ey)), _mm_mul_ps(az[p], ez));
+            touching = _mm_and_ps(touching, _mm_cmpge_ps(_mm_add_ps(d, r), _mm_setzero_ps()));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_sub_ps(d, r), _mm_setzero_ps()));
+        }
+        int touchMask = _mm_movemask_ps(touching), insideMask = _mm_movemask_ps(inside);
+        for (int i = 0; i < 4; ++i)
+        {
+            if (!(touchMask & (1 << i)) || node.count[i] < 0)
+                continue;
+            if (node.count[i] > 0)
+                visible.insert(visible.end(), bvh.indices.begin() + node.child[i], bvh.indices.begin() + node.child[i] + node.count[i]);
+            else if (insideMask & (1 << i))
+                append_subtree(bvh, node.child[i], visible);
+            else
+                stack[stackSize++] = node.child[i];
+        }
+    }
+}
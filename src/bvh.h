@@ -0,0 +1,51 @@
+#ifndef AOGL_BVH_H
+#define AOGL_BVH_H
+
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "culling.h"
+
+const int BVH_MAX_LEAF_SIZE = 4;
+
+// Four children with their boxes as SoA arrays so one SSE test covers the
+// whole node. Nodes are stored depth first, children after their parent.
+struct BvhNode
+{
+    float minX[4], minY[4], minZ[4];
+    float maxX[4], maxY[4], maxZ[4];
+    int child[4];   // node index, or first entry of Bvh::indices for a leaf
+    int count[4];   // primitives of a leaf, 0 for an inner node, -1 for an empty slot
+};
+
+// Bounding volume hierarchy over primitive AABBs, built with binned SAH and
+// collapsed to 4-wide nodes
+struct Bvh
+{
+    std::vector<BvhNode> nodes;
+    std::vector<int> indices;       // primitive indices referenced by the leaves
+    int primitiveCount;
+    int depth;
+    double buildMs;
+};
+
+// Distance along the ray to a primitive, anything >= tMax is a miss
+typedef float (*BvhIntersectFn)(void * user, int primitive, const glm::vec3 & origin, const glm::vec3 & direction, float tMax);
+
+void bvh_build(Bvh & bvh, const glm::vec3 * boundsMin, const glm::vec3 * boundsMax, int count);
+
+// Updates the node boxes after primitives moved, keeping the topology.
+// Cheap but the tree degrades if primitives travel far from where they were built.
+void bvh_refit(Bvh & bvh, const glm::vec3 * boundsMin, const glm::vec3 * boundsMax);
+
+// Closest hit, children visited front to back. Returns the primitive or -1,
+// tMax is lowered to the hit distance.
+int bvh_raycast(const Bvh & bvh, const glm::vec3 & origin, const glm::vec3 & direction, float & tMax,
+                BvhIntersectFn intersect, void * user);
+
+// Appends the primitives of the leaves whose box touches the frustum.
+// Subtrees entirely inside are appended without further tests.
+void bvh_cull_frustum(const Bvh & bvh, const Frustum & frustum, std::vector<int> & visible);
+
+#endif // AOGL_BVH_H
@@ -0,0 +1,182 @@
+#include "culling.h"
+
+#include <math.h>
+#include <emmintrin.h>
+
+#include "glm/gtx/simd_vec4.hpp"
+#include "glm/gtx/simd_mat4.hpp"
+
+#include "parallel.h"
+#include "timer.h"
+
+// Instances per parallel block, also the grain below which culling stays on one thread
+static const int CULL_BLOCK = 2048;
+
+void frustum_from_matrix(const glm::mat4 & m, Frustum & frustum)
+{
+    glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+    glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+    glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+    glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+    frustum.planes[0] = row3 + row0;
+    frustum.planes[1] = row3 - row0;
+    frustum.planes[2] = row3 + row1;
+    frustum.planes[3] = row3 - row1;
+    frustum.planes[4] = row3 + row2;
+    frustum.planes[5] = row3 - row2;
+    for (int i = 0; i < 6; ++i)
+        frustum.planes[i] /= glm::length(glm::vec3(frustum.planes[i]));
+}
+
+bool frustum_test_aabb(const Frustum & frustum, const glm::vec3 & boundsMin, const glm::vec3 & boundsMax)
+{
+    glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+    glm::vec3 extent = (boundsMax - boundsMin) * 0.5f;
+    for (int i = 0; i < 6; ++i)
+    {
+        glm::vec3 n(frustum.planes[i]);
+        if (glm::dot(n, center) + glm::dot(glm::abs(n), extent) + frustum.planes[i].w < 0.f)
+            return false;
+    }
+    return true;
+}
+
+// glm::abs on simdVec4 returns zero in this glm version, clear the sign bits directly
+static inline glm::simdVec4 simd_abs(const glm::simdVec4 & v)
+{
+    return glm::simdVec4(_mm_andnot_ps(_mm_set1_ps(-0.f), v.Data));
+}
+
+void instance_bounds_update(InstanceBounds & bounds, const glm::mat4 * transforms, int count,
+                            const glm::vec3 & localMin, const glm::vec3 & localMax)
+{
+    int padded = (count + 3) & ~3;
+    bounds.count = count;
+    std::vector<float> * arrays[6] = { &bounds.centerX, &bounds.centerY, &bounds.centerZ, &bounds.extentX, &bounds.extentY, &bounds.extentZ };
+    for (int i = 0; i < 6; ++i)
+        arrays[i]->assign(padded, 0.f);
+    bounds.visible.resize(padded);
+
+    // center' = M center, extent' = |M| extent
+    glm::simdVec4 center(glm::vec4((localMin + localMax) * 0.5f, 1.f));
+    glm::vec3 extent = (localMax - localMin) * 0.5f;
+    parallel_for(count, CULL_BLOCK, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; ++i)
+        {
+            glm::simdMat4 m(transforms[i]);
+            glm::vec4 c = glm::vec4_cast(m * center);
+            glm::vec4 e = glm::vec4_cast(simd_abs(m[0]) * glm::simdVec4(extent.x)
+                                       + simd_abs(m[1]) * glm::simdVec4(extent.y)
+                                       + simd_abs(m[2]) * glm::simdVec4(extent.z));
+            bounds.centerX[i] = c.x; bounds.centerY[i] = c.y; bounds.centerZ[i] = c.z;
+            bounds.extentX[i] = e.x; bounds.extentY[i] = e.y; bounds.extentZ[i] = e.z;
+        }
+    });
+}
+
+// Visible indices of [begin, end[ written from out, returns how many
+static int cull_range(const Frustum * frusta, int frustumCount, const InstanceBounds & bounds, const OcclusionBuffer * occlusion,
+                      int begin, int end, int * out, int * occluded)
+{
+    __m128 nx[6 * CULL_MAX_VIEWS], ny[6 * CULL_MAX_VIEWS], nz[6 * CULL_MAX_VIEWS];
+    __m128 ax[6 * CULL_MAX_VIEWS], ay[6 * CULL_MAX_VIEWS], az[6 * CULL_MAX_VIEWS], w[6 * CULL_MAX_VIEWS];
+    for (int p = 0; p < 6 * frustumCount; ++p)
+    {
+        const glm::vec4 & plane = frusta[p / 6].planes[p % 6];
+        nx[p] = _mm_set1_ps(plane.x); ax[p] = _mm_set1_ps(fabsf(plane.x));
+        ny[p] = _mm_set1_ps(plane.y); ay[p] = _mm_set1_ps(fabsf(plane.y));
+        nz[p] = _mm_set1_ps(plane.z); az[p] = _mm_set1_ps(fabsf(plane.z));
+        w[p] = _mm_set1_ps(plane.w);
+    }
+
+    int visible = 0;
+    for (int i = begin; i < end; i += 4)
+    {
+        __m128 cx = _mm_loadu_ps(&bounds.centerX[i]), cy = _mm_loadu_ps(&bounds.centerY[i]), cz = _mm_loadu_ps(&bounds.centerZ[i]);
+        __m128 ex = _mm_loadu_ps(&bounds.extentX[i]), ey = _mm_loadu_ps(&bounds.extentY[i]), ez = _mm_loadu_ps(&bounds.extentZ[i]);
+        __m128 anyInside = _mm_setzero_ps();
+        for (int f = 0; f < frustumCount; ++f)
+        {
+            __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+            for (int p = f * 6; p < f * 6 + 6; ++p)
+            {
+                // Box is outside when even its farthest corner along the normal is behind the plane
+                __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx[p], cx), _mm_mul_ps(ny[p], cy)), _mm_add_ps(_mm_mul_ps(nz[p], cz), w[p]));
+                __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax[p], ex), _mm_mul_ps(ay[p], ey)), _mm_mul_ps(az[p], ez));
+                inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(d, r), _mm_setzero_ps()));
+            }
+            anyInside = _mm_or_ps(anyInside, inside);
+        }
+        int mask = _mm_movemask_ps(anyInside);
+        if (end - i < 4)
+            mask &= (1 << (end - i)) - 1;
+        for (int k = 0; k < 4; ++k)
+        {
+            if (!(mask & (1 << k)))
+                continue;
+            int j = i + k;
+            if (occlusion && !occlusion_test_aabb(*occlusion, glm::vec3(bounds.centerX[j], bounds.centerY[j], bounds.centerZ[j]),
+                                                  glm::vec3(bounds.extentX[j], bounds.extentY[j], bounds.extentZ[j])))
+                (*occluded)++;
+            else
+                out[visible++] = j;
+        }
+    }
+    return visible;
+}
+
+int frustum_cull_instances(const Frustum & frustum, InstanceBounds & bounds, const OcclusionBuffer * occlusion,
+                           const glm::mat4 * transforms, glm::mat4 * visibleTransforms, CullStats * stats)
+{
+    return frustum_cull_instances_views(&frustum, 1, bounds, occlusion, transforms, visibleTransforms, stats);
+}
+
+int frustum_cull_instances_views(const Frustum * frusta, int frustumCount, InstanceBounds & bounds, const OcclusionBuffer * occlusion,
+                                 const glm::mat4 * transforms, glm::mat4 * visibleTransforms, CullStats * stats)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int blockCount = (bounds.count + CULL_BLOCK - 1) / CULL_BLOCK;
+    bounds.blockVisible.resize(blockCount);
+    bounds.blockOccluded.assign(blockCount, 0);
+
+    // Test every block, then turn the per block counts into output offsets
+    // and copy the visible transforms in instance order
+    parallel_for(blockCount, 1, [&](int begin, int end)
+    {
+        for (int b = begin; b < end; ++b)
+        {
+            int first = b * CULL_BLOCK;
+            int last = first + CULL_BLOCK < bounds.count ? first + CULL_BLOCK : bounds.count;
+            bounds.blockVisible[b] = cull_range(frusta, frustumCount, bounds, occlusion, first, last, &bounds.visible[first], &bounds.blockOccluded[b]);
+        }
+    });
+    int visible = 0, occluded = 0;
+    for (int b = 0; b < blockCount; ++b)
+    {
+        occluded += bounds.blockOccluded[b];
+        int n = bounds.blockVisible[b];
+        bounds.blockVisible[b] = visible;
+        visible += n;
+    }
+    parallel_for(blockCount, 1, [&](int begin, int end)
+    {
+        for (int b = begin; b < end; ++b)
+        {
+            int n = (b + 1 < blockCount ? bounds.blockVisible[b + 1] : visible) - bounds.blockVisible[b];
+            const int * indices = &bounds.visible[b * CULL_BLOCK];
+            glm::mat4 * out = visibleTransforms + bounds.blockVisible[b];
+            for (int i = 0; i < n; ++i)
+                out[i] = transforms[indices[i]];
+        }
+    });
+
+    if (stats)
+    {
+        stats->tested = bounds.count;
+        stats->visible = visible;
+        stats->occluded = occluded;
+        stats->ms = elapsed_ms(start);
+    }
+    return visible;
+}
@@ -0,0 +1,60 @@
+#ifndef AOGL_CULLING_H
+#define AOGL_CULLING_H
+
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "occlusion.h"
+
+const int CULL_MAX_VIEWS = 4;
+
+// Plane equations (normal, distance) pointing inside: left, right, bottom,
+// top, near, far
+struct Frustum
+{
+    glm::vec4 planes[6];
+};
+
+// World space AABBs of instances as center / half extent arrays, padded to
+// a multiple of 4 so the culling loop runs on whole SSE batches
+struct InstanceBounds
+{
+    int count;
+    std::vector<float> centerX, centerY, centerZ;
+    std::vector<float> extentX, extentY, extentZ;
+    std::vector<int> visible;       // scratch: visible indices per block
+    std::vector<int> blockVisible;  // scratch: visible count, then output offset per block
+    std::vector<int> blockOccluded; // scratch: occluded count per block
+};
+
+struct CullStats
+{
+    int tested;
+    int visible;
+    int occluded;   // inside the frustum but hidden by occluders
+    double ms;
+};
+
+// Gribb-Hartmann plane extraction from a view-projection matrix
+void frustum_from_matrix(const glm::mat4 & viewProjection, Frustum & frustum);
+bool frustum_test_aabb(const Frustum & frustum, const glm::vec3 & boundsMin, const glm::vec3 & boundsMax);
+
+// Transforms the local AABB shared by all instances into world space bounds
+void instance_bounds_update(InstanceBounds & bounds, const glm::mat4 * transforms, int count,
+                            const glm::vec3 & localMin, const glm::vec3 & localMax);
+
+// Tests 4 instances at a time against the frustum, on the worker pool for
+// large counts, and writes the transforms of the visible ones in order to
+// visibleTransforms (which can be a mapped instance buffer). Instances that
+// pass are then tested against the occlusion buffer, when there is one.
+// Returns the number of visible instances.
+int frustum_cull_instances(const Frustum & frustum, InstanceBounds & bounds, const OcclusionBuffer * occlusion,
+                           const glm::mat4 * transforms, glm::mat4 * visibleTransforms, CullStats * stats);
+
+// Same for up to CULL_MAX_VIEWS views drawn at once: an instance is kept
+// when any of the frusta holds it
+int frustum_cull_instances_views(const Frustum * frusta, int frustumCount, InstanceBounds & bounds, const OcclusionBuffer * occlusion,
+                                 const glm::mat4 * transforms, glm::mat4 * visibleTransforms, CullStats * stats);
+
+#endif // AOGL_CULLING_H
@@ -0,0 +1,79 @@
+#include "deferred.h"
+
+#include <stdio.h>
+
+#include "glm/gtc/type_ptr.hpp"
+
+void deferred_init(DeferredRenderer & deferred, GLuint program, int width, int height)
+{
+    static const GLenum internalFormats[4] = { GL_RGBA8, GL_RGBA8, GL_RG16, GL_DEPTH_COMPONENT24 };
+    static const GLenum formats[4] = { GL_RGBA, GL_RGBA, GL_RG, GL_DEPTH_COMPONENT };
+    static const GLenum types[4] = { GL_UNSIGNED_BYTE, GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT, GL_FLOAT };
+    static const GLenum attachments[4] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_DEPTH_ATTACHMENT };
+
+    deferred.width = width;
+    deferred.height = height;
+    glGenTextures(4, deferred.textures);
+    glGenFramebuffers(1, &deferred.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, deferred.fbo);
+    for (int i = 0; i < 4; ++i)
+    {
+        // Read with texelFetch only
+        glBindTexture(GL_TEXTURE_2D, deferred.textures[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormats[i], width, height, 0, formats[i], types[i], 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, attachments[i], GL_TEXTURE_2D, deferred.textures[i], 0);
+    }
+    glDrawBuffers(3, attachments);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        fprintf(stderr, "Deferred: incomplete G-buffer\n");
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    deferred.program = program;
+    deferred.inverseViewProjectionLocation = glGetUniformLocation(program, "InverseViewProjection");
+    deferred.viewportSizeLocation = glGetUniformLocation(program, "ViewportSize");
+    static const char * samplers[4] = { "GBufferAlbedo", "GBufferSpecular", "GBufferNormal", "GBufferDepth" };
+    for (int i = 0; i < 4; ++i)
+        deferred.samplerLocations[i] = glGetUniformLocation(program, samplers[i]);
+    glGenVertexArrays(1, &deferred.vao);
+}
+
+void deferred_release(DeferredRenderer & deferred)
+{
+    glDeleteVertexArrays(1, &deferred.vao);
+    glDeleteFramebuffers(1, &deferred.fbo);
+    glDeleteTextures(4, deferred.textures);
+    glDeleteProgram(deferred.program);
+}
+
+void deferred_begin_geometry(const DeferredRenderer & deferred)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, deferred.fbo);
+    glViewport(0, 0, deferred.width, deferred.height);
+}
+
+void deferred_light(const DeferredRenderer & deferred, const glm::mat4 & viewProjection, int firstUnit)
+{
+    GLuint program = deferred.program;
+    for (int i = 0; i < 4; ++i)
+    {
+        glActiveTexture(GL_TEXTURE0 + firstUnit + i);
+        glBindTexture(GL_TEXTURE_2D, deferred.textures[i]);
+        glProgramUniform1i(program, deferred.samplerLocations[i], firstUnit + i);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    glm::mat4 inverseViewProjection = glm::inverse(viewProjection);
+    glProgramUniformMatrix4fv(program, deferred.inverseViewProjectionLocation, 1, 0, glm::value_ptr(inverseViewProjection));
+    glProgramUniform2f(program, deferred.viewportSizeLocation, (float) deferred.width, (float) deferred.height);
+
+    // Every pixel is written once, no depth test needed
+    glDisable(GL_DEPTH_TEST);
+    glUseProgram(program);
+    glBindVertexArray(deferred.vao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
+    glEnable(GL_DEPTH_TEST);
+}
@@ -0,0 +1,36 @@
+#ifndef AOGL_DEFERRED_H
+#define AOGL_DEFERRED_H
+
+#include "glew/glew.h"
+#include "glm/glm.hpp"
+
+// Deferred path: the scene is drawn with aogl.frag in G-buffer mode, then a
+// full screen pass of deferred.frag lights every pixel once with the same
+// lighting.glsl code as the forward path, point lights coming from the
+// light grid clusters. Targets: albedo and specular power (RGBA8), specular
+// color (RGBA8), octahedral normal (RG16) and depth, from which positions
+// are rebuilt.
+struct DeferredRenderer
+{
+    int width, height;
+    GLuint fbo;
+    GLuint textures[4];     // albedo, specular, normal, depth
+    GLuint program;         // deferred.vert, deferred.frag
+    GLuint vao;             // empty, the full screen triangle has no attributes
+    GLint inverseViewProjectionLocation;
+    GLint viewportSizeLocation;
+    GLint samplerLocations[4];
+};
+
+void deferred_init(DeferredRenderer & deferred, GLuint program, int width, int height);
+void deferred_release(DeferredRenderer & deferred);
+
+// Binds the G-buffer as the draw framebuffer, the caller clears it and
+// draws with GBufferPass set
+void deferred_begin_geometry(const DeferredRenderer & deferred);
+
+// Lights the G-buffer into the bound framebuffer, reading it from texture
+// units firstUnit to firstUnit + 3
+void deferred_light(const DeferredRenderer & deferred, const glm::mat4 & viewProjection, int firstUnit);
+
+#endif // AOGL_DEFERRED_H
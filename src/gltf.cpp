@@ -0,0 +1,994 @@
+#include "gltf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string>
+#include <algorithm>
+
+#include "glm/gtc/matrix_transform.hpp"
+#include "glm/gtc/quaternion.hpp"
+#include "glm/gtc/type_ptr.hpp"
+#include "stb/stb_image.h"
+
+#include "mapped_file.h"
+#include "mesh.h"
+#include "parallel.h"
+#include "culling.h"
+#include "timer.h"
+
+namespace
+{
+
+const unsigned int GLB_MAGIC = 0x46546C67;      // "glTF"
+const unsigned int GLB_CHUNK_JSON = 0x4E4F534A; // "JSON"
+const unsigned int GLB_CHUNK_BIN = 0x004E4942;  // "BIN\0"
+
+// A JSON value inside the mapped chunk, p points at its first character.
+// Nothing is decoded up front: members and elements are found by skipping
+// over the text, so walking the document allocates nothing.
+struct JsonValue
+{
+    const char * p;
+    const char * end;
+};
+
+inline const char * json_skip_space(const char * p, const char * end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        ++p;
+    return p;
+}
+
+// p is on the opening quote, returns past the closing one
+const char * json_skip_string(const char * p, const char * end)
+{
+    for (++p; p < end && *p != '"'; ++p)
+        if (*p == '\\')
+            ++p;
+    return p < end ? p + 1 : end;
+}
+
+const char * json_skip_value(const char * p, const char * end)
+{
+    p = json_skip_space(p, end);
+    if (p >= end)
+        return end;
+    if (*p == '"')
+        return json_skip_string(p, end);
+    if (*p == '{' || *p == '[')
+    {
+        int depth = 0;
+        while (p < end)
+        {
+            char c = *p;
+            if (c == '"')
+            {
+                p = json_skip_string(p, end);
+                continue;
+            }
+            if (c == '{' || c == '[')
+                ++depth;
+            else if ((c == '}' || c == ']') && --depth == 0)
+                return p + 1;
+            ++p;
+        }
+        return end;
+    }
+    while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\n' && *p != '\r' && *p != '\t')
+        ++p;
+    return p;
+}
+
+bool json_member(JsonValue object, const char * key, JsonValue & value)
+{
+    const char * p = json_skip_space(object.p, object.end);
+    const char * end = object.end;
+    if (p >= end || *p != '{')
+        return false;
+    size_t keyLength = strlen(key);
+    p = json_skip_space(p + 1, end);
+    while (p < end && *p == '"')
+    {
+        const char * name = p + 1;
+        p = json_skip_string(p, end);
+        size_t nameLength = p - 1 - name;
+        p = json_skip_space(p, end);
+        if (p >= end || *p != ':')
+            return false;
+        p = json_skip_space(p + 1, end);
+        if (nameLength == keyLength && memcmp(name, key, keyLength) == 0)
+        {
+            value.p = p;
+            value.end = end;
+            return true;
+        }
+        p = json_skip_space(json_skip_value(p, end), end);
+        if (p >= end || *p != ',')
+            return false;
+        p = json_skip_space(p + 1, end);
+    }
+    return false;
+}
+
+// Calls fn on every element of an array, stops early when fn returns false
+template <typename Fn>
+void json_for_each(JsonValue array, Fn fn)
+{
+    const char * p = json_skip_space(array.p, array.end);
+    const char * end = array.end;
+    if (p >= end || *p != '[')
+        return;
+    p = json_skip_space(p + 1, end);
+    while (p < end && *p != ']')
+    {
+        JsonValue element = { p, end };
+        if (!fn(element))
+            return;
+        p = json_skip_space(json_skip_value(p, end), end);
+        if (p < end && *p == ',')
+            p = json_skip_space(p + 1, end);
+    }
+}
+
+double json_number(JsonValue value, double fallback)
+{
+    char buffer[64];
+    size_t length = json_skip_value(value.p, value.end) - value.p;
+    if (length == 0 || length >= sizeof(buffer))
+        return fallback;
+    memcpy(buffer, value.p, length);
+    buffer[length] = 0;
+    char * last;
+    double d = strtod(buffer, &last);
+    return last == buffer ? fallback : d;
+}
+
+double json_number(JsonValue object, const char * key, double fallback)
+{
+    JsonValue value;
+    return json_member(object, key, value) ? json_number(value, fallback) : fallback;
+}
+
+int json_int(JsonValue object, const char * key, int fallback)
+{
+    return (int) json_number(object, key, fallback);
+}
+
+bool json_string_equals(JsonValue value, const char * s)
+{
+    size_t length = strlen(s);
+    return value.p + length + 2 <= value.end && value.p[0] == '"'
+        && memcmp(value.p + 1, s, length) == 0 && value.p[length + 1] == '"';
+}
+
+int json_floats(JsonValue array, float * out, int capacity)
+{
+    int count = 0;
+    json_for_each(array, [&](JsonValue element)
+    {
+        out[count++] = (float) json_number(element, 0.0);
+        return count < capacity;
+    });
+    return count;
+}
+
+// Start of every element of a top level array, the only lookup table the
+// loader builds so that accessors and views are found in constant time
+void json_index(JsonValue root, const char * key, std::vector<JsonValue> & elements)
+{
+    JsonValue array;
+    if (json_member(root, key, array))
+        json_for_each(array, [&](JsonValue element) { elements.push_back(element); return true; });
+}
+
+int component_count(JsonValue accessor)
+{
+    JsonValue type;
+    if (!json_member(accessor, "type", type))
+        return 0;
+    static const char * names[] = { "SCALAR", "VEC2", "VEC3", "VEC4" };
+    for (int i = 0; i < 4; ++i)
+        if (json_string_equals(type, names[i]))
+            return i + 1;
+    return 0;
+}
+
+struct GltfDocument
+{
+    const unsigned char * bin;
+    size_t binSize;
+    std::vector<JsonValue> accessors;
+    std::vector<JsonValue> bufferViews;
+    std::vector<JsonValue> meshes;
+    std::vector<JsonValue> materials;
+    std::vector<JsonValue> textures;
+    std::vector<JsonValue> images;
+    std::vector<JsonValue> nodes;
+    std::vector<GLuint> viewBuffers;    // GL buffer of each buffer view, 0 until used
+    std::vector<JsonValue> primitiveJson;   // source of each loaded primitive
+    GltfStats * stats;
+};
+
+// Byte range of a buffer view inside the binary chunk, external buffers are not supported
+bool view_range(const GltfDocument & doc, int view, const unsigned char ** data, size_t * size)
+{
+    if (view < 0 || view >= (int) doc.bufferViews.size() || json_int(doc.bufferViews[view], "buffer", 0) != 0)
+        return false;
+    double offset = json_number(doc.bufferViews[view], "byteOffset", 0.0);
+    double length = json_number(doc.bufferViews[view], "byteLength", 0.0);
+    if (!doc.bin || offset < 0.0 || length < 0.0 || offset + length > (double) doc.binSize)
+        return false;
+    *data = doc.bin + (size_t) offset;
+    *size = (size_t) length;
+    return true;
+}
+
+int component_size(int type)
+{
+    switch (type)
+    {
+    case GL_BYTE:
+    case GL_UNSIGNED_BYTE:
+        return 1;
+    case GL_SHORT:
+    case GL_UNSIGNED_SHORT:
+        return 2;
+    case GL_UNSIGNED_INT:
+    case GL_FLOAT:
+        return 4;
+    }
+    return 0;
+}
+
+// Elements of an accessor inside its buffer view
+struct AccessorRange
+{
+    int view;
+    const unsigned char * data;     // first element
+    size_t stride;
+    int count;
+};
+
+// Checks that count elements of elementSize bytes, stride apart from
+// byteOffset, all lie inside the buffer view of the accessor
+bool accessor_range(const GltfDocument & doc, JsonValue accessor, size_t elementSize, AccessorRange & range)
+{
+    const unsigned char * data;
+    size_t viewSize;
+    range.view = json_int(accessor, "bufferView", -1);
+    if (!elementSize || !view_range(doc, range.view, &data, &viewSize))
+        return false;
+    double offset = json_number(accessor, "byteOffset", 0.0);
+    double stride = json_number(doc.bufferViews[range.view], "byteStride", 0.0);
+    double count = json_number(accessor, "count", 0.0);
+    if (offset < 0.0 || offset > (double) viewSize || count < 0.0 || count > (double) INT_MAX
+        || (stride != 0.0 && (stride < (double) elementSize || stride > 252.0)))
+        return false;
+    range.stride = stride != 0.0 ? (size_t) stride : elementSize;
+    range.count = (int) count;
+    if (range.count > 0 && (uint64_t) offset + (uint64_t) (range.count - 1) * range.stride + elementSize > viewSize)
+        return false;
+    range.data = data + (size_t) offset;
+    return true;
+}
+
+// Uploads a buffer view the first time an accessor uses it, straight from the mapping
+GLuint view_buffer(GltfDocument & doc, GltfScene & scene, int view)
+{
+    if (view < 0 || view >= (int) doc.viewBuffers.size())
+        return 0;
+    if (doc.viewBuffers[view])
+        return doc.viewBuffers[view];
+    const unsigned char * data;
+    size_t size;
+    if (!view_range(doc, view, &data, &size))
+        return 0;
+    GLuint buffer;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glBufferData(GL_ARRAY_BUFFER, size, data, GL_STATIC_DRAW);
+    doc.viewBuffers[view] = buffer;
+    scene.buffers.push_back(buffer);
+    if (doc.stats)
+    {
+        doc.stats->uploadedBytes += size;
+        doc.stats->bufferViews++;
+    }
+    return buffer;
+}
+
+// Points a vertex attribute of the bound VAO at an accessor holding at
+// least vertexCount elements, or its own count when vertexCount is -1
+bool bind_attribute(GltfDocument & doc, GltfScene & scene, int accessorIndex, GLuint location, int components, int vertexCount)
+{
+    if (accessorIndex < 0 || accessorIndex >= (int) doc.accessors.size())
+        return false;
+    JsonValue accessor = doc.accessors[accessorIndex];
+    int type = json_int(accessor, "componentType", GL_FLOAT);
+    AccessorRange range;
+    if (component_count(accessor) != components || !accessor_range(doc, accessor, component_size(type) * components, range)
+        || range.count < vertexCount)
+        return false;
+    GLuint buffer = view_buffer(doc, scene, range.view);
+    if (!buffer)
+        return false;
+    const unsigned char * view;
+    size_t viewSize;
+    view_range(doc, range.view, &view, &viewSize);
+    JsonValue normalized;
+    GLboolean normalize = json_member(accessor, "normalized", normalized) && *normalized.p == 't';
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glEnableVertexAttribArray(location);
+    glVertexAttribPointer(location, components, type, normalize, (GLsizei) range.stride, (void *) (range.data - view));
+    return true;
+}
+
+bool load_primitive(GltfDocument & doc, GltfScene & scene, JsonValue json, GltfPrimitive & primitive)
+{
+    JsonValue attributes;
+    if (!json_member(json, "attributes", attributes))
+        return false;
+    int position = json_int(attributes, "POSITION", -1);
+    if (position < 0 || position >= (int) doc.accessors.size())
+        return false;
+
+    primitive = GltfPrimitive();
+    primitive.mode = json_int(json, "mode", GL_TRIANGLES);
+    primitive.material = json_int(json, "material", -1);
+    primitive.count = json_int(doc.accessors[position], "count", 0);
+
+    // glTF requires min and max on positions
+    JsonValue bound;
+    if (json_member(doc.accessors[position], "min", bound))
+        json_floats(bound, &primitive.boundsMin[0], 3);
+    if (json_member(doc.accessors[position], "max", bound))
+        json_floats(bound, &primitive.boundsMax[0], 3);
+
+    glGenVertexArrays(1, &primitive.vao);
+    glBindVertexArray(primitive.vao);
+    bool ok = bind_attribute(doc, scene, position, 0, 3, -1);
+    primitive.hasNormals = bind_attribute(doc, scene, json_int(attributes, "NORMAL", -1), 1, 3, primitive.count);
+    primitive.hasUvs = bind_attribute(doc, scene, json_int(attributes, "TEXCOORD_0", -1), 2, 2, primitive.count);
+    primitive.hasTangents = bind_attribute(doc, scene, json_int(attributes, "TANGENT", -1), 3, 4, primitive.count);
+
+    int indices = json_int(json, "indices", -1);
+    if (ok && indices >= 0)
+    {
+        ok = indices < (int) doc.accessors.size();
+        if (ok)
+        {
+            JsonValue accessor = doc.accessors[indices];
+            primitive.indexType = json_int(accessor, "componentType", GL_UNSIGNED_INT);
+            AccessorRange range;
+            ok = (primitive.indexType == GL_UNSIGNED_BYTE || primitive.indexType == GL_UNSIGNED_SHORT || primitive.indexType == GL_UNSIGNED_INT)
+                && accessor_range(doc, accessor, component_size(primitive.indexType), range) && range.stride == (size_t) component_size(primitive.indexType);
+            GLuint buffer = ok ? view_buffer(doc, scene, range.view) : 0;
+            ok = buffer != 0;
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
+            if (ok)
+            {
+                const unsigned char * view;
+                size_t viewSize;
+                view_range(doc, range.view, &view, &viewSize);
+                primitive.indexOffset = range.data - view;
+                primitive.count = range.count;
+            }
+        }
+    }
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    if (!ok)
+        glDeleteVertexArrays(1, &primitive.vao);
+    return ok;
+}
+
+int texture_image(const GltfDocument & doc, JsonValue material, const char * path0, const char * path1)
+{
+    JsonValue info, value;
+    if (path1)
+    {
+        if (!json_member(material, path0, value) || !json_member(value, path1, info))
+            return -1;
+    }
+    else if (!json_member(material, path0, info))
+        return -1;
+    int texture = json_int(info, "index", -1);
+    if (texture < 0 || texture >= (int) doc.textures.size())
+        return -1;
+    int image = json_int(doc.textures[texture], "source", -1);
+    return image < (int) doc.images.size() ? image : -1;
+}
+
+struct DecodedImage
+{
+    unsigned char * pixels;
+    int width;
+    int height;
+};
+
+// Decodes PNG / JPEG images embedded in the binary chunk or stored next to the file
+void decode_image(const GltfDocument & doc, int image, const std::string & directory, DecodedImage & out)
+{
+    int components;
+    out.pixels = 0;
+    JsonValue uri;
+    const unsigned char * data;
+    size_t size;
+    if (view_range(doc, json_int(doc.images[image], "bufferView", -1), &data, &size))
+        out.pixels = stbi_load_from_memory(data, (int) size, &out.width, &out.height, &components, 3);
+    else if (json_member(doc.images[image], "uri", uri) && *uri.p == '"')
+    {
+        std::string name(uri.p + 1, json_skip_string(uri.p, uri.end) - 1);
+        if (name.compare(0, 5, "data:") != 0)
+            out.pixels = stbi_load((directory + name).c_str(), &out.width, &out.height, &components, 3);
+    }
+}
+
+unsigned int color_key(const glm::vec3 & color, unsigned char * rgb)
+{
+    for (int i = 0; i < 3; ++i)
+        rgb[i] = (unsigned char) (glm::clamp(color[i], 0.f, 1.f) * 255.f + 0.5f);
+    return rgb[0] | (rgb[1] << 8) | (rgb[2] << 16);
+}
+
+// 1x1 texture for constant material inputs, shared between materials
+int constant_texture(TextureResidency & residency, std::vector<std::pair<unsigned int, int> > & cache, const glm::vec3 & color)
+{
+    unsigned char rgb[3];
+    unsigned int key = color_key(color, rgb);
+    for (size_t i = 0; i < cache.size(); ++i)
+        if (cache[i].first == key)
+            return cache[i].second;
+    int handle = residency_add_texture(residency, rgb, 1, 1, 3);
+    cache.push_back(std::make_pair(key, handle));
+    return handle;
+}
+
+// Decoded image multiplied by a color, uploaded once per image and color.
+// -1 when the image could not be decoded.
+int tinted_texture(TextureResidency & residency, std::vector<std::pair<uint64_t, int> > & cache, const DecodedImage & image,
+                   int index, const glm::vec3 & color, GltfStats * stats)
+{
+    if (!image.pixels)
+        return -1;
+    unsigned char rgb[3];
+    uint64_t key = ((uint64_t) index << 24) | color_key(color, rgb);
+    for (size_t i = 0; i < cache.size(); ++i)
+        if (cache[i].first == key)
+            return cache[i].second;
+    int handle;
+    if (rgb[0] == 255 && rgb[1] == 255 && rgb[2] == 255)
+        handle = residency_add_texture(residency, image.pixels, image.width, image.height, 3);
+    else
+    {
+        std::vector<unsigned char> pixels(image.pixels, image.pixels + (size_t) image.width * image.height * 3);
+        for (size_t i = 0; i < pixels.size(); ++i)
+            pixels[i] = (unsigned char) ((pixels[i] * rgb[i % 3] + 127) / 255);
+        handle = residency_add_texture(residency, &pixels[0], image.width, image.height, 3);
+    }
+    cache.push_back(std::make_pair(key, handle));
+    stats->images++;
+    return handle;
+}
+
+glm::mat4 node_transform(JsonValue node)
+{
+    float m[16];
+    JsonValue value;
+    if (json_member(node, "matrix", value) && json_floats(value, m, 16) == 16)
+        return glm::make_mat4(m);
+    glm::vec3 t(0.f), s(1.f);
+    float r[4] = { 0.f, 0.f, 0.f, 1.f };
+    if (json_member(node, "translation", value))
+        json_floats(value, &t[0], 3);
+    if (json_member(node, "rotation", value))
+        json_floats(value, r, 4);
+    if (json_member(node, "scale", value))
+        json_floats(value, &s[0], 3);
+    glm::quat q(r[3], r[0], r[1], r[2]);
+    return glm::scale(glm::translate(glm::mat4(1.f), t) * glm::mat4_cast(q), s);
+}
+
+void add_node(const GltfDocument & doc, const std::vector<int> & meshPrimitives, const std::vector<int> & meshPrimitiveCount,
+              GltfScene & scene, int node, const glm::mat4 & parent, int depth)
+{
+    if (node < 0 || node >= (int) doc.nodes.size() || depth > 64)
+        return;
+    glm::mat4 objectToWorld = parent * node_transform(doc.nodes[node]);
+    int mesh = json_int(doc.nodes[node], "mesh", -1);
+    if (mesh >= 0 && mesh < (int) meshPrimitives.size())
+        for (int i = 0; i < meshPrimitiveCount[mesh]; ++i)
+        {
+            GltfDraw draw = { meshPrimitives[mesh] + i, objectToWorld, false };
+            scene.draws.push_back(draw);
+        }
+    JsonValue children;
+    if (json_member(doc.nodes[node], "children", children))
+        json_for_each(children, [&](JsonValue child)
+        {
+            add_node(doc, meshPrimitives, meshPrimitiveCount, scene, (int) json_number(child, -1.0), objectToWorld, depth + 1);
+            return true;
+        });
+}
+
+
+// Accessor elements as floats, from float or normalized unsigned components
+bool read_floats(const GltfDocument & doc, int accessorIndex, int components, std::vector<float> & out)
+{
+    if (accessorIndex < 0 || accessorIndex >= (int) doc.accessors.size())
+        return false;
+    JsonValue accessor = doc.accessors[accessorIndex];
+    int type = json_int(accessor, "componentType", GL_FLOAT);
+    int size = type == GL_FLOAT ? 4 : type == GL_UNSIGNED_SHORT ? 2 : type == GL_UNSIGNED_BYTE ? 1 : 0;
+    AccessorRange range;
+    if (!size || component_count(accessor) != components || !accessor_range(doc, accessor, size * components, range))
+        return false;
+    int count = range.count;
+    out.resize((size_t) count * components);
+    for (int i = 0; i < count; ++i)
+    {
+        const unsigned char * element = range.data + i * range.stride;
+        for (int c = 0; c < components; ++c)
+        {
+            if (type == GL_FLOAT)
+                memcpy(&out[i * components + c], element + c * 4, 4);
+            else if (type == GL_UNSIGNED_SHORT)
+                out[i * components + c] = ((const unsigned short *) element)[c] / 65535.f;
+            else
+                out[i * components + c] = element[c] / 255.f;
+        }
+    }
+    return true;
+}
+
+bool read_indices(const GltfDocument & doc, int accessorIndex, std::vector<int> & out)
+{
+    if (accessorIndex < 0 || accessorIndex >= (int) doc.accessors.size())
+        return false;
+    JsonValue accessor = doc.accessors[accessorIndex];
+    int type = json_int(accessor, "componentType", GL_UNSIGNED_INT);
+    int size = type == GL_UNSIGNED_INT ? 4 : type == GL_UNSIGNED_SHORT ? 2 : 1;
+    AccessorRange range;
+    if (!accessor_range(doc, accessor, size, range) || range.stride != (size_t) size)
+        return false;
+    int count = range.count;
+    out.resize(count);
+    for (int i = 0; i < count; ++i)
+    {
+        const unsigned char * element = range.data + i * size;
+        out[i] = type == GL_UNSIGNED_INT ? *(const unsigned int *) element : type == GL_UNSIGNED_SHORT ? *(const unsigned short *) element : *element;
+    }
+    return true;
+}
+
+// Triangle list with every attribute, missing ones take the gltf_draw constants
+bool decode_primitive(const GltfDocument & doc, const GltfPrimitive & primitive, JsonValue json, MeshBuffers & mesh)
+{
+    JsonValue attributes;
+    if (primitive.mode != GL_TRIANGLES || !json_member(json, "attributes", attributes)
+        || !read_floats(doc, json_int(attributes, "POSITION", -1), 3, mesh.vertices))
+        return false;
+    int vertexCount = (int) mesh.vertices.size() / 3;
+    if (!primitive.hasNormals || !read_floats(doc, json_int(attributes, "NORMAL", -1), 3, mesh.normals))
+        for (int i = 0; i < vertexCount; ++i)
+        {
+            mesh.normals.push_back(0.f);
+            mesh.normals.push_back(1.f);
+            mesh.normals.push_back(0.f);
+        }
+    if (!primitive.hasUvs || !read_floats(doc, json_int(attributes, "TEXCOORD_0", -1), 2, mesh.uvs))
+        mesh.uvs.assign(vertexCount * 2, 0.f);
+    if (!primitive.hasTangents || !read_floats(doc, json_int(attributes, "TANGENT", -1), 4, mesh.tangents))
+        for (int i = 0; i < vertexCount; ++i)
+        {
+            static const float tangent[4] = { 1.f, 0.f, 0.f, 1.f };
+            mesh.tangents.insert(mesh.tangents.end(), tangent, tangent + 4);
+        }
+    if (mesh.normals.size() != mesh.vertices.size() || mesh.uvs.size() != (size_t) vertexCount * 2
+        || mesh.tangents.size() != (size_t) vertexCount * 4)
+        return false;
+    if (primitive.indexType)
+    {
+        if (!read_indices(doc, json_int(json, "indices", -1), mesh.triangleList))
+            return false;
+    }
+    else
+        for (int i = 0; i < vertexCount; ++i)
+            mesh.triangleList.push_back(i);
+    mesh.triangleList.resize(mesh.triangleList.size() / 3 * 3);
+    for (size_t i = 0; i < mesh.triangleList.size(); ++i)
+        if (mesh.triangleList[i] < 0 || mesh.triangleList[i] >= vertexCount)
+            return false;
+    return true;
+}
+
+// Buffer views read by a primitive: its attributes and indices
+void primitive_views(const GltfDocument & doc, JsonValue json, std::vector<int> & views)
+{
+    JsonValue attributes;
+    if (json_member(json, "attributes", attributes))
+    {
+        static const char * names[] = { "POSITION", "NORMAL", "TEXCOORD_0", "TANGENT" };
+        for (int i = 0; i < 4; ++i)
+        {
+            int accessor = json_int(attributes, names[i], -1);
+            if (accessor >= 0 && accessor < (int) doc.accessors.size())
+                views.push_back(json_int(doc.accessors[accessor], "bufferView", -1));
+        }
+    }
+    int indices = json_int(json, "indices", -1);
+    if (indices >= 0 && indices < (int) doc.accessors.size())
+        views.push_back(json_int(doc.accessors[indices], "bufferView", -1));
+}
+
+// Merges the draws that can be read back on the CPU, then drops the vertex
+// arrays and buffers no other draw needs
+void batch_draws(const GltfDocument & doc, GltfScene & scene, GltfStats * stats)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<int> used;
+    std::vector<char> drawn(scene.primitives.size(), 0);
+    for (size_t i = 0; i < scene.draws.size(); ++i)
+        if (!drawn[scene.draws[i].primitive]++)
+            used.push_back(scene.draws[i].primitive);
+    std::vector<MeshBuffers> decoded(scene.primitives.size());
+    std::vector<char> decodable(scene.primitives.size(), 0);
+    parallel_for((int) used.size(), 1, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; ++i)
+            decodable[used[i]] = decode_primitive(doc, scene.primitives[used[i]], doc.primitiveJson[used[i]], decoded[used[i]]);
+    });
+
+    std::vector<BatchSource> sources;
+    for (size_t i = 0; i < scene.draws.size(); ++i)
+    {
+        GltfDraw & draw = scene.draws[i];
+        const GltfPrimitive & primitive = scene.primitives[draw.primitive];
+        if (!decodable[draw.primitive])
+            continue;
+        BatchSource source = { mesh_view(decoded[draw.primitive]), draw.objectToWorld, primitive.boundsMin, primitive.boundsMax, primitive.material };
+        sources.push_back(source);
+        draw.batched = true;
+    }
+    if (sources.empty())
+        return;
+    std::vector<StaticBatch> batches;
+    BatchStats batchStats;
+    static_batch_build(&sources[0], (int) sources.size(), batches, &batchStats);
+    for (size_t i = 0; i < batches.size(); ++i)
+    {
+        GltfBatch batch;
+        mesh_upload(mesh_view(batches[i].mesh), batch.mesh);
+        batch.material = batches[i].material;
+        batch.chunks.swap(batches[i].chunks);
+        scene.batches.push_back(batch);
+    }
+
+    // Views still read by a draw that was not batched are kept
+    std::vector<char> unbatched(scene.primitives.size(), 0);
+    for (size_t i = 0; i < scene.draws.size(); ++i)
+        if (!scene.draws[i].batched)
+            unbatched[scene.draws[i].primitive] = 1;
+    std::vector<int> keptViews, freedViews;
+    for (size_t i = 0; i < scene.primitives.size(); ++i)
+    {
+        if (!drawn[i] || unbatched[i])
+            primitive_views(doc, doc.primitiveJson[i], keptViews);
+        else
+        {
+            primitive_views(doc, doc.primitiveJson[i], freedViews);
+            glDeleteVertexArrays(1, &scene.primitives[i].vao);
+            scene.primitives[i].vao = 0;
+        }
+    }
+    std::vector<char> keep(doc.viewBuffers.size() + 1, 0);
+    for (size_t i = 0; i < keptViews.size(); ++i)
+        if (keptViews[i] >= 0 && keptViews[i] < (int) doc.viewBuffers.size())
+            keep[keptViews[i]] = 1;
+    for (size_t i = 0; i < freedViews.size(); ++i)
+    {
+        int view = freedViews[i];
+        if (view < 0 || view >= (int) doc.viewBuffers.size() || keep[view] || !doc.viewBuffers[view])
+            continue;
+        GLuint buffer = doc.viewBuffers[view];
+        glDeleteBuffers(1, &buffer);
+        scene.buffers.erase(std::find(scene.buffers.begin(), scene.buffers.end(), buffer));
+        keep[view] = 1;
+    }
+    stats->batchedDraws = (int) sources.size();
+    stats->batchChunks = batchStats.chunks;
+    stats->batchMs = elapsed_ms(start);
+}
+}
+
+bool gltf_load_glb(const char * path, TextureResidency & residency, GltfScene & scene, GltfStats * stats)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    GltfStats localStats;
+    if (!stats)
+        stats = &localStats;
+    memset(stats, 0, sizeof(*stats));
+
+    MappedFile file;
+    if (!map_file(file, path))
+        return false;
+    stats->bytes = file.size;
+
+    // 12 byte header then chunks of (length, type, data), JSON first
+    const unsigned int * header = (const unsigned int *) file.data;
+    if (file.size < 20 || header[0] != GLB_MAGIC || header[1] != 2 || (uint64_t) header[3] + 20 > file.size || header[4] != GLB_CHUNK_JSON)
+    {
+        fprintf(stderr, "%s is not a glTF 2.0 binary file\n", path);
+        unmap_file(file);
+        return false;
+    }
+    GltfDocument doc;
+    doc.stats = stats;
+    doc.bin = 0;
+    doc.binSize = 0;
+    const char * json = (const char *) (file.data + 20);
+    size_t binChunk = 20 + (((size_t) header[3] + 3) & ~(size_t) 3);
+    if (binChunk + 8 <= file.size)
+    {
+        const unsigned int * chunk = (const unsigned int *) (file.data + binChunk);
+        if (chunk[1] == GLB_CHUNK_BIN && (uint64_t) binChunk + 8 + chunk[0] <= file.size)
+        {
+            doc.bin = file.data + binChunk + 8;
+            doc.binSize = chunk[0];
+        }
+    }
+
+    JsonValue root = { json, json + header[3] };
+    json_index(root, "accessors", doc.accessors);
+    json_index(root, "bufferViews", doc.bufferViews);
+    json_index(root, "meshes", doc.meshes);
+    json_index(root, "materials", doc.materials);
+    json_index(root, "textures", doc.textures);
+    json_index(root, "images", doc.images);
+    json_index(root, "nodes", doc.nodes);
+    doc.viewBuffers.assign(doc.bufferViews.size(), 0);
+    stats->parseMs = elapsed_ms(start);
+
+    // Primitives, with the buffer views they use uploaded on the way
+    std::chrono::steady_clock::time_point uploadStart = std::chrono::steady_clock::now();
+    std::vector<int> meshPrimitives(doc.meshes.size()), meshPrimitiveCount(doc.meshes.size());
+    for (size_t m = 0; m < doc.meshes.size(); ++m)
+    {
+        meshPrimitives[m] = (int) scene.primitives.size();
+        JsonValue primitives;
+        if (json_member(doc.meshes[m], "primitives", primitives))
+            json_for_each(primitives, [&](JsonValue json)
+            {
+                GltfPrimitive primitive;
+                if (load_primitive(doc, scene, json, primitive))
+                {
+                    scene.primitives.push_back(primitive);
+                    doc.primitiveJson.push_back(json);
+                }
+                return true;
+            });
+        meshPrimitiveCount[m] = (int) scene.primitives.size() - meshPrimitives[m];
+    }
+    stats->uploadMs = elapsed_ms(uploadStart);
+
+    // Decode the images the materials use in parallel, then hand them to the residency manager
+    std::chrono::steady_clock::time_point imageStart = std::chrono::steady_clock::now();
+    std::string directory(path);
+    size_t slash = directory.find_last_of("/\\");
+    directory = slash == std::string::npos ? std::string() : directory.substr(0, slash + 1);
+    std::vector<int> materialImages(doc.materials.size() * 2);
+    std::vector<int> imageDecoded(doc.images.size(), -1);
+    std::vector<int> usedImages;
+    for (size_t i = 0; i < doc.materials.size(); ++i)
+    {
+        materialImages[i * 2] = texture_image(doc, doc.materials[i], "pbrMetallicRoughness", "baseColorTexture");
+        materialImages[i * 2 + 1] = texture_image(doc, doc.materials[i], "normalTexture", 0);
+        for (int j = 0; j < 2; ++j)
+        {
+            int image = materialImages[i * 2 + j];
+            if (image >= 0 && imageDecoded[image] == -1)
+            {
+                imageDecoded[image] = (int) usedImages.size();
+                usedImages.push_back(image);
+            }
+        }
+    }
+    std::vector<DecodedImage> decoded(usedImages.size());
+    parallel_for((int) usedImages.size(), 1, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; ++i)
+            decode_image(doc, usedImages[i], directory, decoded[i]);
+    });
+
+    // Metallic-roughness factors turned into a specular color and a Blinn-Phong
+    // exponent, the base color factor multiplied into the base color texture
+    std::vector<std::pair<unsigned int, int> > constants;
+    std::vector<std::pair<uint64_t, int> > tinted;
+    for (size_t i = 0; i <= doc.materials.size(); ++i)
+    {
+        JsonValue material = { "{}", 0 };
+        material.end = material.p + 2;
+        JsonValue pbr = material, value;
+        if (i < doc.materials.size())
+        {
+            material = doc.materials[i];
+            if (!json_member(material, "pbrMetallicRoughness", pbr))
+                pbr = material;
+        }
+        float baseColor[4] = { 1.f, 1.f, 1.f, 1.f };
+        if (json_member(pbr, "baseColorFactor", value))
+            json_floats(value, baseColor, 4);
+        float metallic = (float) json_number(pbr, "metallicFactor", 1.0);
+        float roughness = glm::clamp((float) json_number(pbr, "roughnessFactor", 1.0), 0.05f, 1.f);
+        float alpha = roughness * roughness;
+
+        GltfMaterial m;
+        int diffuseImage = i < doc.materials.size() ? materialImages[i * 2] : -1;
+        int normalImage = i < doc.materials.size() ? materialImages[i * 2 + 1] : -1;
+        glm::vec3 base(baseColor[0], baseColor[1], baseColor[2]);
+        m.diffuse = diffuseImage >= 0 ? tinted_texture(residency, tinted, decoded[imageDecoded[diffuseImage]], diffuseImage, base, stats) : -1;
+        if (m.diffuse < 0)
+            m.diffuse = constant_texture(residency, constants, base);
+        m.specular = constant_texture(residency, constants, glm::mix(glm::vec3(0.04f), base, metallic) * (1.f - roughness * 0.5f));
+        m.normal = normalImage >= 0 ? tinted_texture(residency, tinted, decoded[imageDecoded[normalImage]], normalImage, glm::vec3(1.f), stats) : -1;
+        if (m.normal < 0)
+            m.normal = constant_texture(residency, constants, glm::vec3(0.5f, 0.5f, 1.f));
+        m.specularPower = (int) glm::clamp(2.f / (alpha * alpha) - 2.f, 1.f, 256.f);
+        scene.materials.push_back(m);
+    }
+    int defaultMaterial = (int) doc.materials.size();
+    for (size_t i = 0; i < scene.primitives.size(); ++i)
+        if (scene.primitives[i].material < 0 || scene.primitives[i].material >= defaultMaterial)
+            scene.primitives[i].material = defaultMaterial;
+    for (size_t i = 0; i < decoded.size(); ++i)
+        if (decoded[i].pixels)
+            stbi_image_free(decoded[i].pixels);
+    stats->imageMs = elapsed_ms(imageStart);
+
+    // Node hierarchy of the default scene, every mesh once when there is no scene
+    JsonValue nodes;
+    std::vector<JsonValue> sceneList;
+    json_index(root, "scenes", sceneList);
+    int sceneIndex = json_int(root, "scene", 0);
+    if (sceneIndex >= 0 && sceneIndex < (int) sceneList.size() && json_member(sceneList[sceneIndex], "nodes", nodes))
+        json_for_each(nodes, [&](JsonValue node)
+        {
+            add_node(doc, meshPrimitives, meshPrimitiveCount, scene, (int) json_number(node, -1.0), glm::mat4(1.f), 0);
+            return true;
+        });
+    else
+        for (size_t i = 0; i < scene.primitives.size(); ++i)
+        {
+            GltfDraw draw = { (int) i, glm::mat4(1.f), false };
+            scene.draws.push_back(draw);
+        }
+
+    batch_draws(doc, scene, stats);
+
+    // Everything the GPU needs has been copied out of the mapping
+    unmap_file(file);
+    stats->totalMs = elapsed_ms(start);
+    return !scene.draws.empty();
+}
+
+void gltf_release(GltfScene & scene)
+{
+    for (size_t i = 0; i < scene.primitives.size(); ++i)
+        glDeleteVertexArrays(1, &scene.primitives[i].vao);
+    for (size_t i = 0; i < scene.batches.size(); ++i)
+        mesh_release(scene.batches[i].mesh);
+    if (!scene.buffers.empty())
+        glDeleteBuffers((GLsizei) scene.buffers.size(), &scene.buffers[0]);
+    scene.buffers.clear();
+    scene.primitives.clear();
+    scene.materials.clear();
+    scene.draws.clear();
+    scene.batches.clear();
+}
+
+int gltf_draw(const GltfScene & scene, const TextureResidency & residency, GLuint vertexProgram, GLint mvpLocation,
+              GLuint fragmentProgram, GLint specularPowerLocation, const glm::mat4 & viewProjection)
+{
+    // Node transforms go through the constant ObjectToWorld attributes, so
+    // that the world space position, normal and tangent are right too
+    glProgramUniformMatrix4fv(vertexProgram, mvpLocation, 1, 0, glm::value_ptr(viewProjection));
+    int drawCalls = 0;
+    for (size_t i = 0; i < scene.draws.size(); ++i)
+    {
+        const GltfDraw & draw = scene.draws[i];
+        if (draw.batched)
+            continue;
+        const GltfPrimitive & primitive = scene.primitives[draw.primitive];
+        const GltfMaterial & material = scene.materials[primitive.material];
+
+        for (int c = 0; c < 4; ++c)
+            glVertexAttrib4fv(4 + c, glm::value_ptr(draw.objectToWorld[c]));
+        glProgramUniform1i(fragmentProgram, specularPowerLocation, material.specularPower);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, residency_texture_id(residency, material.diffuse));
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, residency_texture_id(residency, material.specular));
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D, residency_texture_id(residency, material.normal));
+
+        // Constant values for the attributes the primitive does not have
+        if (!primitive.hasNormals)
+            glVertexAttrib3f(1, 0.f, 1.f, 0.f);
+        if (!primitive.hasUvs)
+            glVertexAttrib2f(2, 0.f, 0.f);
+        if (!primitive.hasTangents)
+            glVertexAttrib4f(3, 1.f, 0.f, 0.f, 1.f);
+
+        glBindVertexArray(primitive.vao);
+        if (primitive.indexType)
+            glDrawElements(primitive.mode, primitive.count, primitive.indexType, (void *) primitive.indexOffset);
+        else
+            glDrawArrays(primitive.mode, 0, primitive.count);
+        ++drawCalls;
+    }
+
+    // Batches are already in world space
+    mesh_identity_instance();
+    Frustum frustum;
+    frustum_from_matrix(viewProjection, frustum);
+    for (size_t i = 0; i < scene.batches.size(); ++i)
+    {
+        const GltfBatch & batch = scene.batches[i];
+        const GltfMaterial & material = scene.materials[batch.material];
+        bool bound = false;
+        for (size_t c = 0; c < batch.chunks.size(); )
+        {
+            if (!frustum_test_aabb(frustum, batch.chunks[c].boundsMin, batch.chunks[c].boundsMax))
+            {
+                ++c;
+                continue;
+            }
+            int firstIndex = batch.chunks[c].firstIndex;
+            int indexCount = 0;
+            for (; c < batch.chunks.size() && frustum_test_aabb(frustum, batch.chunks[c].boundsMin, batch.chunks[c].boundsMax); ++c)
+                indexCount += batch.chunks[c].indexCount;
+            if (!bound)
+            {
+                glProgramUniform1i(fragmentProgram, specularPowerLocation, material.specularPower);
+                glActiveTexture(GL_TEXTURE0);
+                glBindTexture(GL_TEXTURE_2D, residency_texture_id(residency, material.diffuse));
+                glActiveTexture(GL_TEXTURE1);
+                glBindTexture(GL_TEXTURE_2D, residency_texture_id(residency, material.specular));
+                glActiveTexture(GL_TEXTURE2);
+                glBindTexture(GL_TEXTURE_2D, residency_texture_id(residency, material.normal));
+                glBindVertexArray(batch.mesh.vao);
+                bound = true;
+            }
+            glDrawElements(GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, (void *) (firstIndex * sizeof(int)));
+            ++drawCalls;
+        }
+    }
+    glBindVertexArray(0);
+    return drawCalls;
+}
+
+void gltf_request_textures(const GltfScene & scene, TextureResidency & residency,
+                           const glm::vec3 & eye, float projectionScale, int viewportHeight)
+{
+    for (size_t i = 0; i < scene.draws.size(); ++i)
+    {
+        const GltfDraw & draw = scene.draws[i];
+        const GltfPrimitive & primitive = scene.primitives[draw.primitive];
+        const GltfMaterial & material = scene.materials[primitive.material];
+
+        // The uv range is assumed to span the primitive bounds
+        glm::vec3 center = glm::vec3(draw.objectToWorld * glm::vec4((primitive.boundsMin + primitive.boundsMax) * 0.5f, 1.f));
+        float worldSize = glm::length(glm::vec3(draw.objectToWorld * glm::vec4(primitive.boundsMax - primitive.boundsMin, 0.f)));
+        float distance = glm::length(eye - center);
+        int handles[3] = { material.diffuse, material.specular, material.normal };
+        for (int j = 0; j < 3; ++j)
+            residency_request(residency, handles[j],
+                              residency_estimate_mip(residency_texture_size(residency, handles[j]), worldSize, distance, projectionScale, viewportHeight));
+    }
+}
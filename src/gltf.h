@@ -0,0 +1,100 @@
+#ifndef AOGL_GLTF_H
+#define AOGL_GLTF_H
+
+#include <vector>
+
+#include "glew/glew.h"
+#include "glm/glm.hpp"
+
+#include "residency.h"
+#include "mesh.h"
+#include "batch.h"
+
+// One glTF primitive, attributes read in place from buffer view buffers
+// at the aogl.vert locations. Missing attributes are left disabled and
+// take the constant values set by gltf_draw.
+struct GltfPrimitive
+{
+    GLuint vao;
+    GLenum mode;
+    GLenum indexType;           // 0 when not indexed
+    GLsizei count;
+    size_t indexOffset;
+    int material;
+    bool hasNormals;
+    bool hasUvs;
+    bool hasTangents;
+    glm::vec3 boundsMin;
+    glm::vec3 boundsMax;
+};
+
+// glTF PBR inputs mapped onto the aogl.frag Blinn-Phong ones. Handles are
+// residency textures: base color, specular color and normal map.
+struct GltfMaterial
+{
+    int diffuse;
+    int specular;
+    int normal;
+    int specularPower;
+};
+
+struct GltfDraw
+{
+    int primitive;
+    glm::mat4 objectToWorld;
+    bool batched;               // drawn through a batch instead
+};
+
+// Static draws of one material merged at load, see static_batch_build
+struct GltfBatch
+{
+    GpuMesh mesh;
+    int material;
+    std::vector<BatchChunk> chunks;
+};
+
+struct GltfStats
+{
+    size_t bytes;
+    size_t uploadedBytes;
+    int bufferViews;
+    int images;
+    double parseMs;
+    double uploadMs;
+    double imageMs;
+    double batchMs;
+    double totalMs;
+    int batchedDraws;
+    int batchChunks;
+};
+
+struct GltfScene
+{
+    std::vector<GLuint> buffers;    // one per uploaded buffer view
+    std::vector<GltfPrimitive> primitives;
+    std::vector<GltfMaterial> materials;
+    std::vector<GltfDraw> draws;
+    std::vector<GltfBatch> batches;
+};
+
+// Loads a binary glTF 2.0 file. The file is memory-mapped, the JSON chunk is
+// walked in place without allocations per value, and the buffer views used
+// by the primitives are uploaded straight from the mapped binary chunk.
+// Triangle lists with attributes readable as floats are then batched per
+// material, and the buffers only they used are released.
+bool gltf_load_glb(const char * path, TextureResidency & residency, GltfScene & scene, GltfStats * stats);
+void gltf_release(GltfScene & scene);
+
+// Draws every node of the default scene with the bound pipeline, MVP set in
+// vertexProgram and the material in fragmentProgram, aogl.frag samplers 0
+// (Diffuse), 1 (Diffuse2) and 2 (NormalMap). Batch chunks outside the frustum
+// are skipped, neighbouring visible ones share a draw call.
+// Returns the number of draw calls.
+int gltf_draw(const GltfScene & scene, const TextureResidency & residency, GLuint vertexProgram, GLint mvpLocation,
+              GLuint fragmentProgram, GLint specularPowerLocation, const glm::mat4 & viewProjection);
+
+// Asks the residency manager for the mips the scene needs from this viewpoint
+void gltf_request_textures(const GltfScene & scene, TextureResidency & residency,
+                           const glm::vec3 & eye, float projectionScale, int viewportHeight);
+
+#endif // AOGL_GLTF_H
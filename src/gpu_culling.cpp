@@ -0,0 +1,206 @@
+#include "gpu_culling.h"
+
+#include <string.h>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+static const int CULL_GROUP_SIZE = 64;
+static const int PASS_CLASSIFY = 0;
+static const int PASS_SCATTER = 1;
+
+// std140 layout of CullParams in cull.comp
+struct CullParams
+{
+    glm::vec4 planes[6];
+    glm::vec4 eye;
+    glm::vec4 lodSphere;
+    glm::vec4 lodDistance[LOD_MAX_LEVELS];
+};
+
+// Draws block of cull.comp
+struct CullDraws
+{
+    DrawElementsIndirectCommand commands[LOD_MAX_LEVELS];
+    GLuint cursors[LOD_MAX_LEVELS];
+};
+
+static bool transform_less(const glm::mat4 & a, const glm::mat4 & b)
+{
+    return memcmp(&a, &b, sizeof(glm::mat4)) < 0;
+}
+
+bool gpu_culling_supported()
+{
+    // Binding layout qualifiers come with 4.2, some drivers do not list 420pack
+    return GLEW_ARB_compute_shader && GLEW_ARB_shader_storage_buffer_object
+        && (GLEW_VERSION_4_2 || GLEW_ARB_shading_language_420pack)
+        && GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance;
+}
+
+void gpu_culling_init(GpuCulling & culling, GLuint program)
+{
+    culling.program = program;
+    culling.instanceCountLocation = glGetUniformLocation(program, "InstanceCount");
+    culling.levelCountLocation = glGetUniformLocation(program, "LevelCount");
+    culling.passLocation = glGetUniformLocation(program, "Pass");
+    culling.instanceCount = 0;
+    culling.levelCount = 0;
+
+    GLuint buffers[6];
+    glGenBuffers(6, buffers);
+    culling.paramsBuffer = buffers[0];
+    culling.boundsBuffer = buffers[1];
+    culling.transformBuffer = buffers[2];
+    culling.visibleBuffer = buffers[3];
+    culling.drawBuffer = buffers[4];
+    culling.levelBuffer = buffers[5];
+
+    glBindBuffer(GL_UNIFORM_BUFFER, culling.paramsBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(CullParams), 0, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.drawBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(CullDraws), 0, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void gpu_culling_release(GpuCulling & culling)
+{
+    GLuint buffers[6] = { culling.paramsBuffer, culling.boundsBuffer, culling.transformBuffer,
+                          culling.visibleBuffer, culling.drawBuffer, culling.levelBuffer };
+    glDeleteBuffers(6, buffers);
+    glDeleteProgram(culling.program);
+}
+
+void gpu_culling_set_instances(GpuCulling & culling, const InstanceBounds & bounds, const glm::mat4 * transforms, int count)
+{
+    // Center and extent as two vec4 per instance
+    std::vector<glm::vec4> packed(count * 2);
+    for (int i = 0; i < count; ++i)
+    {
+        packed[i * 2] = glm::vec4(bounds.centerX[i], bounds.centerY[i], bounds.centerZ[i], 0.f);
+        packed[i * 2 + 1] = glm::vec4(bounds.extentX[i], bounds.extentY[i], bounds.extentZ[i], 0.f);
+    }
+    // Empty stores are not valid bindings
+    size_t size = std::max(count, 1) * sizeof(glm::mat4);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.boundsBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, size / 2, count ? &packed[0] : 0, GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.transformBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, size, transforms, GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.visibleBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, size, 0, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.levelBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, std::max(count, 1) * sizeof(GLuint), 0, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    culling.instanceCount = count;
+}
+
+void gpu_culling_dispatch(GpuCulling & culling, const LodChain & chain, const Frustum & frustum, const glm::vec3 & eye,
+                          float projectionScale, float viewportHeight, float pixelError)
+{
+    // lod_select inverted: level l is used from the distance where its
+    // error projects to pixelError, per unit of instance scale
+    CullParams params;
+    for (int i = 0; i < 6; ++i)
+        params.planes[i] = frustum.planes[i];
+    params.eye = glm::vec4(eye, 1.f);
+    params.lodSphere = glm::vec4(chain.center, chain.radius);
+    culling.levelCount = std::min((int) chain.levels.size(), LOD_MAX_LEVELS);
+    for (int l = 0; l < LOD_MAX_LEVELS; ++l)
+    {
+        float error = l < culling.levelCount ? chain.levels[l].error : 0.f;
+        params.lodDistance[l] = glm::vec4(error * projectionScale * viewportHeight * 0.5f / pixelError, 0.f, 0.f, 0.f);
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, culling.paramsBuffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(params), &params);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+    CullDraws draws;
+    memset(&draws, 0, sizeof(draws));
+    for (int l = 0; l < culling.levelCount; ++l)
+    {
+        draws.commands[l].count = chain.levels[l].triangleCount * 3;
+        draws.commands[l].firstIndex = chain.levels[l].indexOffset;
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.drawBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(draws), &draws);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    if (culling.instanceCount == 0)
+        return;
+    glUseProgram(culling.program);
+    glUniform1i(culling.instanceCountLocation, culling.instanceCount);
+    glUniform1i(culling.levelCountLocation, culling.levelCount);
+    glBindBufferBase(GL_UNIFORM_BUFFER, 0, culling.paramsBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, culling.boundsBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, culling.transformBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, culling.visibleBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, culling.drawBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, culling.levelBuffer);
+    GLuint groups = (culling.instanceCount + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE;
+    glUniform1i(culling.passLocation, PASS_CLASSIFY);
+    glDispatchCompute(groups, 1, 1);
+    // Scatter offsets need every count of the first pass
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    glUniform1i(culling.passLocation, PASS_SCATTER);
+    glDispatchCompute(groups, 1, 1);
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+    for (int i = 0; i < 5; ++i)
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, i, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, 0, 0);
+}
+
+void gpu_culling_draw(const GpuCulling & culling, GpuMesh & mesh)
+{
+    if (culling.instanceCount == 0 || culling.levelCount == 0)
+        return;
+    mesh_bind_instances(mesh, culling.visibleBuffer, 0);
+    glBindVertexArray(mesh.vao);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, culling.drawBuffer);
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, 0, culling.levelCount, sizeof(DrawElementsIndirectCommand));
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    glBindVertexArray(0);
+}
+
+int gpu_culling_compare(const GpuCulling & culling, const LodChain & chain, const InstanceBounds & bounds,
+                        const glm::mat4 * transforms, const Frustum & frustum, const glm::vec3 & eye,
+                        float projectionScale, float viewportHeight, float pixelError)
+{
+    int count = culling.instanceCount;
+    if (count == 0)
+        return 0;
+    std::vector<glm::mat4> visible(count);
+    std::vector<glm::mat4> sorted(count);
+    LodInstances instances;
+    InstanceBounds scratch = bounds;
+    int visibleCount = frustum_cull_instances(frustum, scratch, 0, transforms, &visible[0], 0);
+    lod_sort_instances(chain, &visible[0], visibleCount, eye, projectionScale, viewportHeight, pixelError,
+                       &sorted[0], instances);
+
+    CullDraws draws;
+    std::vector<glm::mat4> gpuVisible(count);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.drawBuffer);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(draws), &draws);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.visibleBuffer);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, count * sizeof(glm::mat4), &gpuVisible[0]);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    // Order inside a level depends on the atomics, compare them as sets
+    int mismatches = 0;
+    std::vector<glm::mat4> difference;
+    for (int l = 0; l < culling.levelCount; ++l)
+    {
+        const DrawElementsIndirectCommand & command = draws.commands[l];
+        if (command.baseInstance + command.instanceCount > (GLuint) count)
+            return count;
+        glm::mat4 * cpuFirst = &sorted[0] + instances.first[l];
+        glm::mat4 * gpuFirst = &gpuVisible[0] + command.baseInstance;
+        std::sort(cpuFirst, cpuFirst + instances.count[l], transform_less);
+        std::sort(gpuFirst, gpuFirst + command.instanceCount, transform_less);
+        difference.clear();
+        std::set_symmetric_difference(cpuFirst, cpuFirst + instances.count[l], gpuFirst, gpuFirst + command.instanceCount,
+                                      std::back_inserter(difference), transform_less);
+        mismatches += (int) difference.size();
+    }
+    return mismatches;
+}
@@ -0,0 +1,68 @@
+#ifndef AOGL_GPU_CULLING_H
+#define AOGL_GPU_CULLING_H
+
+#include "glew/glew.h"
+#include "glm/glm.hpp"
+
+#include "culling.h"
+#include "lod.h"
+#include "mesh.h"
+
+// Layout read by glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand
+{
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+// GPU driven version of frustum_cull_instances followed by
+// lod_sort_instances. cull.comp classifies every instance, counting them
+// per level in the draw commands, then a second pass appends the visible
+// transforms grouped by level. Nothing comes back to the CPU.
+struct GpuCulling
+{
+    GLuint program;
+    GLuint paramsBuffer;        // frustum planes, eye and level distances
+    GLuint boundsBuffer;        // world space center and extent per instance
+    GLuint transformBuffer;
+    GLuint visibleBuffer;       // instance attributes of the draws
+    GLuint drawBuffer;          // one command per level, then the append cursors
+    GLuint levelBuffer;         // level of every instance, or culled
+    GLint instanceCountLocation;
+    GLint levelCountLocation;
+    GLint passLocation;
+    int instanceCount;
+    int levelCount;
+};
+
+// Compute shaders, storage buffers, multi draw indirect and base instance,
+// core in GL 4.3 and exposed as extensions by recent drivers, llvmpipe included
+bool gpu_culling_supported();
+
+// program is linked from cull.comp
+void gpu_culling_init(GpuCulling & culling, GLuint program);
+void gpu_culling_release(GpuCulling & culling);
+
+// Uploads bounds and transforms, only needed when the instances change
+void gpu_culling_set_instances(GpuCulling & culling, const InstanceBounds & bounds, const glm::mat4 * transforms, int count);
+
+// Resets the draw commands from the chain and dispatches both passes.
+// Level selection matches lod_select.
+void gpu_culling_dispatch(GpuCulling & culling, const LodChain & chain, const Frustum & frustum, const glm::vec3 & eye,
+                          float projectionScale, float viewportHeight, float pixelError);
+
+// Draws every level with a single glMultiDrawElementsIndirect, mesh must
+// hold the indices of the chain
+void gpu_culling_draw(const GpuCulling & culling, GpuMesh & mesh);
+
+// Reads back the last dispatch and runs the CPU path on the same inputs.
+// Returns the number of transforms found by only one of them at some level,
+// 0 when both agree. Stalls the pipeline, for tests only.
+int gpu_culling_compare(const GpuCulling & culling, const LodChain & chain, const InstanceBounds & bounds,
+                        const glm::mat4 * transforms, const Frustum & frustum, const glm::vec3 & eye,
+                        float projectionScale, float viewportHeight, float pixelError);
+
+#endif // AOGL_GPU_CULLING_H
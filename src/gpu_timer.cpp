@@ -0,0 +1,49 @@
+#include "gpu_timer.h"
+
+void gpu_timer_init(GpuTimer & timer)
+{
+    glGenQueries(GPU_TIMER_QUERIES, timer.queries);
+    for (int i = 0; i < GPU_TIMER_QUERIES; ++i)
+        timer.pending[i] = false;
+    timer.next = 0;
+    timer.active = false;
+    timer.ms = 0.0;
+}
+
+void gpu_timer_release(GpuTimer & timer)
+{
+    glDeleteQueries(GPU_TIMER_QUERIES, timer.queries);
+}
+
+void gpu_timer_begin(GpuTimer & timer)
+{
+    // The oldest query comes back first, a frame is skipped when it is still
+    // in flight rather than waiting for it
+    GLuint query = timer.queries[timer.next];
+    if (timer.pending[timer.next])
+    {
+        GLuint available = 0;
+        glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+        {
+            timer.active = false;
+            return;
+        }
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+        timer.ms = elapsed / 1000000.0;
+        timer.pending[timer.next] = false;
+    }
+    glBeginQuery(GL_TIME_ELAPSED, query);
+    timer.active = true;
+}
+
+void gpu_timer_end(GpuTimer & timer)
+{
+    if (!timer.active)
+        return;
+    glEndQuery(GL_TIME_ELAPSED);
+    timer.pending[timer.next] = true;
+    timer.next = (timer.next + 1) % GPU_TIMER_QUERIES;
+    timer.active = false;
+}
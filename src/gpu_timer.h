@@ -0,0 +1,25 @@
+#ifndef AOGL_GPU_TIMER_H
+#define AOGL_GPU_TIMER_H
+
+#include "glew/glew.h"
+
+const int GPU_TIMER_QUERIES = 4;
+
+// GPU time of a range of commands from GL_TIME_ELAPSED queries. Results
+// are picked up a few frames later so that reading them never stalls.
+// Ranges of different timers cannot overlap.
+struct GpuTimer
+{
+    GLuint queries[GPU_TIMER_QUERIES];
+    bool pending[GPU_TIMER_QUERIES];
+    int next;
+    bool active;
+    double ms;              // latest result
+};
+
+void gpu_timer_init(GpuTimer & timer);
+void gpu_timer_release(GpuTimer & timer);
+void gpu_timer_begin(GpuTimer & timer);
+void gpu_timer_end(GpuTimer & timer);
+
+#endif // AOGL_GPU_TIMER_H
@@ -0,0 +1,104 @@
+#include "ground.h"
+
+#include <vector>
+
+#include "glm/gtc/type_ptr.hpp"
+
+void ground_init(Ground & ground, GLuint program, float size, int patchesPerSide, float height)
+{
+    // Corners shared between patches so their edges match exactly
+    int side = patchesPerSide + 1;
+    std::vector<float> positions;
+    for (int z = 0; z < side; ++z)
+        for (int x = 0; x < side; ++x)
+        {
+            positions.push_back((x / (float) patchesPerSide - 0.5f) * size);
+            positions.push_back(height);
+            positions.push_back((z / (float) patchesPerSide - 0.5f) * size);
+        }
+    std::vector<int> indices;
+    for (int z = 0; z < patchesPerSide; ++z)
+        for (int x = 0; x < patchesPerSide; ++x)
+        {
+            int corner = z * side + x;
+            indices.push_back(corner);
+            indices.push_back(corner + 1);
+            indices.push_back(corner + side + 1);
+            indices.push_back(corner + side);
+        }
+    ground.patchCount = patchesPerSide * patchesPerSide;
+
+    glGenVertexArrays(1, &ground.vao);
+    glGenBuffers(2, ground.vbo);
+    glBindVertexArray(ground.vao);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ground.vbo[0]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(int), &indices[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, ground.vbo[1]);
+    glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(float), &positions[0], GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 3, (void*)0);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    ground.program = program;
+    ground.mvpLocation = glGetUniformLocation(program, "MVP");
+    ground.planesLocation = glGetUniformLocation(program, "Planes");
+    ground.cameraLocation = glGetUniformLocation(program, "Camera");
+    ground.amplitudeLocation = glGetUniformLocation(program, "Amplitude");
+    ground.projectionScaleLocation = glGetUniformLocation(program, "ProjectionScale");
+    ground.viewportHeightLocation = glGetUniformLocation(program, "ViewportHeight");
+    ground.pixelsPerEdgeLocation = glGetUniformLocation(program, "PixelsPerEdge");
+    ground.texScaleLocation = glGetUniformLocation(program, "TexScale");
+    glGenQueries(1, &ground.primitivesQuery);
+    ground.queryPending = false;
+    ground.triangles = 0;
+}
+
+void ground_release(Ground & ground)
+{
+    glDeleteQueries(1, &ground.primitivesQuery);
+    glDeleteBuffers(2, ground.vbo);
+    glDeleteVertexArrays(1, &ground.vao);
+}
+
+void ground_draw(Ground & ground, const GroundSettings & settings, const glm::mat4 & viewProjection,
+                 const glm::vec3 & eye, float projectionScale, float viewportHeight)
+{
+    Frustum frustum;
+    frustum_from_matrix(viewProjection, frustum);
+    GLuint program = ground.program;
+    glProgramUniformMatrix4fv(program, ground.mvpLocation, 1, 0, glm::value_ptr(viewProjection));
+    glProgramUniform4fv(program, ground.planesLocation, 6, glm::value_ptr(frustum.planes[0]));
+    glProgramUniform3f(program, ground.cameraLocation, eye.x, eye.y, eye.z);
+    glProgramUniform1f(program, ground.amplitudeLocation, settings.amplitude);
+    glProgramUniform1f(program, ground.projectionScaleLocation, projectionScale);
+    glProgramUniform1f(program, ground.viewportHeightLocation, viewportHeight);
+    glProgramUniform1f(program, ground.pixelsPerEdgeLocation, settings.pixelsPerEdge);
+    glProgramUniform1f(program, ground.texScaleLocation, settings.texScale);
+
+    // Only one query in flight, its result is picked up once available
+    if (ground.queryPending)
+    {
+        GLuint available = 0;
+        glGetQueryObjectuiv(ground.primitivesQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available)
+        {
+            glGetQueryObjectuiv(ground.primitivesQuery, GL_QUERY_RESULT, &ground.triangles);
+            ground.queryPending = false;
+        }
+    }
+    if (!ground.queryPending)
+        glBeginQuery(GL_PRIMITIVES_GENERATED, ground.primitivesQuery);
+
+    glPatchParameteri(GL_PATCH_VERTICES, 4);
+    glBindVertexArray(ground.vao);
+    glDrawElements(GL_PATCHES, ground.patchCount * 4, GL_UNSIGNED_INT, (void*)0);
+    glBindVertexArray(0);
+
+    if (!ground.queryPending)
+    {
+        glEndQuery(GL_PRIMITIVES_GENERATED);
+        ground.queryPending = true;
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef AOGL_GROUND_H
+#define AOGL_GROUND_H
+
+#include "glew/glew.h"
+#include "glm/glm.hpp"
+
+#include "culling.h"
+
+// Square grid of quad patches on the xz plane, tessellated by ground.tesc
+// from the screen size of their edges and displaced by ground.tese. Patches
+// outside the frustum are dropped before tessellation, so the vertex count
+// follows the view rather than the extent of the ground.
+struct Ground
+{
+    GLuint vao;
+    GLuint vbo[2];          // indices, positions
+    int patchCount;
+    GLuint program;
+    GLint mvpLocation;
+    GLint planesLocation;
+    GLint cameraLocation;
+    GLint amplitudeLocation;
+    GLint projectionScaleLocation;
+    GLint viewportHeightLocation;
+    GLint pixelsPerEdgeLocation;
+    GLint texScaleLocation;
+    GLuint primitivesQuery;
+    bool queryPending;
+    unsigned int triangles;     // generated by the last finished query
+};
+
+struct GroundSettings
+{
+    float amplitude;        // hills reach height +- amplitude
+    float pixelsPerEdge;    // target on-screen length of a tessellated edge
+    float texScale;         // uv per world unit
+};
+
+// program is the separable program of ground.vert, ground.tesc and ground.tese,
+// owned by the caller
+void ground_init(Ground & ground, GLuint program, float size, int patchesPerSide, float height);
+void ground_release(Ground & ground);
+
+// Draws with the pipeline the caller bound, program and aogl.frag, and counts
+// the generated triangles, read back without stalling a few frames later
+void ground_draw(Ground & ground, const GroundSettings & settings, const glm::mat4 & viewProjection,
+                 const glm::vec3 & eye, float projectionScale, float viewportHeight);
+
+#endif // AOGL_GROUND_H
@@ -0,0 +1,88 @@
+#include "hash.h"
+
+#include <string.h>
+
+static const uint64_t PRIME1 = 11400714785074694791ULL;
+static const uint64_t PRIME2 = 14029467366897019727ULL;
+static const uint64_t PRIME3 = 1609587929392839161ULL;
+static const uint64_t PRIME4 = 9650029242287828579ULL;
+static const uint64_t PRIME5 = 2870177450012600261ULL;
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char * p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char * p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static inline uint64_t merge(uint64_t acc, uint64_t v)
+{
+    acc ^= hash_round(0, v);
+    return acc * PRIME1 + PRIME4;
+}
+
+uint64_t hash_bytes(const void * data, size_t size, uint64_t seed)
+{
+    const unsigned char * p = (const unsigned char *) data;
+    const unsigned char * end = p + size;
+    uint64_t h;
+    if (size >= 32)
+    {
+        uint64_t v1 = seed + PRIME1 + PRIME2;
+        uint64_t v2 = seed + PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME1;
+        const unsigned char * limit = end - 32;
+        do
+        {
+            v1 = hash_round(v1, read64(p)); p += 8;
+            v2 = hash_round(v2, read64(p)); p += 8;
+            v3 = hash_round(v3, read64(p)); p += 8;
+            v4 = hash_round(v4, read64(p)); p += 8;
+        } while (p <= limit);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(h, v1);
+        h = merge(h, v2);
+        h = merge(h, v3);
+        h = merge(h, v4);
+    }
+    else
+        h = seed + PRIME5;
+    h += (uint64_t) size;
+
+    for (; p + 8 <= end; p += 8)
+        h = rotl(h ^ hash_round(0, read64(p)), 27) * PRIME1 + PRIME4;
+    if (p + 4 <= end)
+    {
+        h = rotl(h ^ (read32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; ++p)
+        h = rotl(h ^ (*p * PRIME5), 11) * PRIME1;
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
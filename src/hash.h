@@ -0,0 +1,10 @@
+#ifndef AOGL_HASH_H
+#define AOGL_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 64-bit content hash (xxHash64), reads 32 bytes per iteration
+uint64_t hash_bytes(const void * data, size_t size, uint64_t seed);
+
+#endif // AOGL_HASH_H
@@ -0,0 +1,480 @@
+#include "ibl.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <xmmintrin.h>
+
+#include "glm/gtc/type_ptr.hpp"
+
+#include "stb/stb_image.h"
+#include "parallel.h"
+#include "timer.h"
+
+namespace
+{
+
+const int IBL_CACHE_VERSION = 1;
+const float PI = 3.14159265f;
+
+struct IblCacheHeader
+{
+    char magic[4];
+    int version;
+    int width;
+    int levels;
+    int samples;
+    long long sourceSize;
+    long long sourceTime;
+};
+
+float radical_inverse(int i)
+{
+    unsigned int bits = (unsigned int) i;
+    bits = (bits << 16) | (bits >> 16);
+    bits = ((bits & 0x55555555u) << 1) | ((bits & 0xAAAAAAAAu) >> 1);
+    bits = ((bits & 0x33333333u) << 2) | ((bits & 0xCCCCCCCCu) >> 2);
+    bits = ((bits & 0x0F0F0F0Fu) << 4) | ((bits & 0xF0F0F0F0u) >> 4);
+    bits = ((bits & 0x00FF00FFu) << 8) | ((bits & 0xFF00FF00u) >> 8);
+    return bits * 2.3283064365386963e-10f;
+}
+
+glm::vec3 texel_direction(int x, int y, int width, int height)
+{
+    float theta = (y + 0.5f) / height * PI;
+    float phi = (x + 0.5f) / width * 2.f * PI - PI;
+    return glm::vec3(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi));
+}
+
+glm::vec3 bilinear(const IblImage & image, float u, float v)
+{
+    float x = u * image.width - 0.5f;
+    float y = std::min(std::max(v * image.height - 0.5f, 0.f), image.height - 1.f);
+    int x0 = (int) floorf(x);
+    int y0 = (int) y;
+    float fx = x - x0;
+    float fy = y - y0;
+    x0 = ((x0 % image.width) + image.width) % image.width;
+    int x1 = (x0 + 1) % image.width;
+    int y1 = std::min(y0 + 1, image.height - 1);
+    const float * p00 = &image.rgb[(y0 * image.width + x0) * 3];
+    const float * p10 = &image.rgb[(y0 * image.width + x1) * 3];
+    const float * p01 = &image.rgb[(y1 * image.width + x0) * 3];
+    const float * p11 = &image.rgb[(y1 * image.width + x1) * 3];
+    glm::vec3 result;
+    for (int c = 0; c < 3; ++c)
+        result[c] = (p00[c] * (1.f - fx) + p10[c] * fx) * (1.f - fy) + (p01[c] * (1.f - fx) + p11[c] * fx) * fy;
+    return result;
+}
+
+// Trilinear lookup in the box filtered pyramid of the source
+glm::vec3 sample_pyramid(const std::vector<IblImage> & pyramid, const glm::vec3 & d, float lod)
+{
+    float u = atan2f(d.z, d.x) / (2.f * PI) + 0.5f;
+    float v = acosf(std::min(std::max(d.y, -1.f), 1.f)) / PI;
+    lod = std::min(std::max(lod, 0.f), pyramid.size() - 1.f);
+    int level = (int) lod;
+    float f = lod - level;
+    glm::vec3 result = bilinear(pyramid[level], u, v);
+    if (f > 0.f && level + 1 < (int) pyramid.size())
+        result = result * (1.f - f) + bilinear(pyramid[level + 1], u, v) * f;
+    return result;
+}
+
+void downsample(const IblImage & source, IblImage & target)
+{
+    target.width = std::max(source.width / 2, 1);
+    target.height = std::max(source.height / 2, 1);
+    target.rgb.resize(target.width * target.height * 3);
+    for (int y = 0; y < target.height; ++y)
+        for (int x = 0; x < target.width; ++x)
+            for (int c = 0; c < 3; ++c)
+            {
+                int x0 = std::min(x * 2, source.width - 1), x1 = std::min(x * 2 + 1, source.width - 1);
+                int y0 = std::min(y * 2, source.height - 1), y1 = std::min(y * 2 + 1, source.height - 1);
+                target.rgb[(y * target.width + x) * 3 + c] = 0.25f * (source.rgb[(y0 * source.width + x0) * 3 + c]
+                    + source.rgb[(y0 * source.width + x1) * 3 + c] + source.rgb[(y1 * source.width + x0) * 3 + c]
+                    + source.rgb[(y1 * source.width + x1) * 3 + c]);
+            }
+}
+
+// Sums Y_k(d) * radiance over one row of the equirectangular image, 4 texels
+// at a time. r, g, b, cosPhi and sinPhi are padded with zeros to a multiple
+// of 4.
+void project_row(const float * r, const float * g, const float * b, const float * cosPhi, const float * sinPhi,
+                 int paddedWidth, float sinTheta, float cosTheta, float * sums)
+{
+    __m128 acc[27];
+    for (int k = 0; k < 27; ++k)
+        acc[k] = _mm_setzero_ps();
+    const __m128 st = _mm_set1_ps(sinTheta);
+    const __m128 y = _mm_set1_ps(cosTheta);
+    const __m128 c1 = _mm_set1_ps(0.488603f);
+    const __m128 c4 = _mm_set1_ps(1.092548f);
+    const __m128 c6 = _mm_set1_ps(0.315392f);
+    const __m128 c8 = _mm_set1_ps(0.546274f);
+    const __m128 three = _mm_set1_ps(3.f);
+    const __m128 one = _mm_set1_ps(1.f);
+    __m128 basis[9];
+    basis[0] = _mm_set1_ps(0.282095f);
+    basis[1] = _mm_mul_ps(c1, y);
+    for (int x = 0; x < paddedWidth; x += 4)
+    {
+        __m128 dx = _mm_mul_ps(st, _mm_loadu_ps(cosPhi + x));
+        __m128 dz = _mm_mul_ps(st, _mm_loadu_ps(sinPhi + x));
+        basis[2] = _mm_mul_ps(c1, dz);
+        basis[3] = _mm_mul_ps(c1, dx);
+        basis[4] = _mm_mul_ps(c4, _mm_mul_ps(dx, y));
+        basis[5] = _mm_mul_ps(c4, _mm_mul_ps(y, dz));
+        basis[6] = _mm_mul_ps(c6, _mm_sub_ps(_mm_mul_ps(three, _mm_mul_ps(dz, dz)), one));
+        basis[7] = _mm_mul_ps(c4, _mm_mul_ps(dx, dz));
+        basis[8] = _mm_mul_ps(c8, _mm_sub_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(y, y)));
+        __m128 cr = _mm_loadu_ps(r + x), cg = _mm_loadu_ps(g + x), cb = _mm_loadu_ps(b + x);
+        for (int k = 0; k < 9; ++k)
+        {
+            acc[k * 3 + 0] = _mm_add_ps(acc[k * 3 + 0], _mm_mul_ps(basis[k], cr));
+            acc[k * 3 + 1] = _mm_add_ps(acc[k * 3 + 1], _mm_mul_ps(basis[k], cg));
+            acc[k * 3 + 2] = _mm_add_ps(acc[k * 3 + 2], _mm_mul_ps(basis[k], cb));
+        }
+    }
+    for (int k = 0; k < 27; ++k)
+    {
+        float lanes[4];
+        _mm_storeu_ps(lanes, acc[k]);
+        sums[k] = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    }
+}
+
+// Gradient from the ground to the zenith, with a sun away from sunDirection
+void sky(int width, int height, const glm::vec3 & sunDirection, IblImage & image)
+{
+    static const glm::vec3 zenith(0.15f, 0.3f, 0.8f);
+    static const glm::vec3 horizon(0.7f, 0.75f, 0.85f);
+    static const glm::vec3 ground(0.2f, 0.18f, 0.15f);
+    static const glm::vec3 sunColor(1.f, 0.9f, 0.75f);
+    glm::vec3 sun = -glm::normalize(sunDirection);
+    float sunCos = cosf(1.5f * PI / 180.f);
+    image.width = width;
+    image.height = height;
+    image.rgb.resize(width * height * 3);
+    parallel_for(height, 8, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; ++y)
+            for (int x = 0; x < width; ++x)
+            {
+                glm::vec3 d = texel_direction(x, y, width, height);
+                glm::vec3 color;
+                if (d.y >= 0.f)
+                    color = horizon + (zenith - horizon) * sqrtf(d.y);
+                else
+                    color = ground + (horizon - ground) * expf(d.y * 20.f);
+                float c = glm::dot(d, sun);
+                color += sunColor * (powf(std::max(c, 0.f), 64.f) * 2.f + (c > sunCos ? 200.f : 0.f));
+                memcpy(&image.rgb[(y * width + x) * 3], &color[0], sizeof(color));
+            }
+    });
+}
+
+void project_sh(const IblImage & image, glm::vec3 * sh)
+{
+    int width = image.width, height = image.height;
+    int paddedWidth = (width + 3) & ~3;
+    std::vector<float> cosPhi(paddedWidth, 0.f), sinPhi(paddedWidth, 0.f);
+    for (int x = 0; x < width; ++x)
+    {
+        float phi = (x + 0.5f) / width * 2.f * PI - PI;
+        cosPhi[x] = cosf(phi);
+        sinPhi[x] = sinf(phi);
+    }
+
+    // Rows on the worker threads, each with its own sums so the result does
+    // not depend on the split
+    std::vector<float> rowSums(height * 27);
+    parallel_for(height, 16, [&](int begin, int end)
+    {
+        std::vector<float> planes(paddedWidth * 3, 0.f);
+        for (int y = begin; y < end; ++y)
+        {
+            const float * row = &image.rgb[y * width * 3];
+            for (int x = 0; x < width; ++x)
+            {
+                planes[x] = row[x * 3];
+                planes[paddedWidth + x] = row[x * 3 + 1];
+                planes[paddedWidth * 2 + x] = row[x * 3 + 2];
+            }
+            float theta = (y + 0.5f) / height * PI;
+            project_row(&planes[0], &planes[paddedWidth], &planes[paddedWidth * 2], &cosPhi[0], &sinPhi[0],
+                        paddedWidth, sinf(theta), cosf(theta), &rowSums[y * 27]);
+        }
+    });
+
+    // Texel solid angle, then the cosine lobe convolution per band divided
+    // by pi, so that sh gives the radiance leaving a white Lambert surface
+    double total[27] = {};
+    for (int y = 0; y < height; ++y)
+    {
+        double solidAngle = (2.0 * PI / width) * (PI / height) * sin((y + 0.5) / height * PI);
+        for (int k = 0; k < 27; ++k)
+            total[k] += rowSums[y * 27 + k] * solidAngle;
+    }
+    static const float bands[9] = { 1.f, 2.f / 3.f, 2.f / 3.f, 2.f / 3.f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f };
+    for (int k = 0; k < 9; ++k)
+        sh[k] = glm::vec3((float) total[k * 3], (float) total[k * 3 + 1], (float) total[k * 3 + 2]) * bands[k];
+}
+
+// Level i of the prefiltered chain is the environment under a Phong lobe of
+// this power, level 0 being a plain resample
+float level_power(int level)
+{
+    return powf(2.f, 11.f - 2.f * level);
+}
+
+void prefilter(const IblImage & image, const IblSettings & settings, std::vector<IblImage> & levels)
+{
+    std::vector<IblImage> pyramid(1, image);
+    while (pyramid.back().width > 4 && pyramid.back().height > 2)
+    {
+        pyramid.push_back(IblImage());
+        downsample(pyramid[pyramid.size() - 2], pyramid.back());
+    }
+    float texelSolidAngle = 4.f * PI / (image.width * image.height);
+
+    levels.resize(settings.levels);
+    for (int i = 0; i < settings.levels; ++i)
+    {
+        IblImage & level = levels[i];
+        level.width = settings.width >> i;
+        level.height = settings.width >> (i + 1);
+        level.rgb.resize(level.width * level.height * 3);
+
+        // Phong lobe samples around +z, each read from the pyramid level
+        // whose texels cover its share of the lobe
+        float power = level_power(i);
+        int sampleCount = i == 0 ? 1 : settings.samples;
+        std::vector<glm::vec3> directions(sampleCount);
+        std::vector<float> lods(sampleCount);
+        for (int s = 0; s < sampleCount; ++s)
+        {
+            float u = (s + 0.5f) / sampleCount;
+            float cosTheta = i == 0 ? 1.f : powf(u, 1.f / (power + 1.f));
+            float sinTheta = sqrtf(std::max(0.f, 1.f - cosTheta * cosTheta));
+            float phi = 2.f * PI * radical_inverse(s);
+            directions[s] = glm::vec3(sinTheta * cosf(phi), sinTheta * sinf(phi), cosTheta);
+            float pdf = (power + 1.f) / (2.f * PI) * powf(cosTheta, power);
+            float sampleSolidAngle = 1.f / (sampleCount * pdf);
+            lods[s] = i == 0 ? log2f(std::max((float) image.width / level.width, 1.f))
+                             : std::max(0.5f * log2f(sampleSolidAngle / texelSolidAngle) + 1.f, 0.f);
+        }
+
+        parallel_for(level.height, 1, [&](int begin, int end)
+        {
+            for (int y = begin; y < end; ++y)
+                for (int x = 0; x < level.width; ++x)
+                {
+                    glm::vec3 n = texel_direction(x, y, level.width, level.height);
+                    glm::vec3 t = glm::normalize(glm::cross(fabsf(n.y) < 0.99f ? glm::vec3(0.f, 1.f, 0.f) : glm::vec3(1.f, 0.f, 0.f), n));
+                    glm::vec3 b = glm::cross(n, t);
+                    glm::vec3 sum(0.f);
+                    for (int s = 0; s < sampleCount; ++s)
+                    {
+                        const glm::vec3 & d = directions[s];
+                        sum += sample_pyramid(pyramid, t * d.x + b * d.y + n * d.z, lods[s]);
+                    }
+                    sum /= (float) sampleCount;
+                    memcpy(&level.rgb[(y * level.width + x) * 3], &sum[0], sizeof(sum));
+                }
+        });
+    }
+}
+
+void upload(Ibl & ibl)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    glBindTexture(GL_TEXTURE_2D, ibl.texture);
+    for (size_t i = 0; i < ibl.levels.size(); ++i)
+        glTexImage2D(GL_TEXTURE_2D, (GLint) i, GL_RGB16F, ibl.levels[i].width, ibl.levels[i].height, 0, GL_RGB, GL_FLOAT,
+                     &ibl.levels[i].rgb[0]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint) ibl.levels.size() - 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    ibl.stats.uploadMs = elapsed_ms(start);
+}
+
+void bake(Ibl & ibl, const IblImage & source)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    project_sh(source, ibl.sh);
+    ibl.stats.shMs = elapsed_ms(start);
+    start = std::chrono::steady_clock::now();
+    prefilter(source, ibl.settings, ibl.levels);
+    ibl.stats.prefilterMs = elapsed_ms(start);
+    ibl.stats.cached = false;
+}
+
+bool load_cache(Ibl & ibl, const std::string & path, const struct stat & sourceStat)
+{
+    FILE * f = fopen(path.c_str(), "rb");
+    if (!f)
+        return false;
+    IblCacheHeader header;
+    bool valid = fread(&header, sizeof(header), 1, f) == 1
+        && memcmp(header.magic, "AOIB", 4) == 0
+        && header.version == IBL_CACHE_VERSION
+        && header.width == ibl.settings.width
+        && header.levels == ibl.settings.levels
+        && header.samples == ibl.settings.samples
+        && header.sourceSize == (long long) sourceStat.st_size
+        && header.sourceTime == (long long) sourceStat.st_mtime;
+    std::vector<IblImage> levels(ibl.settings.levels);
+    glm::vec3 sh[9];
+    valid = valid && fread(sh, sizeof(sh), 1, f) == 1;
+    for (int i = 0; valid && i < ibl.settings.levels; ++i)
+    {
+        levels[i].width = ibl.settings.width >> i;
+        levels[i].height = ibl.settings.width >> (i + 1);
+        levels[i].rgb.resize(levels[i].width * levels[i].height * 3);
+        valid = fread(&levels[i].rgb[0], sizeof(float), levels[i].rgb.size(), f) == levels[i].rgb.size();
+    }
+    fclose(f);
+    if (!valid)
+        return false;
+    std::copy(sh, sh + 9, ibl.sh);
+    ibl.levels.swap(levels);
+    return true;
+}
+
+// Written next to the final name then renamed, so readers never see half a bake
+void save_cache(const Ibl & ibl, const std::string & path, const struct stat & sourceStat)
+{
+    std::string tmp = path + ".tmp";
+    FILE * f = fopen(tmp.c_str(), "wb");
+    if (!f)
+        return;
+    IblCacheHeader header;
+    memcpy(header.magic, "AOIB", 4);
+    header.version = IBL_CACHE_VERSION;
+    header.width = ibl.settings.width;
+    header.levels = ibl.settings.levels;
+    header.samples = ibl.settings.samples;
+    header.sourceSize = (long long) sourceStat.st_size;
+    header.sourceTime = (long long) sourceStat.st_mtime;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+        && fwrite(ibl.sh, sizeof(ibl.sh), 1, f) == 1;
+    for (size_t i = 0; ok && i < ibl.levels.size(); ++i)
+        ok = fwrite(&ibl.levels[i].rgb[0], sizeof(float), ibl.levels[i].rgb.size(), f) == ibl.levels[i].rgb.size();
+    ok = fclose(f) == 0 && ok;
+    remove(path.c_str());
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+        remove(tmp.c_str());
+}
+
+}
+
+void ibl_default_settings(IblSettings & settings)
+{
+    settings.width = 256;
+    settings.levels = 6;
+    settings.samples = 64;
+}
+
+void ibl_init(Ibl & ibl, const IblSettings & settings)
+{
+    ibl.settings = settings;
+    // The last level keeps at least 4x2 texels
+    int maxLevels = 1;
+    while (maxLevels < IBL_MAX_LEVELS && (settings.width >> maxLevels) >= 4)
+        ++maxLevels;
+    ibl.settings.levels = std::min(std::max(settings.levels, 1), maxLevels);
+    glGenTextures(1, &ibl.texture);
+    for (int k = 0; k < 9; ++k)
+        ibl.sh[k] = glm::vec3(0.f);
+    ibl.sourceSize = 0;
+    ibl.sourceTime = 0;
+    memset(&ibl.stats, 0, sizeof(ibl.stats));
+}
+
+void ibl_release(Ibl & ibl)
+{
+    glDeleteTextures(1, &ibl.texture);
+    ibl.levels.clear();
+}
+
+bool ibl_load(Ibl & ibl, const char * path)
+{
+    struct stat sourceStat;
+    if (stat(path, &sourceStat) != 0)
+        return false;
+    std::string cachePath = std::string(path) + ".ibl";
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (load_cache(ibl, cachePath, sourceStat))
+    {
+        ibl.stats.loadMs = elapsed_ms(start);
+        ibl.stats.shMs = 0.0;
+        ibl.stats.prefilterMs = 0.0;
+        ibl.stats.cached = true;
+    }
+    else
+    {
+        int comp;
+        IblImage source;
+        float * pixels = stbi_loadf(path, &source.width, &source.height, &comp, 3);
+        if (!pixels)
+            return false;
+        source.rgb.assign(pixels, pixels + source.width * source.height * 3);
+        stbi_image_free(pixels);
+        ibl.stats.loadMs = elapsed_ms(start);
+        bake(ibl, source);
+        save_cache(ibl, cachePath, sourceStat);
+    }
+    ibl.path = path;
+    ibl.sourceSize = (long long) sourceStat.st_size;
+    ibl.sourceTime = (long long) sourceStat.st_mtime;
+    upload(ibl);
+    return true;
+}
+
+void ibl_load_sky(Ibl & ibl, const glm::vec3 & sunDirection)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    IblImage source;
+    sky(ibl.settings.width * 2, ibl.settings.width, sunDirection, source);
+    ibl.stats.loadMs = elapsed_ms(start);
+    bake(ibl, source);
+    ibl.path.clear();
+    upload(ibl);
+}
+
+bool ibl_source_changed(const Ibl & ibl)
+{
+    struct stat sourceStat;
+    if (ibl.path.empty() || stat(ibl.path.c_str(), &sourceStat) != 0)
+        return false;
+    return (long long) sourceStat.st_size != ibl.sourceSize || (long long) sourceStat.st_mtime != ibl.sourceTime;
+}
+
+void ibl_uniforms_init(IblUniforms & uniforms, GLuint program)
+{
+    uniforms.program = program;
+    uniforms.environmentLocation = glGetUniformLocation(program, "Environment");
+    uniforms.intensityLocation = glGetUniformLocation(program, "EnvironmentIntensity");
+    uniforms.levelsLocation = glGetUniformLocation(program, "EnvironmentLevels");
+    uniforms.shLocation = glGetUniformLocation(program, "EnvironmentSH");
+}
+
+void ibl_bind(const Ibl & ibl, const IblUniforms & uniforms, int unit, float intensity)
+{
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D, ibl.texture);
+    glActiveTexture(GL_TEXTURE0);
+    GLuint program = uniforms.program;
+    glProgramUniform1i(program, uniforms.environmentLocation, unit);
+    glProgramUniform1f(program, uniforms.intensityLocation, ibl.levels.empty() ? 0.f : intensity);
+    glProgramUniform1i(program, uniforms.levelsLocation, (int) ibl.levels.size());
+    glProgramUniform3fv(program, uniforms.shLocation, 9, glm::value_ptr(ibl.sh[0]));
+}
@@ -0,0 +1,87 @@
+#ifndef AOGL_IBL_H
+#define AOGL_IBL_H
+
+#include <string>
+#include <vector>
+
+#include "glew/glew.h"
+#include "glm/glm.hpp"
+
+const int IBL_MAX_LEVELS = 8;
+
+struct IblSettings
+{
+    int width;              // of the first prefiltered level, height is half
+    int levels;             // prefiltered levels, up to IBL_MAX_LEVELS
+    int samples;            // importance samples per texel
+};
+
+// Equirectangular RGB float image, row 0 looks up (+y), u turns around y
+// starting from -x
+struct IblImage
+{
+    int width, height;
+    std::vector<float> rgb;
+};
+
+struct IblStats
+{
+    double loadMs;          // decoding the source, or reading the cache
+    double shMs;
+    double prefilterMs;
+    double uploadMs;
+    bool cached;
+};
+
+// Ambient light of an environment: 9 spherical harmonics coefficients of
+// the irradiance for diffuse, and the environment convolved with Phong lobes
+// of decreasing power in the mip levels of an equirectangular texture for
+// specular. Both are baked on the worker threads, the projection 4 texels
+// at a time, and an HDR file's bake is cached next to it in path.ibl while
+// its size and date match.
+struct Ibl
+{
+    IblSettings settings;
+    GLuint texture;
+    glm::vec3 sh[9];        // irradiance / pi, ready to scale an albedo
+    std::vector<IblImage> levels;
+    std::string path;       // HDR source, empty for a generated sky
+    long long sourceSize;
+    long long sourceTime;
+    IblStats stats;
+};
+
+// Locations of the environment uniforms in one program, looked up once
+struct IblUniforms
+{
+    GLuint program;
+    GLint environmentLocation;
+    GLint intensityLocation;
+    GLint levelsLocation;
+    GLint shLocation;
+};
+
+void ibl_default_settings(IblSettings & settings);
+
+void ibl_init(Ibl & ibl, const IblSettings & settings);
+void ibl_release(Ibl & ibl);
+
+// program includes lighting.glsl
+void ibl_uniforms_init(IblUniforms & uniforms, GLuint program);
+
+// Loads a Radiance HDR (or any stb_image format) with stbi_loadf, reusing
+// the cached bake when the file did not change. Returns false if it cannot
+// be read, ibl is left as it was.
+bool ibl_load(Ibl & ibl, const char * path);
+
+// Bakes a generated sky with the sun away from sunDirection, not cached
+void ibl_load_sky(Ibl & ibl, const glm::vec3 & sunDirection);
+
+// The HDR source was modified since it was loaded
+bool ibl_source_changed(const Ibl & ibl);
+
+// Binds the prefiltered texture at unit and sets the environment uniforms
+// of the program of uniforms. An intensity of 0 falls back to Ambient.
+void ibl_bind(const Ibl & ibl, const IblUniforms & uniforms, int unit, float intensity);
+
+#endif // AOGL_IBL_H
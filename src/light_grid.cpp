@@ -0,0 +1,275 @@
+#include "light_grid.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <xmmintrin.h>
+
+#include "parallel.h"
+#include "timer.h"
+
+namespace
+{
+
+float slice_depth(const LightGrid & grid, int slice)
+{
+    return grid.nearPlane * powf(grid.farPlane / grid.nearPlane, slice / (float) grid.slices);
+}
+
+// View space boxes around the frustum part of every cluster
+void build_bounds(LightGrid & grid, const glm::mat4 & projection, float nearPlane, float farPlane, int width, int height)
+{
+    grid.projection = projection;
+    grid.nearPlane = nearPlane;
+    grid.farPlane = farPlane;
+    grid.width = width;
+    grid.height = height;
+    grid.tilesX = (width + LIGHT_GRID_TILE_SIZE - 1) / LIGHT_GRID_TILE_SIZE;
+    grid.tilesY = (height + LIGHT_GRID_TILE_SIZE - 1) / LIGHT_GRID_TILE_SIZE;
+    int clusterCount = grid.tilesX * grid.tilesY * grid.slices;
+    std::vector<float> * bounds[6] = { &grid.minX, &grid.minY, &grid.minZ, &grid.maxX, &grid.maxY, &grid.maxZ };
+    for (int i = 0; i < 6; ++i)
+        bounds[i]->resize(clusterCount);
+    grid.cells.resize(clusterCount * 2);
+
+    // At view depth d a point of the tile edge at ndc x sits at x d / P00
+    float scaleX = 1.f / projection[0][0];
+    float scaleY = 1.f / projection[1][1];
+    for (int s = 0; s < grid.slices; ++s)
+    {
+        float dn = slice_depth(grid, s);
+        float df = slice_depth(grid, s + 1);
+        for (int y = 0; y < grid.tilesY; ++y)
+        {
+            float y0 = -1.f + 2.f * y * LIGHT_GRID_TILE_SIZE / height;
+            float y1 = std::min(1.f, -1.f + 2.f * (y + 1) * LIGHT_GRID_TILE_SIZE / height);
+            for (int x = 0; x < grid.tilesX; ++x)
+            {
+                float x0 = -1.f + 2.f * x * LIGHT_GRID_TILE_SIZE / width;
+                float x1 = std::min(1.f, -1.f + 2.f * (x + 1) * LIGHT_GRID_TILE_SIZE / width);
+                int c = (s * grid.tilesY + y) * grid.tilesX + x;
+                grid.minX[c] = std::min(x0 * dn, x0 * df) * scaleX;
+                grid.maxX[c] = std::max(x1 * dn, x1 * df) * scaleX;
+                grid.minY[c] = std::min(y0 * dn, y0 * df) * scaleY;
+                grid.maxY[c] = std::max(y1 * dn, y1 * df) * scaleY;
+                grid.minZ[c] = -df;
+                grid.maxZ[c] = -dn;
+            }
+        }
+    }
+}
+
+// Lights of one slice against its clusters, 4 lights per test. Cluster
+// offsets are relative to the slice until the lists are concatenated.
+void build_slice(LightGrid & grid, int s)
+{
+    float dn = slice_depth(grid, s);
+    float df = slice_depth(grid, s + 1);
+    std::vector<int> & lights = grid.sliceLights[s];
+    lights.clear();
+    for (int l = 0; l < grid.lightCount; ++l)
+    {
+        float depth = -grid.viewZ[l];
+        if (depth + grid.viewRadius[l] >= dn && depth - grid.viewRadius[l] <= df)
+            lights.push_back(l);
+    }
+
+    // Padding lanes get a negative squared radius and never pass
+    int count = (int) lights.size();
+    int padded = (count + 3) & ~3;
+    std::vector<float> & packedLights = grid.slicePacked[s];
+    packedLights.resize(padded * 4 + 4);
+    float * packed = &packedLights[0];
+    for (int i = 0; i < padded; ++i)
+    {
+        int group = i / 4 * 16, lane = i % 4;
+        int l = i < count ? lights[i] : -1;
+        packed[group + lane] = l >= 0 ? grid.viewX[l] : 0.f;
+        packed[group + 4 + lane] = l >= 0 ? grid.viewY[l] : 0.f;
+        packed[group + 8 + lane] = l >= 0 ? grid.viewZ[l] : 0.f;
+        packed[group + 12 + lane] = l >= 0 ? grid.viewRadius[l] * grid.viewRadius[l] : -1.f;
+    }
+
+    std::vector<unsigned short> & indices = grid.sliceIndices[s];
+    indices.clear();
+    __m128 zero = _mm_setzero_ps();
+    int first = s * grid.tilesX * grid.tilesY;
+    for (int c = first; c < first + grid.tilesX * grid.tilesY; ++c)
+    {
+        __m128 minX = _mm_set1_ps(grid.minX[c]), maxX = _mm_set1_ps(grid.maxX[c]);
+        __m128 minY = _mm_set1_ps(grid.minY[c]), maxY = _mm_set1_ps(grid.maxY[c]);
+        __m128 minZ = _mm_set1_ps(grid.minZ[c]), maxZ = _mm_set1_ps(grid.maxZ[c]);
+        unsigned int offset = (unsigned int) indices.size();
+        for (int i = 0; i < padded; i += 4)
+        {
+            // Squared distance from the sphere center to the box
+            const float * p = packed + i * 4;
+            __m128 cx = _mm_loadu_ps(p), cy = _mm_loadu_ps(p + 4), cz = _mm_loadu_ps(p + 8);
+            __m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minX, cx), _mm_sub_ps(cx, maxX)), zero);
+            __m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minY, cy), _mm_sub_ps(cy, maxY)), zero);
+            __m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minZ, cz), _mm_sub_ps(cz, maxZ)), zero);
+            __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+            int mask = _mm_movemask_ps(_mm_cmple_ps(d2, _mm_loadu_ps(p + 12)));
+            for (int k = 0; mask; ++k, mask >>= 1)
+                if (mask & 1)
+                    indices.push_back((unsigned short) lights[i + k]);
+        }
+        grid.cells[c * 2] = offset;
+        grid.cells[c * 2 + 1] = (unsigned int) indices.size() - offset;
+    }
+}
+
+}
+
+void light_grid_init(LightGrid & grid)
+{
+    grid.tilesX = grid.tilesY = 0;
+    grid.slices = LIGHT_GRID_SLICES;
+    grid.nearPlane = grid.farPlane = 0.f;
+    grid.projection = glm::mat4(0.f);
+    grid.width = grid.height = 0;
+    grid.sliceIndices.resize(grid.slices);
+    grid.sliceLights.resize(grid.slices);
+    grid.slicePacked.resize(grid.slices);
+    grid.lightCount = 0;
+    grid.maxClusterLights = 0;
+    grid.ms = 0.0;
+
+    static const GLenum formats[3] = { GL_RG32UI, GL_R16UI, GL_RGBA32F };
+    glGenBuffers(3, grid.buffers);
+    glGenTextures(3, grid.textures);
+    for (int i = 0; i < 3; ++i)
+    {
+        glBindBuffer(GL_TEXTURE_BUFFER, grid.buffers[i]);
+        glBufferData(GL_TEXTURE_BUFFER, 16, 0, GL_STREAM_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, grid.textures[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, formats[i], grid.buffers[i]);
+    }
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void light_grid_release(LightGrid & grid)
+{
+    glDeleteTextures(3, grid.textures);
+    glDeleteBuffers(3, grid.buffers);
+}
+
+void light_grid_build(LightGrid & grid, const PointLight * lights, int count, const glm::mat4 & worldToView,
+                      const glm::mat4 & projection, float nearPlane, float farPlane, int width, int height)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (projection != grid.projection || nearPlane != grid.nearPlane || farPlane != grid.farPlane
+        || width != grid.width || height != grid.height)
+        build_bounds(grid, projection, nearPlane, farPlane, width, height);
+
+    // Indices are 16 bits
+    count = std::min(count, 65535);
+    grid.lightCount = count;
+    grid.viewX.resize(count);
+    grid.viewY.resize(count);
+    grid.viewZ.resize(count);
+    grid.viewRadius.resize(count);
+    grid.lightData.resize(count * 8);
+    for (int i = 0; i < count; ++i)
+    {
+        const PointLight & light = lights[i];
+        glm::vec4 p = worldToView * glm::vec4(light.position, 1.f);
+        grid.viewX[i] = p.x;
+        grid.viewY[i] = p.y;
+        grid.viewZ[i] = p.z;
+        grid.viewRadius[i] = light.radius;
+        float * data = &grid.lightData[i * 8];
+        data[0] = light.position.x;
+        data[1] = light.position.y;
+        data[2] = light.position.z;
+        data[3] = light.radius;
+        data[4] = light.color.r;
+        data[5] = light.color.g;
+        data[6] = light.color.b;
+        data[7] = 0.f;
+    }
+
+    parallel_for(grid.slices, 1, [&](int begin, int end)
+    {
+        for (int s = begin; s < end; ++s)
+            build_slice(grid, s);
+    });
+
+    // Concatenate the slices and make their offsets absolute
+    size_t total = 0;
+    for (int s = 0; s < grid.slices; ++s)
+        total += grid.sliceIndices[s].size();
+    grid.indices.resize(total);
+    size_t base = 0;
+    int clustersPerSlice = grid.tilesX * grid.tilesY;
+    grid.maxClusterLights = 0;
+    for (int s = 0; s < grid.slices; ++s)
+    {
+        const std::vector<unsigned short> & slice = grid.sliceIndices[s];
+        if (!slice.empty())
+            memcpy(&grid.indices[base], &slice[0], slice.size() * sizeof(unsigned short));
+        for (int c = s * clustersPerSlice; c < (s + 1) * clustersPerSlice; ++c)
+        {
+            grid.cells[c * 2] += (unsigned int) base;
+            grid.maxClusterLights = std::max(grid.maxClusterLights, (int) grid.cells[c * 2 + 1]);
+        }
+        base += slice.size();
+    }
+    grid.ms = elapsed_ms(start);
+}
+
+void light_grid_upload(LightGrid & grid)
+{
+    // Orphaned every frame, empty lists still get a valid store
+    const void * data[3] = { grid.cells.empty() ? 0 : &grid.cells[0], grid.indices.empty() ? 0 : &grid.indices[0],
+                             grid.lightData.empty() ? 0 : &grid.lightData[0] };
+    size_t sizes[3] = { grid.cells.size() * sizeof(unsigned int), grid.indices.size() * sizeof(unsigned short),
+                        grid.lightData.size() * sizeof(float) };
+    for (int i = 0; i < 3; ++i)
+    {
+        glBindBuffer(GL_TEXTURE_BUFFER, grid.buffers[i]);
+        if (sizes[i])
+            glBufferData(GL_TEXTURE_BUFFER, sizes[i], data[i], GL_STREAM_DRAW);
+        else
+            glBufferData(GL_TEXTURE_BUFFER, 16, 0, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void light_grid_uniforms_init(LightGridUniforms & uniforms, GLuint program)
+{
+    static const char * samplers[3] = { "ClusterCells", "ClusterLights", "LightData" };
+    uniforms.program = program;
+    for (int i = 0; i < 3; ++i)
+        uniforms.samplerLocations[i] = glGetUniformLocation(program, samplers[i]);
+    uniforms.modeLocation = glGetUniformLocation(program, "ClusterMode");
+    uniforms.tileSizeLocation = glGetUniformLocation(program, "ClusterTileSize");
+    uniforms.countLocation = glGetUniformLocation(program, "ClusterCount");
+    uniforms.depthLocation = glGetUniformLocation(program, "ClusterDepth");
+    uniforms.depthPlaneLocation = glGetUniformLocation(program, "DepthPlane");
+}
+
+void light_grid_bind(const LightGrid & grid, const LightGridUniforms & uniforms, int firstUnit, const glm::mat4 & worldToView,
+                     int mode)
+{
+    GLuint program = uniforms.program;
+    for (int i = 0; i < 3; ++i)
+    {
+        glActiveTexture(GL_TEXTURE0 + firstUnit + i);
+        glBindTexture(GL_TEXTURE_BUFFER, grid.textures[i]);
+        glProgramUniform1i(program, uniforms.samplerLocations[i], firstUnit + i);
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    // Slice of a view depth d: log(d) * scale + bias
+    float logRange = logf(grid.farPlane / grid.nearPlane);
+    float scale = grid.slices / logRange;
+    float bias = -grid.slices * logf(grid.nearPlane) / logRange;
+    glm::vec4 depthPlane = -glm::vec4(worldToView[0][2], worldToView[1][2], worldToView[2][2], worldToView[3][2]);
+    glProgramUniform1i(program, uniforms.modeLocation, mode);
+    glProgramUniform1i(program, uniforms.tileSizeLocation, LIGHT_GRID_TILE_SIZE);
+    glProgramUniform3i(program, uniforms.countLocation, grid.tilesX, grid.tilesY, grid.slices);
+    glProgramUniform2f(program, uniforms.depthLocation, scale, bias);
+    glProgramUniform4f(program, uniforms.depthPlaneLocation, depthPlane.x, depthPlane.y, depthPlane.z, depthPlane.w);
+}
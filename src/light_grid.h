@@ -0,0 +1,77 @@
+#ifndef AOGL_LIGHT_GRID_H
+#define AOGL_LIGHT_GRID_H
+
+#include <vector>
+
+#include "glew/glew.h"
+#include "glm/glm.hpp"
+
+const int LIGHT_GRID_TILE_SIZE = 64;    // pixels per cluster side on screen
+const int LIGHT_GRID_SLICES = 24;       // depth slices, exponentially spaced
+
+struct PointLight
+{
+    glm::vec3 position;
+    float radius;           // no contribution beyond
+    glm::vec3 color;
+};
+
+// Froxel grid over the view frustum: screen tiles times depth slices. Every
+// frame each cluster gets the list of lights whose sphere touches it, so
+// aogl.frag only walks the lights of the cluster a pixel falls in.
+// Clusters are stored slice by slice, rows of tiles from the bottom of the
+// screen.
+struct LightGrid
+{
+    int tilesX, tilesY, slices;
+    float nearPlane, farPlane;
+    glm::mat4 projection;               // bounds below were built for it
+    int width, height;
+    std::vector<float> minX, minY, minZ, maxX, maxY, maxZ;     // view space cluster bounds
+    std::vector<unsigned int> cells;    // first index and light count per cluster
+    std::vector<unsigned short> indices;
+    std::vector<float> lightData;       // position and radius, color, 2 texels per light
+    std::vector<float> viewX, viewY, viewZ, viewRadius;        // scratch: view space lights
+    std::vector<std::vector<unsigned short> > sliceIndices;    // scratch: indices per slice
+    std::vector<std::vector<int> > sliceLights;                // scratch: lights overlapping a slice
+    std::vector<std::vector<float> > slicePacked;              // scratch: their x, y, z, radius^2 by 4
+    GLuint buffers[3];                  // cells, indices, lights
+    GLuint textures[3];
+    int lightCount;
+    int maxClusterLights;
+    double ms;
+};
+
+// Locations of the cluster uniforms in one program, looked up once
+struct LightGridUniforms
+{
+    GLuint program;
+    GLint samplerLocations[3];
+    GLint modeLocation;
+    GLint tileSizeLocation;
+    GLint countLocation;
+    GLint depthLocation;
+    GLint depthPlaneLocation;
+};
+
+void light_grid_init(LightGrid & grid);
+void light_grid_release(LightGrid & grid);
+
+// program includes lighting.glsl
+void light_grid_uniforms_init(LightGridUniforms & uniforms, GLuint program);
+
+// Fills the clusters of the view on the worker pool, slices in parallel, 4
+// lights per sphere / box test. Cluster bounds are rebuilt when the
+// projection or the viewport changes. Projection is a symmetric perspective.
+void light_grid_build(LightGrid & grid, const PointLight * lights, int count, const glm::mat4 & worldToView,
+                      const glm::mat4 & projection, float nearPlane, float farPlane, int width, int height);
+
+// Copies the lists to the buffer textures
+void light_grid_upload(LightGrid & grid);
+
+// Binds the buffer textures from firstUnit on and sets the cluster uniforms
+// of the program of uniforms
+void light_grid_bind(const LightGrid & grid, const LightGridUniforms & uniforms, int firstUnit, const glm::mat4 & worldToView,
+                     int mode);
+
+#endif // AOGL_LIGHT_GRID_H
@@ -0,0 +1,531 @@
+#include "lod.h"
+
+#include <math.h>
+#include <float.h>
+#include <string.h>
+#include <algorithm>
+
+#include "parallel.h"
+#include "timer.h"
+
+namespace
+{
+
+const float EDGE_WEIGHT = 10.f;     // border and seam planes against surface planes
+
+enum VertexKind
+{
+    KIND_MANIFOLD,  // collapses onto any neighbour
+    KIND_BORDER,    // collapses along its open edges only
+    KIND_SEAM,      // two wedges, both collapse along the seam
+    KIND_LOCKED
+};
+
+// Sum of squared distances to weighted planes as a symmetric 4x4 matrix
+struct Quadric
+{
+    float a00, a11, a22, a10, a20, a21;
+    float b0, b1, b2, c;
+    float w;
+};
+
+struct Collapse
+{
+    int v, u;       // vertex removed, vertex it moves onto
+    float cost;
+    bool operator<(const Collapse & other) const { return cost < other.cost; }
+};
+
+inline glm::vec3 position(const MeshData & mesh, int v)
+{
+    return glm::vec3(mesh.vertices[v * 3], mesh.vertices[v * 3 + 1], mesh.vertices[v * 3 + 2]);
+}
+
+void quadric_add_plane(Quadric & q, const glm::vec3 & n, float d, float w)
+{
+    q.a00 += w * n.x * n.x;
+    q.a11 += w * n.y * n.y;
+    q.a22 += w * n.z * n.z;
+    q.a10 += w * n.y * n.x;
+    q.a20 += w * n.z * n.x;
+    q.a21 += w * n.z * n.y;
+    q.b0 += w * n.x * d;
+    q.b1 += w * n.y * d;
+    q.b2 += w * n.z * d;
+    q.c += w * d * d;
+    q.w += w;
+}
+
+void quadric_add(Quadric & q, const Quadric & other)
+{
+    q.a00 += other.a00; q.a11 += other.a11; q.a22 += other.a22;
+    q.a10 += other.a10; q.a20 += other.a20; q.a21 += other.a21;
+    q.b0 += other.b0; q.b1 += other.b1; q.b2 += other.b2;
+    q.c += other.c;
+    q.w += other.w;
+}
+
+// Weighted mean of the squared plane distances
+float quadric_error(const Quadric & q, const glm::vec3 & p)
+{
+    float rx = q.b0 * 2.f + q.a10 * 2.f * p.y + q.a00 * p.x;
+    float ry = q.b1 * 2.f + q.a21 * 2.f * p.z + q.a11 * p.y;
+    float rz = q.b2 * 2.f + q.a20 * 2.f * p.x + q.a22 * p.z;
+    float r = q.c + rx * p.x + ry * p.y + rz * p.z;
+    return q.w > 0.f ? fabsf(r) / q.w : 0.f;
+}
+
+inline unsigned int hash_position(const float * p)
+{
+    unsigned int k[3];
+    memcpy(k, p, sizeof(k));
+    unsigned int h = k[0] * 73856093u;
+    h ^= k[1] * 19349663u;
+    h ^= k[2] * 83492791u;
+    return h ^ (h >> 15);
+}
+
+// remap is the first vertex at the same position, wedge the next one in a
+// circular list of the vertices at that position
+void build_position_remap(const MeshData & mesh, std::vector<int> & remap, std::vector<int> & wedge)
+{
+    unsigned int capacity = 16;
+    while (capacity < (unsigned int) mesh.vertexCount * 2)
+        capacity *= 2;
+    std::vector<int> table(capacity, -1);
+    remap.resize(mesh.vertexCount);
+    wedge.resize(mesh.vertexCount);
+    for (int v = 0; v < mesh.vertexCount; ++v)
+    {
+        const float * p = mesh.vertices + v * 3;
+        unsigned int slot = hash_position(p) & (capacity - 1);
+        while (table[slot] >= 0 && memcmp(mesh.vertices + table[slot] * 3, p, sizeof(float) * 3) != 0)
+            slot = (slot + 1) & (capacity - 1);
+        if (table[slot] < 0)
+        {
+            table[slot] = v;
+            remap[v] = v;
+            wedge[v] = v;
+        }
+        else
+        {
+            int first = table[slot];
+            remap[v] = first;
+            wedge[v] = wedge[first];
+            wedge[first] = v;
+        }
+    }
+}
+
+// Compressed lists: items of key k are list[offsets[k]] to list[offsets[k + 1]]
+struct Adjacency
+{
+    std::vector<int> offsets;
+    std::vector<int> list;
+};
+
+// Outgoing edges of every vertex, b and c for the corner a of triangle (a, b, c)
+void build_edges(const int * indices, int triangleCount, int vertexCount, Adjacency & edges)
+{
+    edges.offsets.assign(vertexCount + 1, 0);
+    for (int i = 0; i < triangleCount * 3; ++i)
+        ++edges.offsets[indices[i] + 1];
+    for (int v = 0; v < vertexCount; ++v)
+        edges.offsets[v + 1] += edges.offsets[v];
+    edges.list.resize(triangleCount * 3);
+    std::vector<int> cursor(edges.offsets.begin(), edges.offsets.end() - 1);
+    for (int t = 0; t < triangleCount; ++t)
+        for (int k = 0; k < 3; ++k)
+            edges.list[cursor[indices[t * 3 + k]]++] = indices[t * 3 + (k + 1) % 3];
+}
+
+bool has_edge(const Adjacency & edges, int a, int b)
+{
+    for (int i = edges.offsets[a]; i < edges.offsets[a + 1]; ++i)
+        if (edges.list[i] == b)
+            return true;
+    return false;
+}
+
+// Triangles around every position
+void build_triangles(const int * indices, int triangleCount, const std::vector<int> & remap, Adjacency & triangles)
+{
+    int vertexCount = (int) remap.size();
+    triangles.offsets.assign(vertexCount + 1, 0);
+    for (int i = 0; i < triangleCount * 3; ++i)
+        ++triangles.offsets[remap[indices[i]] + 1];
+    for (int v = 0; v < vertexCount; ++v)
+        triangles.offsets[v + 1] += triangles.offsets[v];
+    triangles.list.resize(triangleCount * 3);
+    std::vector<int> cursor(triangles.offsets.begin(), triangles.offsets.end() - 1);
+    for (int i = 0; i < triangleCount * 3; ++i)
+        triangles.list[cursor[remap[indices[i]]]++] = i / 3;
+}
+
+inline int next_used_wedge(const std::vector<int> & wedge, const std::vector<unsigned char> & used, int v)
+{
+    int w = wedge[v];
+    while (!used[w])
+        w = wedge[w];
+    return w;
+}
+
+// Open edges are the edges without a twin in the opposite direction. openIn
+// and openOut hold the other end of the single open edge entering or leaving
+// a vertex, -1 for none and the vertex itself when there are several.
+void classify_vertices(const int * indices, int triangleCount, const Adjacency & edges,
+                       const std::vector<int> & remap, const std::vector<int> & wedge,
+                       const std::vector<unsigned char> & used,
+                       std::vector<int> & openIn, std::vector<int> & openOut, std::vector<unsigned char> & kind)
+{
+    int vertexCount = (int) remap.size();
+    openIn.assign(vertexCount, -1);
+    openOut.assign(vertexCount, -1);
+    for (int t = 0; t < triangleCount; ++t)
+        for (int k = 0; k < 3; ++k)
+        {
+            int a = indices[t * 3 + k];
+            int b = indices[t * 3 + (k + 1) % 3];
+            if (has_edge(edges, b, a))
+                continue;
+            openIn[b] = openIn[b] == -1 ? a : b;
+            openOut[a] = openOut[a] == -1 ? b : a;
+        }
+
+    // Positions share one kind, classified from any of their used wedges
+    const unsigned char unknown = 0xff;
+    kind.assign(vertexCount, unknown);
+    for (int v = 0; v < vertexCount; ++v)
+    {
+        if (!used[v] || kind[remap[v]] != unknown)
+            continue;
+        int w = next_used_wedge(wedge, used, v);
+        bool singleIn = openIn[v] >= 0 && openIn[v] != v;
+        bool singleOut = openOut[v] >= 0 && openOut[v] != v;
+        unsigned char k = KIND_LOCKED;
+        if (w == v)
+        {
+            if (openIn[v] == -1 && openOut[v] == -1)
+                k = KIND_MANIFOLD;
+            else if (singleIn && singleOut)
+                k = KIND_BORDER;
+        }
+        else if (next_used_wedge(wedge, used, w) == v)
+        {
+            // Both sides of a seam see it as a border running the other way
+            bool singleW = openIn[w] >= 0 && openIn[w] != w && openOut[w] >= 0 && openOut[w] != w;
+            if (singleIn && singleOut && singleW &&
+                remap[openIn[v]] == remap[openOut[w]] && remap[openOut[v]] == remap[openIn[w]])
+                k = KIND_SEAM;
+        }
+        kind[remap[v]] = k;
+    }
+    for (int v = 0; v < vertexCount; ++v)
+        kind[v] = kind[remap[v]] == unknown ? (unsigned char) KIND_LOCKED : kind[remap[v]];
+}
+
+bool collapse_allowed(const std::vector<unsigned char> & kind, const std::vector<int> & remap,
+                      const std::vector<int> & openIn, const std::vector<int> & openOut, int v, int u)
+{
+    switch (kind[v])
+    {
+    case KIND_MANIFOLD:
+        return true;
+    case KIND_BORDER:
+    case KIND_SEAM:
+        return remap[u] == remap[openOut[v]] || remap[u] == remap[openIn[v]];
+    default:
+        return false;
+    }
+}
+
+// Rejects collapses that turn triangles around v over or into slivers
+bool collapse_flips(const MeshData & mesh, const int * indices, const Adjacency & triangles,
+                    const std::vector<int> & remap, int v, int u)
+{
+    int pv = remap[v], pu = remap[u];
+    glm::vec3 target = position(mesh, u);
+    for (int i = triangles.offsets[pv]; i < triangles.offsets[pv + 1]; ++i)
+    {
+        const int * t = indices + triangles.list[i] * 3;
+        glm::vec3 p[3], q[3];
+        bool degenerate = false;
+        for (int k = 0; k < 3; ++k)
+        {
+            p[k] = position(mesh, t[k]);
+            q[k] = remap[t[k]] == pv ? target : p[k];
+            degenerate = degenerate || remap[t[k]] == pu;
+        }
+        if (degenerate)
+            continue;
+        glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+        glm::vec3 after = glm::cross(q[1] - q[0], q[2] - q[0]);
+        if (glm::dot(before, after) <= 0.25f * glm::length(before) * glm::length(after))
+            return true;
+    }
+    return false;
+}
+
+}
+
+int lod_simplify(const MeshData & mesh, const int * indices, int triangleCount, int targetTriangles,
+                 std::vector<int> & out, float & error)
+{
+    out.assign(indices, indices + triangleCount * 3);
+    error = 0.f;
+    int vertexCount = mesh.vertexCount;
+    std::vector<int> remap, wedge;
+    build_position_remap(mesh, remap, wedge);
+
+    std::vector<unsigned char> used(vertexCount, 0);
+    for (int i = 0; i < triangleCount * 3; ++i)
+        used[indices[i]] = 1;
+    Adjacency edges, triangles;
+    std::vector<int> openIn, openOut;
+    std::vector<unsigned char> kind;
+    build_edges(&out[0], triangleCount, vertexCount, edges);
+    classify_vertices(&out[0], triangleCount, edges, remap, wedge, used, openIn, openOut, kind);
+
+    // Area weighted triangle planes, plus planes perpendicular to the open
+    // edges that keep borders and seams in place
+    Quadric zero;
+    memset(&zero, 0, sizeof(zero));
+    std::vector<Quadric> quadrics(vertexCount, zero);
+    for (int t = 0; t < triangleCount; ++t)
+    {
+        const int * tri = indices + t * 3;
+        glm::vec3 p0 = position(mesh, tri[0]), p1 = position(mesh, tri[1]), p2 = position(mesh, tri[2]);
+        glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+        float area = glm::length(normal);
+        if (area == 0.f)
+            continue;
+        normal /= area;
+        Quadric q = zero;
+        quadric_add_plane(q, normal, -glm::dot(normal, p0), area * 0.5f);
+        for (int k = 0; k < 3; ++k)
+            quadric_add(quadrics[remap[tri[k]]], q);
+
+        for (int k = 0; k < 3; ++k)
+        {
+            int a = tri[k], b = tri[(k + 1) % 3];
+            if (has_edge(edges, b, a))
+                continue;
+            glm::vec3 pa = position(mesh, a);
+            glm::vec3 edge = position(mesh, b) - pa;
+            float length = glm::length(edge);
+            if (length == 0.f)
+                continue;
+            glm::vec3 edgeNormal = glm::normalize(glm::cross(edge, normal));
+            Quadric e = zero;
+            quadric_add_plane(e, edgeNormal, -glm::dot(edgeNormal, pa), length * length * EDGE_WEIGHT);
+            quadric_add(quadrics[remap[a]], e);
+            quadric_add(quadrics[remap[b]], e);
+        }
+    }
+
+    std::vector<Collapse> collapses;
+    std::vector<int> target(vertexCount);
+    std::vector<unsigned char> locked(vertexCount);
+    float maxCost = 0.f;
+    bool first = true;
+    while (triangleCount > targetTriangles)
+    {
+        if (!first)
+        {
+            std::fill(used.begin(), used.end(), 0);
+            for (int i = 0; i < triangleCount * 3; ++i)
+                used[out[i]] = 1;
+            build_edges(&out[0], triangleCount, vertexCount, edges);
+            classify_vertices(&out[0], triangleCount, edges, remap, wedge, used, openIn, openOut, kind);
+        }
+        first = false;
+        build_triangles(&out[0], triangleCount, remap, triangles);
+
+        // Both allowed directions of every edge. Interior edges are seen from
+        // both of their triangles, open edges from one.
+        collapses.clear();
+        for (int t = 0; t < triangleCount; ++t)
+            for (int k = 0; k < 3; ++k)
+            {
+                int a = out[t * 3 + k], b = out[t * 3 + (k + 1) % 3];
+                if (remap[a] > remap[b] && has_edge(edges, b, a))
+                    continue;
+                if (collapse_allowed(kind, remap, openIn, openOut, a, b))
+                {
+                    Collapse c = { a, b, quadric_error(quadrics[remap[a]], position(mesh, b)) };
+                    collapses.push_back(c);
+                }
+                if (collapse_allowed(kind, remap, openIn, openOut, b, a))
+                {
+                    Collapse c = { b, a, quadric_error(quadrics[remap[b]], position(mesh, a)) };
+                    collapses.push_back(c);
+                }
+            }
+        if (collapses.empty())
+            break;
+
+        // A collapse removes about two triangles and most edges have two
+        // candidates. Collapses much worse than the goal are left to later
+        // passes, when cheaper ones may have been unlocked, and only the
+        // ones under that limit need sorting.
+        int goal = std::max(1, (triangleCount - targetTriangles) / 2);
+        std::vector<Collapse>::iterator nth = collapses.begin() + std::min(goal * 2, (int) collapses.size()) - 1;
+        std::nth_element(collapses.begin(), nth, collapses.end());
+        float costLimit = nth->cost * 1.5f;
+        size_t limited = std::partition(nth + 1, collapses.end(),
+                                        [costLimit](const Collapse & c) { return c.cost <= costLimit; }) - collapses.begin();
+        std::sort(collapses.begin(), collapses.begin() + limited);
+
+        for (int v = 0; v < vertexCount; ++v)
+            target[v] = v;
+        std::fill(locked.begin(), locked.end(), 0);
+        int done = 0;
+        for (size_t i = 0; i < collapses.size() && done < goal; ++i)
+        {
+            if (i == limited)
+            {
+                // Nothing under the limit could go, fall back to the rest
+                if (done)
+                    break;
+                std::sort(collapses.begin() + limited, collapses.end());
+            }
+            const Collapse & c = collapses[i];
+            int pv = remap[c.v], pu = remap[c.u];
+            if (locked[pv] || locked[pu] || pv == pu)
+                continue;
+            if (collapse_flips(mesh, &out[0], triangles, remap, c.v, c.u))
+                continue;
+
+            target[c.v] = c.u;
+            if (kind[c.v] == KIND_SEAM)
+            {
+                // The other wedge follows the seam to the matching wedge of u
+                int w = next_used_wedge(wedge, used, c.v);
+                target[w] = remap[openOut[c.v]] == pu ? openIn[w] : openOut[w];
+            }
+            quadric_add(quadrics[pu], quadrics[pv]);
+            maxCost = std::max(maxCost, c.cost);
+
+            // Triangles around v change, nothing touching them may collapse
+            // again in this pass
+            for (int j = triangles.offsets[pv]; j < triangles.offsets[pv + 1]; ++j)
+                for (int k = 0; k < 3; ++k)
+                    locked[remap[out[triangles.list[j] * 3 + k]]] = 1;
+            ++done;
+        }
+        if (!done)
+            break;
+
+        int kept = 0;
+        for (int t = 0; t < triangleCount; ++t)
+        {
+            int a = target[out[t * 3]], b = target[out[t * 3 + 1]], c = target[out[t * 3 + 2]];
+            if (remap[a] == remap[b] || remap[b] == remap[c] || remap[c] == remap[a])
+                continue;
+            out[kept * 3] = a;
+            out[kept * 3 + 1] = b;
+            out[kept * 3 + 2] = c;
+            ++kept;
+        }
+        triangleCount = kept;
+    }
+    out.resize(triangleCount * 3);
+    error = sqrtf(maxCost);
+    return triangleCount;
+}
+
+void lod_build_chain(const MeshData & mesh, LodChain & chain)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    chain.indices.assign(mesh.triangleList, mesh.triangleList + mesh.triangleCount * 3);
+    chain.levels.clear();
+    LodLevel source = { 0, mesh.triangleCount, 0.f };
+    chain.levels.push_back(source);
+
+    glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+    for (int v = 0; v < mesh.vertexCount; ++v)
+    {
+        boundsMin = glm::min(boundsMin, position(mesh, v));
+        boundsMax = glm::max(boundsMax, position(mesh, v));
+    }
+    chain.center = mesh.vertexCount ? (boundsMin + boundsMax) * 0.5f : glm::vec3(0.f);
+    chain.radius = 0.f;
+    for (int v = 0; v < mesh.vertexCount; ++v)
+        chain.radius = std::max(chain.radius, glm::length(position(mesh, v) - chain.center));
+
+    // Each level starts from the previous one, its error bounds the sum of
+    // the errors of the steps
+    std::vector<int> previous(chain.indices), simplified;
+    while ((int) chain.levels.size() < LOD_MAX_LEVELS)
+    {
+        const LodLevel & last = chain.levels.back();
+        if (last.triangleCount < 2)
+            break;
+        float error;
+        int count = lod_simplify(mesh, &previous[0], last.triangleCount, last.triangleCount / 2, simplified, error);
+        if (count == 0 || count > last.triangleCount * 4 / 5)
+            break;
+        LodLevel level = { (int) chain.indices.size(), count, last.error + error };
+        chain.indices.insert(chain.indices.end(), simplified.begin(), simplified.end());
+        chain.levels.push_back(level);
+        previous.swap(simplified);
+    }
+    chain.buildMs = elapsed_ms(start);
+}
+
+void lod_upload(const LodChain & chain, GpuMesh & gpu)
+{
+    glBindVertexArray(gpu.vao);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gpu.vbo[0]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, chain.indices.size() * sizeof(int), &chain.indices[0], GL_STATIC_DRAW);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    gpu.triangleCount = chain.levels[0].triangleCount;
+}
+
+int lod_select(const LodChain & chain, float scale, float distance, float projectionScale,
+               float viewportHeight, float pixelError)
+{
+    if (distance <= 0.f)
+        return 0;
+    float pixelsPerUnit = projectionScale * viewportHeight * 0.5f / distance;
+    for (int i = (int) chain.levels.size() - 1; i > 0; --i)
+        if (chain.levels[i].error * scale * pixelsPerUnit <= pixelError)
+            return i;
+    return 0;
+}
+
+void lod_sort_instances(const LodChain & chain, const glm::mat4 * transforms, int count, const glm::vec3 & eye,
+                        float projectionScale, float viewportHeight, float pixelError,
+                        glm::mat4 * sorted, LodInstances & instances)
+{
+    instances.level.resize(count);
+    parallel_for(count, 4096, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; ++i)
+        {
+            const glm::mat4 & m = transforms[i];
+            float scale = std::max(glm::length(glm::vec3(m[0])), std::max(glm::length(glm::vec3(m[1])), glm::length(glm::vec3(m[2]))));
+            glm::vec3 center(m * glm::vec4(chain.center, 1.f));
+            float distance = glm::length(center - eye) - chain.radius * scale;
+            instances.level[i] = (unsigned char) lod_select(chain, scale, distance, projectionScale, viewportHeight, pixelError);
+        }
+    });
+
+    // Counting sort, instances keep their order inside a level
+    memset(instances.count, 0, sizeof(instances.count));
+    for (int i = 0; i < count; ++i)
+        ++instances.count[instances.level[i]];
+    int cursor[LOD_MAX_LEVELS];
+    int first = 0;
+    instances.triangles = 0;
+    for (int l = 0; l < LOD_MAX_LEVELS; ++l)
+    {
+        instances.first[l] = cursor[l] = first;
+        first += instances.count[l];
+        if (l < (int) chain.levels.size())
+            instances.triangles += instances.count[l] * chain.levels[l].triangleCount;
+    }
+    for (int i = 0; i < count; ++i)
+        sorted[cursor[instances.level[i]]++] = transforms[i];
+}
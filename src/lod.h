@@ -0,0 +1,66 @@
+#ifndef AOGL_LOD_H
+#define AOGL_LOD_H
+
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "mesh.h"
+
+const int LOD_MAX_LEVELS = 6;
+
+struct LodLevel
+{
+    int indexOffset;    // first index in LodChain::indices
+    int triangleCount;
+    float error;        // object space distance to the source surface
+};
+
+// Index buffers of decreasing detail sharing the vertices of one mesh,
+// concatenated so they can live in a single element buffer
+struct LodChain
+{
+    std::vector<int> indices;
+    std::vector<LodLevel> levels;   // level 0 is the source mesh
+    glm::vec3 center;               // bounding sphere of the vertices
+    float radius;
+    double buildMs;
+};
+
+// Visible instances sorted by level, as written by lod_sort_instances
+struct LodInstances
+{
+    std::vector<unsigned char> level;   // scratch: level per instance
+    int first[LOD_MAX_LEVELS];
+    int count[LOD_MAX_LEVELS];
+    int triangles;                      // drawn by all the instances
+};
+
+// Quadric error edge collapse down to targetTriangles, or until no collapse
+// is left. Vertices only move onto their neighbours so the vertex arrays are
+// kept as they are. Vertices sharing a position but not their attributes
+// form UV or normal seams: they only collapse along the seam, together.
+// Open borders only collapse along the border. Returns the triangle count
+// written to out and the object space error in error.
+int lod_simplify(const MeshData & mesh, const int * indices, int triangleCount, int targetTriangles,
+                 std::vector<int> & out, float & error);
+
+// Halves the triangle count at every level until the mesh stops simplifying
+void lod_build_chain(const MeshData & mesh, LodChain & chain);
+
+// Replaces the element buffer of the mesh with every level of the chain
+void lod_upload(const LodChain & chain, GpuMesh & gpu);
+
+// Coarsest level whose error stays under pixelError pixels on screen, for
+// an instance of the given scale at distance from the eye. projectionScale
+// is projection[1][1] of glm::perspective.
+int lod_select(const LodChain & chain, float scale, float distance, float projectionScale,
+               float viewportHeight, float pixelError);
+
+// Selects the level of every instance then writes the transforms grouped by
+// level to sorted
+void lod_sort_instances(const LodChain & chain, const glm::mat4 * transforms, int count, const glm::vec3 & eye,
+                        float projectionScale, float viewportHeight, float pixelError,
+                        glm::mat4 * sorted, LodInstances & instances);
+
+#endif // AOGL_LOD_H
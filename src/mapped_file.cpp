@@ -0,0 +1,107 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+bool map_file(MappedFile & f, const char * path)
+{
+    f.data = 0;
+    f.size = 0;
+    f.mapping = 0;
+    f.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if (f.file == INVALID_HANDLE_VALUE)
+    {
+        f.file = 0;
+        return false;
+    }
+    LARGE_INTEGER size;
+    GetFileSizeEx(f.file, &size);
+    f.size = (size_t) size.QuadPart;
+
+    // Nothing to map, the file is not kept open
+    if (f.size == 0)
+    {
+        CloseHandle(f.file);
+        f.file = 0;
+        return true;
+    }
+    f.mapping = CreateFileMappingA(f.file, 0, PAGE_READONLY, 0, 0, 0);
+    if (f.mapping)
+        f.data = (const unsigned char *) MapViewOfFile(f.mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!f.data)
+    {
+        unmap_file(f);
+        return false;
+    }
+    return true;
+}
+
+void unmap_file(MappedFile & f)
+{
+    if (f.data)
+        UnmapViewOfFile(f.data);
+    if (f.mapping)
+        CloseHandle(f.mapping);
+    if (f.file)
+        CloseHandle(f.file);
+    f.data = 0;
+    f.size = 0;
+    f.mapping = 0;
+    f.file = 0;
+}
+
+#else
+
+bool map_file(MappedFile & f, const char * path)
+{
+    f.data = 0;
+    f.size = 0;
+    f.fd = open(path, O_RDONLY);
+    if (f.fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(f.fd, &st) != 0)
+    {
+        unmap_file(f);
+        return false;
+    }
+    f.size = (size_t) st.st_size;
+
+    // Nothing to map, the file is not kept open
+    if (f.size == 0)
+    {
+        close(f.fd);
+        f.fd = -1;
+        return true;
+    }
+    void * data = mmap(0, f.size, PROT_READ, MAP_PRIVATE, f.fd, 0);
+    if (data == MAP_FAILED)
+    {
+        unmap_file(f);
+        return false;
+    }
+    f.data = (const unsigned char *) data;
+    return true;
+}
+
+void unmap_file(MappedFile & f)
+{
+    if (f.data)
+        munmap((void *) f.data, f.size);
+    if (f.fd >= 0)
+        close(f.fd);
+    f.data = 0;
+    f.size = 0;
+    f.fd = -1;
+}
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef AOGL_MAPPED_FILE_H
+#define AOGL_MAPPED_FILE_H
+
+#include <stddef.h>
+
+// Read-only memory mapping of a whole file
+struct MappedFile
+{
+    const unsigned char * data;
+    size_t size;
+#ifdef _WIN32
+    void * file;
+    void * mapping;
+#else
+    int fd;
+#endif
+};
+
+bool map_file(MappedFile & f, const char * path);
+void unmap_file(MappedFile & f);
+
+#endif // AOGL_MAPPED_FILE_H
@@ -0,0 +1,184 @@
+#include "mesh.h"
+
+#include <string.h>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+void compute_tangents(const int * triangleList, int triangleCount,
+                      const float * vertices, const float * normals, const float * uvs,
+                      int vertexCount, float * tangents)
+{
+    std::vector<glm::vec3> tan(vertexCount, glm::vec3(0.f));
+    std::vector<glm::vec3> bitan(vertexCount, glm::vec3(0.f));
+
+    // Accumulate uv gradients of every triangle on its vertices
+    for (int i = 0; i < triangleCount; ++i)
+    {
+        int i0 = triangleList[i * 3], i1 = triangleList[i * 3 + 1], i2 = triangleList[i * 3 + 2];
+        glm::vec3 p0(vertices[i0 * 3], vertices[i0 * 3 + 1], vertices[i0 * 3 + 2]);
+        glm::vec3 p1(vertices[i1 * 3], vertices[i1 * 3 + 1], vertices[i1 * 3 + 2]);
+        glm::vec3 p2(vertices[i2 * 3], vertices[i2 * 3 + 1], vertices[i2 * 3 + 2]);
+        glm::vec2 t0(uvs[i0 * 2], uvs[i0 * 2 + 1]);
+        glm::vec2 t1(uvs[i1 * 2], uvs[i1 * 2 + 1]);
+        glm::vec2 t2(uvs[i2 * 2], uvs[i2 * 2 + 1]);
+        glm::vec3 e1 = p1 - p0, e2 = p2 - p0;
+        glm::vec2 d1 = t1 - t0, d2 = t2 - t0;
+        float det = d1.x * d2.y - d2.x * d1.y;
+        if (det == 0.f)
+            continue;
+        float r = 1.f / det;
+        glm::vec3 sdir = (e1 * d2.y - e2 * d1.y) * r;
+        glm::vec3 tdir = (e2 * d1.x - e1 * d2.x) * r;
+        tan[i0] += sdir; tan[i1] += sdir; tan[i2] += sdir;
+        bitan[i0] += tdir; bitan[i1] += tdir; bitan[i2] += tdir;
+    }
+
+    for (int i = 0; i < vertexCount; ++i)
+    {
+        glm::vec3 n(normals[i * 3], normals[i * 3 + 1], normals[i * 3 + 2]);
+        glm::vec3 t = tan[i] - n * glm::dot(n, tan[i]);
+        float len = glm::length(t);
+        if (len > 1e-6f)
+            t /= len;
+        else
+        {
+            // No usable uv gradient, pick any direction orthogonal to the normal
+            glm::vec3 axis = fabsf(n.x) < 0.9f ? glm::vec3(1.f, 0.f, 0.f) : glm::vec3(0.f, 1.f, 0.f);
+            t = glm::normalize(glm::cross(axis, n));
+        }
+        tangents[i * 4] = t.x;
+        tangents[i * 4 + 1] = t.y;
+        tangents[i * 4 + 2] = t.z;
+        tangents[i * 4 + 3] = glm::dot(glm::cross(n, t), bitan[i]) < 0.f ? -1.f : 1.f;
+    }
+}
+
+MeshData mesh_view(const MeshBuffers & buffers)
+{
+    MeshData mesh;
+    mesh.vertexCount = (int) buffers.vertices.size() / 3;
+    mesh.triangleCount = (int) buffers.triangleList.size() / 3;
+    mesh.vertices = buffers.vertices.empty() ? 0 : &buffers.vertices[0];
+    mesh.normals = buffers.normals.empty() ? 0 : &buffers.normals[0];
+    mesh.uvs = buffers.uvs.empty() ? 0 : &buffers.uvs[0];
+    mesh.tangents = buffers.tangents.empty() ? 0 : &buffers.tangents[0];
+    mesh.triangleList = buffers.triangleList.empty() ? 0 : &buffers.triangleList[0];
+    return mesh;
+}
+
+struct MeshBlobHeader
+{
+    int vertexCount;
+    int triangleCount;
+};
+
+static size_t mesh_blob_size(int vertexCount, int triangleCount)
+{
+    return sizeof(MeshBlobHeader) + sizeof(float) * vertexCount * (3 + 3 + 2 + 4) + sizeof(int) * triangleCount * 3;
+}
+
+void mesh_write_blob(const MeshData & mesh, std::vector<unsigned char> & blob)
+{
+    blob.resize(mesh_blob_size(mesh.vertexCount, mesh.triangleCount));
+    MeshBlobHeader header = { mesh.vertexCount, mesh.triangleCount };
+    unsigned char * p = &blob[0];
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    size_t v = mesh.vertexCount * sizeof(float);
+    memcpy(p, mesh.vertices, v * 3); p += v * 3;
+    memcpy(p, mesh.normals, v * 3); p += v * 3;
+    memcpy(p, mesh.uvs, v * 2); p += v * 2;
+    memcpy(p, mesh.tangents, v * 4); p += v * 4;
+    memcpy(p, mesh.triangleList, mesh.triangleCount * 3 * sizeof(int));
+}
+
+bool mesh_from_blob(const void * blob, size_t size, MeshData & mesh)
+{
+    const MeshBlobHeader * header = (const MeshBlobHeader *) blob;
+    if (!blob || size < sizeof(MeshBlobHeader) || header->vertexCount < 0 || header->triangleCount < 0)
+        return false;
+
+    // Counts are bounded by the blob before sizes are computed from them
+    size_t available = size - sizeof(MeshBlobHeader);
+    if ((size_t) header->vertexCount > available / (sizeof(float) * (3 + 3 + 2 + 4))
+        || (size_t) header->triangleCount > available / (sizeof(int) * 3)
+        || size < mesh_blob_size(header->vertexCount, header->triangleCount))
+        return false;
+    // mesh is left untouched unless every index is in range
+    int vertexCount = header->vertexCount;
+    const float * f = (const float *) (header + 1);
+    const int * triangleList = (const int *) (f + vertexCount * (3 + 3 + 2 + 4));
+    for (int i = 0; i < header->triangleCount * 3; ++i)
+        if (triangleList[i] < 0 || triangleList[i] >= vertexCount)
+            return false;
+    mesh.vertexCount = vertexCount;
+    mesh.triangleCount = header->triangleCount;
+    mesh.vertices = f; f += vertexCount * 3;
+    mesh.normals = f; f += vertexCount * 3;
+    mesh.uvs = f; f += vertexCount * 2;
+    mesh.tangents = f;
+    mesh.triangleList = triangleList;
+    return true;
+}
+
+void mesh_upload(const MeshData & mesh, GpuMesh & gpu)
+{
+    gpu.triangleCount = mesh.triangleCount;
+
+    // Create a Vertex Array Object
+    glGenVertexArrays(1, &gpu.vao);
+
+    // Create a VBO for each array
+    glGenBuffers(5, gpu.vbo);
+
+    // Bind the VAO
+    glBindVertexArray(gpu.vao);
+
+    // Bind indices and upload data
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gpu.vbo[0]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh.triangleCount * 3 * sizeof(int), mesh.triangleList, GL_STATIC_DRAW);
+
+    // Bind vertices, normals, uv coords and tangents and upload data
+    const float * attributes[4] = { mesh.vertices, mesh.normals, mesh.uvs, mesh.tangents };
+    const int sizes[4] = { 3, 3, 2, 4 };
+    for (int i = 0; i < 4; ++i)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, gpu.vbo[i + 1]);
+        glEnableVertexAttribArray(i);
+        glVertexAttribPointer(i, sizes[i], GL_FLOAT, GL_FALSE, sizeof(GL_FLOAT) * sizes[i], (void*)0);
+        glBufferData(GL_ARRAY_BUFFER, mesh.vertexCount * sizes[i] * sizeof(float), attributes[i], GL_STATIC_DRAW);
+    }
+
+    // Unbind everything
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+void mesh_release(GpuMesh & gpu)
+{
+    glDeleteBuffers(5, gpu.vbo);
+    glDeleteVertexArrays(1, &gpu.vao);
+    gpu.vao = 0;
+}
+
+void mesh_bind_instances(GpuMesh & gpu, GLuint instanceBuffer, int firstInstance)
+{
+    glBindVertexArray(gpu.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+    for (int i = 0; i < 4; ++i)
+    {
+        glEnableVertexAttribArray(4 + i);
+        glVertexAttribPointer(4 + i, 4, GL_FLOAT, GL_FALSE, sizeof(float) * 16, (void*)(sizeof(float) * (16 * firstInstance + 4 * i)));
+        glVertexAttribDivisor(4 + i, 1);
+    }
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void mesh_identity_instance()
+{
+    for (int i = 0; i < 4; ++i)
+        glVertexAttrib4f(4 + i, i == 0, i == 1, i == 2, i == 3);
+}
@@ -0,0 +1,64 @@
+#ifndef AOGL_MESH_H
+#define AOGL_MESH_H
+
+#include <stddef.h>
+#include <vector>
+
+#include "glew/glew.h"
+
+// Non owning view of an indexed triangle mesh, one array per attribute
+struct MeshData
+{
+    int vertexCount;
+    int triangleCount;
+    const float * vertices;     // 3 floats per vertex
+    const float * normals;      // 3 floats per vertex
+    const float * uvs;          // 2 floats per vertex
+    const float * tangents;     // 4 floats per vertex
+    const int * triangleList;   // 3 indices per triangle
+};
+
+// Mesh owning its arrays, as produced by the importers
+struct MeshBuffers
+{
+    std::vector<float> vertices;
+    std::vector<float> normals;
+    std::vector<float> uvs;
+    std::vector<float> tangents;
+    std::vector<int> triangleList;
+};
+
+// Vertex array with one buffer per attribute, bound to the locations used
+// by aogl.vert: indices, position (0), normal (1), uv (2), tangent (3)
+struct GpuMesh
+{
+    GLuint vao;
+    GLuint vbo[5];
+    int triangleCount;
+};
+
+// Per-vertex tangents for normal mapping, written as 4 floats per vertex:
+// xyz is the tangent orthogonalized against the normal and w the handedness
+// of the (tangent, bitangent, normal) frame.
+void compute_tangents(const int * triangleList, int triangleCount,
+                      const float * vertices, const float * normals, const float * uvs,
+                      int vertexCount, float * tangents);
+
+MeshData mesh_view(const MeshBuffers & buffers);
+
+// Packed mesh layout: vertex and triangle counts then the arrays of MeshData
+// in declaration order. Reading points the view into the blob.
+void mesh_write_blob(const MeshData & mesh, std::vector<unsigned char> & blob);
+bool mesh_from_blob(const void * blob, size_t size, MeshData & mesh);
+
+void mesh_upload(const MeshData & mesh, GpuMesh & gpu);
+void mesh_release(GpuMesh & gpu);
+
+// Reads the per-instance objectToWorld matrices of aogl.vert (locations 4 to
+// 7) from a buffer of glm::mat4, one per instance, starting at firstInstance.
+// GL 4.1 has no base instance so draws of a range rebind the offset.
+void mesh_bind_instances(GpuMesh & gpu, GLuint instanceBuffer, int firstInstance);
+// Identity objectToWorld for vertex arrays without an instance buffer
+void mesh_identity_instance();
+
+#endif // AOGL_MESH_H
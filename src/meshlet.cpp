@@ -0,0 +1,302 @@
+#include "meshlet.h"
+
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+#include <emmintrin.h>
+
+#include "parallel.h"
+#include "timer.h"
+
+// Meshlets per parallel block, also the grain below which culling stays on one thread
+static const int MESHLET_CULL_BLOCK = 256;
+
+static glm::vec3 mesh_position(const MeshData & mesh, int v)
+{
+    return glm::vec3(mesh.vertices[v * 3], mesh.vertices[v * 3 + 1], mesh.vertices[v * 3 + 2]);
+}
+
+// Bounding sphere around the box of the vertices, and the cone containing
+// every triangle normal. The cone is left open (cutoff 1) when the normals
+// spread over more than about 85 degrees from the axis.
+static void meshlet_bounds(const MeshData & mesh, const MeshletMesh & meshlets, const Meshlet & m,
+                           glm::vec3 & center, float & radius, glm::vec3 & axis, float & cutoff)
+{
+    glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+    for (int i = 0; i < m.vertexCount; ++i)
+    {
+        glm::vec3 p = mesh_position(mesh, meshlets.vertices[m.vertexOffset + i]);
+        boundsMin = glm::min(boundsMin, p);
+        boundsMax = glm::max(boundsMax, p);
+    }
+    center = (boundsMin + boundsMax) * 0.5f;
+    radius = 0.f;
+    for (int i = 0; i < m.vertexCount; ++i)
+        radius = std::max(radius, glm::length(mesh_position(mesh, meshlets.vertices[m.vertexOffset + i]) - center));
+
+    glm::vec3 normals[MESHLET_MAX_TRIANGLES];
+    int normalCount = 0;
+    glm::vec3 sum(0.f);
+    for (int t = 0; t < m.triangleCount; ++t)
+    {
+        const unsigned char * local = &meshlets.triangles[(m.triangleOffset + t) * 3];
+        glm::vec3 p0 = mesh_position(mesh, meshlets.vertices[m.vertexOffset + local[0]]);
+        glm::vec3 p1 = mesh_position(mesh, meshlets.vertices[m.vertexOffset + local[1]]);
+        glm::vec3 p2 = mesh_position(mesh, meshlets.vertices[m.vertexOffset + local[2]]);
+        glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+        float length = glm::length(n);
+        if (length == 0.f)
+            continue;
+        normals[normalCount++] = n / length;
+        sum += n / length;
+    }
+    axis = glm::vec3(0.f, 0.f, 1.f);
+    cutoff = 1.f;
+    float sumLength = glm::length(sum);
+    if (!normalCount || sumLength < 1e-6f)
+        return;
+    axis = sum / sumLength;
+    float minDot = 1.f;
+    for (int i = 0; i < normalCount; ++i)
+        minDot = std::min(minDot, glm::dot(normals[i], axis));
+    // Every triangle faces away when the view direction is closer to the axis
+    // than 90 degrees minus the cone angle, the cutoff is the cosine of that
+    if (minDot > 0.1f)
+        cutoff = sqrtf(1.f - minDot * minDot);
+}
+
+void meshlet_build(const MeshData & mesh, const int * indices, int triangleCount, MeshletMesh & meshlets)
+{
+    meshlets.meshlets.clear();
+    meshlets.vertices.clear();
+    meshlets.triangles.clear();
+    meshlets.triangleCount = triangleCount;
+
+    // Triangles around every vertex
+    std::vector<int> offsets(mesh.vertexCount + 1, 0), adjacency(triangleCount * 3);
+    for (int i = 0; i < triangleCount * 3; ++i)
+        ++offsets[indices[i] + 1];
+    for (int v = 0; v < mesh.vertexCount; ++v)
+        offsets[v + 1] += offsets[v];
+    std::vector<int> cursor(offsets.begin(), offsets.end() - 1);
+    for (int i = 0; i < triangleCount * 3; ++i)
+        adjacency[cursor[indices[i]]++] = i / 3;
+
+    std::vector<unsigned char> emitted(triangleCount, 0);
+    std::vector<int> localIndex(mesh.vertexCount, -1);
+    std::vector<int> candidates;
+    Meshlet current = { 0, 0, 0, 0 };
+    auto flush = [&]()
+    {
+        meshlets.meshlets.push_back(current);
+        for (int i = 0; i < current.vertexCount; ++i)
+            localIndex[meshlets.vertices[current.vertexOffset + i]] = -1;
+        current.vertexOffset = (int) meshlets.vertices.size();
+        current.triangleOffset = (int) meshlets.triangles.size() / 3;
+        current.vertexCount = 0;
+        current.triangleCount = 0;
+        candidates.clear();
+    };
+    int seed = 0;
+    for (int emittedCount = 0; emittedCount < triangleCount; ++emittedCount)
+    {
+        // Neighbour bringing the fewest new vertices, emitted ones are dropped
+        int best = -1, bestNew = 4;
+        size_t kept = 0;
+        for (size_t i = 0; i < candidates.size(); ++i)
+        {
+            int t = candidates[i];
+            if (emitted[t])
+                continue;
+            candidates[kept++] = t;
+            if (bestNew == 0)
+                continue;
+            int newVertices = (localIndex[indices[t * 3]] < 0) + (localIndex[indices[t * 3 + 1]] < 0) + (localIndex[indices[t * 3 + 2]] < 0);
+            if (current.vertexCount + newVertices <= MESHLET_MAX_VERTICES && newVertices < bestNew)
+            {
+                best = t;
+                bestNew = newVertices;
+            }
+        }
+        candidates.resize(kept);
+
+        // Without neighbours left, the next triangle in index order joins
+        // this meshlet while its vertices fit, so islands do not leave it
+        // undersized. A new meshlet starts from it otherwise.
+        if (best < 0)
+        {
+            while (emitted[seed])
+                ++seed;
+            int newVertices = (localIndex[indices[seed * 3]] < 0) + (localIndex[indices[seed * 3 + 1]] < 0) + (localIndex[indices[seed * 3 + 2]] < 0);
+            if (current.triangleCount && (!candidates.empty() || current.vertexCount + newVertices > MESHLET_MAX_VERTICES))
+                flush();
+            best = seed;
+        }
+
+        for (int k = 0; k < 3; ++k)
+        {
+            int v = indices[best * 3 + k];
+            if (localIndex[v] < 0)
+            {
+                localIndex[v] = current.vertexCount++;
+                meshlets.vertices.push_back(v);
+                candidates.insert(candidates.end(), adjacency.begin() + offsets[v], adjacency.begin() + offsets[v + 1]);
+            }
+            meshlets.triangles.push_back((unsigned char) localIndex[v]);
+        }
+        emitted[best] = 1;
+        if (++current.triangleCount == MESHLET_MAX_TRIANGLES)
+            flush();
+    }
+    if (current.triangleCount)
+        meshlets.meshlets.push_back(current);
+
+    int count = (int) meshlets.meshlets.size();
+    int padded = (count + 3) & ~3;
+    std::vector<float> * arrays[8] = { &meshlets.centerX, &meshlets.centerY, &meshlets.centerZ, &meshlets.radius,
+                                       &meshlets.coneX, &meshlets.coneY, &meshlets.coneZ, &meshlets.coneCutoff };
+    for (int i = 0; i < 8; ++i)
+        arrays[i]->assign(padded, 0.f);
+    for (int i = 0; i < count; ++i)
+    {
+        const Meshlet & m = meshlets.meshlets[i];
+        glm::vec3 center, axis;
+        float radius, cutoff;
+        meshlet_bounds(mesh, meshlets, m, center, radius, axis, cutoff);
+        meshlets.centerX[i] = center.x; meshlets.centerY[i] = center.y; meshlets.centerZ[i] = center.z;
+        meshlets.radius[i] = radius;
+        meshlets.coneX[i] = axis.x; meshlets.coneY[i] = axis.y; meshlets.coneZ[i] = axis.z;
+        meshlets.coneCutoff[i] = cutoff;
+    }
+    meshlets.visible.resize(padded);
+}
+
+// Visible meshlets of [begin, end[ written from out, returns how many
+static int cull_range(const MeshletMesh & meshlets, const glm::vec4 * planes, const glm::vec3 & eye,
+                      int begin, int end, int * out, int * frustumCulled, int * backfaceCulled)
+{
+    __m128 nx[6], ny[6], nz[6], w[6];
+    for (int p = 0; p < 6; ++p)
+    {
+        nx[p] = _mm_set1_ps(planes[p].x);
+        ny[p] = _mm_set1_ps(planes[p].y);
+        nz[p] = _mm_set1_ps(planes[p].z);
+        w[p] = _mm_set1_ps(planes[p].w);
+    }
+    __m128 ex = _mm_set1_ps(eye.x), ey = _mm_set1_ps(eye.y), ez = _mm_set1_ps(eye.z);
+
+    int visible = 0;
+    for (int i = begin; i < end; i += 4)
+    {
+        __m128 cx = _mm_loadu_ps(&meshlets.centerX[i]), cy = _mm_loadu_ps(&meshlets.centerY[i]), cz = _mm_loadu_ps(&meshlets.centerZ[i]);
+        __m128 r = _mm_loadu_ps(&meshlets.radius[i]);
+        __m128 negativeR = _mm_sub_ps(_mm_setzero_ps(), r);
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int p = 0; p < 6; ++p)
+        {
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx[p], cx), _mm_mul_ps(ny[p], cy)), _mm_add_ps(_mm_mul_ps(nz[p], cz), w[p]));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(d, negativeR));
+        }
+
+        // Back facing when dot(center - eye, axis) >= cutoff * |center - eye| + radius
+        __m128 vx = _mm_sub_ps(cx, ex), vy = _mm_sub_ps(cy, ey), vz = _mm_sub_ps(cz, ez);
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, _mm_loadu_ps(&meshlets.coneX[i])), _mm_mul_ps(vy, _mm_loadu_ps(&meshlets.coneY[i]))),
+                              _mm_mul_ps(vz, _mm_loadu_ps(&meshlets.coneZ[i])));
+        __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz)));
+        __m128 back = _mm_cmpge_ps(d, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&meshlets.coneCutoff[i]), length), r));
+
+        int valid = end - i < 4 ? (1 << (end - i)) - 1 : 15;
+        int insideMask = _mm_movemask_ps(inside) & valid;
+        int visibleMask = _mm_movemask_ps(_mm_andnot_ps(back, inside)) & valid;
+        for (int k = 0; k < 4; ++k)
+        {
+            if (!(valid & (1 << k)))
+                continue;
+            if (!(insideMask & (1 << k)))
+                (*frustumCulled)++;
+            else if (!(visibleMask & (1 << k)))
+                (*backfaceCulled)++;
+            else
+                out[visible++] = i + k;
+        }
+    }
+    return visible;
+}
+
+int meshlet_cull(MeshletMesh & meshlets, const glm::mat4 & objectToWorld, const Frustum & frustum,
+                 const glm::vec3 & eye, std::vector<int> & indices, MeshletStats * stats)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // Planes and eye moved to object space, where the bounds are. The sign
+    // of a backface test does not change under an affine transform.
+    glm::vec4 planes[6];
+    for (int p = 0; p < 6; ++p)
+    {
+        planes[p] = frustum.planes[p] * objectToWorld;
+        planes[p] /= glm::length(glm::vec3(planes[p]));
+    }
+    glm::vec3 localEye(glm::inverse(objectToWorld) * glm::vec4(eye, 1.f));
+
+    int count = (int) meshlets.meshlets.size();
+    int blockCount = (count + MESHLET_CULL_BLOCK - 1) / MESHLET_CULL_BLOCK;
+    meshlets.blockVisible.resize(blockCount * 3);
+    meshlets.blockIndices.resize(blockCount);
+    parallel_for(blockCount, 1, [&](int begin, int end)
+    {
+        for (int b = begin; b < end; ++b)
+        {
+            int first = b * MESHLET_CULL_BLOCK;
+            int last = first + MESHLET_CULL_BLOCK < count ? first + MESHLET_CULL_BLOCK : count;
+            int * counts = &meshlets.blockVisible[b * 3];
+            counts[1] = counts[2] = 0;
+            counts[0] = cull_range(meshlets, planes, localEye, first, last, &meshlets.visible[first], &counts[1], &counts[2]);
+            int triangles = 0;
+            for (int i = 0; i < counts[0]; ++i)
+                triangles += meshlets.meshlets[meshlets.visible[first + i]].triangleCount;
+            meshlets.blockIndices[b] = triangles * 3;
+        }
+    });
+
+    // Output offsets per block, then the indices of the visible meshlets in order
+    size_t base = indices.size();
+    int total = 0, visible = 0, frustumCulled = 0, backfaceCulled = 0;
+    for (int b = 0; b < blockCount; ++b)
+    {
+        visible += meshlets.blockVisible[b * 3];
+        frustumCulled += meshlets.blockVisible[b * 3 + 1];
+        backfaceCulled += meshlets.blockVisible[b * 3 + 2];
+        int n = meshlets.blockIndices[b];
+        meshlets.blockIndices[b] = total;
+        total += n;
+    }
+    indices.resize(base + total);
+    int * output = total ? &indices[base] : 0;
+    parallel_for(blockCount, 1, [&](int begin, int end)
+    {
+        for (int b = begin; b < end; ++b)
+        {
+            int * out = output + meshlets.blockIndices[b];
+            const int * visibleMeshlets = &meshlets.visible[b * MESHLET_CULL_BLOCK];
+            for (int i = 0; i < meshlets.blockVisible[b * 3]; ++i)
+            {
+                const Meshlet & m = meshlets.meshlets[visibleMeshlets[i]];
+                const int * vertices = &meshlets.vertices[m.vertexOffset];
+                const unsigned char * local = &meshlets.triangles[m.triangleOffset * 3];
+                for (int j = 0; j < m.triangleCount * 3; ++j)
+                    *out++ = vertices[local[j]];
+            }
+        }
+    });
+
+    if (stats)
+    {
+        stats->meshlets += count;
+        stats->frustumCulled += frustumCulled;
+        stats->backfaceCulled += backfaceCulled;
+        stats->triangles += meshlets.triangleCount;
+        stats->visibleTriangles += total / 3;
+        stats->ms += elapsed_ms(start);
+    }
+    return total;
+}
@@ -0,0 +1,61 @@
+#ifndef AOGL_MESHLET_H
+#define AOGL_MESHLET_H
+
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "mesh.h"
+#include "culling.h"
+
+const int MESHLET_MAX_VERTICES = 64;
+const int MESHLET_MAX_TRIANGLES = 124;
+
+struct Meshlet
+{
+    int vertexOffset;       // first entry in MeshletMesh::vertices
+    int triangleOffset;     // first triangle in MeshletMesh::triangles
+    int vertexCount;
+    int triangleCount;
+};
+
+// Small clusters of triangles with their culling bounds. Triangles index the
+// vertex list of their meshlet, which references the mesh vertices. Bounds
+// are stored as arrays padded to a multiple of 4 for the SSE tests.
+struct MeshletMesh
+{
+    std::vector<Meshlet> meshlets;
+    std::vector<int> vertices;
+    std::vector<unsigned char> triangles;   // 3 local indices per triangle
+    std::vector<float> centerX, centerY, centerZ, radius;
+    std::vector<float> coneX, coneY, coneZ, coneCutoff;   // cutoff 1 never culls
+    int triangleCount;
+    std::vector<int> visible;           // scratch: visible meshlets per block
+    std::vector<int> blockVisible;      // scratch: visible count per block
+    std::vector<int> blockIndices;      // scratch: output offset per block
+};
+
+struct MeshletStats
+{
+    int meshlets;
+    int frustumCulled;
+    int backfaceCulled;
+    int triangles;
+    int visibleTriangles;
+    double ms;
+};
+
+// Greedy clustering: each meshlet grows from a seed triangle by adding the
+// neighbouring triangle that brings the fewest new vertices
+void meshlet_build(const MeshData & mesh, const int * indices, int triangleCount, MeshletMesh & meshlets);
+
+// Tests the meshlets of one instance against the frustum and their normal
+// cone against the eye, both given in world space and moved to the object
+// space of the bounds, then appends the indices of the visible ones to
+// indices. Front faces are counter-clockwise, as in GL. Returns the number
+// of indices appended. Stats are accumulated so several instances can share
+// them.
+int meshlet_cull(MeshletMesh & meshlets, const glm::mat4 & objectToWorld, const Frustum & frustum,
+                 const glm::vec3 & eye, std::vector<int> & indices, MeshletStats * stats);
+
+#endif // AOGL_MESHLET_H
@@ -0,0 +1,169 @@
+#include "normalmap.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <vector>
+#include <string>
+#include <emmintrin.h>
+
+#include "stb/stb_image.h"
+#include "parallel.h"
+
+static inline void sobel_pack(float dx, float dy, float strength, unsigned char * out)
+{
+    float nx = -dx * strength;
+    float ny = -dy * strength;
+    float inv = 1.f / sqrtf(nx * nx + ny * ny + 1.f);
+    out[0] = (unsigned char) ((nx * inv * 0.5f + 0.5f) * 255.f + 0.5f);
+    out[1] = (unsigned char) ((ny * inv * 0.5f + 0.5f) * 255.f + 0.5f);
+    out[2] = (unsigned char) ((inv * 0.5f + 0.5f) * 255.f + 0.5f);
+}
+
+// t, c and b point at the first texel of the rows above, at and below y in
+// the padded float image, so that [-1] and [width] are the wrapped neighbours
+static void sobel_row(const float * t, const float * c, const float * b, int width, float strength, unsigned char * out)
+{
+    const __m128 two = _mm_set1_ps(2.f);
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 scale = _mm_set1_ps(255.f);
+    const __m128 s = _mm_set1_ps(-strength);
+    int x = 0;
+    for (; x + 4 <= width; x += 4)
+    {
+        __m128 tl = _mm_loadu_ps(t + x - 1), tc = _mm_loadu_ps(t + x), tr = _mm_loadu_ps(t + x + 1);
+        __m128 cl = _mm_loadu_ps(c + x - 1), cr = _mm_loadu_ps(c + x + 1);
+        __m128 bl = _mm_loadu_ps(b + x - 1), bc = _mm_loadu_ps(b + x), br = _mm_loadu_ps(b + x + 1);
+        __m128 dx = _mm_sub_ps(_mm_add_ps(_mm_add_ps(tr, br), _mm_mul_ps(two, cr)),
+                               _mm_add_ps(_mm_add_ps(tl, bl), _mm_mul_ps(two, cl)));
+        __m128 dy = _mm_sub_ps(_mm_add_ps(_mm_add_ps(bl, br), _mm_mul_ps(two, bc)),
+                               _mm_add_ps(_mm_add_ps(tl, tr), _mm_mul_ps(two, tc)));
+        __m128 nx = _mm_mul_ps(dx, s);
+        __m128 ny = _mm_mul_ps(dy, s);
+        __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), one));
+        __m128 inv = _mm_div_ps(one, len);
+        __m128 r = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(nx, inv), half), half), scale), half);
+        __m128 g = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(ny, inv), half), half), scale), half);
+        __m128 bz = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(inv, half), half), scale), half);
+        int ri[4], gi[4], bi[4];
+        _mm_storeu_si128((__m128i *) ri, _mm_cvttps_epi32(r));
+        _mm_storeu_si128((__m128i *) gi, _mm_cvttps_epi32(g));
+        _mm_storeu_si128((__m128i *) bi, _mm_cvttps_epi32(bz));
+        for (int k = 0; k < 4; ++k)
+        {
+            out[(x + k) * 3 + 0] = (unsigned char) ri[k];
+            out[(x + k) * 3 + 1] = (unsigned char) gi[k];
+            out[(x + k) * 3 + 2] = (unsigned char) bi[k];
+        }
+    }
+    for (; x < width; ++x)
+    {
+        float dx = (t[x + 1] + 2.f * c[x + 1] + b[x + 1]) - (t[x - 1] + 2.f * c[x - 1] + b[x - 1]);
+        float dy = (b[x - 1] + 2.f * b[x] + b[x + 1]) - (t[x - 1] + 2.f * t[x] + t[x + 1]);
+        sobel_pack(dx, dy, strength, out + x * 3);
+    }
+}
+
+void height_to_normal_map(const unsigned char * heights, int width, int height, float strength, unsigned char * normals)
+{
+    // Heights as floats in [0, 1] with one wrapped texel of padding on each side
+    int pitch = width + 2;
+    std::vector<float> padded(pitch * height);
+    const int grain = 32;
+    parallel_for(height, grain, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; ++y)
+        {
+            const unsigned char * src = heights + y * width;
+            float * dst = &padded[y * pitch];
+            for (int x = 0; x < width; ++x)
+                dst[x + 1] = src[x] * (1.f / 255.f);
+            dst[0] = dst[width];
+            dst[width + 1] = dst[1];
+        }
+    });
+    parallel_for(height, grain, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; ++y)
+        {
+            const float * t = &padded[((y + height - 1) % height) * pitch + 1];
+            const float * c = &padded[y * pitch + 1];
+            const float * b = &padded[((y + 1) % height) * pitch + 1];
+            sobel_row(t, c, b, width, strength, normals + y * width * 3);
+        }
+    });
+}
+
+struct NormalMapCacheHeader
+{
+    char magic[4];
+    int version;
+    int width;
+    int height;
+    float strength;
+    long long sourceSize;
+    long long sourceTime;
+};
+
+static const int NORMAL_MAP_CACHE_VERSION = 1;
+
+unsigned char * load_normal_map_from_height(const char * path, float strength, int * width, int * height)
+{
+    struct stat sourceStat;
+    if (stat(path, &sourceStat) != 0)
+        return 0;
+    std::string cachePath = std::string(path) + ".nrm";
+
+    // Cached conversion is valid while the source size, date and strength match
+    FILE * cache = fopen(cachePath.c_str(), "rb");
+    if (cache)
+    {
+        NormalMapCacheHeader header;
+        bool valid = fread(&header, sizeof(header), 1, cache) == 1
+            && memcmp(header.magic, "AONM", 4) == 0
+            && header.version == NORMAL_MAP_CACHE_VERSION
+            && header.strength == strength
+            && header.sourceSize == (long long) sourceStat.st_size
+            && header.sourceTime == (long long) sourceStat.st_mtime;
+        if (valid)
+        {
+            unsigned char * normals = new unsigned char[header.width * header.height * 3];
+            if (fread(normals, header.width * header.height * 3, 1, cache) == 1)
+            {
+                fclose(cache);
+                *width = header.width;
+                *height = header.height;
+                return normals;
+            }
+            delete[] normals;
+        }
+        fclose(cache);
+    }
+
+    int comp;
+    unsigned char * heights = stbi_load(path, width, height, &comp, 1);
+    if (!heights)
+        return 0;
+    unsigned char * normals = new unsigned char[*width * *height * 3];
+    height_to_normal_map(heights, *width, *height, strength, normals);
+    stbi_image_free(heights);
+
+    cache = fopen(cachePath.c_str(), "wb");
+    if (cache)
+    {
+        NormalMapCacheHeader header;
+        memcpy(header.magic, "AONM", 4);
+        header.version = NORMAL_MAP_CACHE_VERSION;
+        header.width = *width;
+        header.height = *height;
+        header.strength = strength;
+        header.sourceSize = (long long) sourceStat.st_size;
+        header.sourceTime = (long long) sourceStat.st_mtime;
+        fwrite(&header, sizeof(header), 1, cache);
+        fwrite(normals, *width * *height * 3, 1, cache);
+        fclose(cache);
+    }
+    return normals;
+}
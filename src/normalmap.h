@@ -0,0 +1,17 @@
+#ifndef AOGL_NORMALMAP_H
+#define AOGL_NORMALMAP_H
+
+// Strength the bump map is converted with, at run time and when cooked
+const float NORMAL_MAP_STRENGTH = 2.f;
+
+// Converts a single channel 8-bit height map into an RGB8 tangent-space
+// normal map with a 3x3 Sobel filter. Borders wrap like GL_REPEAT.
+// Rows are processed in bands on the worker threads, 4 texels at a time.
+void height_to_normal_map(const unsigned char * heights, int width, int height, float strength, unsigned char * normals);
+
+// Loads the height map at path and returns its normal map, reusing the
+// converted result cached in path.nrm while the source is unchanged.
+// The returned buffer is released with delete[].
+unsigned char * load_normal_map_from_height(const char * path, float strength, int * width, int * height);
+
+#endif // AOGL_NORMALMAP_H
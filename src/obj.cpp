@@ -0,0 +1,425 @@
+#include "obj.h"
+
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <vector>
+#include <algorithm>
+
+#include "glm/glm.hpp"
+#include "mapped_file.h"
+#include "parallel.h"
+#include "timer.h"
+
+namespace
+{
+
+// Corner indices are stored resolved when absolute, and relative to the
+// chunk when negative in the file, offset by OBJ_RELATIVE_BIAS so the sign
+// tells them apart until the chunk offsets are known
+const int OBJ_NONE = INT_MAX;
+const int OBJ_RELATIVE_BIAS = 1 << 30;
+
+// Target chunk size, large enough for the per chunk overhead to vanish
+const size_t OBJ_CHUNK_BYTES = 1 << 20;
+
+struct ObjChunk
+{
+    const char * begin;
+    const char * end;
+    std::vector<float> positions;
+    std::vector<float> uvs;
+    std::vector<float> normals;
+    std::vector<int> corners;       // (v, vt, vn) per triangle corner
+    int positionOffset;
+    int uvOffset;
+    int normalOffset;
+    std::vector<int> vertexKeys;    // absolute (v, vt, vn) per unique vertex, -1 when missing
+    std::vector<int> indices;       // chunk local vertex indices
+    int vertexOffset;
+    int indexOffset;
+};
+
+const double POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+inline bool is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline const char * skip_blanks(const char * p, const char * end)
+{
+    while (p < end && is_blank(*p))
+        ++p;
+    return p;
+}
+
+// Decimal float with optional sign, fraction and exponent. Up to 19
+// significant digits are accumulated exactly, the rest only scale.
+const char * parse_float(const char * p, const char * end, float & value)
+{
+    p = skip_blanks(p, end);
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    unsigned long long mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    for (; p < end && (unsigned) (*p - '0') < 10; ++p)
+    {
+        if (digits < 19)
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa)
+                ++digits;
+        }
+        else
+            ++exponent;
+    }
+    if (p < end && *p == '.')
+    {
+        for (++p; p < end && (unsigned) (*p - '0') < 10; ++p)
+        {
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa)
+                    ++digits;
+                --exponent;
+            }
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        ++p;
+        bool negativeExponent = false;
+        if (p < end && (*p == '-' || *p == '+'))
+            negativeExponent = *p++ == '-';
+        int e = 0;
+        for (; p < end && (unsigned) (*p - '0') < 10; ++p)
+            e = e < 10000 ? e * 10 + (*p - '0') : e;
+        exponent += negativeExponent ? -e : e;
+    }
+    double v = (double) mantissa;
+    while (exponent > 22)
+    {
+        v *= 1e22;
+        exponent -= 22;
+    }
+    while (exponent < -22)
+    {
+        v /= 1e22;
+        exponent += 22;
+    }
+    v = exponent >= 0 ? v * POW10[exponent] : v / POW10[-exponent];
+    value = (float) (negative ? -v : v);
+    return p;
+}
+
+const char * parse_int(const char * p, const char * end, int & value, bool & found)
+{
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    int v = 0;
+    found = false;
+    for (; p < end && (unsigned) (*p - '0') < 10; ++p)
+    {
+        v = v * 10 + (*p - '0');
+        found = true;
+    }
+    value = negative ? -v : v;
+    return p;
+}
+
+inline int encode_index(int index, bool found, int localCount)
+{
+    if (!found || index == 0)
+        return OBJ_NONE;
+    if (index > 0)
+        return index - 1;
+    return localCount + index - OBJ_RELATIVE_BIAS;
+}
+
+inline int decode_index(int index, int chunkOffset)
+{
+    if (index == OBJ_NONE)
+        return -1;
+    if (index >= 0)
+        return index;
+    return index + OBJ_RELATIVE_BIAS + chunkOffset;
+}
+
+void parse_chunk(ObjChunk & c)
+{
+    const char * p = c.begin;
+    int corner[3];
+    int first[3], previous[3];
+    while (p < c.end)
+    {
+        const char * eol = (const char *) memchr(p, '\n', c.end - p);
+        if (!eol)
+            eol = c.end;
+        p = skip_blanks(p, eol);
+        if (eol - p > 2 && p[0] == 'v')
+        {
+            float f[3];
+            if (is_blank(p[1]))
+            {
+                p = parse_float(p + 1, eol, f[0]);
+                p = parse_float(p, eol, f[1]);
+                parse_float(p, eol, f[2]);
+                c.positions.insert(c.positions.end(), f, f + 3);
+            }
+            else if (p[1] == 't' && is_blank(p[2]))
+            {
+                p = parse_float(p + 2, eol, f[0]);
+                parse_float(p, eol, f[1]);
+                c.uvs.insert(c.uvs.end(), f, f + 2);
+            }
+            else if (p[1] == 'n' && is_blank(p[2]))
+            {
+                p = parse_float(p + 2, eol, f[0]);
+                p = parse_float(p, eol, f[1]);
+                parse_float(p, eol, f[2]);
+                c.normals.insert(c.normals.end(), f, f + 3);
+            }
+        }
+        else if (eol - p > 2 && p[0] == 'f' && is_blank(p[1]))
+        {
+            // Fan triangulation of the polygon
+            int count = 0;
+            const int localCounts[3] = { (int) c.positions.size() / 3, (int) c.uvs.size() / 2, (int) c.normals.size() / 3 };
+            for (p = skip_blanks(p + 1, eol); p < eol; p = skip_blanks(p, eol))
+            {
+                int index[3] = { 0, 0, 0 };
+                bool found[3] = { false, false, false };
+                p = parse_int(p, eol, index[0], found[0]);
+                if (!found[0])
+                    break;
+                if (p < eol && *p == '/')
+                {
+                    ++p;
+                    if (p < eol && *p != '/')
+                        p = parse_int(p, eol, index[1], found[1]);
+                    if (p < eol && *p == '/')
+                        p = parse_int(p + 1, eol, index[2], found[2]);
+                }
+                for (int k = 0; k < 3; ++k)
+                    corner[k] = encode_index(index[k], found[k], localCounts[k]);
+                if (count == 0)
+                    memcpy(first, corner, sizeof(first));
+                else if (count >= 2)
+                {
+                    c.corners.insert(c.corners.end(), first, first + 3);
+                    c.corners.insert(c.corners.end(), previous, previous + 3);
+                    c.corners.insert(c.corners.end(), corner, corner + 3);
+                }
+                memcpy(previous, corner, sizeof(previous));
+                ++count;
+            }
+        }
+        p = eol + 1;
+    }
+}
+
+inline unsigned int hash_key(const int * k)
+{
+    unsigned int h = (unsigned int) k[0] * 73856093u;
+    h ^= (unsigned int) k[1] * 19349663u;
+    h ^= (unsigned int) k[2] * 83492791u;
+    return h ^ (h >> 15);
+}
+
+// Resolves the corners of a chunk and gives each distinct triplet one vertex
+void deduplicate_chunk(ObjChunk & c)
+{
+    int cornerCount = (int) c.corners.size() / 3;
+    unsigned int capacity = 16;
+    while (capacity < (unsigned int) cornerCount * 2)
+        capacity *= 2;
+    std::vector<int> table(capacity, -1);
+    c.indices.resize(cornerCount);
+    for (int i = 0; i < cornerCount; ++i)
+    {
+        int key[3] = { decode_index(c.corners[i * 3], c.positionOffset),
+                       decode_index(c.corners[i * 3 + 1], c.uvOffset),
+                       decode_index(c.corners[i * 3 + 2], c.normalOffset) };
+        unsigned int slot = hash_key(key) & (capacity - 1);
+        for (;;)
+        {
+            int v = table[slot];
+            if (v < 0)
+            {
+                v = (int) c.vertexKeys.size() / 3;
+                c.vertexKeys.insert(c.vertexKeys.end(), key, key + 3);
+                table[slot] = v;
+                c.indices[i] = v;
+                break;
+            }
+            if (memcmp(&c.vertexKeys[v * 3], key, sizeof(key)) == 0)
+            {
+                c.indices[i] = v;
+                break;
+            }
+            slot = (slot + 1) & (capacity - 1);
+        }
+    }
+    std::vector<int>().swap(c.corners);
+}
+
+}
+
+bool parse_obj(const char * text, size_t size, MeshBuffers & mesh, ObjStats * stats)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // Line aligned chunks
+    size_t chunkCount = size / OBJ_CHUNK_BYTES + 1;
+    std::vector<ObjChunk> chunks(chunkCount);
+    const char * end = text + size;
+    const char * p = text;
+    for (size_t i = 0; i < chunkCount; ++i)
+    {
+        const char * chunkEnd = i + 1 == chunkCount ? end : text + size * (i + 1) / chunkCount;
+        if (chunkEnd < p)
+            chunkEnd = p;
+        const char * eol = chunkEnd < end ? (const char *) memchr(chunkEnd, '\n', end - chunkEnd) : 0;
+        chunkEnd = eol ? eol + 1 : end;
+        chunks[i].begin = p;
+        chunks[i].end = chunkEnd;
+        p = chunkEnd;
+    }
+    parallel_for((int) chunkCount, 1, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; ++i)
+            parse_chunk(chunks[i]);
+    });
+    double parseMs = elapsed_ms(start);
+
+    // Gather the attribute arrays, file order is kept so indices stay valid
+    std::chrono::steady_clock::time_point mergeStart = std::chrono::steady_clock::now();
+    int positionCount = 0, uvCount = 0, normalCount = 0;
+    for (size_t i = 0; i < chunkCount; ++i)
+    {
+        chunks[i].positionOffset = positionCount;
+        chunks[i].uvOffset = uvCount;
+        chunks[i].normalOffset = normalCount;
+        positionCount += (int) chunks[i].positions.size() / 3;
+        uvCount += (int) chunks[i].uvs.size() / 2;
+        normalCount += (int) chunks[i].normals.size() / 3;
+    }
+    if (positionCount == 0)
+        return false;
+    std::vector<float> positions(positionCount * 3), uvs(uvCount * 2), normals(normalCount * 3);
+    parallel_for((int) chunkCount, 1, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; ++i)
+        {
+            ObjChunk & c = chunks[i];
+            std::copy(c.positions.begin(), c.positions.end(), positions.begin() + c.positionOffset * 3);
+            std::copy(c.uvs.begin(), c.uvs.end(), uvs.begin() + c.uvOffset * 2);
+            std::copy(c.normals.begin(), c.normals.end(), normals.begin() + c.normalOffset * 3);
+            std::vector<float>().swap(c.positions);
+            std::vector<float>().swap(c.uvs);
+            std::vector<float>().swap(c.normals);
+            deduplicate_chunk(c);
+        }
+    });
+
+    int vertexCount = 0, indexCount = 0;
+    for (size_t i = 0; i < chunkCount; ++i)
+    {
+        chunks[i].vertexOffset = vertexCount;
+        chunks[i].indexOffset = indexCount;
+        vertexCount += (int) chunks[i].vertexKeys.size() / 3;
+        indexCount += (int) chunks[i].indices.size();
+    }
+    mesh.vertices.resize(vertexCount * 3);
+    mesh.uvs.assign(vertexCount * 2, 0.f);
+    mesh.normals.assign(vertexCount * 3, 0.f);
+    mesh.tangents.resize(vertexCount * 4);
+    mesh.triangleList.resize(indexCount);
+    std::vector<char> missingNormals(chunkCount, 0);
+    parallel_for((int) chunkCount, 1, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; ++i)
+        {
+            ObjChunk & c = chunks[i];
+            int n = (int) c.vertexKeys.size() / 3;
+            for (int v = 0; v < n; ++v)
+            {
+                const int * key = &c.vertexKeys[v * 3];
+                int dst = c.vertexOffset + v;
+                int pi = key[0] >= 0 && key[0] < positionCount ? key[0] : 0;
+                memcpy(&mesh.vertices[dst * 3], &positions[pi * 3], 3 * sizeof(float));
+                if (key[1] >= 0 && key[1] < uvCount)
+                    memcpy(&mesh.uvs[dst * 2], &uvs[key[1] * 2], 2 * sizeof(float));
+                if (key[2] >= 0 && key[2] < normalCount)
+                    memcpy(&mesh.normals[dst * 3], &normals[key[2] * 3], 3 * sizeof(float));
+                else
+                    missingNormals[i] = 1;
+            }
+            for (size_t k = 0; k < c.indices.size(); ++k)
+                mesh.triangleList[c.indexOffset + k] = c.indices[k] + c.vertexOffset;
+        }
+    });
+
+    // Area weighted face normals for vertices the file gives no normal
+    if (std::find(missingNormals.begin(), missingNormals.end(), 1) != missingNormals.end())
+    {
+        std::vector<glm::vec3> accumulated(vertexCount, glm::vec3(0.f));
+        const glm::vec3 * v = (const glm::vec3 *) &mesh.vertices[0];
+        for (int i = 0; i < indexCount; i += 3)
+        {
+            const int * t = &mesh.triangleList[i];
+            glm::vec3 n = glm::cross(v[t[1]] - v[t[0]], v[t[2]] - v[t[0]]);
+            accumulated[t[0]] += n;
+            accumulated[t[1]] += n;
+            accumulated[t[2]] += n;
+        }
+        for (int i = 0; i < vertexCount; ++i)
+        {
+            float * n = &mesh.normals[i * 3];
+            if (n[0] != 0.f || n[1] != 0.f || n[2] != 0.f)
+                continue;
+            float len = glm::length(accumulated[i]);
+            glm::vec3 a = len > 0.f ? accumulated[i] / len : glm::vec3(0.f, 1.f, 0.f);
+            n[0] = a.x;
+            n[1] = a.y;
+            n[2] = a.z;
+        }
+    }
+    double mergeMs = elapsed_ms(mergeStart);
+    if (indexCount == 0)
+        return false;
+
+    std::chrono::steady_clock::time_point tangentStart = std::chrono::steady_clock::now();
+    compute_tangents(&mesh.triangleList[0], indexCount / 3, &mesh.vertices[0], &mesh.normals[0], &mesh.uvs[0], vertexCount, &mesh.tangents[0]);
+
+    if (stats)
+    {
+        stats->bytes = size;
+        stats->chunks = (int) chunkCount;
+        stats->vertexCount = vertexCount;
+        stats->triangleCount = indexCount / 3;
+        stats->parseMs = parseMs;
+        stats->mergeMs = mergeMs;
+        stats->tangentMs = elapsed_ms(tangentStart);
+        stats->totalMs = elapsed_ms(start);
+    }
+    return indexCount > 0;
+}
+
+bool load_obj(const char * path, MeshBuffers & mesh, ObjStats * stats)
+{
+    MappedFile f;
+    if (!map_file(f, path))
+        return false;
+    bool ok = f.size > 0 && parse_obj((const char *) f.data, f.size, mesh, stats);
+    unmap_file(f);
+    return ok;
+}
@@ -0,0 +1,29 @@
+#ifndef AOGL_OBJ_H
+#define AOGL_OBJ_H
+
+#include <stddef.h>
+
+#include "mesh.h"
+
+struct ObjStats
+{
+    size_t bytes;
+    int chunks;
+    int vertexCount;
+    int triangleCount;
+    double parseMs;     // line parsing, in parallel over chunks
+    double mergeMs;     // index resolution, vertex deduplication and merge
+    double tangentMs;
+    double totalMs;
+};
+
+// Wavefront OBJ importer. The text is split in line aligned chunks parsed in
+// parallel, each chunk deduplicates its (position, uv, normal) triplets and
+// the results are concatenated into buffers ready for mesh_upload. Polygons
+// are triangulated as fans, missing normals are computed per vertex.
+bool parse_obj(const char * text, size_t size, MeshBuffers & mesh, ObjStats * stats);
+
+// Same on a memory-mapped file
+bool load_obj(const char * path, MeshBuffers & mesh, ObjStats * stats);
+
+#endif // AOGL_OBJ_H
@@ -0,0 +1,258 @@
+#include "occlusion.h"
+
+#include <math.h>
+#include <float.h>
+#include <emmintrin.h>
+
+#include "parallel.h"
+#include "timer.h"
+
+static const int OCCLUSION_TILES_X = OCCLUSION_WIDTH / OCCLUSION_TILE;
+static const int OCCLUSION_TILES_Y = OCCLUSION_HEIGHT / OCCLUSION_TILE;
+static const int OCCLUSION_BLOCKS_X = OCCLUSION_WIDTH / OCCLUSION_BLOCK;
+static const int OCCLUSION_BLOCKS_Y = OCCLUSION_HEIGHT / OCCLUSION_BLOCK;
+
+static inline int imin(int a, int b)
+{
+    return a < b ? a : b;
+}
+
+static inline int imax(int a, int b)
+{
+    return a > b ? a : b;
+}
+
+static inline float hmin(__m128 v)
+{
+    v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(v);
+}
+
+static inline float hmax(__m128 v)
+{
+    v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(v);
+}
+
+void occlusion_init(OcclusionBuffer & buffer)
+{
+    buffer.depth.assign(OCCLUSION_WIDTH * OCCLUSION_HEIGHT, 1.f);
+    buffer.blockDepth.assign(OCCLUSION_BLOCKS_X * OCCLUSION_BLOCKS_Y, 1.f);
+    buffer.bins.resize(OCCLUSION_TILES_X * OCCLUSION_TILES_Y);
+    buffer.occluderTriangles = 0;
+    buffer.rasterMs = 0.0;
+}
+
+// Projects a clip space triangle to pixels, counter-clockwise on screen.
+// Returns false for triangles crossing the near plane, degenerate or off-screen.
+static bool setup_triangle(const glm::vec4 * clip[3], OcclusionTriangle & t)
+{
+    for (int k = 0; k < 3; ++k)
+    {
+        const glm::vec4 & c = *clip[k];
+        if (c.z < -c.w || c.w <= 0.f)
+            return false;
+        float invW = 1.f / c.w;
+        t.x[k] = (c.x * invW * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+        t.y[k] = (c.y * invW * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+        t.z[k] = c.z * invW * 0.5f + 0.5f;
+    }
+    float area = (t.x[1] - t.x[0]) * (t.y[2] - t.y[0]) - (t.x[2] - t.x[0]) * (t.y[1] - t.y[0]);
+    if (fabsf(area) < 1e-6f)
+        return false;
+    if (area < 0.f)
+    {
+        float x = t.x[1], y = t.y[1], z = t.z[1];
+        t.x[1] = t.x[2]; t.y[1] = t.y[2]; t.z[1] = t.z[2];
+        t.x[2] = x; t.y[2] = y; t.z[2] = z;
+    }
+    t.minX = imax(0, (int) floorf(fminf(t.x[0], fminf(t.x[1], t.x[2]))));
+    t.minY = imax(0, (int) floorf(fminf(t.y[0], fminf(t.y[1], t.y[2]))));
+    t.maxX = imin(OCCLUSION_WIDTH - 1, (int) floorf(fmaxf(t.x[0], fmaxf(t.x[1], t.x[2]))));
+    t.maxY = imin(OCCLUSION_HEIGHT - 1, (int) floorf(fmaxf(t.y[0], fmaxf(t.y[1], t.y[2]))));
+    return t.minX <= t.maxX && t.minY <= t.maxY;
+}
+
+// Rasterizes the part of a triangle inside one tile, 4 pixels at a time,
+// keeping the nearest depth at pixel centers
+static void raster_triangle(float * depth, const OcclusionTriangle & t, int tileX, int tileY)
+{
+    // Edge e goes from vertex e to e + 1, its function is positive inside
+    float a[3], b[3], c[3];
+    for (int e = 0; e < 3; ++e)
+    {
+        int i = e, j = (e + 1) % 3;
+        a[e] = t.y[i] - t.y[j];
+        b[e] = t.x[j] - t.x[i];
+        c[e] = t.x[i] * t.y[j] - t.x[j] * t.y[i];
+    }
+    // Depth plane from the barycentric weights, edge e is opposite vertex e + 2
+    float invArea = 1.f / (a[0] * t.x[2] + b[0] * t.y[2] + c[0]);
+    float za = (a[1] * t.z[0] + a[2] * t.z[1] + a[0] * t.z[2]) * invArea;
+    float zb = (b[1] * t.z[0] + b[2] * t.z[1] + b[0] * t.z[2]) * invArea;
+    float zc = (c[1] * t.z[0] + c[2] * t.z[1] + c[0] * t.z[2]) * invArea;
+
+    int x0 = imax(t.minX, tileX) & ~3, x1 = imin(t.maxX, tileX + OCCLUSION_TILE - 1);
+    int y0 = imax(t.minY, tileY), y1 = imin(t.maxY, tileY + OCCLUSION_TILE - 1);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 step = _mm_set1_ps(4.f);
+    __m128 a0 = _mm_set1_ps(a[0]), a1 = _mm_set1_ps(a[1]), a2 = _mm_set1_ps(a[2]), az = _mm_set1_ps(za);
+    for (int y = y0; y <= y1; ++y)
+    {
+        float py = y + 0.5f;
+        __m128 px = _mm_add_ps(_mm_set1_ps((float) x0), _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f));
+        __m128 r0 = _mm_set1_ps(b[0] * py + c[0]), r1 = _mm_set1_ps(b[1] * py + c[1]), r2 = _mm_set1_ps(b[2] * py + c[2]);
+        __m128 rz = _mm_set1_ps(zb * py + zc);
+        float * row = depth + y * OCCLUSION_WIDTH;
+        for (int x = x0; x <= x1; x += 4, px = _mm_add_ps(px, step))
+        {
+            __m128 e0 = _mm_add_ps(_mm_mul_ps(a0, px), r0);
+            __m128 e1 = _mm_add_ps(_mm_mul_ps(a1, px), r1);
+            __m128 e2 = _mm_add_ps(_mm_mul_ps(a2, px), r2);
+            __m128 inside = _mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_and_ps(_mm_cmpge_ps(e1, zero), _mm_cmpge_ps(e2, zero)));
+            if (!_mm_movemask_ps(inside))
+                continue;
+            __m128 z = _mm_add_ps(_mm_mul_ps(az, px), rz);
+            __m128 old = _mm_loadu_ps(row + x);
+            __m128 nearest = _mm_min_ps(old, z);
+            _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, old)));
+        }
+    }
+}
+
+void occlusion_render(OcclusionBuffer & buffer, const glm::mat4 & viewProjection,
+                      const MeshData & mesh, const glm::mat4 * transforms, int count)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    buffer.viewProjection = viewProjection;
+    buffer.triangles.resize(count * mesh.triangleCount);
+
+    // Transform and set up the triangles of every occluder
+    parallel_for(count, 4, [&](int begin, int end)
+    {
+        std::vector<glm::vec4> clip(mesh.vertexCount);
+        for (int i = begin; i < end; ++i)
+        {
+            glm::mat4 m = viewProjection * transforms[i];
+            for (int v = 0; v < mesh.vertexCount; ++v)
+                clip[v] = m * glm::vec4(mesh.vertices[v * 3], mesh.vertices[v * 3 + 1], mesh.vertices[v * 3 + 2], 1.f);
+            for (int t = 0; t < mesh.triangleCount; ++t)
+            {
+                const int * indices = mesh.triangleList + t * 3;
+                const glm::vec4 * corners[3] = { &clip[indices[0]], &clip[indices[1]], &clip[indices[2]] };
+                OcclusionTriangle & triangle = buffer.triangles[i * mesh.triangleCount + t];
+                if (!setup_triangle(corners, triangle))
+                    triangle.minX = triangle.maxX + 1;
+            }
+        }
+    });
+
+    // Bin triangles to the tiles they overlap
+    for (size_t i = 0; i < buffer.bins.size(); ++i)
+        buffer.bins[i].clear();
+    buffer.occluderTriangles = 0;
+    for (int i = 0; i < (int) buffer.triangles.size(); ++i)
+    {
+        const OcclusionTriangle & t = buffer.triangles[i];
+        if (t.minX > t.maxX)
+            continue;
+        buffer.occluderTriangles++;
+        for (int ty = t.minY / OCCLUSION_TILE; ty <= t.maxY / OCCLUSION_TILE; ++ty)
+            for (int tx = t.minX / OCCLUSION_TILE; tx <= t.maxX / OCCLUSION_TILE; ++tx)
+                buffer.bins[ty * OCCLUSION_TILES_X + tx].push_back(i);
+    }
+
+    // Tiles own disjoint pixels, so each one is cleared, rasterized and
+    // reduced to block depths independently
+    parallel_for(OCCLUSION_TILES_X * OCCLUSION_TILES_Y, 1, [&](int begin, int end)
+    {
+        for (int tile = begin; tile < end; ++tile)
+        {
+            int tileX = (tile % OCCLUSION_TILES_X) * OCCLUSION_TILE;
+            int tileY = (tile / OCCLUSION_TILES_X) * OCCLUSION_TILE;
+            float * depth = &buffer.depth[0];
+            for (int y = tileY; y < tileY + OCCLUSION_TILE; ++y)
+                for (int x = tileX; x < tileX + OCCLUSION_TILE; x += 4)
+                    _mm_storeu_ps(depth + y * OCCLUSION_WIDTH + x, _mm_set1_ps(1.f));
+
+            const std::vector<int> & bin = buffer.bins[tile];
+            for (size_t i = 0; i < bin.size(); ++i)
+                raster_triangle(depth, buffer.triangles[bin[i]], tileX, tileY);
+
+            for (int by = tileY; by < tileY + OCCLUSION_TILE; by += OCCLUSION_BLOCK)
+                for (int bx = tileX; bx < tileX + OCCLUSION_TILE; bx += OCCLUSION_BLOCK)
+                {
+                    __m128 farthest = _mm_setzero_ps();
+                    for (int y = by; y < by + OCCLUSION_BLOCK; ++y)
+                    {
+                        const float * row = depth + y * OCCLUSION_WIDTH + bx;
+                        farthest = _mm_max_ps(farthest, _mm_max_ps(_mm_loadu_ps(row), _mm_loadu_ps(row + 4)));
+                    }
+                    buffer.blockDepth[(by / OCCLUSION_BLOCK) * OCCLUSION_BLOCKS_X + bx / OCCLUSION_BLOCK] = hmax(farthest);
+                }
+        }
+    });
+
+    buffer.rasterMs = elapsed_ms(start);
+}
+
+bool occlusion_test_aabb(const OcclusionBuffer & buffer, const glm::vec3 & center, const glm::vec3 & extent)
+{
+    // Project the 8 corners, 4 at a time, to a pixel rectangle and the depth
+    // of the nearest corner
+    const glm::mat4 & m = buffer.viewProjection;
+    __m128 px = _mm_add_ps(_mm_set1_ps(center.x), _mm_mul_ps(_mm_setr_ps(-1.f, 1.f, -1.f, 1.f), _mm_set1_ps(extent.x)));
+    __m128 py = _mm_add_ps(_mm_set1_ps(center.y), _mm_mul_ps(_mm_setr_ps(-1.f, -1.f, 1.f, 1.f), _mm_set1_ps(extent.y)));
+    __m128 minX = _mm_set1_ps(FLT_MAX), minY = minX, minZ = minX;
+    __m128 maxX = _mm_set1_ps(-FLT_MAX), maxY = maxX;
+    for (int side = 0; side < 2; ++side)
+    {
+        __m128 pz = _mm_set1_ps(side ? center.z + extent.z : center.z - extent.z);
+        __m128 clip[4];
+        for (int r = 0; r < 4; ++r)
+            clip[r] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[0][r]), px), _mm_mul_ps(_mm_set1_ps(m[1][r]), py)),
+                                 _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[2][r]), pz), _mm_set1_ps(m[3][r])));
+        // Boxes reaching the near plane are always visible
+        if (_mm_movemask_ps(_mm_cmplt_ps(clip[2], _mm_sub_ps(_mm_setzero_ps(), clip[3]))))
+            return true;
+        __m128 half = _mm_set1_ps(0.5f);
+        __m128 invW = _mm_div_ps(half, clip[3]);
+        __m128 x = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(clip[0], invW), half), _mm_set1_ps((float) OCCLUSION_WIDTH));
+        __m128 y = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(clip[1], invW), half), _mm_set1_ps((float) OCCLUSION_HEIGHT));
+        __m128 z = _mm_add_ps(_mm_mul_ps(clip[2], invW), half);
+        minX = _mm_min_ps(minX, x); maxX = _mm_max_ps(maxX, x);
+        minY = _mm_min_ps(minY, y); maxY = _mm_max_ps(maxY, y);
+        minZ = _mm_min_ps(minZ, z);
+    }
+    int x0 = imax(0, (int) floorf(hmin(minX))), x1 = imin(OCCLUSION_WIDTH - 1, (int) floorf(hmax(maxX)));
+    int y0 = imax(0, (int) floorf(hmin(minY))), y1 = imin(OCCLUSION_HEIGHT - 1, (int) floorf(hmax(maxY)));
+    if (x0 > x1 || y0 > y1)
+        return true;
+    float nearest = hmin(minZ);
+
+    // Visible as soon as one covered pixel has its occluder behind the box.
+    // Blocks whose farthest pixel is in front of the box are skipped whole.
+    __m128 boxDepth = _mm_set1_ps(nearest);
+    __m128 left = _mm_set1_ps((float) x0 - 0.5f), right = _mm_set1_ps((float) x1 + 0.5f);
+    for (int by = y0 / OCCLUSION_BLOCK; by <= y1 / OCCLUSION_BLOCK; ++by)
+        for (int bx = x0 / OCCLUSION_BLOCK; bx <= x1 / OCCLUSION_BLOCK; ++bx)
+        {
+            if (buffer.blockDepth[by * OCCLUSION_BLOCKS_X + bx] < nearest)
+                continue;
+            int rowBegin = imax(y0, by * OCCLUSION_BLOCK), rowEnd = imin(y1, by * OCCLUSION_BLOCK + OCCLUSION_BLOCK - 1);
+            for (int x = bx * OCCLUSION_BLOCK; x < bx * OCCLUSION_BLOCK + OCCLUSION_BLOCK; x += 4)
+            {
+                __m128 xs = _mm_add_ps(_mm_set1_ps((float) x), _mm_setr_ps(0.f, 1.f, 2.f, 3.f));
+                __m128 columns = _mm_and_ps(_mm_cmpgt_ps(xs, left), _mm_cmplt_ps(xs, right));
+                for (int y = rowBegin; y <= rowEnd; ++y)
+                {
+                    __m128 behind = _mm_cmpge_ps(_mm_loadu_ps(&buffer.depth[y * OCCLUSION_WIDTH + x]), boxDepth);
+                    if (_mm_movemask_ps(_mm_and_ps(behind, columns)))
+                        return true;
+                }
+            }
+        }
+    return false;
+}
@@ -0,0 +1,46 @@
+#ifndef AOGL_OCCLUSION_H
+#define AOGL_OCCLUSION_H
+
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "mesh.h"
+
+const int OCCLUSION_WIDTH = 256;
+const int OCCLUSION_HEIGHT = 128;
+const int OCCLUSION_TILE = 32;      // tiles are rasterized in parallel
+const int OCCLUSION_BLOCK = 8;      // hierarchical depth resolution
+
+// Occluder triangle in depth buffer pixels, z is the [0, 1] window depth
+struct OcclusionTriangle
+{
+    float x[3], y[3], z[3];
+    int minX, minY, maxX, maxY;
+};
+
+// Low resolution depth buffer of a few occluder meshes. Every pixel keeps
+// the nearest occluder depth, every 8x8 block the farthest of its pixels so
+// most boxes are accepted or rejected without touching single pixels.
+struct OcclusionBuffer
+{
+    glm::mat4 viewProjection;
+    std::vector<float> depth;
+    std::vector<float> blockDepth;
+    std::vector<OcclusionTriangle> triangles;
+    std::vector< std::vector<int> > bins;   // triangles overlapping each tile
+    int occluderTriangles;
+    double rasterMs;
+};
+
+void occlusion_init(OcclusionBuffer & buffer);
+
+// Clears the buffer and rasterizes count instances of mesh. Triangles that
+// cross the near plane are skipped, which only makes culling less aggressive.
+void occlusion_render(OcclusionBuffer & buffer, const glm::mat4 & viewProjection,
+                      const MeshData & mesh, const glm::mat4 * transforms, int count);
+
+// False when the box is entirely behind the occluders
+bool occlusion_test_aabb(const OcclusionBuffer & buffer, const glm::vec3 & center, const glm::vec3 & extent);
+
+#endif // AOGL_OCCLUSION_H
@@ -0,0 +1,139 @@
+#include "parallel.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+
+namespace
+{
+
+struct Job
+{
+    const std::function<void(int, int)> * fn;
+    int count;
+    int grain;
+    std::atomic<int> next;
+    int workers;                        // workers currently inside this job
+
+    void run_ranges()
+    {
+        for (;;)
+        {
+            int begin = next.fetch_add(grain);
+            if (begin >= count)
+                break;
+            int end = begin + grain < count ? begin + grain : count;
+            (*fn)(begin, end);
+        }
+    }
+};
+
+struct WorkerPool
+{
+    std::vector<std::thread> threads;
+    std::mutex busy;                    // held by the thread submitting a job
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    Job * job;
+    unsigned int generation;
+    bool quit;
+
+    WorkerPool() : job(0), generation(0), quit(false)
+    {
+        unsigned int n = std::thread::hardware_concurrency();
+        for (unsigned int i = 1; i < n; ++i)
+            threads.push_back(std::thread(&WorkerPool::worker, this));
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            quit = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < threads.size(); ++i)
+            threads[i].join();
+    }
+
+    void worker();
+};
+
+thread_local bool insideParallelFor = false;
+
+void WorkerPool::worker()
+{
+    insideParallelFor = true;
+    unsigned int seen = 0;
+    for (;;)
+    {
+        Job * current;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [&] { return quit || (job && generation != seen); });
+            if (quit)
+                return;
+            seen = generation;
+            current = job;
+            ++current->workers;
+        }
+        current->run_ranges();
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            --current->workers;
+        }
+        done.notify_all();
+    }
+}
+
+WorkerPool & pool()
+{
+    static WorkerPool p;
+    return p;
+}
+
+}
+
+int parallel_thread_count()
+{
+    return (int) pool().threads.size() + 1;
+}
+
+void parallel_for(int count, int grain, const std::function<void(int begin, int end)> & fn)
+{
+    if (count <= 0)
+        return;
+    if (grain < 1)
+        grain = 1;
+    WorkerPool & p = pool();
+    if (insideParallelFor || count <= grain || p.threads.empty() || !p.busy.try_lock())
+    {
+        fn(0, count);
+        return;
+    }
+    Job job;
+    job.fn = &fn;
+    job.count = count;
+    job.grain = grain;
+    job.next = 0;
+    job.workers = 0;
+    {
+        std::lock_guard<std::mutex> guard(p.lock);
+        p.job = &job;
+        ++p.generation;
+    }
+    p.wake.notify_all();
+    insideParallelFor = true;
+    job.run_ranges();
+    insideParallelFor = false;
+    {
+        // Workers waking after this point do not see the job anymore
+        std::unique_lock<std::mutex> guard(p.lock);
+        p.job = 0;
+        p.done.wait(guard, [&] { return job.workers == 0; });
+    }
+    p.busy.unlock();
+}
@@ -0,0 +1,14 @@
+#ifndef AOGL_PARALLEL_H
+#define AOGL_PARALLEL_H
+
+#include <functional>
+
+// Number of threads parallel_for spreads work on, including the caller
+int parallel_thread_count();
+
+// Splits [0, count[ into ranges of at least grain items and runs fn(begin, end)
+// on the worker pool. Returns once every range is done. Nested calls, or calls
+// made while another thread owns the pool, run serially on the caller.
+void parallel_for(int count, int grain, const std::function<void(int begin, int end)> & fn);
+
+#endif // AOGL_PARALLEL_H
@@ -0,0 +1,133 @@
+#include "picking.h"
+
+#include <math.h>
+#include <float.h>
+
+#include "timer.h"
+
+namespace
+{
+
+// Moller-Trumbore, both faces
+float triangle_intersect(void * user, int triangle, const glm::vec3 & origin, const glm::vec3 & direction, float tMax)
+{
+    const MeshData & mesh = *(const MeshData *) user;
+    const int * t = mesh.triangleList + triangle * 3;
+    glm::vec3 p0(mesh.vertices[t[0] * 3], mesh.vertices[t[0] * 3 + 1], mesh.vertices[t[0] * 3 + 2]);
+    glm::vec3 p1(mesh.vertices[t[1] * 3], mesh.vertices[t[1] * 3 + 1], mesh.vertices[t[1] * 3 + 2]);
+    glm::vec3 p2(mesh.vertices[t[2] * 3], mesh.vertices[t[2] * 3 + 1], mesh.vertices[t[2] * 3 + 2]);
+    glm::vec3 e1 = p1 - p0;
+    glm::vec3 e2 = p2 - p0;
+    glm::vec3 p = glm::cross(direction, e2);
+    float det = glm::dot(e1, p);
+    if (fabsf(det) < 1e-12f)
+        return FLT_MAX;
+    float invDet = 1.f / det;
+    glm::vec3 s = origin - p0;
+    float u = glm::dot(s, p) * invDet;
+    if (u < 0.f || u > 1.f)
+        return FLT_MAX;
+    glm::vec3 q = glm::cross(s, e1);
+    float v = glm::dot(direction, q) * invDet;
+    if (v < 0.f || u + v > 1.f)
+        return FLT_MAX;
+    float distance = glm::dot(e2, q) * invDet;
+    return distance >= 0.f && distance < tMax ? distance : FLT_MAX;
+}
+
+struct InstanceQuery
+{
+    const PickScene * scene;
+    int triangle;
+};
+
+// The ray is moved to object space without normalizing the direction so
+// distances stay comparable between instances
+float instance_intersect(void * user, int instance, const glm::vec3 & origin, const glm::vec3 & direction, float tMax)
+{
+    InstanceQuery & query = *(InstanceQuery *) user;
+    const PickMesh & mesh = *query.scene->mesh;
+    const glm::mat4 & worldToObject = query.scene->worldToObject[instance];
+    glm::vec3 localOrigin(worldToObject * glm::vec4(origin, 1.f));
+    glm::vec3 localDirection(worldToObject * glm::vec4(direction, 0.f));
+    float t = tMax;
+    int triangle = bvh_raycast(mesh.bvh, localOrigin, localDirection, t, triangle_intersect, (void *) &mesh.mesh);
+    if (triangle < 0)
+        return FLT_MAX;
+    query.triangle = triangle;
+    return t;
+}
+
+}
+
+void pick_mesh_build(PickMesh & pick, const MeshData & mesh)
+{
+    pick.mesh = mesh;
+    pick.boundsMin = glm::vec3(FLT_MAX);
+    pick.boundsMax = glm::vec3(-FLT_MAX);
+    std::vector<glm::vec3> boundsMin(mesh.triangleCount, glm::vec3(FLT_MAX));
+    std::vector<glm::vec3> boundsMax(mesh.triangleCount, glm::vec3(-FLT_MAX));
+    for (int i = 0; i < mesh.triangleCount; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            const float * v = mesh.vertices + mesh.triangleList[i * 3 + j] * 3;
+            glm::vec3 p(v[0], v[1], v[2]);
+            boundsMin[i] = glm::min(boundsMin[i], p);
+            boundsMax[i] = glm::max(boundsMax[i], p);
+        }
+        pick.boundsMin = glm::min(pick.boundsMin, boundsMin[i]);
+        pick.boundsMax = glm::max(pick.boundsMax, boundsMax[i]);
+    }
+    if (mesh.triangleCount)
+        bvh_build(pick.bvh, &boundsMin[0], &boundsMax[0], mesh.triangleCount);
+    else
+        pick.bvh = Bvh();
+}
+
+void pick_scene_build(PickScene & scene, const PickMesh & mesh, const glm::mat4 * transforms, int count)
+{
+    scene.mesh = &mesh;
+    scene.worldToObject.resize(count);
+    std::vector<glm::vec3> boundsMin(count), boundsMax(count);
+    glm::vec3 center = (mesh.boundsMin + mesh.boundsMax) * 0.5f;
+    glm::vec3 extent = (mesh.boundsMax - mesh.boundsMin) * 0.5f;
+    for (int i = 0; i < count; ++i)
+    {
+        const glm::mat4 & m = transforms[i];
+        scene.worldToObject[i] = glm::inverse(m);
+        glm::vec3 worldCenter(m * glm::vec4(center, 1.f));
+        glm::vec3 worldExtent = glm::abs(glm::vec3(m[0])) * extent.x
+                              + glm::abs(glm::vec3(m[1])) * extent.y
+                              + glm::abs(glm::vec3(m[2])) * extent.z;
+        boundsMin[i] = worldCenter - worldExtent;
+        boundsMax[i] = worldCenter + worldExtent;
+    }
+    if (count && !mesh.bvh.nodes.empty())
+        bvh_build(scene.bvh, &boundsMin[0], &boundsMax[0], count);
+    else
+        scene.bvh = Bvh();
+}
+
+void pick_ray(const glm::mat4 & viewProjection, const glm::vec3 & eye, double x, double y,
+              int windowWidth, int windowHeight, glm::vec3 & origin, glm::vec3 & direction)
+{
+    float ndcX = (float) (2.0 * x / windowWidth - 1.0);
+    float ndcY = (float) (1.0 - 2.0 * y / windowHeight);
+    glm::vec4 far = glm::inverse(viewProjection) * glm::vec4(ndcX, ndcY, 1.f, 1.f);
+    origin = eye;
+    direction = glm::normalize(glm::vec3(far) / far.w - eye);
+}
+
+bool pick_raycast(const PickScene & scene, const glm::vec3 & origin, const glm::vec3 & direction, PickHit & hit)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    InstanceQuery query = { &scene, -1 };
+    float t = FLT_MAX;
+    hit.instance = bvh_raycast(scene.bvh, origin, direction, t, instance_intersect, &query);
+    hit.triangle = hit.instance >= 0 ? query.triangle : -1;
+    hit.distance = t;
+    hit.position = hit.instance >= 0 ? origin + direction * t : glm::vec3(0.f);
+    hit.ms = elapsed_ms(start);
+    return hit.instance >= 0;
+}
@@ -0,0 +1,49 @@
+#ifndef AOGL_PICKING_H
+#define AOGL_PICKING_H
+
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "mesh.h"
+#include "bvh.h"
+
+// Triangles of a mesh with a BVH over them, shared by all its instances
+struct PickMesh
+{
+    MeshData mesh;
+    Bvh bvh;
+    glm::vec3 boundsMin, boundsMax;
+};
+
+// Instances of one mesh with a BVH over their world space bounds
+struct PickScene
+{
+    const PickMesh * mesh;
+    std::vector<glm::mat4> worldToObject;
+    Bvh bvh;
+};
+
+struct PickHit
+{
+    int instance;       // -1 on a miss
+    int triangle;
+    float distance;     // in units of the ray direction
+    glm::vec3 position;
+    double ms;
+};
+
+// The mesh data must outlive the pick mesh
+void pick_mesh_build(PickMesh & pick, const MeshData & mesh);
+void pick_scene_build(PickScene & scene, const PickMesh & mesh, const glm::mat4 * transforms, int count);
+
+// Ray from the eye through a window position in pixels, origin at the top
+// left as returned by glfwGetCursorPos
+void pick_ray(const glm::mat4 & viewProjection, const glm::vec3 & eye, double x, double y,
+              int windowWidth, int windowHeight, glm::vec3 & origin, glm::vec3 & direction);
+
+// Closest triangle along the ray: instance boxes first, then the triangles
+// of the instances whose box is hit, in object space
+bool pick_raycast(const PickScene & scene, const glm::vec3 & origin, const glm::vec3 & direction, PickHit & hit);
+
+#endif // AOGL_PICKING_H
@@ -0,0 +1,104 @@
+#include "pipeline.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "timer.h"
+
+bool PipelineStagesLess::operator()(const PipelineStages & a, const PipelineStages & b) const
+{
+    return memcmp(&a, &b, sizeof(PipelineStages)) < 0;
+}
+
+void pipeline_cache_init(PipelineCache & cache)
+{
+    cache.bound = 0;
+    memset(&cache.stats, 0, sizeof(cache.stats));
+}
+
+void pipeline_cache_release(PipelineCache & cache)
+{
+    glBindProgramPipeline(0);
+    for (std::map<PipelineStages, GLuint, PipelineStagesLess>::iterator it = cache.pipelines.begin(); it != cache.pipelines.end(); ++it)
+        glDeleteProgramPipelines(1, &it->second);
+    for (std::map<std::string, GLuint>::iterator it = cache.programs.begin(); it != cache.programs.end(); ++it)
+        glDeleteProgram(it->second);
+    cache.pipelines.clear();
+    cache.programs.clear();
+    cache.bound = 0;
+}
+
+GLuint pipeline_program(PipelineCache & cache, const char * name, const GLuint * shaders, int shaderCount)
+{
+    std::map<std::string, GLuint>::iterator found = cache.programs.find(name);
+    if (found != cache.programs.end())
+        return found->second;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    GLuint program = glCreateProgram();
+    glProgramParameteri(program, GL_PROGRAM_SEPARABLE, GL_TRUE);
+    for (int i = 0; i < shaderCount; ++i)
+        glAttachShader(program, shaders[i]);
+    glLinkProgram(program);
+    for (int i = 0; i < shaderCount; ++i)
+        glDetachShader(program, shaders[i]);
+    cache.stats.links++;
+    cache.stats.linkMs += elapsed_ms(start);
+
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        GLint logLength;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLength);
+        std::vector<char> log(logLength + 1);
+        glGetProgramInfoLog(program, logLength, 0, &log[0]);
+        fprintf(stderr, "Pipeline: link of %s failed\n%s\n", name, &log[0]);
+        glDeleteProgram(program);
+        return 0;
+    }
+    cache.programs[name] = program;
+    return program;
+}
+
+GLuint pipeline_get(PipelineCache & cache, const PipelineStages & stages)
+{
+    std::map<PipelineStages, GLuint, PipelineStagesLess>::iterator found = cache.pipelines.find(stages);
+    if (found != cache.pipelines.end())
+        return found->second;
+
+    static const GLbitfield bits[5] = { GL_VERTEX_SHADER_BIT, GL_TESS_CONTROL_SHADER_BIT, GL_TESS_EVALUATION_SHADER_BIT,
+                                        GL_GEOMETRY_SHADER_BIT, GL_FRAGMENT_SHADER_BIT };
+    const GLuint * programs = &stages.vertex;
+    GLuint pipeline;
+    glGenProgramPipelines(1, &pipeline);
+    for (int i = 0; i < 5; ++i)
+        if (programs[i])
+            glUseProgramStages(pipeline, bits[i], programs[i]);
+
+    cache.pipelines[stages] = pipeline;
+    cache.stats.pipelines++;
+    return pipeline;
+}
+
+void pipeline_bind(PipelineCache & cache, GLuint pipeline)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    glUseProgram(0);
+    if (pipeline != cache.bound)
+    {
+        glBindProgramPipeline(pipeline);
+        cache.bound = pipeline;
+        cache.stats.switches++;
+    }
+    cache.stats.binds++;
+    cache.stats.bindMs += elapsed_ms(start);
+}
+
+void pipeline_frame(PipelineCache & cache)
+{
+    cache.stats.binds = 0;
+    cache.stats.switches = 0;
+    cache.stats.bindMs = 0.0;
+}
@@ -0,0 +1,65 @@
+#ifndef AOGL_PIPELINE_H
+#define AOGL_PIPELINE_H
+
+#include <map>
+#include <string>
+
+#include "glew/glew.h"
+
+// Separable program of each stage, 0 for the stages left out. A program
+// linked from several stages is given for each of them.
+struct PipelineStages
+{
+    GLuint vertex;
+    GLuint tessControl;
+    GLuint tessEvaluation;
+    GLuint geometry;
+    GLuint fragment;
+};
+
+struct PipelineStagesLess
+{
+    bool operator()(const PipelineStages & a, const PipelineStages & b) const;
+};
+
+struct PipelineStats
+{
+    int links;              // separable programs linked since init
+    double linkMs;
+    int pipelines;          // pipeline objects created since init
+    int binds;              // this frame
+    int switches;           // binds that changed the pipeline, this frame
+    double bindMs;          // CPU time in the binds, this frame
+};
+
+// Shader stages linked once as separable programs, then combined into
+// program pipeline objects on demand. Programs are cached by the names of
+// their shaders and pipelines by their stage programs, so mixing stages
+// never links again.
+struct PipelineCache
+{
+    std::map<std::string, GLuint> programs;
+    std::map<PipelineStages, GLuint, PipelineStagesLess> pipelines;
+    GLuint bound;
+    PipelineStats stats;
+};
+
+void pipeline_cache_init(PipelineCache & cache);
+// Deletes the pipelines and the programs
+void pipeline_cache_release(PipelineCache & cache);
+
+// Separable program of the compiled shaders, linked on first use of name.
+// Returns 0 if the link fails.
+GLuint pipeline_program(PipelineCache & cache, const char * name, const GLuint * shaders, int shaderCount);
+
+GLuint pipeline_get(PipelineCache & cache, const PipelineStages & stages);
+
+// Makes the pipeline current. glUseProgram takes precedence over pipelines,
+// so the program binding is cleared every time; the pipeline itself is only
+// rebound when it changes.
+void pipeline_bind(PipelineCache & cache, GLuint pipeline);
+
+// Clears the per frame counters
+void pipeline_frame(PipelineCache & cache);
+
+#endif // AOGL_PIPELINE_H
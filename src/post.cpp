@@ -0,0 +1,139 @@
+#include "post.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+namespace
+{
+
+enum
+{
+    PASS_PREFILTER,
+    PASS_DOWNSAMPLE,
+    PASS_UPSAMPLE,
+    PASS_TONEMAP
+};
+
+void draw_pass(const PostProcess & post, const RenderTarget * target, int pass, const RenderTarget & source, int unit)
+{
+    int width = target ? target->width : post.width;
+    int height = target ? target->height : post.height;
+    glBindFramebuffer(GL_FRAMEBUFFER, target ? target->fbo : 0);
+    glViewport(0, 0, width, height);
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D, source.texture);
+    glActiveTexture(GL_TEXTURE0);
+    glProgramUniform1i(post.program, post.passLocation, pass);
+    glProgramUniform1i(post.program, post.sourceLocation, unit);
+    glProgramUniform2f(post.program, post.sourceTexelSizeLocation, 1.f / source.width, 1.f / source.height);
+    glProgramUniform2f(post.program, post.targetTexelSizeLocation, 1.f / width, 1.f / height);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+}
+
+void post_default_settings(PostSettings & settings)
+{
+    settings.exposure = 1.f;
+    settings.bloom = true;
+    settings.bloomThreshold = 1.f;
+    settings.bloomIntensity = 0.3f;
+    settings.bloomLevels = 5;
+}
+
+void post_init(PostProcess & post, const PostSettings & settings, GLuint program)
+{
+    post.settings = settings;
+    post.program = program;
+    post.width = 0;
+    post.height = 0;
+    post.color = -1;
+    post.depth = -1;
+    glGenVertexArrays(1, &post.vao);
+    glGenFramebuffers(1, &post.sceneFbo);
+    post.passLocation = glGetUniformLocation(program, "Pass");
+    post.sourceLocation = glGetUniformLocation(program, "Source");
+    post.bloomLocation = glGetUniformLocation(program, "Bloom");
+    post.sourceTexelSizeLocation = glGetUniformLocation(program, "SourceTexelSize");
+    post.targetTexelSizeLocation = glGetUniformLocation(program, "TargetTexelSize");
+    post.bloomThresholdLocation = glGetUniformLocation(program, "BloomThreshold");
+    post.bloomIntensityLocation = glGetUniformLocation(program, "BloomIntensity");
+    post.exposureLocation = glGetUniformLocation(program, "Exposure");
+}
+
+void post_release(PostProcess & post)
+{
+    glDeleteFramebuffers(1, &post.sceneFbo);
+    glDeleteVertexArrays(1, &post.vao);
+    glDeleteProgram(post.program);
+}
+
+void post_begin(PostProcess & post, RenderTargetPool & pool, int width, int height, bool depth)
+{
+    post.width = width;
+    post.height = height;
+    if (post.color < 0)
+        post.color = render_target_acquire(pool, width, height, GL_RGBA16F);
+    if (depth && post.depth < 0)
+        post.depth = render_target_acquire(pool, width, height, GL_DEPTH_COMPONENT24);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, post.sceneFbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, pool.targets[post.color].texture, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, post.depth >= 0 ? pool.targets[post.depth].texture : 0, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        fprintf(stderr, "Post: incomplete scene framebuffer\n");
+    glViewport(0, 0, width, height);
+}
+
+void post_end(PostProcess & post, RenderTargetPool & pool, int firstUnit)
+{
+    if (post.color < 0)
+        return;
+    glDisable(GL_DEPTH_TEST);
+    glUseProgram(post.program);
+    glBindVertexArray(post.vao);
+
+    // Bright parts down the pyramid, then each level added to the larger one
+    int bloom = -1;
+    if (post.settings.bloom)
+    {
+        int levels[POST_MAX_BLOOM_LEVELS];
+        int count = std::min(std::max(post.settings.bloomLevels, 1), POST_MAX_BLOOM_LEVELS);
+        glProgramUniform1f(post.program, post.bloomThresholdLocation, post.settings.bloomThreshold);
+        int source = post.color;
+        for (int i = 0; i < count; ++i)
+        {
+            levels[i] = render_target_acquire(pool, std::max(post.width >> (i + 1), 1), std::max(post.height >> (i + 1), 1),
+                                              GL_R11F_G11F_B10F);
+            draw_pass(post, &pool.targets[levels[i]], i == 0 ? PASS_PREFILTER : PASS_DOWNSAMPLE, pool.targets[source], firstUnit);
+            source = levels[i];
+        }
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+        for (int i = count - 2; i >= 0; --i)
+        {
+            draw_pass(post, &pool.targets[levels[i]], PASS_UPSAMPLE, pool.targets[levels[i + 1]], firstUnit);
+            render_target_release(pool, levels[i + 1]);
+        }
+        glDisable(GL_BLEND);
+        bloom = levels[0];
+
+        glActiveTexture(GL_TEXTURE0 + firstUnit + 1);
+        glBindTexture(GL_TEXTURE_2D, pool.targets[bloom].texture);
+        glActiveTexture(GL_TEXTURE0);
+        glProgramUniform1i(post.program, post.bloomLocation, firstUnit + 1);
+    }
+    glProgramUniform1f(post.program, post.bloomIntensityLocation, bloom >= 0 ? post.settings.bloomIntensity : 0.f);
+    glProgramUniform1f(post.program, post.exposureLocation, post.settings.exposure);
+    draw_pass(post, 0, PASS_TONEMAP, pool.targets[post.color], firstUnit);
+
+    glBindVertexArray(0);
+    glEnable(GL_DEPTH_TEST);
+    if (bloom >= 0)
+        render_target_release(pool, bloom);
+    render_target_release(pool, post.color);
+    if (post.depth >= 0)
+        render_target_release(pool, post.depth);
+    post.color = -1;
+    post.depth = -1;
+}
@@ -0,0 +1,57 @@
+#ifndef AOGL_POST_H
+#define AOGL_POST_H
+
+#include "glew/glew.h"
+
+#include "render_target.h"
+
+const int POST_MAX_BLOOM_LEVELS = 8;
+
+struct PostSettings
+{
+    float exposure;         // scale of the scene before tonemapping
+    bool bloom;
+    float bloomThreshold;   // luminance where bloom starts
+    float bloomIntensity;
+    int bloomLevels;        // pyramid levels, from half resolution down
+};
+
+// Offscreen HDR path: the scene is drawn into an RGBA16F target, then
+// bloom is built by downsampling the bright parts into a pyramid of half
+// sized levels and upsampling it back with tent filters added level over
+// level, and the sum is tonemapped into the default framebuffer. All the
+// targets come from a RenderTargetPool and go back to it at the end of the
+// frame, so toggling bloom or HDR does not allocate.
+struct PostProcess
+{
+    PostSettings settings;
+    GLuint program;         // deferred.vert, post.frag
+    GLuint vao;             // empty, the full screen triangle has no attributes
+    GLuint sceneFbo;        // the pooled color and depth of the frame attached
+    int width, height;
+    int color;              // pool targets of the frame, -1 when none
+    int depth;
+    GLint passLocation;
+    GLint sourceLocation;
+    GLint bloomLocation;
+    GLint sourceTexelSizeLocation;
+    GLint targetTexelSizeLocation;
+    GLint bloomThresholdLocation;
+    GLint bloomIntensityLocation;
+    GLint exposureLocation;
+};
+
+void post_default_settings(PostSettings & settings);
+
+void post_init(PostProcess & post, const PostSettings & settings, GLuint program);
+void post_release(PostProcess & post);
+
+// Binds a pooled RGBA16F target as the draw framebuffer and the viewport,
+// with a pooled depth buffer when depth is set. The caller clears it.
+void post_begin(PostProcess & post, RenderTargetPool & pool, int width, int height, bool depth);
+
+// Bloom and tonemapping into the default framebuffer, with texture units
+// firstUnit and firstUnit + 1. The targets go back to the pool.
+void post_end(PostProcess & post, RenderTargetPool & pool, int firstUnit);
+
+#endif // AOGL_POST_H
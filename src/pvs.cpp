@@ -0,0 +1,308 @@
+#include "pvs.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <algorithm>
+
+#include "parallel.h"
+#include "timer.h"
+
+namespace
+{
+
+const int PVS_CACHE_VERSION = 1;
+const uint64_t PVS_MAX_CELLS = 1 << 24;
+
+struct PvsCacheHeader
+{
+    char magic[4];
+    int version;
+    uint64_t key;
+    float boundsMin[3];
+    float cellSize;
+    int cellsX, cellsY, cellsZ;
+    int objectCount;
+    int dataSize;
+};
+
+// xorshift32, one stream per cell so the bake does not depend on threads
+float random_unit(uint32_t & state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (state >> 8) * (1.f / 16777216.f);
+}
+
+// Dense bitsets grow under run length encoding, they are kept raw. A cell
+// holding exactly the size of a raw bitset is raw.
+void compress_bits(const std::vector<unsigned char> & bits, std::vector<unsigned char> & out)
+{
+    out.clear();
+    for (size_t i = 0; i < bits.size(); )
+    {
+        if (bits[i])
+        {
+            out.push_back(bits[i++]);
+            continue;
+        }
+        size_t run = 1;
+        while (i + run < bits.size() && !bits[i + run] && run < 255)
+            ++run;
+        out.push_back(0);
+        out.push_back((unsigned char) run);
+        i += run;
+    }
+    if (out.size() >= bits.size())
+        out = bits;
+}
+
+// A cell decodes to exactly the size of a raw bitset, without bits past objectCount
+bool cell_valid(const unsigned char * p, const unsigned char * end, int objectCount)
+{
+    int rawSize = (objectCount + 7) / 8;
+    unsigned char lastMask = objectCount % 8 ? (unsigned char) (0xff << (objectCount % 8)) : 0;
+    bool raw = end - p == rawSize;
+    int size = 0;
+    while (p < end)
+    {
+        if (!*p && !raw)
+        {
+            if (end - p < 2 || !p[1])
+                return false;
+            size += p[1];
+            p += 2;
+            continue;
+        }
+        if (size == rawSize - 1 && (*p & lastMask))
+            return false;
+        ++size;
+        ++p;
+    }
+    return size == rawSize;
+}
+
+void bake(Pvs & pvs, const PickScene & scene, const InstanceBounds & bounds, const glm::vec3 & boundsMin,
+          const glm::vec3 & boundsMax, float cellSize, int samplesPerObject, const std::atomic<bool> * cancel)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    glm::ivec3 cells = glm::max(glm::ivec3(glm::ceil((boundsMax - boundsMin) / cellSize)), glm::ivec3(1));
+    int cellCount = cells.x * cells.y * cells.z;
+    pvs.boundsMin = boundsMin;
+    pvs.cellSize = cellSize;
+    pvs.cellsX = cells.x;
+    pvs.cellsY = cells.y;
+    pvs.cellsZ = cells.z;
+    pvs.objectCount = bounds.count;
+
+    std::vector< std::vector<unsigned char> > compressed(cellCount);
+    std::vector<long long> cellRays(cellCount);
+    parallel_for(cellCount, 1, [&](int begin, int end)
+    {
+        std::vector<unsigned char> bits((bounds.count + 7) / 8);
+        for (int cell = begin; cell < end && !(cancel && *cancel); ++cell)
+        {
+            glm::vec3 cellMin = boundsMin + glm::vec3(cell % cells.x, cell / cells.x % cells.y, cell / (cells.x * cells.y)) * cellSize;
+            uint32_t state = 0x9e3779b9u ^ (uint32_t) (cell * 0x85ebca6bu);
+            memset(&bits[0], 0, bits.size());
+            long long rays = 0;
+            for (int object = 0; object < bounds.count; ++object)
+            {
+                glm::vec3 center(bounds.centerX[object], bounds.centerY[object], bounds.centerZ[object]);
+                glm::vec3 extent(bounds.extentX[object], bounds.extentY[object], bounds.extentZ[object]);
+                for (int s = 0; s < samplesPerObject && !(bits[object >> 3] & (1 << (object & 7))); ++s)
+                {
+                    glm::vec3 origin = cellMin + glm::vec3(random_unit(state), random_unit(state), random_unit(state)) * cellSize;
+                    glm::vec3 target = center + extent * (glm::vec3(random_unit(state), random_unit(state), random_unit(state)) * 2.f - 1.f);
+                    PickHit hit;
+                    ++rays;
+                    // Whatever is hit first is visible, often not the target
+                    if (pick_raycast(scene, origin, target - origin, hit))
+                        bits[hit.instance >> 3] |= 1 << (hit.instance & 7);
+                }
+            }
+            compress_bits(bits, compressed[cell]);
+            cellRays[cell] = rays;
+        }
+    });
+
+    pvs.cellOffsets.resize(cellCount + 1);
+    pvs.data.clear();
+    pvs.rays = 0;
+    for (int cell = 0; cell < cellCount; ++cell)
+    {
+        pvs.cellOffsets[cell] = (int) pvs.data.size();
+        pvs.data.insert(pvs.data.end(), compressed[cell].begin(), compressed[cell].end());
+        pvs.rays += cellRays[cell];
+    }
+    pvs.cellOffsets[cellCount] = (int) pvs.data.size();
+    pvs.bakeMs = elapsed_ms(start);
+}
+
+// Written next to the final name then renamed, so readers never see half a set
+bool save(const Pvs & pvs, const char * path, uint64_t key)
+{
+    std::string tmp = std::string(path) + ".tmp";
+    FILE * f = fopen(tmp.c_str(), "wb");
+    if (!f)
+        return false;
+    PvsCacheHeader header;
+    memcpy(header.magic, "AOPV", 4);
+    header.version = PVS_CACHE_VERSION;
+    header.key = key;
+    header.boundsMin[0] = pvs.boundsMin.x;
+    header.boundsMin[1] = pvs.boundsMin.y;
+    header.boundsMin[2] = pvs.boundsMin.z;
+    header.cellSize = pvs.cellSize;
+    header.cellsX = pvs.cellsX;
+    header.cellsY = pvs.cellsY;
+    header.cellsZ = pvs.cellsZ;
+    header.objectCount = pvs.objectCount;
+    header.dataSize = (int) pvs.data.size();
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+        && fwrite(&pvs.cellOffsets[0], sizeof(int), pvs.cellOffsets.size(), f) == pvs.cellOffsets.size()
+        && (pvs.data.empty() || fwrite(&pvs.data[0], pvs.data.size(), 1, f) == 1);
+    ok = fclose(f) == 0 && ok;
+    remove(path);
+    if (!ok || rename(tmp.c_str(), path) != 0)
+    {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+}
+
+void pvs_bake(Pvs & pvs, const PickScene & scene, const InstanceBounds & bounds, const glm::vec3 & boundsMin,
+              const glm::vec3 & boundsMax, float cellSize, int samplesPerObject)
+{
+    bake(pvs, scene, bounds, boundsMin, boundsMax, cellSize, samplesPerObject, 0);
+}
+
+void pvs_bake_start(PvsBakeJob & job, const PickScene & scene, const InstanceBounds & bounds, const glm::vec3 & boundsMin,
+                    const glm::vec3 & boundsMax, float cellSize, int samplesPerObject, const char * path, uint64_t key)
+{
+    if (job.thread.joinable())
+        return;
+    job.scene = scene;
+    job.bounds = bounds;
+    job.done = false;
+    job.cancel = false;
+    std::string file(path);
+    job.thread = std::thread([&job, boundsMin, boundsMax, cellSize, samplesPerObject, file, key]()
+    {
+        bake(job.pvs, job.scene, job.bounds, boundsMin, boundsMax, cellSize, samplesPerObject, &job.cancel);
+        if (!job.cancel)
+            save(job.pvs, file.c_str(), key);
+        job.done = true;
+    });
+}
+
+bool pvs_bake_finish(PvsBakeJob & job, Pvs & pvs, bool cancel)
+{
+    if (!job.thread.joinable() || (!cancel && !job.done))
+        return false;
+    job.cancel = cancel;
+    job.thread.join();
+    if (cancel)
+        return false;
+    std::swap(pvs, job.pvs);
+    return true;
+}
+
+int pvs_find_cell(const Pvs & pvs, const glm::vec3 & point)
+{
+    if (pvs.cellOffsets.empty())
+        return -1;
+    glm::vec3 p = (point - pvs.boundsMin) / pvs.cellSize;
+    if (p.x < 0.f || p.y < 0.f || p.z < 0.f)
+        return -1;
+    int x = (int) p.x, y = (int) p.y, z = (int) p.z;
+    if (x >= pvs.cellsX || y >= pvs.cellsY || z >= pvs.cellsZ)
+        return -1;
+    return x + (y + z * pvs.cellsY) * pvs.cellsX;
+}
+
+int pvs_visible_objects(const Pvs & pvs, int cell, int * objects)
+{
+    if (pvs.data.empty())
+        return 0;
+    const unsigned char * p = &pvs.data[0] + pvs.cellOffsets[cell];
+    const unsigned char * end = &pvs.data[0] + pvs.cellOffsets[cell + 1];
+    int count = 0;
+    int base = 0;
+    bool raw = end - p == (pvs.objectCount + 7) / 8;
+    while (p < end)
+    {
+        if (!*p && !raw)
+        {
+            base += p[1] * 8;
+            p += 2;
+            continue;
+        }
+        for (int bit = 0; bit < 8; ++bit)
+            if (*p & (1 << bit))
+                objects[count++] = base + bit;
+        ++p;
+        base += 8;
+    }
+    return count;
+}
+
+bool pvs_load(Pvs & pvs, const char * path, uint64_t key)
+{
+    FILE * f = fopen(path, "rb");
+    if (!f)
+        return false;
+    PvsCacheHeader header;
+    bool valid = fread(&header, sizeof(header), 1, f) == 1
+        && memcmp(header.magic, "AOPV", 4) == 0
+        && header.version == PVS_CACHE_VERSION
+        && header.key == key;
+    valid = valid && header.cellsX > 0 && header.cellsY > 0 && header.cellsZ > 0
+        && (uint64_t) header.cellsX * header.cellsY * header.cellsZ <= PVS_MAX_CELLS
+        && header.objectCount >= 0 && header.dataSize >= 0 && header.cellSize > 0.f;
+    if (valid)
+    {
+        // Nothing is allocated before the sizes are known to match the file
+        int cellCount = header.cellsX * header.cellsY * header.cellsZ;
+        long start = ftell(f);
+        fseek(f, 0, SEEK_END);
+        valid = (uint64_t) (ftell(f) - start) == (uint64_t) (cellCount + 1) * sizeof(int) + header.dataSize;
+        fseek(f, start, SEEK_SET);
+        if (valid)
+        {
+            pvs.cellOffsets.resize(cellCount + 1);
+            pvs.data.resize(header.dataSize);
+            valid = fread(&pvs.cellOffsets[0], sizeof(int), cellCount + 1, f) == (size_t) cellCount + 1
+                && (header.dataSize == 0 || fread(&pvs.data[0], header.dataSize, 1, f) == 1)
+                && pvs.cellOffsets[0] == 0 && pvs.cellOffsets[cellCount] == header.dataSize;
+        }
+        for (int cell = 0; valid && cell < cellCount; ++cell)
+            valid = pvs.cellOffsets[cell] <= pvs.cellOffsets[cell + 1];
+        for (int cell = 0; valid && cell < cellCount; ++cell)
+            valid = cell_valid(pvs.data.data() + pvs.cellOffsets[cell], pvs.data.data() + pvs.cellOffsets[cell + 1], header.objectCount);
+        pvs.boundsMin = glm::vec3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+        pvs.cellSize = header.cellSize;
+        pvs.cellsX = header.cellsX;
+        pvs.cellsY = header.cellsY;
+        pvs.cellsZ = header.cellsZ;
+        pvs.objectCount = header.objectCount;
+        pvs.rays = 0;
+        pvs.bakeMs = 0.0;
+        if (!valid)
+        {
+            pvs.cellOffsets.clear();
+            pvs.objectCount = -1;
+        }
+    }
+    fclose(f);
+    return valid;
+}
+
+bool pvs_save(const Pvs & pvs, const char * path, uint64_t key)
+{
+    return save(pvs, path, key);
+}
@@ -0,0 +1,71 @@
+#ifndef AOGL_PVS_H
+#define AOGL_PVS_H
+
+#include <stdint.h>
+#include <vector>
+#include <atomic>
+#include <thread>
+
+#include "glm/glm.hpp"
+
+#include "culling.h"
+#include "picking.h"
+
+// Potentially visible set of a static scene: a grid of cells over the space
+// the camera moves in, each with the bitset of the instances seen from
+// somewhere inside it. Sparse bitsets are stored run length encoded, a zero
+// byte being followed by the number of zero bytes it stands for.
+struct Pvs
+{
+    glm::vec3 boundsMin;
+    float cellSize;
+    int cellsX, cellsY, cellsZ;
+    int objectCount;
+    std::vector<int> cellOffsets;       // cell count + 1 offsets into data
+    std::vector<unsigned char> data;
+    long long rays;
+    double bakeMs;
+};
+
+// Casts samplesPerObject rays from random points of each cell to random
+// points in the bounds of every instance not yet seen from it, marking the
+// closest instance hit. Cells are baked in parallel. Visibility is sampled
+// so tiny gaps can be missed, more samples lower the odds.
+void pvs_bake(Pvs & pvs, const PickScene & scene, const InstanceBounds & bounds, const glm::vec3 & boundsMin,
+              const glm::vec3 & boundsMax, float cellSize, int samplesPerObject);
+
+// Bake running on a thread of its own so the frame loop goes on meanwhile,
+// the thread is joinable until pvs_bake_finish. The scene and bounds are
+// copied, the mesh the scene points at must stay.
+struct PvsBakeJob
+{
+    std::thread thread;
+    std::atomic<bool> done;
+    std::atomic<bool> cancel;
+    Pvs pvs;
+    PickScene scene;
+    InstanceBounds bounds;
+};
+
+// Starts a bake, its result is saved to path under key when it completes.
+// Does nothing while another bake runs.
+void pvs_bake_start(PvsBakeJob & job, const PickScene & scene, const InstanceBounds & bounds, const glm::vec3 & boundsMin,
+                    const glm::vec3 & boundsMax, float cellSize, int samplesPerObject, const char * path, uint64_t key);
+// Moves the result of a completed bake into pvs and returns true. Returns
+// false while the bake runs, or after stopping it when cancel is set.
+bool pvs_bake_finish(PvsBakeJob & job, Pvs & pvs, bool cancel);
+
+// Cell containing point, -1 outside the grid
+int pvs_find_cell(const Pvs & pvs, const glm::vec3 & point);
+
+// Writes the instances visible from cell in increasing order, objects must
+// hold objectCount entries. Returns their count.
+int pvs_visible_objects(const Pvs & pvs, int cell, int * objects);
+
+// Cache files are only read back when key matches, which should hash the
+// scene and the bake settings, and when every cell decodes to a bitset of
+// objectCount bits
+bool pvs_load(Pvs & pvs, const char * path, uint64_t key);
+bool pvs_save(const Pvs & pvs, const char * path, uint64_t key);
+
+#endif // AOGL_PVS_H
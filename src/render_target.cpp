@@ -0,0 +1,167 @@
+#include "render_target.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace
+{
+
+bool is_depth_format(GLenum format)
+{
+    return format == GL_DEPTH_COMPONENT16 || format == GL_DEPTH_COMPONENT24 || format == GL_DEPTH_COMPONENT32F;
+}
+
+size_t texel_bytes(GLenum format)
+{
+    switch (format)
+    {
+    case GL_R8:
+        return 1;
+    case GL_RG8:
+    case GL_R16F:
+    case GL_DEPTH_COMPONENT16:
+        return 2;
+    case GL_RGBA16F:
+        return 8;
+    case GL_RGBA32F:
+        return 16;
+    default:
+        return 4;
+    }
+}
+
+void destroy(RenderTargetPool & pool, RenderTarget & target)
+{
+    glDeleteFramebuffers(1, &target.fbo);
+    glDeleteTextures(1, &target.texture);
+    pool.stats.targets--;
+    pool.stats.bytes -= target.bytes;
+    memset(&target, 0, sizeof(target));
+}
+
+// Deletes the least recently used free targets until bytes more fit
+void make_room(RenderTargetPool & pool, size_t bytes)
+{
+    while (pool.stats.bytes + bytes > pool.budget)
+    {
+        int oldest = -1;
+        for (int i = 0; i < (int) pool.targets.size(); ++i)
+        {
+            const RenderTarget & target = pool.targets[i];
+            if (target.format && !target.used && (oldest < 0 || target.lastFrame < pool.targets[oldest].lastFrame))
+                oldest = i;
+        }
+        if (oldest < 0)
+            return;
+        destroy(pool, pool.targets[oldest]);
+        pool.stats.evictions++;
+    }
+}
+
+}
+
+void render_target_pool_init(RenderTargetPool & pool, size_t budget, int idleFrames)
+{
+    pool.targets.clear();
+    pool.budget = budget;
+    pool.idleFrames = idleFrames;
+    pool.frame = 0;
+    memset(&pool.stats, 0, sizeof(pool.stats));
+}
+
+void render_target_pool_release(RenderTargetPool & pool)
+{
+    for (size_t i = 0; i < pool.targets.size(); ++i)
+        if (pool.targets[i].format)
+            destroy(pool, pool.targets[i]);
+    pool.targets.clear();
+}
+
+int render_target_acquire(RenderTargetPool & pool, int width, int height, GLenum format)
+{
+    int empty = -1;
+    for (int i = 0; i < (int) pool.targets.size(); ++i)
+    {
+        RenderTarget & target = pool.targets[i];
+        if (!target.format)
+            empty = empty < 0 ? i : empty;
+        else if (!target.used && target.width == width && target.height == height && target.format == format)
+        {
+            target.used = true;
+            target.lastFrame = pool.frame;
+            pool.stats.reuses++;
+            return i;
+        }
+    }
+
+    size_t bytes = (size_t) width * height * texel_bytes(format);
+    make_room(pool, bytes);
+    if (empty < 0)
+    {
+        // make_room may have emptied a slot
+        for (int i = 0; i < (int) pool.targets.size() && empty < 0; ++i)
+            if (!pool.targets[i].format)
+                empty = i;
+        if (empty < 0)
+        {
+            empty = (int) pool.targets.size();
+            pool.targets.push_back(RenderTarget());
+        }
+    }
+
+    RenderTarget & target = pool.targets[empty];
+    target.width = width;
+    target.height = height;
+    target.format = format;
+    target.bytes = bytes;
+    target.used = true;
+    target.lastFrame = pool.frame;
+    glGenTextures(1, &target.texture);
+    glBindTexture(GL_TEXTURE_2D, target.texture);
+    bool depth = is_depth_format(format);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, depth ? GL_DEPTH_COMPONENT : GL_RGBA, GL_FLOAT, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    target.fbo = 0;
+    if (!depth)
+    {
+        GLint previous;
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+        glGenFramebuffers(1, &target.fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.texture, 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            fprintf(stderr, "Render target: incomplete framebuffer for format 0x%x\n", format);
+        glBindFramebuffer(GL_FRAMEBUFFER, previous);
+    }
+
+    pool.stats.targets++;
+    pool.stats.bytes += bytes;
+    pool.stats.allocations++;
+    pool.stats.frameAllocations++;
+    return empty;
+}
+
+void render_target_release(RenderTargetPool & pool, int target)
+{
+    pool.targets[target].used = false;
+}
+
+void render_target_pool_frame(RenderTargetPool & pool)
+{
+    for (size_t i = 0; i < pool.targets.size(); ++i)
+    {
+        RenderTarget & target = pool.targets[i];
+        if (target.format && !target.used && pool.frame - target.lastFrame > pool.idleFrames)
+        {
+            destroy(pool, target);
+            pool.stats.evictions++;
+        }
+    }
+    pool.frame++;
+    pool.stats.frameAllocations = 0;
+}
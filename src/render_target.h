@@ -0,0 +1,54 @@
+#ifndef AOGL_RENDER_TARGET_H
+#define AOGL_RENDER_TARGET_H
+
+#include <stddef.h>
+#include <vector>
+
+#include "glew/glew.h"
+
+struct RenderTarget
+{
+    int width, height;
+    GLenum format;          // internal format, 0 for an empty slot
+    GLuint texture;         // linear filtered, clamped, no mips
+    GLuint fbo;             // texture as the only attachment, 0 for depth formats
+    size_t bytes;
+    bool used;
+    int lastFrame;          // last frame it was acquired in
+};
+
+struct RenderTargetStats
+{
+    int targets;
+    size_t bytes;
+    int allocations;        // since init
+    int reuses;
+    int evictions;
+    int frameAllocations;   // during the last frame
+};
+
+// Intermediate targets shared by the passes of a frame and kept across
+// frames. A target is acquired for a size and format, reusing a free one
+// with the same key, and released once the pass reading it is done, so
+// passes that do not overlap share memory. Free targets are deleted when
+// they have not been used for idleFrames, or to stay under budget.
+struct RenderTargetPool
+{
+    std::vector<RenderTarget> targets;
+    size_t budget;          // bytes, exceeded only while everything is in use
+    int idleFrames;
+    int frame;
+    RenderTargetStats stats;
+};
+
+void render_target_pool_init(RenderTargetPool & pool, size_t budget, int idleFrames);
+void render_target_pool_release(RenderTargetPool & pool);
+
+// Index of a target in pool.targets, kept until it is released
+int render_target_acquire(RenderTargetPool & pool, int width, int height, GLenum format);
+void render_target_release(RenderTargetPool & pool, int target);
+
+// Ends a frame, deleting the targets idle for too long
+void render_target_pool_frame(RenderTargetPool & pool);
+
+#endif // AOGL_RENDER_TARGET_H
@@ -0,0 +1,301 @@
+#include "residency.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+size_t texture_mip_bytes(int width, int height, int components)
+{
+    // Drivers pad RGB8 texels to 32 bits
+    int texelBytes = components == 3 ? 4 : components;
+    return (size_t) width * height * texelBytes;
+}
+
+static inline int imin(int a, int b)
+{
+    return a < b ? a : b;
+}
+
+static size_t residency_chain_bytes(const ResidentTexture & t, int base)
+{
+    size_t bytes = 0;
+    for (int i = base; i < (int) t.mips.size(); ++i)
+        bytes += texture_mip_bytes(t.mips[i].width, t.mips[i].height, t.components);
+    return bytes;
+}
+
+static size_t texture_chain_offset(size_t offset)
+{
+    return (offset + 3) & ~(size_t) 3;
+}
+
+void texture_build_chain(const unsigned char * pixels, int width, int height, int components, std::vector<unsigned char> & chain)
+{
+    int c = components;
+    int mipCount = 1;
+    size_t size = texture_chain_offset(sizeof(TextureChainHeader) + (size_t) width * height * c);
+    for (int w = width, h = height; w > 1 || h > 1; ++mipCount)
+    {
+        w = w > 1 ? w / 2 : 1;
+        h = h > 1 ? h / 2 : 1;
+        size = texture_chain_offset(size + (size_t) w * h * c);
+    }
+    chain.assign(size, 0);
+    TextureChainHeader * header = (TextureChainHeader *) &chain[0];
+    header->width = width;
+    header->height = height;
+    header->components = components;
+    header->mipCount = mipCount;
+
+    size_t offset = sizeof(TextureChainHeader);
+    memcpy(&chain[offset], pixels, (size_t) width * height * c);
+    while (width > 1 || height > 1)
+    {
+        const unsigned char * src = &chain[offset];
+        int srcWidth = width, srcHeight = height;
+        offset = texture_chain_offset(offset + (size_t) width * height * c);
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+        unsigned char * dst = &chain[offset];
+        for (int y = 0; y < height; ++y)
+        {
+            int y0 = imin(y * 2, srcHeight - 1);
+            int y1 = imin(y * 2 + 1, srcHeight - 1);
+            for (int x = 0; x < width; ++x)
+            {
+                int x0 = imin(x * 2, srcWidth - 1);
+                int x1 = imin(x * 2 + 1, srcWidth - 1);
+                for (int k = 0; k < c; ++k)
+                {
+                    int sum = src[(y0 * srcWidth + x0) * c + k]
+                            + src[(y0 * srcWidth + x1) * c + k]
+                            + src[(y1 * srcWidth + x0) * c + k]
+                            + src[(y1 * srcWidth + x1) * c + k];
+                    dst[(y * width + x) * c + k] = (unsigned char) ((sum + 2) / 4);
+                }
+            }
+        }
+    }
+}
+
+// Re-creates the texture object with levels [base, mipCount[ so that the
+// driver actually releases the memory of the dropped levels
+static void residency_upload(ResidentTexture & t, int base)
+{
+    static const GLenum formats[] = { GL_RED, GL_RG, GL_RGB, GL_RGBA };
+    GLenum format = formats[t.components - 1];
+    if (t.id)
+        glDeleteTextures(1, &t.id);
+    glGenTextures(1, &t.id);
+    glBindTexture(GL_TEXTURE_2D, t.id);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (int i = base; i < (int) t.mips.size(); ++i)
+    {
+        const TextureMip & m = t.mips[i];
+        glTexImage2D(GL_TEXTURE_2D, i - base, format, m.width, m.height, 0, format, GL_UNSIGNED_BYTE, m.pixels);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (int) t.mips.size() - 1 - base);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    t.residentBase = base;
+    t.residentBytes = residency_chain_bytes(t, base);
+}
+
+void residency_init(TextureResidency & r, size_t budgetBytes)
+{
+    r.budget = budgetBytes;
+    r.usage = 0;
+    r.frame = 0;
+    r.evictedMips = 0;
+    r.streamedMips = 0;
+    r.textures.clear();
+}
+
+void residency_release(TextureResidency & r)
+{
+    for (size_t i = 0; i < r.textures.size(); ++i)
+        glDeleteTextures(1, &r.textures[i].id);
+    r.textures.clear();
+    r.usage = 0;
+}
+
+int residency_add_chain(TextureResidency & r, const void * chain, size_t size)
+{
+    const TextureChainHeader * header = (const TextureChainHeader *) chain;
+    if (!chain || size < sizeof(TextureChainHeader) || header->components < 1 || header->components > 4
+        || header->width < 1 || header->height < 1 || header->width > 32768 || header->height > 32768
+        || header->mipCount < 1 || header->mipCount > 16)
+        return -1;
+    r.textures.push_back(ResidentTexture());
+    ResidentTexture & t = r.textures.back();
+    t.id = 0;
+    t.components = header->components;
+    t.lastUsedFrame = r.frame;
+
+    const unsigned char * bytes = (const unsigned char *) chain;
+    size_t offset = sizeof(TextureChainHeader);
+    int width = header->width, height = header->height;
+    for (int i = 0; i < header->mipCount; ++i)
+    {
+        TextureMip m;
+        m.width = width;
+        m.height = height;
+        m.pixels = bytes + offset;
+        size_t end = offset + (size_t) width * height * t.components;
+        if (end > size)
+        {
+            r.textures.pop_back();
+            return -1;
+        }
+        offset = texture_chain_offset(end);
+        t.mips.push_back(m);
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+
+    // Start with the finest chain that fits, the smallest mip is always resident
+    int base = 0;
+    while (base < (int) t.mips.size() - 1 && r.usage + residency_chain_bytes(t, base) > r.budget)
+        ++base;
+    residency_upload(t, base);
+    t.requestedBase = base;
+    r.usage += t.residentBytes;
+    return (int) r.textures.size() - 1;
+}
+
+int residency_add_texture(TextureResidency & r, const unsigned char * pixels, int width, int height, int components)
+{
+    if (!pixels || components < 1 || components > 4)
+        return -1;
+    std::vector<unsigned char> chain;
+    texture_build_chain(pixels, width, height, components, chain);
+    int handle = residency_add_chain(r, &chain[0], chain.size());
+    if (handle < 0)
+        return -1;
+    // The mips point into the heap block, which moves along with the vector
+    r.textures[handle].storage.swap(chain);
+    return handle;
+}
+
+GLuint residency_texture_id(const TextureResidency & r, int handle)
+{
+    if (handle < 0 || handle >= (int) r.textures.size())
+        return 0;
+    return r.textures[handle].id;
+}
+
+int residency_texture_size(const TextureResidency & r, int handle)
+{
+    if (handle < 0 || handle >= (int) r.textures.size())
+        return 0;
+    return r.textures[handle].mips[0].width;
+}
+
+void residency_request(TextureResidency & r, int handle, int mipLevel)
+{
+    if (handle < 0 || handle >= (int) r.textures.size())
+        return;
+    ResidentTexture & t = r.textures[handle];
+    int maxLevel = (int) t.mips.size() - 1;
+    mipLevel = mipLevel < 0 ? 0 : (mipLevel > maxLevel ? maxLevel : mipLevel);
+    if (t.lastUsedFrame != r.frame || mipLevel < t.requestedBase)
+        t.requestedBase = mipLevel;
+    t.lastUsedFrame = r.frame;
+}
+
+// Drops finest mips of least recently used textures until needed bytes fit.
+// Mips requested this frame are only dropped when force is set.
+static bool residency_make_room(TextureResidency & r, std::vector<int> & target, size_t & usage, size_t needed, int exclude, bool force)
+{
+    while (usage + needed > r.budget)
+    {
+        int victim = -1;
+        bool victimNeeded = true;
+        for (int i = 0; i < (int) r.textures.size(); ++i)
+        {
+            const ResidentTexture & t = r.textures[i];
+            if (i == exclude || target[i] >= (int) t.mips.size() - 1)
+                continue;
+            bool inUse = t.lastUsedFrame == r.frame && target[i] >= t.requestedBase;
+            if (inUse && !force)
+                continue;
+            // Unneeded mips first, then least recently used
+            if (victim < 0 || (victimNeeded && !inUse) ||
+                (victimNeeded == inUse && t.lastUsedFrame < r.textures[victim].lastUsedFrame))
+            {
+                victim = i;
+                victimNeeded = inUse;
+            }
+        }
+        if (victim < 0)
+            return false;
+        const ResidentTexture & t = r.textures[victim];
+        usage -= texture_mip_bytes(t.mips[target[victim]].width, t.mips[target[victim]].height, t.components);
+        ++target[victim];
+    }
+    return true;
+}
+
+void residency_update(TextureResidency & r)
+{
+    std::vector<int> target(r.textures.size());
+    for (size_t i = 0; i < r.textures.size(); ++i)
+        target[i] = r.textures[i].residentBase;
+    size_t usage = r.usage;
+
+    // Budget may have been lowered since last frame
+    residency_make_room(r, target, usage, 0, -1, true);
+
+    // Stream finer mips back for textures that need them, one level at a time
+    for (int i = 0; i < (int) r.textures.size(); ++i)
+    {
+        const ResidentTexture & t = r.textures[i];
+        if (t.lastUsedFrame != r.frame)
+            continue;
+        while (target[i] > t.requestedBase)
+        {
+            const TextureMip & m = t.mips[target[i] - 1];
+            size_t bytes = texture_mip_bytes(m.width, m.height, t.components);
+            if (!residency_make_room(r, target, usage, bytes, i, false))
+                break;
+            usage += bytes;
+            --target[i];
+        }
+    }
+
+    for (size_t i = 0; i < r.textures.size(); ++i)
+    {
+        ResidentTexture & t = r.textures[i];
+        if (target[i] == t.residentBase)
+            continue;
+        if (target[i] > t.residentBase)
+            r.evictedMips += target[i] - t.residentBase;
+        else
+            r.streamedMips += t.residentBase - target[i];
+        residency_upload(t, target[i]);
+        if (glGetError() == GL_OUT_OF_MEMORY)
+        {
+            fprintf(stderr, "Texture residency: out of memory at %.1f MB, lowering budget\n", usage / (1024.f * 1024.f));
+            r.budget = usage * 3 / 4;
+        }
+    }
+    r.usage = usage;
+    ++r.frame;
+}
+
+int residency_estimate_mip(int textureSize, float worldSize, float distance, float projectionScale, int viewportHeight)
+{
+    if (distance <= 0.f || worldSize <= 0.f)
+        return 0;
+    float pixelsPerUnit = viewportHeight * 0.5f * projectionScale / distance;
+    float texelsPerUnit = textureSize / worldSize;
+    float ratio = texelsPerUnit / pixelsPerUnit;
+    if (ratio <= 1.f)
+        return 0;
+    return (int) floorf(log2f(ratio));
+}
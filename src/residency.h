@@ -0,0 +1,78 @@
+#ifndef AOGL_RESIDENCY_H
+#define AOGL_RESIDENCY_H
+
+#include <vector>
+#include <stddef.h>
+
+#include "glew/glew.h"
+
+// CPU copy of one mip level, kept so evicted levels can be streamed back
+struct TextureMip
+{
+    int width;
+    int height;
+    const unsigned char * pixels;
+};
+
+// Mip chain layout shared with packed archives: this header, then every mip
+// from finest to coarsest, each starting on a 4 byte boundary
+struct TextureChainHeader
+{
+    int width;
+    int height;
+    int components;
+    int mipCount;
+};
+
+struct ResidentTexture
+{
+    GLuint id;
+    int components;
+    std::vector<unsigned char> storage; // chain owned by the texture, empty when mapped
+    std::vector<TextureMip> mips;   // mips[0] is the full resolution level
+    int residentBase;               // finest mip level currently on the GPU
+    int requestedBase;              // finest mip level requested this frame
+    size_t residentBytes;
+    unsigned int lastUsedFrame;
+};
+
+// Tracks the GPU bytes of every texture and mip against a budget. High
+// resolution mips of the least recently used textures are dropped when over
+// budget and uploaded again once an object needs them.
+struct TextureResidency
+{
+    size_t budget;
+    size_t usage;
+    unsigned int frame;
+    int evictedMips;
+    int streamedMips;
+    std::vector<ResidentTexture> textures;
+};
+
+void residency_init(TextureResidency & r, size_t budgetBytes);
+void residency_release(TextureResidency & r);
+
+// Builds the CPU mip chain and uploads as much of it as fits, returns a texture handle
+int residency_add_texture(TextureResidency & r, const unsigned char * pixels, int width, int height, int components);
+// Same from a prebuilt chain, which is referenced and must outlive the texture
+int residency_add_chain(TextureResidency & r, const void * chain, size_t size);
+GLuint residency_texture_id(const TextureResidency & r, int handle);
+// Width of the full resolution mip, 0 for an invalid handle
+int residency_texture_size(const TextureResidency & r, int handle);
+
+// Marks the texture as used this frame and asks for mipLevel to be resident
+void residency_request(TextureResidency & r, int handle, int mipLevel);
+
+// Evicts and streams mips so that the requests fit the budget, call once per frame
+void residency_update(TextureResidency & r);
+
+// Finest mip an object needs, from its texture size, the world size its uv
+// range covers, its view distance and the projection scale (projection[1][1])
+int residency_estimate_mip(int textureSize, float worldSize, float distance, float projectionScale, int viewportHeight);
+
+size_t texture_mip_bytes(int width, int height, int components);
+
+// Box filtered mip chain of an 8-bit image in the TextureChainHeader layout
+void texture_build_chain(const unsigned char * pixels, int width, int height, int components, std::vector<unsigned char> & chain);
+
+#endif // AOGL_RESIDENCY_H
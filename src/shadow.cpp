@@ -0,0 +1,362 @@
+#include "shadow.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <xmmintrin.h>
+
+#include "glm/gtc/matrix_transform.hpp"
+#include "glm/gtc/type_ptr.hpp"
+
+#include "parallel.h"
+#include "timer.h"
+
+namespace
+{
+
+// Instances whose bounds touch the cascade box and cover at least minSize,
+// 4 at a time. The near plane is left out: casters between the sun and the
+// box still shadow it, their depth is clamped to the near plane.
+void cull_casters(const Frustum & frustum, const InstanceBounds & bounds, float minSize, std::vector<int> & out)
+{
+    static const int planes[5] = { 0, 1, 2, 3, 5 };
+    __m128 nx[5], ny[5], nz[5], ax[5], ay[5], az[5], w[5];
+    for (int p = 0; p < 5; ++p)
+    {
+        const glm::vec4 & plane = frustum.planes[planes[p]];
+        nx[p] = _mm_set1_ps(plane.x); ax[p] = _mm_set1_ps(fabsf(plane.x));
+        ny[p] = _mm_set1_ps(plane.y); ay[p] = _mm_set1_ps(fabsf(plane.y));
+        nz[p] = _mm_set1_ps(plane.z); az[p] = _mm_set1_ps(fabsf(plane.z));
+        w[p] = _mm_set1_ps(plane.w);
+    }
+    __m128 halfSize = _mm_set1_ps(minSize * 0.5f);
+
+    out.clear();
+    for (int i = 0; i < bounds.count; i += 4)
+    {
+        __m128 cx = _mm_loadu_ps(&bounds.centerX[i]), cy = _mm_loadu_ps(&bounds.centerY[i]), cz = _mm_loadu_ps(&bounds.centerZ[i]);
+        __m128 ex = _mm_loadu_ps(&bounds.extentX[i]), ey = _mm_loadu_ps(&bounds.extentY[i]), ez = _mm_loadu_ps(&bounds.extentZ[i]);
+        __m128 keep = _mm_cmpge_ps(_mm_max_ps(_mm_max_ps(ex, ey), ez), halfSize);
+        for (int p = 0; p < 5; ++p)
+        {
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx[p], cx), _mm_mul_ps(ny[p], cy)), _mm_add_ps(_mm_mul_ps(nz[p], cz), w[p]));
+            __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax[p], ex), _mm_mul_ps(ay[p], ey)), _mm_mul_ps(az[p], ez));
+            keep = _mm_and_ps(keep, _mm_cmpge_ps(_mm_add_ps(d, r), _mm_setzero_ps()));
+        }
+        int mask = _mm_movemask_ps(keep);
+        if (bounds.count - i < 4)
+            mask &= (1 << (bounds.count - i)) - 1;
+        for (int k = 0; k < 4; ++k)
+            if (mask & (1 << k))
+                out.push_back(i + k);
+    }
+}
+
+}
+
+void shadow_default_settings(ShadowSettings & settings)
+{
+    settings.cascadeCount = 4;
+    settings.resolution = 1024;
+    settings.distance = 60.f;
+    settings.splitLambda = 0.75f;
+    settings.cachedCascades = 2;
+    settings.cachePadding = 0.25f;
+    settings.minCasterTexels = 1.f;
+    settings.direction = glm::normalize(glm::vec3(-0.4f, -1.f, -0.3f));
+}
+
+void shadow_init(ShadowMap & shadow, const ShadowSettings & settings, GLuint program, const GpuMesh & casterMesh)
+{
+    shadow.settings = settings;
+    shadow.settings.cascadeCount = std::min(std::max(settings.cascadeCount, 1), SHADOW_MAX_CASCADES);
+    int count = shadow.settings.cascadeCount;
+
+    // Hardware compare with bilinear filtering gives 2x2 PCF per tap
+    glGenTextures(1, &shadow.texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, shadow.texture);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, settings.resolution, settings.resolution, count,
+                 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    glGenFramebuffers(1, &shadow.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, shadow.fbo);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadow.texture, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        fprintf(stderr, "Shadow: incomplete framebuffer\n");
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // Positions and indices of the caster mesh, the instance attributes are
+    // pointed at each draw range
+    glGenVertexArrays(1, &shadow.vao);
+    glGenBuffers(1, &shadow.instanceBuffer);
+    glBindVertexArray(shadow.vao);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, casterMesh.vbo[0]);
+    glBindBuffer(GL_ARRAY_BUFFER, casterMesh.vbo[1]);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 3, (void*)0);
+    glBindBuffer(GL_ARRAY_BUFFER, shadow.instanceBuffer);
+    for (int i = 0; i < 5; ++i)
+    {
+        glEnableVertexAttribArray(4 + i);
+        glVertexAttribDivisor(4 + i, 1);
+    }
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    shadow.instanceCapacity = 0;
+
+    shadow.program = program;
+    shadow.viewProjectionLocation = glGetUniformLocation(program, "CascadeViewProjection");
+
+    shadow_set_direction(shadow, settings.direction);
+    for (int i = 0; i < SHADOW_MAX_CASCADES; ++i)
+    {
+        shadow.radius[i] = 0.f;
+        shadow.dirty[i] = false;
+        shadow.level[i] = 0;
+    }
+    shadow_invalidate(shadow);
+    memset(&shadow.stats, 0, sizeof(shadow.stats));
+}
+
+void shadow_release(ShadowMap & shadow)
+{
+    glDeleteVertexArrays(1, &shadow.vao);
+    glDeleteBuffers(1, &shadow.instanceBuffer);
+    glDeleteFramebuffers(1, &shadow.fbo);
+    glDeleteTextures(1, &shadow.texture);
+    glDeleteProgram(shadow.program);
+}
+
+void shadow_invalidate(ShadowMap & shadow)
+{
+    for (int i = 0; i < SHADOW_MAX_CASCADES; ++i)
+        shadow.valid[i] = false;
+}
+
+void shadow_set_direction(ShadowMap & shadow, const glm::vec3 & direction)
+{
+    // Fixed rotation, only the position of the maps follows the view
+    shadow.settings.direction = glm::normalize(direction);
+    const glm::vec3 & d = shadow.settings.direction;
+    glm::vec3 up = fabsf(d.y) > 0.99f ? glm::vec3(1.f, 0.f, 0.f) : glm::vec3(0.f, 1.f, 0.f);
+    shadow.lightView = glm::lookAt(glm::vec3(0.f), d, up);
+    shadow_invalidate(shadow);
+}
+
+void shadow_update(ShadowMap & shadow, const glm::mat4 & worldToView, const glm::mat4 & projection, float nearPlane,
+                   const InstanceBounds & bounds, const glm::mat4 * transforms, const LodChain & lod)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const ShadowSettings & settings = shadow.settings;
+    int count = settings.cascadeCount;
+
+    // Practical split scheme, a blend of logarithmic and uniform splits
+    float farPlane = std::max(settings.distance, nearPlane * 2.f);
+    for (int i = 0; i <= count; ++i)
+    {
+        float f = i / (float) count;
+        float logSplit = nearPlane * powf(farPlane / nearPlane, f);
+        float uniformSplit = nearPlane + (farPlane - nearPlane) * f;
+        shadow.splits[i] = settings.splitLambda * logSplit + (1.f - settings.splitLambda) * uniformSplit;
+    }
+
+    float tanY = 1.f / projection[1][1];
+    float tanX = 1.f / projection[0][0];
+    glm::mat4 viewToWorld = glm::inverse(worldToView);
+    shadow.stats.renderedCascades = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        // Bounding sphere of the slice corners, its radius only depends on
+        // the projection so the map size does not change as the view turns
+        glm::vec3 corners[8];
+        glm::vec3 center(0.f);
+        for (int c = 0; c < 8; ++c)
+        {
+            float depth = shadow.splits[i + (c >> 2)];
+            glm::vec4 corner(c & 1 ? depth * tanX : -depth * tanX, c & 2 ? depth * tanY : -depth * tanY, -depth, 1.f);
+            corners[c] = glm::vec3(viewToWorld * corner);
+            center += corners[c] * 0.125f;
+        }
+        float sphereRadius = 0.f;
+        for (int c = 0; c < 8; ++c)
+            sphereRadius = std::max(sphereRadius, glm::length(corners[c] - center));
+        sphereRadius = ceilf(sphereRadius * 16.f) / 16.f;
+        glm::vec3 lightCenter(shadow.lightView * glm::vec4(center, 1.f));
+
+        // Cached cascades are kept while the sphere stays inside their box
+        bool cached = i >= count - settings.cachedCascades;
+        float radius = cached ? sphereRadius * (1.f + settings.cachePadding) : sphereRadius;
+        glm::vec3 offset = glm::abs(lightCenter - shadow.center[i]) + glm::vec3(sphereRadius);
+        if (cached && shadow.valid[i] && shadow.radius[i] == radius &&
+            offset.x <= radius && offset.y <= radius && offset.z <= radius)
+        {
+            shadow.dirty[i] = false;
+            continue;
+        }
+
+        // Snap to whole texels so static edges land on the same texels
+        float texel = 2.f * radius / settings.resolution;
+        glm::vec3 snapped(floorf(lightCenter.x / texel) * texel, floorf(lightCenter.y / texel) * texel, lightCenter.z);
+        if (shadow.valid[i] && shadow.radius[i] == radius && snapped.x == shadow.center[i].x && snapped.y == shadow.center[i].y &&
+            fabsf(snapped.z - shadow.center[i].z) + sphereRadius <= radius)
+        {
+            shadow.dirty[i] = false;
+            continue;
+        }
+        shadow.center[i] = snapped;
+        shadow.radius[i] = radius;
+        glm::mat4 ortho = glm::ortho(snapped.x - radius, snapped.x + radius, snapped.y - radius, snapped.y + radius,
+                                     -snapped.z - radius, -snapped.z + radius);
+        shadow.viewProjection[i] = ortho * shadow.lightView;
+        shadow.level[i] = lod_select(lod, 1.f, radius, 1.f, (float) settings.resolution, 1.f);
+        shadow.dirty[i] = true;
+        shadow.valid[i] = true;
+        shadow.stats.renderedCascades++;
+    }
+
+    parallel_for(count, 1, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; ++i)
+        {
+            if (!shadow.dirty[i])
+            {
+                shadow.casters[i].clear();
+                continue;
+            }
+            Frustum frustum;
+            frustum_from_matrix(shadow.viewProjection[i], frustum);
+            float texel = 2.f * shadow.radius[i] / settings.resolution;
+            cull_casters(frustum, bounds, texel * settings.minCasterTexels, shadow.casters[i]);
+        }
+    });
+
+    // One draw per level of detail, the cascades sharing a level go together
+    shadow.instances.clear();
+    shadow.draws.clear();
+    for (int level = 0; level < (int) lod.levels.size(); ++level)
+    {
+        ShadowDraw draw = { level, (int) shadow.instances.size(), 0 };
+        for (int i = 0; i < count; ++i)
+        {
+            if (!shadow.dirty[i] || shadow.level[i] != level)
+                continue;
+            for (size_t j = 0; j < shadow.casters[i].size(); ++j)
+            {
+                ShadowInstance instance = { transforms[shadow.casters[i][j]], i, { 0, 0, 0 } };
+                shadow.instances.push_back(instance);
+            }
+        }
+        draw.count = (int) shadow.instances.size() - draw.first;
+        if (draw.count)
+            shadow.draws.push_back(draw);
+    }
+    for (int i = 0; i < SHADOW_MAX_CASCADES; ++i)
+        shadow.stats.casters[i] = i < count ? (int) shadow.casters[i].size() : 0;
+    shadow.stats.draws = (int) shadow.draws.size();
+
+    if (!shadow.instances.empty())
+    {
+        int size = (int) (shadow.instances.size() * sizeof(ShadowInstance));
+        glBindBuffer(GL_ARRAY_BUFFER, shadow.instanceBuffer);
+        // Orphaned every update so the previous draws do not stall the copy
+        if (size > shadow.instanceCapacity)
+            shadow.instanceCapacity = size + size / 2;
+        glBufferData(GL_ARRAY_BUFFER, shadow.instanceCapacity, 0, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, size, &shadow.instances[0]);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    shadow.stats.ms = elapsed_ms(start);
+}
+
+void shadow_render(ShadowMap & shadow, const LodChain & lod)
+{
+    int count = shadow.settings.cascadeCount;
+    if (!shadow.stats.renderedCascades)
+        return;
+
+    // Layers are cleared one by one, a layered attachment would clear them all
+    glBindFramebuffer(GL_FRAMEBUFFER, shadow.fbo);
+    glViewport(0, 0, shadow.settings.resolution, shadow.settings.resolution);
+    glDepthMask(GL_TRUE);
+    for (int i = 0; i < count; ++i)
+    {
+        if (!shadow.dirty[i])
+            continue;
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadow.texture, 0, i);
+        glClear(GL_DEPTH_BUFFER_BIT);
+    }
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadow.texture, 0);
+
+    // Depth clamp flattens the casters in front of the near plane onto it
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_DEPTH_CLAMP);
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(2.f, 4.f);
+    glUseProgram(shadow.program);
+    glProgramUniformMatrix4fv(shadow.program, shadow.viewProjectionLocation, count, 0, glm::value_ptr(shadow.viewProjection[0]));
+    glBindVertexArray(shadow.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, shadow.instanceBuffer);
+    for (size_t i = 0; i < shadow.draws.size(); ++i)
+    {
+        // GL 4.1 has no base instance, the attributes point at the range
+        const ShadowDraw & draw = shadow.draws[i];
+        const LodLevel & level = lod.levels[draw.level];
+        size_t first = draw.first * sizeof(ShadowInstance);
+        for (int k = 0; k < 4; ++k)
+            glVertexAttribPointer(4 + k, 4, GL_FLOAT, GL_FALSE, sizeof(ShadowInstance), (void*)(first + sizeof(float) * 4 * k));
+        glVertexAttribIPointer(8, 1, GL_INT, sizeof(ShadowInstance), (void*)(first + sizeof(glm::mat4)));
+        glDrawElementsInstanced(GL_TRIANGLES, level.triangleCount * 3, GL_UNSIGNED_INT,
+                                (void*)(level.indexOffset * sizeof(int)), draw.count);
+    }
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glDisable(GL_POLYGON_OFFSET_FILL);
+    glDisable(GL_DEPTH_CLAMP);
+}
+
+void shadow_uniforms_init(ShadowUniforms & uniforms, GLuint program)
+{
+    uniforms.program = program;
+    uniforms.mapLocation = glGetUniformLocation(program, "ShadowMap");
+    uniforms.cascadesLocation = glGetUniformLocation(program, "ShadowCascades");
+    uniforms.matricesLocation = glGetUniformLocation(program, "ShadowMatrices");
+    uniforms.texelSizeLocation = glGetUniformLocation(program, "ShadowTexelSize");
+    uniforms.sunDirectionLocation = glGetUniformLocation(program, "SunDirection");
+}
+
+void shadow_bind(const ShadowMap & shadow, const ShadowUniforms & uniforms, int unit, bool enabled)
+{
+    int count = shadow.settings.cascadeCount;
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, shadow.texture);
+    glActiveTexture(GL_TEXTURE0);
+
+    // Clip space to texture space
+    glm::mat4 bias = glm::translate(glm::mat4(1.f), glm::vec3(0.5f)) * glm::scale(glm::mat4(1.f), glm::vec3(0.5f));
+    glm::mat4 matrices[SHADOW_MAX_CASCADES];
+    float texelSizes[SHADOW_MAX_CASCADES];
+    for (int i = 0; i < count; ++i)
+    {
+        matrices[i] = bias * shadow.viewProjection[i];
+        texelSizes[i] = 2.f * shadow.radius[i] / shadow.settings.resolution;
+    }
+    GLuint program = uniforms.program;
+    glProgramUniform1i(program, uniforms.mapLocation, unit);
+    glProgramUniform1i(program, uniforms.cascadesLocation, enabled ? count : 0);
+    glProgramUniformMatrix4fv(program, uniforms.matricesLocation, count, 0, glm::value_ptr(matrices[0]));
+    glProgramUniform1fv(program, uniforms.texelSizeLocation, count, texelSizes);
+    const glm::vec3 & direction = shadow.settings.direction;
+    glProgramUniform3f(program, uniforms.sunDirectionLocation, direction.x, direction.y, direction.z);
+}
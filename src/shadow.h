@@ -0,0 +1,122 @@
+#ifndef AOGL_SHADOW_H
+#define AOGL_SHADOW_H
+
+#include <vector>
+
+#include "glew/glew.h"
+#include "glm/glm.hpp"
+
+#include "culling.h"
+#include "lod.h"
+#include "mesh.h"
+
+const int SHADOW_MAX_CASCADES = 4;
+
+struct ShadowSettings
+{
+    int cascadeCount;
+    int resolution;         // texels per cascade side
+    float distance;         // view depth covered by the last cascade
+    float splitLambda;      // 0 uniform splits, 1 logarithmic
+    int cachedCascades;     // far cascades kept until the view leaves them
+    float cachePadding;     // extra footprint of cached cascades, to last longer
+    float minCasterTexels;  // casters smaller than this in a cascade are skipped
+    glm::vec3 direction;    // sun light travels along it
+};
+
+// One instance of a caster in a cascade, as read by shadow.vert
+struct ShadowInstance
+{
+    glm::mat4 objectToWorld;
+    int cascade;
+    int padding[3];
+};
+
+// Instanced draw of the casters at one level of detail, over all cascades
+struct ShadowDraw
+{
+    int level;
+    int first;
+    int count;
+};
+
+struct ShadowStats
+{
+    int renderedCascades;   // re-rendered this frame, the others are cached
+    int casters[SHADOW_MAX_CASCADES];
+    int draws;
+    double ms;              // culling and instance upload
+};
+
+// Cascaded shadow maps of the sun over the view frustum. Each cascade is an
+// orthographic box around the bounding sphere of its depth slice, centered
+// on a whole texel so the map does not shimmer as the camera moves. Casters
+// are culled per cascade on the worker pool, picked at the level of detail
+// the cascade resolution needs, and drawn in a single pass: shadow.geom
+// sends each instance to the layer of its cascade. Far cascades are cached
+// with a padded footprint and only redrawn when the view leaves it or the
+// casters change.
+struct ShadowMap
+{
+    ShadowSettings settings;
+    GLuint texture;             // depth array, one layer per cascade
+    GLuint fbo;
+    GLuint program;
+    GLint viewProjectionLocation;
+    GLuint vao;                 // positions of the caster mesh and instances
+    GLuint instanceBuffer;
+    int instanceCapacity;
+    glm::mat4 lightView;
+    glm::mat4 viewProjection[SHADOW_MAX_CASCADES];
+    glm::vec3 center[SHADOW_MAX_CASCADES];     // light space center of the map
+    float radius[SHADOW_MAX_CASCADES];         // half the side of the map
+    float splits[SHADOW_MAX_CASCADES + 1];     // view depths
+    bool valid[SHADOW_MAX_CASCADES];           // map still holds the casters at viewProjection
+    bool dirty[SHADOW_MAX_CASCADES];           // to render this frame
+    int level[SHADOW_MAX_CASCADES];            // caster level of detail per cascade
+    std::vector<int> casters[SHADOW_MAX_CASCADES];     // scratch: instance indices per cascade
+    std::vector<ShadowInstance> instances;             // scratch: upload order
+    std::vector<ShadowDraw> draws;
+    ShadowStats stats;
+};
+
+// Locations of the shadow uniforms in one program, looked up once
+struct ShadowUniforms
+{
+    GLuint program;
+    GLint mapLocation;
+    GLint cascadesLocation;
+    GLint matricesLocation;
+    GLint texelSizeLocation;
+    GLint sunDirectionLocation;
+};
+
+void shadow_default_settings(ShadowSettings & settings);
+
+// program is linked from shadow.vert and shadow.geom; casterMesh is drawn
+// with the index ranges of lod, which must already be uploaded to it
+void shadow_init(ShadowMap & shadow, const ShadowSettings & settings, GLuint program, const GpuMesh & casterMesh);
+void shadow_release(ShadowMap & shadow);
+
+// program includes lighting.glsl
+void shadow_uniforms_init(ShadowUniforms & uniforms, GLuint program);
+
+// Casters moved, every cascade is redrawn on the next update
+void shadow_invalidate(ShadowMap & shadow);
+
+// Turns the light, every cascade is redrawn on the next update
+void shadow_set_direction(ShadowMap & shadow, const glm::vec3 & direction);
+
+// Fits the cascades to the view, then culls the instances for the cascades
+// that need redrawing and uploads them. Projection is a symmetric perspective.
+void shadow_update(ShadowMap & shadow, const glm::mat4 & worldToView, const glm::mat4 & projection, float nearPlane,
+                   const InstanceBounds & bounds, const glm::mat4 * transforms, const LodChain & lod);
+
+// Renders the dirty cascades, the caller binds its framebuffer back
+void shadow_render(ShadowMap & shadow, const LodChain & lod);
+
+// Binds the depth array at unit and sets the shadow uniforms of the program
+// of uniforms, enabled selects between the sun and the point key light
+void shadow_bind(const ShadowMap & shadow, const ShadowUniforms & uniforms, int unit, bool enabled);
+
+#endif // AOGL_SHADOW_H
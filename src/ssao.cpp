@@ -0,0 +1,473 @@
+#include "ssao.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+
+#include "glm/gtc/matrix_transform.hpp"
+#include "glm/gtc/type_ptr.hpp"
+
+#include "parallel.h"
+
+namespace
+{
+
+enum
+{
+    PASS_DOWNSAMPLE,
+    PASS_OCCLUSION,
+    PASS_TEMPORAL,
+    PASS_BLUR
+};
+
+const int BLUR_RADIUS = 4;
+const float SKY_DEPTH = 1e20f;
+
+// Rotations of the kernel over a 4x4 tile, in 16ths of a turn, as in ssao.frag
+const int ROTATIONS[16] = { 0, 8, 2, 10, 12, 4, 14, 6, 3, 11, 1, 9, 15, 7, 13, 5 };
+
+GLuint create_target(GLenum internalFormat, GLenum format, GLenum type, int width, int height, GLenum filter)
+{
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    return texture;
+}
+
+GLuint create_fbo(GLuint color0, GLuint color1)
+{
+    static const GLenum attachments[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    GLuint fbo;
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color0, 0);
+    if (color1)
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, color1, 0);
+    glDrawBuffers(color1 ? 2 : 1, attachments);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        fprintf(stderr, "SSAO: incomplete framebuffer\n");
+    return fbo;
+}
+
+float radical_inverse(int i, int base)
+{
+    float inverse = 1.f / base;
+    float scale = inverse;
+    float value = 0.f;
+    for (; i > 0; i /= base, scale *= inverse)
+        value += (i % base) * scale;
+    return value;
+}
+
+// Value written to an 8 bit normalized target
+float unorm8(float value)
+{
+    return floorf(std::min(std::max(value, 0.f), 1.f) * 255.f + 0.5f) / 255.f;
+}
+
+float smoothstep01(float x)
+{
+    float t = std::min(std::max(x, 0.f), 1.f);
+    return t * t * (3.f - 2.f * t);
+}
+
+// Octahedral decoding of lighting.glsl, from RG16 texels
+glm::vec3 oct_decode(const unsigned short * texel)
+{
+    glm::vec2 e(texel[0] / 65535.f * 2.f - 1.f, texel[1] / 65535.f * 2.f - 1.f);
+    glm::vec3 n(e.x, e.y, 1.f - fabsf(e.x) - fabsf(e.y));
+    if (n.z < 0.f)
+        n = glm::vec3((1.f - fabsf(e.y)) * (e.x >= 0.f ? 1.f : -1.f), (1.f - fabsf(e.x)) * (e.y >= 0.f ? 1.f : -1.f), n.z);
+    return glm::normalize(n);
+}
+
+void draw_pass(const Ssao & ssao, GLuint fbo, int pass)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glProgramUniform1i(ssao.program, ssao.passLocation, pass);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+void bind_texture(int unit, GLuint texture)
+{
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D, texture);
+}
+
+}
+
+void ssao_default_settings(SsaoSettings & settings)
+{
+    settings.samples = 12;
+    settings.radius = 1.f;
+    settings.bias = 0.02f;
+    settings.blurSharpness = 10.f;
+    settings.temporal = false;
+    settings.temporalBlend = 0.1f;
+}
+
+void ssao_init(Ssao & ssao, const SsaoSettings & settings, GLuint program, int width, int height)
+{
+    ssao.settings = settings;
+    ssao.width = (width + 1) / 2;
+    ssao.height = (height + 1) / 2;
+    ssao.program = program;
+    ssao.passLocation = glGetUniformLocation(program, "Pass");
+    ssao.kernelLocation = glGetUniformLocation(program, "Kernel");
+    static const char * samplers[5] = { "Source", "Normal", "Depth", "History", "HistoryDepth" };
+    for (int i = 0; i < 5; ++i)
+        ssao.samplerLocations[i] = glGetUniformLocation(program, samplers[i]);
+    ssao.depthParametersLocation = glGetUniformLocation(program, "DepthParameters");
+    ssao.projectionLocation = glGetUniformLocation(program, "Projection");
+    ssao.worldToViewLocation = glGetUniformLocation(program, "WorldToView");
+    ssao.sampleCountLocation = glGetUniformLocation(program, "SampleCount");
+    ssao.radiusLocation = glGetUniformLocation(program, "Radius");
+    ssao.biasLocation = glGetUniformLocation(program, "Bias");
+    ssao.rotationLocation = glGetUniformLocation(program, "Rotation");
+    ssao.blurSharpnessLocation = glGetUniformLocation(program, "BlurSharpness");
+    ssao.blurDirectionLocation = glGetUniformLocation(program, "BlurDirection");
+    ssao.viewToPreviousClipLocation = glGetUniformLocation(program, "ViewToPreviousClip");
+    ssao.temporalBlendLocation = glGetUniformLocation(program, "TemporalBlend");
+    glGenVertexArrays(1, &ssao.vao);
+
+    int w = ssao.width, h = ssao.height;
+    for (int i = 0; i < 2; ++i)
+    {
+        ssao.depthTextures[i] = create_target(GL_R32F, GL_RED, GL_FLOAT, w, h, GL_NEAREST);
+        ssao.historyTextures[i] = create_target(GL_R16F, GL_RED, GL_FLOAT, w, h, GL_LINEAR);
+    }
+    ssao.normalTexture = create_target(GL_RG16, GL_RG, GL_UNSIGNED_SHORT, w, h, GL_NEAREST);
+    ssao.resultTexture = create_target(GL_R8, GL_RED, GL_UNSIGNED_BYTE, w, h, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        ssao.downsampleFbos[i] = create_fbo(ssao.depthTextures[i], ssao.normalTexture);
+        ssao.historyFbos[i] = create_fbo(ssao.historyTextures[i], 0);
+    }
+    ssao.resultFbo = create_fbo(ssao.resultTexture, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    ssao.current = 0;
+    ssao.frame = 0;
+    ssao.historyValid = false;
+    ssao.depthParameters = glm::vec2(1.f, 0.f);
+    ssao.kernelSamples = 0;
+}
+
+void ssao_release(Ssao & ssao)
+{
+    glDeleteFramebuffers(2, ssao.downsampleFbos);
+    glDeleteFramebuffers(2, ssao.historyFbos);
+    glDeleteFramebuffers(1, &ssao.resultFbo);
+    glDeleteTextures(2, ssao.depthTextures);
+    glDeleteTextures(2, ssao.historyTextures);
+    glDeleteTextures(1, &ssao.normalTexture);
+    glDeleteTextures(1, &ssao.resultTexture);
+    glDeleteVertexArrays(1, &ssao.vao);
+    glDeleteProgram(ssao.program);
+}
+
+void ssao_kernel(int samples, glm::vec3 * kernel)
+{
+    // Cosine weighted directions from a Halton sequence, scaled so that
+    // samples gather near the center where occluders matter most
+    for (int i = 0; i < samples; ++i)
+    {
+        float u = radical_inverse(i + 1, 2);
+        float v = radical_inverse(i + 1, 3);
+        float r = sqrtf(u);
+        float phi = 6.2831853f * v;
+        glm::vec3 direction(r * cosf(phi), r * sinf(phi), sqrtf(std::max(0.f, 1.f - u)));
+        float scale = (i + 1.f) / samples;
+        kernel[i] = direction * (0.1f + 0.9f * scale * scale);
+    }
+}
+
+void ssao_render(Ssao & ssao, RenderTargetPool & pool, const DeferredRenderer & deferred, const glm::mat4 & projection,
+                 const glm::mat4 & worldToView, int firstUnit)
+{
+    const SsaoSettings & settings = ssao.settings;
+    GLuint program = ssao.program;
+    int samples = std::min(std::max(settings.samples, 1), SSAO_MAX_SAMPLES);
+    if (ssao.kernelSamples != samples)
+    {
+        ssao_kernel(samples, ssao.kernel);
+        glProgramUniform3fv(program, ssao.kernelLocation, samples, glm::value_ptr(ssao.kernel[0]));
+        ssao.kernelSamples = samples;
+    }
+    int previous = ssao.current;
+    int current = ssao.current = 1 - ssao.current;
+    ssao.depthParameters = glm::vec2(projection[3][2], projection[2][2]);
+    glm::mat4 viewProjection = projection * worldToView;
+    glm::mat3 worldToView3(worldToView);
+
+    for (int i = 0; i < 5; ++i)
+        glProgramUniform1i(program, ssao.samplerLocations[i], firstUnit + i);
+    glProgramUniform2fv(program, ssao.depthParametersLocation, 1, glm::value_ptr(ssao.depthParameters));
+    glProgramUniformMatrix4fv(program, ssao.projectionLocation, 1, 0, glm::value_ptr(projection));
+    glProgramUniformMatrix3fv(program, ssao.worldToViewLocation, 1, 0, glm::value_ptr(worldToView3));
+    glProgramUniform1i(program, ssao.sampleCountLocation, samples);
+    glProgramUniform1f(program, ssao.radiusLocation, settings.radius);
+    glProgramUniform1f(program, ssao.biasLocation, settings.bias);
+    glProgramUniform1i(program, ssao.rotationLocation, settings.temporal ? (ssao.frame * 7) & 15 : 0);
+    glProgramUniform1f(program, ssao.blurSharpnessLocation, settings.blurSharpness);
+
+    glDisable(GL_DEPTH_TEST);
+    glViewport(0, 0, ssao.width, ssao.height);
+    glUseProgram(program);
+    glBindVertexArray(ssao.vao);
+
+    // Closest depth and its normal of each 2x2 G-buffer texels
+    bind_texture(firstUnit, deferred.textures[3]);
+    bind_texture(firstUnit + 1, deferred.textures[2]);
+    draw_pass(ssao, ssao.downsampleFbos[current], PASS_DOWNSAMPLE);
+
+    // Read with texelFetch only, the linear filtering of the pool does not matter
+    int raw = render_target_acquire(pool, ssao.width, ssao.height, GL_R8);
+    int blur = render_target_acquire(pool, ssao.width, ssao.height, GL_R8);
+    GLuint rawTexture = pool.targets[raw].texture;
+    GLuint blurTexture = pool.targets[blur].texture;
+    bind_texture(firstUnit + 1, ssao.normalTexture);
+    bind_texture(firstUnit + 2, ssao.depthTextures[current]);
+    draw_pass(ssao, pool.targets[raw].fbo, PASS_OCCLUSION);
+
+    // The history follows the surfaces through the previous view, and
+    // starts over where they were hidden
+    GLuint occlusion = rawTexture;
+    if (settings.temporal)
+    {
+        glm::mat4 viewToPreviousClip = ssao.previousViewProjection * glm::inverse(worldToView);
+        glProgramUniformMatrix4fv(program, ssao.viewToPreviousClipLocation, 1, 0, glm::value_ptr(viewToPreviousClip));
+        glProgramUniform1f(program, ssao.temporalBlendLocation, ssao.historyValid ? settings.temporalBlend : 1.f);
+        bind_texture(firstUnit, rawTexture);
+        bind_texture(firstUnit + 3, ssao.historyTextures[previous]);
+        bind_texture(firstUnit + 4, ssao.depthTextures[previous]);
+        draw_pass(ssao, ssao.historyFbos[current], PASS_TEMPORAL);
+        occlusion = ssao.historyTextures[current];
+    }
+    ssao.historyValid = settings.temporal;
+
+    bind_texture(firstUnit, occlusion);
+    glProgramUniform2i(program, ssao.blurDirectionLocation, 1, 0);
+    draw_pass(ssao, pool.targets[blur].fbo, PASS_BLUR);
+    render_target_release(pool, raw);
+    bind_texture(firstUnit, blurTexture);
+    glProgramUniform2i(program, ssao.blurDirectionLocation, 0, 1);
+    draw_pass(ssao, ssao.resultFbo, PASS_BLUR);
+    render_target_release(pool, blur);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindVertexArray(0);
+    glEnable(GL_DEPTH_TEST);
+    ssao.previousViewProjection = viewProjection;
+    ssao.frame++;
+}
+
+void ssao_uniforms_init(SsaoUniforms & uniforms, GLuint program)
+{
+    uniforms.program = program;
+    uniforms.occlusionLocation = glGetUniformLocation(program, "Occlusion");
+    uniforms.occlusionDepthLocation = glGetUniformLocation(program, "OcclusionDepth");
+    uniforms.modeLocation = glGetUniformLocation(program, "OcclusionMode");
+    uniforms.depthParametersLocation = glGetUniformLocation(program, "DepthParameters");
+}
+
+void ssao_bind(const Ssao & ssao, const SsaoUniforms & uniforms, int unit, int mode)
+{
+    bind_texture(unit, ssao.resultTexture);
+    bind_texture(unit + 1, ssao.depthTextures[ssao.current]);
+    glActiveTexture(GL_TEXTURE0);
+    GLuint program = uniforms.program;
+    glProgramUniform1i(program, uniforms.occlusionLocation, unit);
+    glProgramUniform1i(program, uniforms.occlusionDepthLocation, unit + 1);
+    glProgramUniform1i(program, uniforms.modeLocation, mode);
+    glProgramUniform2fv(program, uniforms.depthParametersLocation, 1, glm::value_ptr(ssao.depthParameters));
+}
+
+void ssao_reference(const SsaoSettings & settings, const glm::vec3 * kernel, const glm::mat4 & projection,
+                    const glm::mat4 & worldToView, int width, int height, const float * depth,
+                    const unsigned short * normals, std::vector<float> & occlusion, std::vector<float> * fullOcclusion)
+{
+    int w = (width + 1) / 2, h = (height + 1) / 2;
+    int samples = std::min(std::max(settings.samples, 1), SSAO_MAX_SAMPLES);
+    float depthScale = projection[3][2], depthBias = projection[2][2];
+    glm::mat3 worldToView3(worldToView);
+    std::vector<float> halfDepth(w * h);
+    std::vector<glm::vec3> halfNormals(w * h);
+    std::vector<float> raw(w * h);
+    std::vector<float> blurred(w * h);
+    occlusion.resize(w * h);
+
+    // Downsample, as PASS_DOWNSAMPLE
+    parallel_for(h, 8, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; ++y)
+            for (int x = 0; x < w; ++x)
+            {
+                int closest = std::min(y * 2, height - 1) * width + std::min(x * 2, width - 1);
+                for (int i = 1; i < 4; ++i)
+                {
+                    int tap = std::min(y * 2 + (i >> 1), height - 1) * width + std::min(x * 2 + (i & 1), width - 1);
+                    if (depth[tap] < depth[closest])
+                        closest = tap;
+                }
+                float d = depth[closest];
+                halfDepth[y * w + x] = d == 1.f ? SKY_DEPTH : depthScale / (d * 2.f - 1.f + depthBias);
+                halfNormals[y * w + x] = glm::normalize(worldToView3 * oct_decode(&normals[closest * 2]));
+            }
+    });
+
+    // Kernel tests, as PASS_OCCLUSION
+    parallel_for(h, 8, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; ++y)
+            for (int x = 0; x < w; ++x)
+            {
+                float d = halfDepth[y * w + x];
+                if (d >= SKY_DEPTH)
+                {
+                    raw[y * w + x] = 1.f;
+                    continue;
+                }
+                glm::vec2 ndc((x + 0.5f) / w * 2.f - 1.f, (y + 0.5f) / h * 2.f - 1.f);
+                glm::vec3 p(ndc.x * d / projection[0][0], ndc.y * d / projection[1][1], -d);
+                glm::vec3 n = halfNormals[y * w + x];
+
+                int index = ROTATIONS[(y & 3) * 4 + (x & 3)];
+                float angle = (index + 0.5f) * (6.2831853f / 16.f);
+                glm::vec3 r(cosf(angle), sinf(angle), 0.f);
+                glm::vec3 t = r - n * glm::dot(r, n);
+                t = glm::dot(t, t) > 1e-6f ? glm::normalize(t) : glm::vec3(-r.y, r.x, 0.f);
+                glm::vec3 b = glm::cross(n, t);
+
+                float occluded = 0.f;
+                for (int i = 0; i < samples; ++i)
+                {
+                    glm::vec3 s = p + (t * kernel[i].x + b * kernel[i].y + n * kernel[i].z) * settings.radius;
+                    glm::vec4 clip = projection * glm::vec4(s, 1.f);
+                    if (clip.w <= 0.f)
+                        continue;
+                    glm::vec2 uv = glm::vec2(clip) / clip.w * 0.5f + 0.5f;
+                    if (uv.x < 0.f || uv.y < 0.f || uv.x >= 1.f || uv.y >= 1.f)
+                        continue;
+                    float sceneDepth = halfDepth[(int) (uv.y * h) * w + (int) (uv.x * w)];
+                    float range = smoothstep01(settings.radius / fabsf(d - sceneDepth));
+                    if (sceneDepth < -s.z - settings.bias)
+                        occluded += range;
+                }
+                raw[y * w + x] = unorm8(1.f - occluded / samples);
+            }
+    });
+
+    // Horizontal then vertical blur, as PASS_BLUR
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        const std::vector<float> & source = pass == 0 ? raw : blurred;
+        std::vector<float> & target = pass == 0 ? blurred : occlusion;
+        parallel_for(h, 8, [&](int begin, int end)
+        {
+            for (int y = begin; y < end; ++y)
+                for (int x = 0; x < w; ++x)
+                {
+                    float d = halfDepth[y * w + x];
+                    float sum = 0.f;
+                    float weights = 0.f;
+                    for (int i = -BLUR_RADIUS; i <= BLUR_RADIUS; ++i)
+                    {
+                        int tx = pass == 0 ? std::min(std::max(x + i, 0), w - 1) : x;
+                        int ty = pass == 0 ? y : std::min(std::max(y + i, 0), h - 1);
+                        float tapDepth = halfDepth[ty * w + tx];
+                        float weight = expf(-(i * i) / 8.f) * std::max(0.f, 1.f - fabsf(tapDepth - d) * settings.blurSharpness / d);
+                        sum += source[ty * w + tx] * weight;
+                        weights += weight;
+                    }
+                    target[y * w + x] = unorm8(sum / weights);
+                }
+        });
+    }
+
+    if (!fullOcclusion)
+        return;
+
+    // Depth weighted bilinear upsample of deferred.frag, 1 on the sky
+    fullOcclusion->resize(width * height);
+    std::vector<float> & full = *fullOcclusion;
+    parallel_for(height, 8, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; ++y)
+            for (int x = 0; x < width; ++x)
+            {
+                float d = depth[y * width + x];
+                if (d == 1.f)
+                {
+                    full[y * width + x] = 1.f;
+                    continue;
+                }
+                float viewDepth = depthScale / (d * 2.f - 1.f + depthBias);
+                glm::vec2 hp((x + 0.5f) * 0.5f - 0.5f, (y + 0.5f) * 0.5f - 0.5f);
+                glm::vec2 base(floorf(hp.x), floorf(hp.y));
+                glm::vec2 f = hp - base;
+                float sum = 0.f;
+                float weights = 0.f;
+                for (int i = 0; i < 4; ++i)
+                {
+                    int ox = i & 1, oy = i >> 1;
+                    int tx = std::min(std::max((int) base.x + ox, 0), w - 1);
+                    int ty = std::min(std::max((int) base.y + oy, 0), h - 1);
+                    float bilinear = (ox ? f.x : 1.f - f.x) * (oy ? f.y : 1.f - f.y);
+                    float weight = bilinear / (1e-3f + fabsf(halfDepth[ty * w + tx] - viewDepth) / viewDepth);
+                    sum += occlusion[ty * w + tx] * weight;
+                    weights += weight;
+                }
+                full[y * width + x] = sum / weights;
+            }
+    });
+}
+
+void ssao_diff(const float * a, const float * b, int count, float tolerance, SsaoDiff & diff)
+{
+    diff.pixels = count;
+    diff.different = 0;
+    diff.maxError = 0.f;
+    double sum = 0.0;
+    for (int i = 0; i < count; ++i)
+    {
+        float error = fabsf(a[i] - b[i]);
+        if (error > tolerance)
+            diff.different++;
+        diff.maxError = std::max(diff.maxError, error);
+        sum += error;
+    }
+    diff.meanError = count ? (float) (sum / count) : 0.f;
+}
+
+SsaoDiff ssao_compare(const Ssao & ssao, const DeferredRenderer & deferred, const glm::mat4 & projection,
+                      const glm::mat4 & worldToView, float tolerance)
+{
+    std::vector<float> depth(deferred.width * deferred.height);
+    std::vector<unsigned short> normals(deferred.width * deferred.height * 2);
+    std::vector<float> gpu(ssao.width * ssao.height);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glBindTexture(GL_TEXTURE_2D, deferred.textures[3]);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, GL_FLOAT, &depth[0]);
+    glBindTexture(GL_TEXTURE_2D, deferred.textures[2]);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RG, GL_UNSIGNED_SHORT, &normals[0]);
+    glBindTexture(GL_TEXTURE_2D, ssao.resultTexture);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_FLOAT, &gpu[0]);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+    std::vector<float> cpu;
+    ssao_reference(ssao.settings, ssao.kernel, projection, worldToView, deferred.width, deferred.height,
+                   &depth[0], &normals[0], cpu, 0);
+    SsaoDiff diff;
+    ssao_diff(&cpu[0], &gpu[0], (int) gpu.size(), tolerance, diff);
+    return diff;
+}
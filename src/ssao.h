@@ -0,0 +1,125 @@
+#ifndef AOGL_SSAO_H
+#define AOGL_SSAO_H
+
+#include <vector>
+
+#include "glew/glew.h"
+#include "glm/glm.hpp"
+
+#include "deferred.h"
+#include "render_target.h"
+
+const int SSAO_MAX_SAMPLES = 16;
+
+struct SsaoSettings
+{
+    int samples;            // kernel size, up to SSAO_MAX_SAMPLES
+    float radius;           // world units
+    float bias;             // view depth an occluder must be in front by
+    float blurSharpness;    // relative depth difference dropping a blur tap
+    bool temporal;          // accumulate over frames with a rotating kernel
+    float temporalBlend;    // weight of the current frame
+};
+
+// Difference of two occlusion images
+struct SsaoDiff
+{
+    int pixels;
+    int different;          // pixels off by more than the tolerance
+    float maxError;
+    float meanError;
+};
+
+// Ambient occlusion from the G-buffer at half resolution. The depth and
+// normals are downsampled to the closest of each 2x2 texels, then a small
+// hemisphere kernel, rotated over a 4x4 tile of pixels, is tested against
+// the depth buffer. A separable blur that stops at depth edges removes the
+// rotation pattern and deferred.frag upsamples the result with the same
+// depth weights. With temporal accumulation the rotations change every
+// frame and are blended with the reprojected previous result. The cost only
+// depends on the window size and the kernel, not on the scene.
+struct Ssao
+{
+    SsaoSettings settings;
+    int width, height;          // half resolution
+    GLuint program;             // deferred.vert, ssao.frag
+    GLuint vao;                 // empty, the full screen triangle has no attributes
+    GLuint depthTextures[2];    // linear view depth, this frame and the previous one
+    GLuint normalTexture;
+    GLuint historyTextures[2];  // temporal accumulation, this frame and the previous one
+    GLuint resultTexture;       // read by deferred.frag and ssao_compare after the passes
+    GLuint downsampleFbos[2];   // depthTextures[i] and normalTexture
+    GLuint historyFbos[2];
+    GLuint resultFbo;
+    int current;                // index of this frame's depth and history
+    int frame;
+    bool historyValid;
+    glm::mat4 previousViewProjection;
+    glm::vec2 depthParameters;  // view depth = x / (ndc depth + y)
+    int kernelSamples;
+    glm::vec3 kernel[SSAO_MAX_SAMPLES];
+    GLint passLocation;
+    GLint kernelLocation;
+    GLint samplerLocations[5];  // Source, Normal, Depth, History, HistoryDepth
+    GLint depthParametersLocation;
+    GLint projectionLocation;
+    GLint worldToViewLocation;
+    GLint sampleCountLocation;
+    GLint radiusLocation;
+    GLint biasLocation;
+    GLint rotationLocation;
+    GLint blurSharpnessLocation;
+    GLint blurDirectionLocation;
+    GLint viewToPreviousClipLocation;
+    GLint temporalBlendLocation;
+};
+
+// Locations of the occlusion uniforms of deferred.frag in one program,
+// looked up once
+struct SsaoUniforms
+{
+    GLuint program;
+    GLint occlusionLocation;
+    GLint occlusionDepthLocation;
+    GLint modeLocation;
+    GLint depthParametersLocation;
+};
+
+void ssao_default_settings(SsaoSettings & settings);
+
+// width and height are the G-buffer size
+void ssao_init(Ssao & ssao, const SsaoSettings & settings, GLuint program, int width, int height);
+void ssao_release(Ssao & ssao);
+
+void ssao_uniforms_init(SsaoUniforms & uniforms, GLuint program);
+
+// Hemisphere samples around +z, denser near the center
+void ssao_kernel(int samples, glm::vec3 * kernel);
+
+// Computes the occlusion of the G-buffer with texture units firstUnit to
+// firstUnit + 4, the caller binds its framebuffer and viewport back. The
+// raw occlusion and the horizontal blur come from pool and are released
+// before returning. Projection is a symmetric perspective.
+void ssao_render(Ssao & ssao, RenderTargetPool & pool, const DeferredRenderer & deferred, const glm::mat4 & projection,
+                 const glm::mat4 & worldToView, int firstUnit);
+
+// Binds the result at unit and its depth at unit + 1 for deferred.frag,
+// mode is 0 off, 1 ambient occlusion, 2 occlusion only
+void ssao_bind(const Ssao & ssao, const SsaoUniforms & uniforms, int unit, int mode);
+
+// CPU version of the chain without temporal accumulation, to diff against
+// the GPU. depth and normals are the G-buffer targets as read back: window
+// depth and RG16 octahedral world normals. occlusion receives the half
+// resolution result and fullOcclusion, when given, its upsample.
+void ssao_reference(const SsaoSettings & settings, const glm::vec3 * kernel, const glm::mat4 & projection,
+                    const glm::mat4 & worldToView, int width, int height, const float * depth,
+                    const unsigned short * normals, std::vector<float> & occlusion, std::vector<float> * fullOcclusion);
+
+void ssao_diff(const float * a, const float * b, int count, float tolerance, SsaoDiff & diff);
+
+// Reads back the G-buffer and the last result, then diffs the result with
+// ssao_reference. Only meaningful without temporal accumulation.
+SsaoDiff ssao_compare(const Ssao & ssao, const DeferredRenderer & deferred, const glm::mat4 & projection,
+                      const glm::mat4 & worldToView, float tolerance);
+
+#endif // AOGL_SSAO_H
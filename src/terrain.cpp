@@ -0,0 +1,666 @@
+#include "terrain.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+#include "glm/gtc/noise.hpp"
+#include "glm/gtc/type_ptr.hpp"
+
+#include "mesh.h"
+#include "hash.h"
+#include "timer.h"
+
+const int TERRAIN_CACHE_VERSION = 1;
+
+struct TerrainCacheHeader
+{
+    char magic[4];
+    int version;
+    uint64_t key;
+    int x, z, level;
+    float minHeight, maxHeight;
+    int floatCount;
+};
+
+struct TerrainRequest
+{
+    int x, z, level;
+};
+
+struct TerrainQueue
+{
+    TerrainSettings settings;
+    uint64_t settingsKey;
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::vector<TerrainRequest> requests;   // nearest last
+    std::vector<uint64_t> working;          // keys being generated
+    std::vector<TerrainChunkData *> done;
+    long long generated;
+    long long diskHits;
+    double generateMs;
+    bool quit;
+
+    void worker();
+};
+
+namespace
+{
+
+uint64_t chunk_key(int x, int z, int level)
+{
+    // 24 bits per coordinate, chunks are never that far from the origin
+    return ((uint64_t) ((x + (1 << 23)) & 0xffffff) << 32) | ((uint64_t) ((z + (1 << 23)) & 0xffffff) << 8) | (uint64_t) level;
+}
+
+int level_side(const TerrainSettings & settings, int level)
+{
+    return (settings.resolution >> level) + 1;
+}
+
+std::string chunk_path(const TerrainSettings & settings, int x, int z, int level)
+{
+    char name[64];
+    sprintf(name, "/%d_%d_%d.chunk", x, z, level);
+    return settings.cacheDirectory + name;
+}
+
+bool load_chunk(const TerrainSettings & settings, uint64_t key, TerrainChunkData & chunk)
+{
+    FILE * f = fopen(chunk_path(settings, chunk.x, chunk.z, chunk.level).c_str(), "rb");
+    if (!f)
+        return false;
+    int side = level_side(settings, chunk.level);
+    int floatCount = (side * side + 4 * side) * TERRAIN_VERTEX_FLOATS;
+    TerrainCacheHeader header;
+    bool valid = fread(&header, sizeof(header), 1, f) == 1
+        && memcmp(header.magic, "AOTC", 4) == 0
+        && header.version == TERRAIN_CACHE_VERSION
+        && header.key == key
+        && header.x == chunk.x && header.z == chunk.z && header.level == chunk.level
+        && header.floatCount == floatCount;
+    if (valid)
+    {
+        chunk.vertices.resize(floatCount);
+        valid = fread(&chunk.vertices[0], sizeof(float), floatCount, f) == (size_t) floatCount;
+        chunk.minHeight = header.minHeight;
+        chunk.maxHeight = header.maxHeight;
+    }
+    fclose(f);
+    return valid;
+}
+
+// Written next to the final name then renamed, so readers never see half a chunk
+void save_chunk(const TerrainSettings & settings, uint64_t key, const TerrainChunkData & chunk)
+{
+    std::string path = chunk_path(settings, chunk.x, chunk.z, chunk.level);
+    std::string tmp = path + ".tmp";
+    FILE * f = fopen(tmp.c_str(), "wb");
+    if (!f)
+        return;
+    TerrainCacheHeader header;
+    memcpy(header.magic, "AOTC", 4);
+    header.version = TERRAIN_CACHE_VERSION;
+    header.key = key;
+    header.x = chunk.x;
+    header.z = chunk.z;
+    header.level = chunk.level;
+    header.minHeight = chunk.minHeight;
+    header.maxHeight = chunk.maxHeight;
+    header.floatCount = (int) chunk.vertices.size();
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+        && fwrite(&chunk.vertices[0], sizeof(float), chunk.vertices.size(), f) == chunk.vertices.size();
+    ok = fclose(f) == 0 && ok;
+    remove(path.c_str());
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+        remove(tmp.c_str());
+}
+
+// Grid triangles counter-clockwise seen from above, then skirts hanging from
+// the 4 borders and facing outwards
+void build_indices(int side, std::vector<int> & indices)
+{
+    indices.clear();
+    for (int z = 0; z < side - 1; ++z)
+        for (int x = 0; x < side - 1; ++x)
+        {
+            int i = z * side + x;
+            indices.push_back(i);
+            indices.push_back(i + side);
+            indices.push_back(i + 1);
+            indices.push_back(i + 1);
+            indices.push_back(i + side);
+            indices.push_back(i + side + 1);
+        }
+    int skirt = side * side;
+    for (int edge = 0; edge < 4; ++edge)
+    {
+        for (int i = 0; i < side - 1; ++i)
+        {
+            int a, b;
+            switch (edge)
+            {
+            case 0: a = i; b = i + 1; break;
+            case 1: a = (side - 1) * side + i; b = a + 1; break;
+            case 2: a = i * side; b = a + side; break;
+            default: a = i * side + side - 1; b = a + side; break;
+            }
+            int lowA = skirt + edge * side + i;
+            int lowB = lowA + 1;
+            if (edge == 0 || edge == 3)
+            {
+                int quad[6] = { a, b, lowB, a, lowB, lowA };
+                indices.insert(indices.end(), quad, quad + 6);
+            }
+            else
+            {
+                int quad[6] = { b, a, lowA, b, lowA, lowB };
+                indices.insert(indices.end(), quad, quad + 6);
+            }
+        }
+    }
+}
+
+void release_chunk(TerrainChunk & chunk)
+{
+    glDeleteVertexArrays(1, &chunk.vao);
+    glDeleteBuffers(1, &chunk.vbo);
+}
+
+}
+
+void TerrainQueue::worker()
+{
+    for (;;)
+    {
+        TerrainRequest request;
+        uint64_t key;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [&] { return quit || !requests.empty(); });
+            if (quit)
+                return;
+            request = requests.back();
+            requests.pop_back();
+            key = chunk_key(request.x, request.z, request.level);
+            working.push_back(key);
+        }
+
+        TerrainChunkData * chunk = new TerrainChunkData;
+        chunk->x = request.x;
+        chunk->z = request.z;
+        chunk->level = request.level;
+        chunk->lastUsedFrame = 0;
+        bool fromDisk = !settings.cacheDirectory.empty() && load_chunk(settings, settingsKey, *chunk);
+        double ms = 0.0;
+        if (!fromDisk)
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            terrain_build_chunk(settings, *chunk);
+            ms = elapsed_ms(start);
+            if (!settings.cacheDirectory.empty())
+                save_chunk(settings, settingsKey, *chunk);
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        working.erase(std::find(working.begin(), working.end(), key));
+        done.push_back(chunk);
+        if (fromDisk)
+            ++diskHits;
+        else
+        {
+            ++generated;
+            generateMs += ms;
+        }
+    }
+}
+
+void terrain_default_settings(TerrainSettings & settings)
+{
+    settings.chunkSize = 32.f;
+    settings.resolution = 64;
+    settings.levelCount = 4;
+    settings.lodDistance = 2.f;
+    settings.viewRadius = 10;
+    settings.heightScale = 16.f;
+    settings.frequency = 0.006f;
+    settings.octaves = 5;
+    settings.skirtDepth = 2.f;
+    settings.texScale = 0.25f;
+    settings.uploadBudget = 512 * 1024;
+    settings.cacheChunks = 512;
+    settings.cacheDirectory.clear();
+}
+
+float terrain_height(const TerrainSettings & settings, float x, float z)
+{
+    float sum = 0.f;
+    float amplitude = 1.f;
+    float total = 0.f;
+    float frequency = settings.frequency;
+    for (int i = 0; i < settings.octaves; ++i)
+    {
+        sum += amplitude * glm::simplex(glm::vec2(x * frequency, z * frequency));
+        total += amplitude;
+        amplitude *= 0.5f;
+        frequency *= 2.f;
+    }
+    return total > 0.f ? settings.heightScale * sum / total : 0.f;
+}
+
+void terrain_build_chunk(const TerrainSettings & settings, TerrainChunkData & chunk)
+{
+    int side = level_side(settings, chunk.level);
+    float step = settings.chunkSize / (side - 1);
+
+    // One extra sample on every border for the central differences. Positions
+    // come from global sample indices so neighbours share their edge exactly.
+    int border = side + 2;
+    std::vector<float> heights(border * border);
+    int baseX = chunk.x * (side - 1) - 1;
+    int baseZ = chunk.z * (side - 1) - 1;
+    for (int z = 0; z < border; ++z)
+        for (int x = 0; x < border; ++x)
+            heights[z * border + x] = terrain_height(settings, (baseX + x) * step, (baseZ + z) * step);
+
+    chunk.vertices.resize((side * side + 4 * side) * TERRAIN_VERTEX_FLOATS);
+    chunk.minHeight = heights[0];
+    chunk.maxHeight = heights[0];
+    float * v = &chunk.vertices[0];
+    for (int z = 0; z < side; ++z)
+    {
+        for (int x = 0; x < side; ++x)
+        {
+            const float * h = &heights[(z + 1) * border + x + 1];
+            float px = (baseX + 1 + x) * step;
+            float pz = (baseZ + 1 + z) * step;
+            float dx = h[1] - h[-1];
+            float dz = h[border] - h[-border];
+            glm::vec3 normal = glm::normalize(glm::vec3(-dx, 2.f * step, -dz));
+            glm::vec3 tangent = glm::normalize(glm::vec3(2.f * step, dx, 0.f));
+            v[0] = px;
+            v[1] = h[0];
+            v[2] = pz;
+            v[3] = normal.x;
+            v[4] = normal.y;
+            v[5] = normal.z;
+            v[6] = px * settings.texScale;
+            v[7] = pz * settings.texScale;
+            v[8] = tangent.x;
+            v[9] = tangent.y;
+            v[10] = tangent.z;
+            v[11] = -1.f;
+            v += TERRAIN_VERTEX_FLOATS;
+            chunk.minHeight = std::min(chunk.minHeight, h[0]);
+            chunk.maxHeight = std::max(chunk.maxHeight, h[0]);
+        }
+    }
+
+    // Skirts copy the border vertices, lowered
+    const float * grid = &chunk.vertices[0];
+    for (int edge = 0; edge < 4; ++edge)
+    {
+        for (int i = 0; i < side; ++i)
+        {
+            int source;
+            switch (edge)
+            {
+            case 0: source = i; break;
+            case 1: source = (side - 1) * side + i; break;
+            case 2: source = i * side; break;
+            default: source = i * side + side - 1; break;
+            }
+            memcpy(v, grid + source * TERRAIN_VERTEX_FLOATS, TERRAIN_VERTEX_FLOATS * sizeof(float));
+            v[1] -= settings.skirtDepth;
+            v += TERRAIN_VERTEX_FLOATS;
+        }
+    }
+}
+
+void terrain_init(Terrain & terrain, const TerrainSettings & settings)
+{
+    terrain.settings = settings;
+    terrain.settings.levelCount = std::max(1, std::min(settings.levelCount, TERRAIN_MAX_LEVELS));
+    while (terrain.settings.levelCount > 1 && (settings.resolution >> (terrain.settings.levelCount - 1)) < 1)
+        --terrain.settings.levelCount;
+
+    float noise[8] = { settings.chunkSize, (float) settings.resolution, settings.heightScale, settings.frequency,
+                       (float) settings.octaves, settings.skirtDepth, settings.texScale, (float) TERRAIN_VERTEX_FLOATS };
+    terrain.settingsKey = hash_bytes(noise, sizeof(noise), 0);
+
+    std::vector<int> indices;
+    glGenBuffers(TERRAIN_MAX_LEVELS, terrain.indexBuffers);
+    for (int level = 0; level < TERRAIN_MAX_LEVELS; ++level)
+    {
+        terrain.indexCounts[level] = 0;
+        if (level >= terrain.settings.levelCount)
+            continue;
+        build_indices(level_side(terrain.settings, level), indices);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrain.indexBuffers[level]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(int), &indices[0], GL_STATIC_DRAW);
+        terrain.indexCounts[level] = (int) indices.size();
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    if (!terrain.settings.cacheDirectory.empty())
+    {
+#ifdef _WIN32
+        _mkdir(terrain.settings.cacheDirectory.c_str());
+#else
+        mkdir(terrain.settings.cacheDirectory.c_str(), 0755);
+#endif
+    }
+
+    terrain.frame = 0;
+    memset(&terrain.stats, 0, sizeof(terrain.stats));
+
+    // Half the cores at most, the render thread and parallel_for keep the rest
+    TerrainQueue * queue = new TerrainQueue;
+    queue->settings = terrain.settings;
+    queue->settingsKey = terrain.settingsKey;
+    queue->generated = 0;
+    queue->diskHits = 0;
+    queue->generateMs = 0.0;
+    queue->quit = false;
+    unsigned int threadCount = std::max(1u, std::thread::hardware_concurrency() / 2);
+    for (unsigned int i = 0; i < threadCount; ++i)
+        queue->threads.push_back(std::thread(&TerrainQueue::worker, queue));
+    terrain.queue = queue;
+}
+
+void terrain_release(Terrain & terrain)
+{
+    TerrainQueue * queue = terrain.queue;
+    {
+        std::lock_guard<std::mutex> guard(queue->lock);
+        queue->quit = true;
+    }
+    queue->wake.notify_all();
+    for (size_t i = 0; i < queue->threads.size(); ++i)
+        queue->threads[i].join();
+    for (size_t i = 0; i < queue->done.size(); ++i)
+        delete queue->done[i];
+    delete queue;
+    terrain.queue = 0;
+
+    for (std::map<uint64_t, TerrainChunkData *>::iterator it = terrain.cache.begin(); it != terrain.cache.end(); ++it)
+        delete it->second;
+    terrain.cache.clear();
+    for (size_t i = 0; i < terrain.chunks.size(); ++i)
+        release_chunk(terrain.chunks[i]);
+    for (size_t i = 0; i < terrain.freeChunks.size(); ++i)
+        release_chunk(terrain.freeChunks[i]);
+    terrain.chunks.clear();
+    terrain.freeChunks.clear();
+    glDeleteBuffers(TERRAIN_MAX_LEVELS, terrain.indexBuffers);
+}
+
+namespace
+{
+
+struct WantedChunk
+{
+    int x, z, level;
+    float distance;
+    bool operator<(const WantedChunk & other) const { return distance < other.distance; }
+};
+
+// Vertex array of the level from the free list, or a new one
+TerrainChunk acquire_chunk(Terrain & terrain, int level)
+{
+    for (size_t i = 0; i < terrain.freeChunks.size(); ++i)
+    {
+        if (terrain.freeChunks[i].level == level)
+        {
+            TerrainChunk chunk = terrain.freeChunks[i];
+            terrain.freeChunks.erase(terrain.freeChunks.begin() + i);
+            return chunk;
+        }
+    }
+    TerrainChunk chunk;
+    chunk.level = level;
+    glGenVertexArrays(1, &chunk.vao);
+    glGenBuffers(1, &chunk.vbo);
+    glBindVertexArray(chunk.vao);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrain.indexBuffers[level]);
+    glBindBuffer(GL_ARRAY_BUFFER, chunk.vbo);
+    GLsizei stride = TERRAIN_VERTEX_FLOATS * sizeof(float);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)(3 * sizeof(float)));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride, (void*)(6 * sizeof(float)));
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, stride, (void*)(8 * sizeof(float)));
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return chunk;
+}
+
+}
+
+void terrain_update(Terrain & terrain, const glm::vec3 & eye)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const TerrainSettings & settings = terrain.settings;
+    TerrainQueue & queue = *terrain.queue;
+    TerrainStats & stats = terrain.stats;
+    unsigned int frame = ++terrain.frame;
+
+    // Chunks inside the view radius, nearest first, at the level of their distance
+    std::vector<WantedChunk> wanted;
+    int centerX = (int) floorf(eye.x / settings.chunkSize);
+    int centerZ = (int) floorf(eye.z / settings.chunkSize);
+    int radius = settings.viewRadius;
+    for (int dz = -radius; dz <= radius; ++dz)
+    {
+        for (int dx = -radius; dx <= radius; ++dx)
+        {
+            if (dx * dx + dz * dz > radius * radius)
+                continue;
+            WantedChunk w;
+            w.x = centerX + dx;
+            w.z = centerZ + dz;
+            float cx = (w.x + 0.5f) * settings.chunkSize - eye.x;
+            float cz = (w.z + 0.5f) * settings.chunkSize - eye.z;
+            w.distance = sqrtf(cx * cx + cz * cz + eye.y * eye.y);
+            w.level = 0;
+            float limit = settings.lodDistance * settings.chunkSize;
+            while (w.level < settings.levelCount - 1 && w.distance > limit)
+            {
+                ++w.level;
+                limit *= 2.f;
+            }
+            wanted.push_back(w);
+        }
+    }
+    std::sort(wanted.begin(), wanted.end());
+
+    // Finished chunks move to the cache
+    std::vector<TerrainChunkData *> done;
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        done.swap(queue.done);
+        stats.generated = queue.generated;
+        stats.diskHits = queue.diskHits;
+        stats.generateMs = queue.generated ? queue.generateMs / queue.generated : 0.0;
+    }
+    for (size_t i = 0; i < done.size(); ++i)
+    {
+        uint64_t key = chunk_key(done[i]->x, done[i]->z, done[i]->level);
+        std::map<uint64_t, TerrainChunkData *>::iterator it = terrain.cache.find(key);
+        if (it != terrain.cache.end())
+        {
+            delete it->second;
+            it->second = done[i];
+        }
+        else
+            terrain.cache[key] = done[i];
+        done[i]->lastUsedFrame = frame;
+    }
+
+    std::map<uint64_t, int> resident;
+    for (size_t i = 0; i < terrain.chunks.size(); ++i)
+        resident[chunk_key(terrain.chunks[i].x, terrain.chunks[i].z, 0)] = (int) i;
+
+    // Walk the wanted chunks nearest first, queueing the ones not generated
+    // yet. Holes come before level changes of chunks already on screen.
+    std::vector<TerrainRequest> requests;
+    std::vector<TerrainRequest> refinements;
+    std::vector<std::pair<int, TerrainChunkData *> > uploads;      // slot or -1, data
+    std::vector<std::pair<int, TerrainChunkData *> > refinementUploads;
+    stats.missing = 0;
+    for (size_t i = 0; i < wanted.size(); ++i)
+    {
+        const WantedChunk & w = wanted[i];
+        std::map<uint64_t, TerrainChunkData *>::iterator cached = terrain.cache.find(chunk_key(w.x, w.z, w.level));
+        if (cached != terrain.cache.end())
+            cached->second->lastUsedFrame = frame;
+
+        std::map<uint64_t, int>::iterator slot = resident.find(chunk_key(w.x, w.z, 0));
+        int index = slot != resident.end() ? slot->second : -1;
+        if (index >= 0)
+        {
+            // Stays in place, possibly at another level, until the wanted one is uploaded
+            terrain.chunks[index].lastWantedFrame = frame;
+            if (terrain.chunks[index].level == w.level)
+                continue;
+        }
+        ++stats.missing;
+        if (cached == terrain.cache.end())
+        {
+            TerrainRequest request = { w.x, w.z, w.level };
+            (index < 0 ? requests : refinements).push_back(request);
+        }
+        else
+            (index < 0 ? uploads : refinementUploads).push_back(std::make_pair(index, cached->second));
+    }
+    requests.insert(requests.end(), refinements.begin(), refinements.end());
+    uploads.insert(uploads.end(), refinementUploads.begin(), refinementUploads.end());
+
+    // The first upload always goes through so a small budget still makes progress
+    stats.uploads = 0;
+    stats.uploadedBytes = 0;
+    for (size_t i = 0; i < uploads.size(); ++i)
+    {
+        int index = uploads[i].first;
+        const TerrainChunkData & data = *uploads[i].second;
+        size_t bytes = data.vertices.size() * sizeof(float);
+        if (stats.uploads > 0 && stats.uploadedBytes + bytes > settings.uploadBudget)
+            break;
+        // Fresh storage, a recycled buffer may still be read by the previous frame
+        TerrainChunk chunk = acquire_chunk(terrain, data.level);
+        glBindBuffer(GL_ARRAY_BUFFER, chunk.vbo);
+        glBufferData(GL_ARRAY_BUFFER, bytes, &data.vertices[0], GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        chunk.x = data.x;
+        chunk.z = data.z;
+        chunk.boundsMin = glm::vec3(data.x * settings.chunkSize, data.minHeight - settings.skirtDepth, data.z * settings.chunkSize);
+        chunk.boundsMax = glm::vec3((data.x + 1) * settings.chunkSize, data.maxHeight, (data.z + 1) * settings.chunkSize);
+        chunk.lastWantedFrame = frame;
+        if (index >= 0)
+        {
+            terrain.freeChunks.push_back(terrain.chunks[index]);
+            terrain.chunks[index] = chunk;
+        }
+        else
+            terrain.chunks.push_back(chunk);
+        ++stats.uploads;
+        stats.uploadedBytes += bytes;
+        --stats.missing;
+    }
+
+    // Replacing the queue drops the requests that went out of view. Chunks
+    // being generated, or finished since they were collected, are not asked
+    // for twice.
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        std::vector<uint64_t> busy(queue.working);
+        for (size_t i = 0; i < queue.done.size(); ++i)
+            busy.push_back(chunk_key(queue.done[i]->x, queue.done[i]->z, queue.done[i]->level));
+        queue.requests.clear();
+        for (size_t i = requests.size(); i-- > 0; )
+        {
+            uint64_t key = chunk_key(requests[i].x, requests[i].z, requests[i].level);
+            if (std::find(busy.begin(), busy.end(), key) == busy.end())
+                queue.requests.push_back(requests[i]);
+        }
+        stats.pending = (int) (queue.requests.size() + queue.working.size());
+    }
+    if (!requests.empty())
+        queue.wake.notify_all();
+
+    // Chunks out of the view radius give their buffers back
+    for (size_t i = 0; i < terrain.chunks.size(); )
+    {
+        if (terrain.chunks[i].lastWantedFrame != frame)
+        {
+            terrain.freeChunks.push_back(terrain.chunks[i]);
+            terrain.chunks[i] = terrain.chunks.back();
+            terrain.chunks.pop_back();
+        }
+        else
+            ++i;
+    }
+    const size_t maxFreeChunks = 32;
+    while (terrain.freeChunks.size() > maxFreeChunks)
+    {
+        release_chunk(terrain.freeChunks.front());
+        terrain.freeChunks.erase(terrain.freeChunks.begin());
+    }
+
+    // Least recently used chunks leave the memory cache
+    size_t cacheLimit = wanted.size() + (size_t) std::max(0, settings.cacheChunks);
+    if (terrain.cache.size() > cacheLimit)
+    {
+        std::vector<std::pair<unsigned int, uint64_t> > unused;
+        for (std::map<uint64_t, TerrainChunkData *>::iterator it = terrain.cache.begin(); it != terrain.cache.end(); ++it)
+            if (it->second->lastUsedFrame != frame)
+                unused.push_back(std::make_pair(it->second->lastUsedFrame, it->first));
+        std::sort(unused.begin(), unused.end());
+        size_t evict = std::min(unused.size(), terrain.cache.size() - cacheLimit);
+        for (size_t i = 0; i < evict; ++i)
+        {
+            std::map<uint64_t, TerrainChunkData *>::iterator it = terrain.cache.find(unused[i].second);
+            delete it->second;
+            terrain.cache.erase(it);
+        }
+    }
+
+    stats.resident = (int) terrain.chunks.size();
+    stats.wanted = (int) wanted.size();
+    stats.cached = (int) terrain.cache.size();
+    stats.updateMs = elapsed_ms(start);
+}
+
+void terrain_draw(Terrain & terrain, GLuint program, GLint mvpLocation, const glm::mat4 & viewProjection)
+{
+    // Vertices are in world space
+    Frustum frustum;
+    frustum_from_matrix(viewProjection, frustum);
+    glProgramUniformMatrix4fv(program, mvpLocation, 1, 0, glm::value_ptr(viewProjection));
+    mesh_identity_instance();
+    int drawCalls = 0;
+    for (size_t i = 0; i < terrain.chunks.size(); ++i)
+    {
+        const TerrainChunk & chunk = terrain.chunks[i];
+        if (!frustum_test_aabb(frustum, chunk.boundsMin, chunk.boundsMax))
+            continue;
+        glBindVertexArray(chunk.vao);
+        glDrawElements(GL_TRIANGLES, terrain.indexCounts[chunk.level], GL_UNSIGNED_INT, (void*)0);
+        ++drawCalls;
+    }
+    glBindVertexArray(0);
+    terrain.stats.drawCalls = drawCalls;
+}
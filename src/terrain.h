@@ -0,0 +1,112 @@
+#ifndef AOGL_TERRAIN_H
+#define AOGL_TERRAIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include <string>
+
+#include "glew/glew.h"
+#include "glm/glm.hpp"
+
+#include "culling.h"
+
+const int TERRAIN_MAX_LEVELS = 6;
+// Interleaved position, normal, uv and tangent, read by aogl.vert
+const int TERRAIN_VERTEX_FLOATS = 12;
+
+struct TerrainSettings
+{
+    float chunkSize;        // world units per chunk side
+    int resolution;         // quads per chunk side at level 0, a power of two
+    int levelCount;         // each level halves the resolution
+    float lodDistance;      // level 0 up to this many chunk sizes away, doubling per level
+    int viewRadius;         // chunks kept around the eye
+    float heightScale;
+    float frequency;        // noise frequency per world unit
+    int octaves;
+    float skirtDepth;       // hides the cracks between chunks of different levels
+    float texScale;         // uv per world unit
+    size_t uploadBudget;    // vertex bytes uploaded per frame
+    int cacheChunks;        // generated chunks kept in memory once out of view
+    std::string cacheDirectory;     // chunks are also kept on disk there, unless empty
+};
+
+// Heights and vertices of one chunk at one level, built by the workers
+struct TerrainChunkData
+{
+    int x, z, level;
+    float minHeight, maxHeight;
+    std::vector<float> vertices;    // TERRAIN_VERTEX_FLOATS per vertex, grid then skirts
+    unsigned int lastUsedFrame;
+};
+
+// Chunk on the GPU, at most one level per (x, z)
+struct TerrainChunk
+{
+    int x, z, level;
+    GLuint vao;
+    GLuint vbo;
+    glm::vec3 boundsMin, boundsMax;
+    unsigned int lastWantedFrame;
+};
+
+struct TerrainStats
+{
+    int resident;           // chunks on the GPU
+    int wanted;             // chunks around the eye at their wanted level
+    int missing;            // wanted chunks not on the GPU at that level yet
+    int pending;            // queued or being generated
+    int cached;             // chunks in memory
+    long long generated;    // built from noise since init
+    long long diskHits;     // read from the disk cache since init
+    int uploads;            // this frame
+    size_t uploadedBytes;   // this frame
+    double generateMs;      // average worker time per generated chunk
+    double updateMs;        // main thread time of the last update
+    int drawCalls;
+};
+
+struct TerrainQueue;
+
+// Heightfield from octaves of glm::simplex, split into square chunks around
+// the eye. Chunks are generated on background threads, never on the render
+// thread, kept in a memory cache and optionally on disk, and uploaded a few
+// per frame so that flying over new ground keeps the frame time flat. Until
+// a chunk reaches its wanted level the previous one, if any, stays in place.
+struct Terrain
+{
+    TerrainSettings settings;
+    uint64_t settingsKey;           // noise inputs, checked against disk chunks
+    TerrainQueue * queue;
+    GLuint indexBuffers[TERRAIN_MAX_LEVELS];
+    int indexCounts[TERRAIN_MAX_LEVELS];
+    std::vector<TerrainChunk> chunks;
+    std::vector<TerrainChunk> freeChunks;       // buffers of dropped chunks, reused per level
+    std::map<uint64_t, TerrainChunkData *> cache;
+    unsigned int frame;
+    TerrainStats stats;
+};
+
+void terrain_default_settings(TerrainSettings & settings);
+
+// Starts the worker threads, the settings are fixed until release
+void terrain_init(Terrain & terrain, const TerrainSettings & settings);
+void terrain_release(Terrain & terrain);
+
+// Noise height at a world position, as used for the chunk vertices
+float terrain_height(const TerrainSettings & settings, float x, float z);
+
+// Builds the vertices of one chunk, called by the workers
+void terrain_build_chunk(const TerrainSettings & settings, TerrainChunkData & chunk);
+
+// Queues the chunks around the eye by distance, collects the finished ones
+// and uploads them within the frame budget. Call once per frame.
+void terrain_update(Terrain & terrain, const glm::vec3 & eye);
+
+// Draws the resident chunks inside the frustum with the bound pipeline, which
+// reads aogl.vert attributes from program, and the textures bound by the caller
+void terrain_draw(Terrain & terrain, GLuint program, GLint mvpLocation, const glm::mat4 & viewProjection);
+
+#endif // AOGL_TERRAIN_H
@@ -0,0 +1,12 @@
+#ifndef AOGL_TIMER_H
+#define AOGL_TIMER_H
+
+#include <chrono>
+
+// Milliseconds since start, for the load and bake timings of the stats
+inline double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+#endif // AOGL_TIMER_H
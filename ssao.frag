@@ -0,0 +1,157 @@
+#version 410 core
+
+// Screen-space ambient occlusion at half resolution, see ssao.h. Each draw
+// runs one pass of the chain, selected by Pass.
+
+#define PASS_DOWNSAMPLE	0
+#define PASS_OCCLUSION	1
+#define PASS_TEMPORAL	2
+#define PASS_BLUR	3
+#define MAX_SAMPLES	16
+#define BLUR_RADIUS	4
+#define SKY_DEPTH	1e20
+
+precision highp float;
+precision highp int;
+
+#include "lighting.glsl"
+
+uniform int Pass;
+uniform sampler2D Source;           // downsample: G-buffer depth, temporal and blur: occlusion
+uniform sampler2D Normal;           // octahedral world normal, [0, 1], of the G-buffer when downsampling
+uniform sampler2D Depth;            // linear view depth
+uniform vec2 DepthParameters;       // view depth = x / (ndc depth + y)
+uniform mat4 Projection;
+uniform mat3 WorldToView;
+
+uniform vec3 Kernel[MAX_SAMPLES];   // hemisphere around +z, radius 1
+uniform int SampleCount;
+uniform float Radius;
+uniform float Bias;
+uniform int Rotation;               // offsets the 4x4 rotation pattern
+
+uniform sampler2D History;          // accumulated occlusion of the previous frame
+uniform sampler2D HistoryDepth;
+uniform mat4 ViewToPreviousClip;
+uniform float TemporalBlend;        // weight of the current frame
+
+uniform ivec2 BlurDirection;
+uniform float BlurSharpness;        // relative depth difference dropping a tap
+
+layout(location = 0) out vec4 FragColor;
+layout(location = 1) out vec2 FragNormal;
+
+// Rotations of the kernel over a 4x4 tile, in 16ths of a turn
+const int ROTATIONS[16] = int[16](0, 8, 2, 10, 12, 4, 14, 6, 3, 11, 1, 9, 15, 7, 13, 5);
+
+vec3 view_position(ivec2 texel, float depth)
+{
+    vec2 ndc = (vec2(texel) + 0.5) / vec2(textureSize(Depth, 0)) * 2.0 - 1.0;
+    return vec3(ndc.x * depth / Projection[0][0], ndc.y * depth / Projection[1][1], -depth);
+}
+
+// Closest of the 2x2 full resolution texels, as a linear depth
+void downsample(ivec2 texel)
+{
+    ivec2 last = textureSize(Source, 0) - 1;
+    ivec2 closest = min(texel * 2, last);
+    float closestDepth = texelFetch(Source, closest, 0).r;
+    for (int i = 1; i < 4; ++i)
+    {
+        ivec2 tap = min(texel * 2 + ivec2(i & 1, i >> 1), last);
+        float depth = texelFetch(Source, tap, 0).r;
+        if (depth < closestDepth)
+        {
+            closest = tap;
+            closestDepth = depth;
+        }
+    }
+    float depth = closestDepth == 1.0 ? SKY_DEPTH : DepthParameters.x / (closestDepth * 2.0 - 1.0 + DepthParameters.y);
+    FragColor = vec4(depth);
+    FragNormal = texelFetch(Normal, closest, 0).rg;
+}
+
+// Fraction of the kernel, rotated around the normal, that is not behind the
+// depth buffer. Occluders further than Radius in depth fade out.
+float occlusion(ivec2 texel)
+{
+    float depth = texelFetch(Depth, texel, 0).r;
+    if (depth >= SKY_DEPTH)
+        return 1.0;
+    vec3 p = view_position(texel, depth);
+    vec3 n = normalize(WorldToView * oct_decode(texelFetch(Normal, texel, 0).rg * 2.0 - 1.0));
+
+    int index = (ROTATIONS[(texel.y & 3) * 4 + (texel.x & 3)] + Rotation) & 15;
+    float angle = (float(index) + 0.5) * (6.2831853 / 16.0);
+    vec3 r = vec3(cos(angle), sin(angle), 0.0);
+    vec3 t = r - n * dot(r, n);
+    t = dot(t, t) > 1e-6 ? normalize(t) : vec3(-r.y, r.x, 0.0);
+    vec3 b = cross(n, t);
+
+    vec2 size = vec2(textureSize(Depth, 0));
+    float occluded = 0.0;
+    for (int i = 0; i < SampleCount; ++i)
+    {
+        vec3 s = p + (t * Kernel[i].x + b * Kernel[i].y + n * Kernel[i].z) * Radius;
+        vec4 clip = Projection * vec4(s, 1.0);
+        if (clip.w <= 0.0)
+            continue;
+        vec2 uv = clip.xy / clip.w * 0.5 + 0.5;
+        if (any(lessThan(uv, vec2(0.0))) || any(greaterThanEqual(uv, vec2(1.0))))
+            continue;
+        float sceneDepth = texelFetch(Depth, ivec2(uv * size), 0).r;
+        float range = smoothstep(0.0, 1.0, Radius / abs(depth - sceneDepth));
+        occluded += sceneDepth < -s.z - Bias ? range : 0.0;
+    }
+    return 1.0 - occluded / float(SampleCount);
+}
+
+// Blends with the previous frame where the surface was already visible
+float temporal(ivec2 texel)
+{
+    float current = texelFetch(Source, texel, 0).r;
+    float depth = texelFetch(Depth, texel, 0).r;
+    if (depth >= SKY_DEPTH)
+        return current;
+    vec4 previous = ViewToPreviousClip * vec4(view_position(texel, depth), 1.0);
+    if (previous.w <= 0.0)
+        return current;
+    vec2 uv = previous.xy / previous.w * 0.5 + 0.5;
+    if (any(lessThan(uv, vec2(0.0))) || any(greaterThanEqual(uv, vec2(1.0))))
+        return current;
+    float previousDepth = texelFetch(HistoryDepth, ivec2(uv * vec2(textureSize(HistoryDepth, 0))), 0).r;
+    if (abs(previousDepth - previous.w) > 0.05 * previous.w)
+        return current;
+    return mix(texture(History, uv).r, current, TemporalBlend);
+}
+
+// Gaussian taps along BlurDirection, weighted down across depth edges
+float blur(ivec2 texel)
+{
+    ivec2 last = textureSize(Depth, 0) - 1;
+    float depth = texelFetch(Depth, texel, 0).r;
+    float sum = 0.0;
+    float weights = 0.0;
+    for (int i = -BLUR_RADIUS; i <= BLUR_RADIUS; ++i)
+    {
+        ivec2 tap = clamp(texel + BlurDirection * i, ivec2(0), last);
+        float tapDepth = texelFetch(Depth, tap, 0).r;
+        float w = exp(-float(i * i) / 8.0) * max(0.0, 1.0 - abs(tapDepth - depth) * BlurSharpness / depth);
+        sum += texelFetch(Source, tap, 0).r * w;
+        weights += w;
+    }
+    return sum / weights;
+}
+
+void main()
+{
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    if (Pass == PASS_DOWNSAMPLE)
+        downsample(texel);
+    else if (Pass == PASS_OCCLUSION)
+        FragColor = vec4(occlusion(texel));
+    else if (Pass == PASS_TEMPORAL)
+        FragColor = vec4(temporal(texel));
+    else
+        FragColor = vec4(blur(texel));
+}